@@ -0,0 +1,162 @@
+/******************************************************************************
+ *
+ * Name File : acceptor.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "acceptor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+
+/******************************************************************************
+ * Fonction qui ouvre un socket d'écoute sur toutes les interfaces.
+ * Prend en paramètre :
+ *     - port         Pointeur vers une chaine de caractère pour le numéro de
+ *                      port.
+ *     - type         SOCK_STREAM ou SOCK_DGRAM.
+ *     - backlog      Taille de la file des connexions en attente (flux).
+ *     - reusePort    1 pour partager le port entre plusieurs sockets
+ *                      (SO_REUSEPORT), un par worker.
+ * Renvoie le descripteur du socket, en mode non bloquant.
+ *****************************************************************************/
+int acceptor_open(char *port, int type, int backlog, int reusePort) {
+  struct addrinfo hints, *servInfo, *rp;
+  int socketDescriptor = -1;
+  int status;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;		/* IPv4 et IPv6 ou autre protocole */
+  hints.ai_socktype = type;
+  hints.ai_flags = AI_PASSIVE;		/* écoute sur toute les interfaces */
+  status = getaddrinfo(NULL, port, &hints, &servInfo);
+  if ( status != 0 ) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+    exit(EXIT_FAILURE);
+  }
+
+  for ( rp = servInfo; rp != NULL; rp = rp->ai_next ) {
+    socketDescriptor = socket(rp->ai_family,
+                              rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                              rp->ai_protocol);
+    if ( socketDescriptor == -1 )
+      continue;
+    if ( reusePort )
+      setsockopt(socketDescriptor, SOL_SOCKET, SO_REUSEPORT, &reusePort,
+                 sizeof(reusePort));
+    if ( bind(socketDescriptor, rp->ai_addr, rp->ai_addrlen) == 0 )
+      break;
+    close(socketDescriptor);
+  }
+  freeaddrinfo(servInfo);
+
+  if ( rp == NULL ) {
+    fprintf(stderr, "Could not bind\n");
+    fprintf(stderr, "Port number is already used.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if ( type == SOCK_STREAM && listen(socketDescriptor, backlog) == -1 ) {
+    perror("Error with listen");
+    exit(EXIT_FAILURE);
+  }
+
+  return socketDescriptor;
+}
+
+/******************************************************************************
+ * Fonction qui ouvre le descripteur de réserve, libéré pour refuser un
+ * client quand le processus n'a plus de descripteur disponible.
+ * Renvoie le descripteur, -1 en cas d'erreur.
+ *****************************************************************************/
+int acceptor_reserve(void) {
+  return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/******************************************************************************
+ * Fonction qui refuse un client en attente : il est accepté puis fermé
+ * aussitôt.
+ * Prend en paramètre :
+ *     - listenDescriptor    Socket d'écoute.
+ * Renvoie 1 si un client a été refusé, 0 sinon.
+ *****************************************************************************/
+int acceptor_reject(int listenDescriptor) {
+  int client;
+
+  client = accept4(listenDescriptor, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if ( client == -1 )
+    return 0;
+  close(client);
+  return 1;
+}
+
+/******************************************************************************
+ * Fonction qui accepte le prochain client admis. Les clients en excès sont
+ * refusés, et sur EMFILE le descripteur de réserve est libéré le temps d'en
+ * refuser un, puis repris.
+ * Prend en paramètre :
+ *     - listenDescriptor     Socket d'écoute en flux.
+ *     - reserveDescriptor    Pointeur vers le descripteur de réserve, -1 :
+ *                              aucun.
+ *     - full                 1 si la limite de connexions est atteinte.
+ *     - addr                 Pointeur vers l'adresse du client à remplir, ou
+ *                              NULL.
+ *     - addrlen              Pointeur vers la taille de l'adresse, ou NULL.
+ *     - stats                Compteurs des clients refusés.
+ * Renvoie le descripteur du client, en mode non bloquant, -1 quand il n'y a
+ * plus de client à accepter.
+ *****************************************************************************/
+int acceptor_accept(int listenDescriptor, int *reserveDescriptor, int full,
+                    struct sockaddr_storage *addr, socklen_t *addrlen,
+                    struct accept_stats *stats) {
+  int client, rejected;
+
+  while ( 1 ) {
+    if ( addrlen != NULL )
+      *addrlen = sizeof(*addr);
+    client = accept4(listenDescriptor, (struct sockaddr *) addr, addrlen,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ( client == -1 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK )
+        return -1;
+      if ( errno == EMFILE || errno == ENFILE ) {
+        if ( *reserveDescriptor == -1 )
+          return -1;
+        close(*reserveDescriptor);
+        rejected = acceptor_reject(listenDescriptor);
+        *reserveDescriptor = acceptor_reserve();
+        if ( !rejected )
+          return -1;
+        stats->shedFdLimit++;
+        continue;
+      }
+      /* Erreur propre à ce client (ECONNABORTED, EPROTO...) : on continue */
+      stats->errors++;
+      if ( errno == EINTR || errno == ECONNABORTED || errno == EPROTO )
+        continue;
+      perror("Error with accept");
+      return -1;
+    }
+
+    if ( full ) {
+      close(client);
+      stats->shedCapacity++;
+      continue;
+    }
+    return client;
+  }
+}
@@ -0,0 +1,38 @@
+/******************************************************************************
+ *
+ * Name File : acceptor.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <sys/socket.h>
+
+/* Sockets d'écoute des serveurs et admission des clients : un client en
+   excès (limite de connexions) ou arrivé sans descripteur libre (EMFILE)
+   est accepté puis fermé aussitôt, pour qu'il échoue vite plutôt que
+   d'attendre dans la file */
+
+/* Clients refusés ou en échec à l'acceptation */
+struct accept_stats {
+  unsigned long shedCapacity;	/* limite de connexions atteinte */
+  unsigned long shedFdLimit;	/* plus de descripteur disponible */
+  unsigned long errors;		/* erreurs propres à un client */
+};
+
+int acceptor_open(char *port, int type, int backlog, int reusePort);
+int acceptor_reserve(void);
+int acceptor_accept(int listenDescriptor, int *reserveDescriptor, int full,
+                    struct sockaddr_storage *addr, socklen_t *addrlen,
+                    struct accept_stats *stats);
+int acceptor_reject(int listenDescriptor);
+
+#endif
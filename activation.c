@@ -0,0 +1,125 @@
+/******************************************************************************
+ *
+ * Name File : activation.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "activation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/******************************************************************************
+ * Fonction qui récupère les sockets d'écoute transmis par le superviseur
+ * (protocole de systemd) : LISTEN_FDS descripteurs à partir de 3, destinés
+ * au processus LISTEN_PID. Les variables sont retirées de l'environnement
+ * pour ne pas être héritées, et les descripteurs passent en mode non
+ * bloquant et sont fermés à l'exec.
+ * Prend en paramètre :
+ *     - fds    Tableau des descripteurs à remplir.
+ *     - max    Taille du tableau.
+ * Renvoie le nombre de descripteurs reçus, 0 si aucun, -1 s'il y en a plus
+ * que 'max' (errno à EMFILE).
+ *****************************************************************************/
+int activation_listeners(int *fds, int max) {
+  char *pid, *count;
+  long n;
+  int i, flags;
+
+  pid = getenv("LISTEN_PID");
+  count = getenv("LISTEN_FDS");
+  if ( pid == NULL || count == NULL || atol(pid) != (long) getpid() )
+    return 0;
+  n = atol(count);
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  if ( n <= 0 )
+    return 0;
+  if ( n > max ) {
+    errno = EMFILE;
+    return -1;
+  }
+
+  for ( i = 0; i < n; i++ ) {
+    fds[i] = ACTIVATION_FDS_START + i;
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    flags = fcntl(fds[i], F_GETFL);
+    if ( flags != -1 )
+      fcntl(fds[i], F_SETFL, flags | O_NONBLOCK);
+  }
+  return (int) n;
+}
+
+/******************************************************************************
+ * Fonction qui envoie un état au superviseur par le socket NOTIFY_SOCKET
+ * (protocole sd_notify), par exemple "READY=1". Un nom qui commence par '@'
+ * désigne un socket de l'espace abstrait.
+ * Prend en paramètre :
+ *     - state    Lignes d'état à envoyer.
+ * Renvoie 1 si l'état est envoyé, 0 sans superviseur, -1 en cas d'erreur.
+ *****************************************************************************/
+int activation_notify(const char *state) {
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  char *path;
+  size_t length;
+  int fd, status;
+
+  path = getenv("NOTIFY_SOCKET");
+  if ( path == NULL || (path[0] != '/' && path[0] != '@') )
+    return 0;
+  length = strlen(path);
+  if ( length >= sizeof(addr.sun_path) ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, length);
+  if ( path[0] == '@' )
+    addr.sun_path[0] = '\0';
+  addrlen = offsetof(struct sockaddr_un, sun_path) + length
+            + (path[0] == '@' ? 0 : 1);
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if ( fd == -1 )
+    return -1;
+  status = sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+                  (struct sockaddr *) &addr, addrlen);
+  close(fd);
+  return status == -1 ? -1 : 1;
+}
+
+/******************************************************************************
+ * Fonction qui signale que le service est prêt sur un descripteur hérité du
+ * superviseur (protocole de s6 et de nombreux superviseurs : une ligne),
+ * puis le ferme.
+ * Prend en paramètre :
+ *     - fd    Descripteur de notification.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur.
+ *****************************************************************************/
+int activation_ready_fd(int fd) {
+  int status;
+
+  status = write(fd, "\n", 1);
+  close(fd);
+  return status == 1 ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+/******************************************************************************
+ *
+ * Name File : activation.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+#define ACTIVATION_FDS_START 3	/* Premier descripteur transmis (systemd) */
+
+int activation_listeners(int *fds, int max);
+int activation_notify(const char *state);
+int activation_ready_fd(int fd);
+
+#endif
@@ -0,0 +1,150 @@
+/******************************************************************************
+ *
+ * Name File : arena.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#include "arena.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <numa.h>
+
+/******************************************************************************
+ * Fonction qui initialise une arène vide.
+ * Prend en paramètre :
+ *     - arena         Pointeur vers l'arène.
+ *     - objectSize    Taille des objets, arrondie à une ligne de cache pour
+ *                       que deux objets ne la partagent pas.
+ *     - node          Nœud NUMA des blocs, -1 pour la politique par défaut.
+ *****************************************************************************/
+void arena_init(struct arena *arena, size_t objectSize, int node) {
+  memset(arena, 0, sizeof(*arena));
+  if ( objectSize < sizeof(void *) )
+    objectSize = sizeof(void *);
+  arena->objectSize = (objectSize + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  arena->node = node >= 0 && numa_available() != -1 ? node : -1;
+}
+
+/******************************************************************************
+ * Fonction qui ajoute un bloc d'objets à l'arène, sur son nœud NUMA.
+ * Prend en paramètre :
+ *     - arena    Pointeur vers l'arène.
+ * Renvoie 0 en cas de succès, -1 si la mémoire manque.
+ *****************************************************************************/
+static int arena_grow(struct arena *arena) {
+  struct arena_chunk *chunk;
+  size_t size, i;
+  char *object;
+
+  size = ARENA_ALIGN + ARENA_CHUNK_OBJECTS * arena->objectSize;
+  if ( arena->node >= 0 ) {
+    chunk = numa_alloc_onnode(size, arena->node);
+    if ( chunk == NULL )
+      return -1;
+  } else {
+    chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( chunk == MAP_FAILED )
+      return -1;
+  }
+  chunk->size = size;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+
+  /* Objets chaînés dans la liste libre, le premier en tête */
+  object = (char *) chunk + ARENA_ALIGN;
+  for ( i = ARENA_CHUNK_OBJECTS; i > 0; i-- ) {
+    *(void **) (object + (i - 1) * arena->objectSize) = arena->free;
+    arena->free = object + (i - 1) * arena->objectSize;
+  }
+  arena->capacity += ARENA_CHUNK_OBJECTS;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui prépare des objets libres à l'avance, pour que les premières
+ * allocations ne paient ni l'appel système ni les défauts de page : chaque
+ * page d'un bloc est écrite en chaînant ses objets.
+ * Prend en paramètre :
+ *     - arena    Pointeur vers l'arène.
+ *     - count    Nombre d'objets libres voulus.
+ * Renvoie 0 en cas de succès, -1 si la mémoire manque.
+ *****************************************************************************/
+int arena_reserve(struct arena *arena, unsigned long count) {
+  while ( arena->capacity - arena->used < count )
+    if ( arena_grow(arena) == -1 )
+      return -1;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui alloue un objet de l'arène sans l'initialiser, pour les
+ * tampons qui sont écrits avant d'être lus.
+ * Prend en paramètre :
+ *     - arena    Pointeur vers l'arène.
+ * Renvoie l'objet, NULL si la mémoire manque.
+ *****************************************************************************/
+void *arena_take(struct arena *arena) {
+  void *object;
+
+  if ( arena->free == NULL && arena_grow(arena) == -1 )
+    return NULL;
+  object = arena->free;
+  arena->free = *(void **) object;
+  arena->used++;
+  return object;
+}
+
+/******************************************************************************
+ * Fonction qui alloue un objet de l'arène, mis à zéro.
+ * Prend en paramètre :
+ *     - arena    Pointeur vers l'arène.
+ * Renvoie l'objet, NULL si la mémoire manque.
+ *****************************************************************************/
+void *arena_alloc(struct arena *arena) {
+  void *object;
+
+  object = arena_take(arena);
+  if ( object != NULL )
+    memset(object, 0, arena->objectSize);
+  return object;
+}
+
+/******************************************************************************
+ * Fonction qui rend un objet à l'arène.
+ * Prend en paramètre :
+ *     - arena     Pointeur vers l'arène.
+ *     - object    Objet alloué par 'arena_alloc'.
+ *****************************************************************************/
+void arena_free(struct arena *arena, void *object) {
+  *(void **) object = arena->free;
+  arena->free = object;
+  arena->used--;
+}
+
+/******************************************************************************
+ * Fonction qui libère tous les blocs de l'arène.
+ * Prend en paramètre :
+ *     - arena    Pointeur vers l'arène.
+ *****************************************************************************/
+void arena_destroy(struct arena *arena) {
+  struct arena_chunk *chunk, *next;
+
+  for ( chunk = arena->chunks; chunk != NULL; chunk = next ) {
+    next = chunk->next;
+    if ( arena->node >= 0 )
+      numa_free(chunk, chunk->size);
+    else
+      munmap(chunk, chunk->size);
+  }
+  arena->chunks = NULL;
+  arena->free = NULL;
+}
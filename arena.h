@@ -0,0 +1,45 @@
+/******************************************************************************
+ *
+ * Name File : arena.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_OBJECTS 64	/* Objets alloués à la fois */
+#define ARENA_ALIGN 64		/* Alignement des objets : une ligne de cache */
+
+/* Bloc d'objets, chaîné aux autres blocs de l'arène */
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;			/* taille du bloc, en-tête compris */
+};
+
+/* Arène d'objets de même taille, allouée sur un nœud NUMA */
+struct arena {
+  struct arena_chunk *chunks;
+  void *free;			/* liste des objets libres */
+  size_t objectSize;
+  int node;			/* nœud NUMA, -1 : politique par défaut */
+  unsigned long used;
+  unsigned long capacity;
+};
+
+void arena_init(struct arena *arena, size_t objectSize, int node);
+int arena_reserve(struct arena *arena, unsigned long count);
+void *arena_take(struct arena *arena);
+void *arena_alloc(struct arena *arena);
+void arena_free(struct arena *arena, void *object);
+void arena_destroy(struct arena *arena);
+
+#endif
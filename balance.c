@@ -0,0 +1,345 @@
+/******************************************************************************
+ *
+ * Name File : balance.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#include "balance.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/******************************************************************************
+ * Fonction qui calcule le hachage d'une clé : FNV-1a, suivi d'un brassage
+ * final pour que des clés voisines (adresses d'un même réseau) se
+ * répartissent sur tout l'anneau.
+ * Prend en paramètre :
+ *     - key       Pointeur vers la clé.
+ *     - length    Taille de la clé.
+ * Renvoie le hachage.
+ *****************************************************************************/
+uint32_t balance_hash(const void *key, size_t length) {
+  const unsigned char *bytes = key;
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for ( i = 0; i < length; i++ ) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/******************************************************************************
+ * Fonction qui compare deux points de l'anneau, pour qsort.
+ *****************************************************************************/
+static int balance_point_compare(const void *a, const void *b) {
+  const struct balance_point *left = a, *right = b;
+
+  if ( left->hash != right->hash )
+    return left->hash < right->hash ? -1 : 1;
+  return left->upstream - right->upstream;
+}
+
+/******************************************************************************
+ * Fonction qui résout l'adresse d'un serveur amont.
+ * Prend en paramètre :
+ *     - upstream    Pointeur vers le serveur à remplir.
+ *     - entry       Adresse 'hôte:port', ou '[adresse IPv6]:port'.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+static int balance_resolve(struct balance_upstream *upstream, char *entry) {
+  struct addrinfo hints, *result;
+  char *host = entry, *port;
+  int status;
+
+  port = strrchr(entry, ':');
+  if ( port == NULL || port == entry || port[1] == '\0' ) {
+    fprintf(stderr, "Invalid upstream '%s', expected host:port\n", entry);
+    return -1;
+  }
+  snprintf(upstream->name, sizeof(upstream->name), "%s", entry);
+  *port++ = '\0';
+  if ( host[0] == '[' && port[-2] == ']' ) {
+    host++;
+    port[-2] = '\0';
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  status = getaddrinfo(host, port, &hints, &result);
+  if ( status != 0 ) {
+    fprintf(stderr, "Upstream %s: %s\n", upstream->name, gai_strerror(status));
+    return -1;
+  }
+  memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+  upstream->addrlen = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui prépare le répartiteur : résolution des serveurs amont et
+ * construction de l'anneau, BALANCE_VNODES points par serveur pour que
+ * chacun reçoive une part égale des clés.
+ * Prend en paramètre :
+ *     - balance    Pointeur vers le répartiteur.
+ *     - list       Serveurs amont séparés par des virgules.
+ *     - policy     Politique de répartition.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+int balance_init(struct balance *balance, const char *list,
+                 enum balance_policy policy) {
+  char *copy, *entry, *save = NULL, vnode[sizeof(balance->upstreams->name) + 16];
+  int i, v;
+
+  memset(balance, 0, sizeof(*balance));
+  balance->policy = policy;
+  balance->upstreams = calloc(BALANCE_MAX, sizeof(*balance->upstreams));
+  if ( balance->upstreams == NULL || (copy = strdup(list)) == NULL ) {
+    free(balance->upstreams);
+    return -1;
+  }
+
+  for ( entry = strtok_r(copy, ",", &save); entry != NULL;
+        entry = strtok_r(NULL, ",", &save) ) {
+    if ( balance->count == BALANCE_MAX ) {
+      fprintf(stderr, "At most %d upstreams\n", BALANCE_MAX);
+      break;
+    }
+    if ( balance_resolve(&balance->upstreams[balance->count], entry) == -1 )
+      break;
+    balance->upstreams[balance->count].ejectDelay = BALANCE_EJECT_NS;
+    balance->count++;
+  }
+  free(copy);
+  if ( entry != NULL || balance->count == 0 ) {
+    balance_free(balance);
+    errno = EINVAL;
+    return -1;
+  }
+
+  balance->points = balance->count * BALANCE_VNODES;
+  balance->ring = malloc(balance->points * sizeof(*balance->ring));
+  if ( balance->ring == NULL ) {
+    balance_free(balance);
+    return -1;
+  }
+  for ( i = 0; i < balance->count; i++ ) {
+    for ( v = 0; v < BALANCE_VNODES; v++ ) {
+      snprintf(vnode, sizeof(vnode), "%s#%d", balance->upstreams[i].name, v);
+      balance->ring[i * BALANCE_VNODES + v].hash =
+        balance_hash(vnode, strlen(vnode));
+      balance->ring[i * BALANCE_VNODES + v].upstream = i;
+    }
+  }
+  qsort(balance->ring, balance->points, sizeof(*balance->ring),
+        balance_point_compare);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui indique si un serveur amont peut recevoir une requête.
+ * Prend en paramètre :
+ *     - upstream    Pointeur vers le serveur.
+ *     - now         Instant courant en ns.
+ *     - panic       1 pour ignorer l'éviction, quand tous sont évincés.
+ *****************************************************************************/
+static int balance_available(struct balance_upstream *upstream, uint64_t now,
+                             int panic) {
+  return upstream->connected > 0 && (panic || now >= upstream->ejectedUntil);
+}
+
+/******************************************************************************
+ * Fonction qui choisit le serveur qui a le moins de requêtes en cours par
+ * connexion ; à égalité, les serveurs sont pris tour à tour.
+ * Prend en paramètre :
+ *     - balance    Pointeur vers le répartiteur.
+ *     - now        Instant courant en ns.
+ *     - panic      1 pour ignorer l'éviction.
+ * Renvoie le numéro du serveur, -1 si aucun n'est disponible.
+ *****************************************************************************/
+static int balance_pick_least(struct balance *balance, uint64_t now, int panic) {
+  struct balance_upstream *candidate, *best = NULL;
+  int i, index, chosen = -1;
+
+  for ( i = 0; i < balance->count; i++ ) {
+    index = (balance->next + i) % balance->count;
+    candidate = &balance->upstreams[index];
+    if ( !balance_available(candidate, now, panic) )
+      continue;
+    /* outstanding / connected comparés sans division */
+    if ( best == NULL || (uint64_t) candidate->outstanding * best->connected
+                         < (uint64_t) best->outstanding * candidate->connected ) {
+      best = candidate;
+      chosen = index;
+    }
+  }
+  if ( chosen != -1 )
+    balance->next = (chosen + 1) % balance->count;
+  return chosen;
+}
+
+/******************************************************************************
+ * Fonction qui choisit le serveur du premier point de l'anneau qui suit la
+ * clé, en sautant les serveurs indisponibles : seules les clés d'un serveur
+ * qui disparaît changent de serveur.
+ * Prend en paramètre :
+ *     - balance    Pointeur vers le répartiteur.
+ *     - key        Hachage de la clé du client.
+ *     - now        Instant courant en ns.
+ *     - panic      1 pour ignorer l'éviction.
+ * Renvoie le numéro du serveur, -1 si aucun n'est disponible.
+ *****************************************************************************/
+static int balance_pick_hash(struct balance *balance, uint32_t key,
+                             uint64_t now, int panic) {
+  int low = 0, high = balance->points, middle, i, index;
+
+  while ( low < high ) {
+    middle = (low + high) / 2;
+    if ( balance->ring[middle].hash < key )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  for ( i = 0; i < balance->points; i++ ) {
+    index = balance->ring[(low + i) % balance->points].upstream;
+    if ( balance_available(&balance->upstreams[index], now, panic) )
+      return index;
+  }
+  return -1;
+}
+
+/******************************************************************************
+ * Fonction qui choisit le serveur amont d'une requête selon la politique.
+ * Les serveurs évincés sont évités ; s'ils le sont tous, ils sont utilisés
+ * quand même plutôt que de refuser toutes les requêtes.
+ * Prend en paramètre :
+ *     - balance    Pointeur vers le répartiteur.
+ *     - key        Hachage de la clé du client (hachage cohérent).
+ *     - now        Instant courant en ns.
+ * Renvoie le numéro du serveur, -1 si aucun n'est connecté.
+ *****************************************************************************/
+int balance_pick(struct balance *balance, uint32_t key, uint64_t now) {
+  int panic, chosen = -1;
+
+  for ( panic = 0; panic < 2 && chosen == -1; panic++ ) {
+    if ( balance->policy == BALANCE_HASH )
+      chosen = balance_pick_hash(balance, key, now, panic);
+    else
+      chosen = balance_pick_least(balance, now, panic);
+  }
+  return chosen;
+}
+
+/******************************************************************************
+ * Fonction qui compte une requête envoyée à un serveur amont.
+ * Prend en paramètre :
+ *     - balance     Pointeur vers le répartiteur.
+ *     - upstream    Numéro du serveur.
+ *****************************************************************************/
+void balance_start(struct balance *balance, int upstream) {
+  balance->upstreams[upstream].outstanding++;
+  balance->upstreams[upstream].requests++;
+}
+
+/******************************************************************************
+ * Fonction qui compte la fin d'une requête, réussie ou non.
+ * Prend en paramètre :
+ *     - balance     Pointeur vers le répartiteur.
+ *     - upstream    Numéro du serveur.
+ *****************************************************************************/
+void balance_finish(struct balance *balance, int upstream) {
+  balance->upstreams[upstream].outstanding--;
+}
+
+/******************************************************************************
+ * Fonction qui enregistre une réponse d'un serveur amont : ses échecs
+ * consécutifs sont oubliés, et la durée d'éviction revient à sa valeur
+ * initiale s'il sort d'une éviction.
+ * Prend en paramètre :
+ *     - balance     Pointeur vers le répartiteur.
+ *     - upstream    Numéro du serveur.
+ *     - now         Instant courant en ns.
+ *****************************************************************************/
+void balance_success(struct balance *balance, int upstream, uint64_t now) {
+  struct balance_upstream *target = &balance->upstreams[upstream];
+
+  target->failures = 0;
+  if ( target->ejectedUntil != 0 && now >= target->ejectedUntil ) {
+    target->ejectedUntil = 0;
+    target->ejectDelay = BALANCE_EJECT_NS;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui enregistre un échec d'un serveur amont (connexion refusée ou
+ * perdue, réponse hors délai). Après BALANCE_FAILURES échecs consécutifs, il
+ * est évincé ; la durée d'éviction double à chaque récidive.
+ * Prend en paramètre :
+ *     - balance     Pointeur vers le répartiteur.
+ *     - upstream    Numéro du serveur.
+ *     - now         Instant courant en ns.
+ *****************************************************************************/
+void balance_failure(struct balance *balance, int upstream, uint64_t now) {
+  struct balance_upstream *target = &balance->upstreams[upstream];
+
+  target->errors++;
+  if ( now < target->ejectedUntil || ++target->failures < BALANCE_FAILURES )
+    return;
+  target->failures = 0;
+  target->ejectedUntil = now + target->ejectDelay;
+  target->ejections++;
+  fprintf(stderr, "Upstream %s ejected for %llu s\n", target->name,
+          (unsigned long long) (target->ejectDelay / 1000000000ULL));
+  target->ejectDelay *= 2;
+  if ( target->ejectDelay > BALANCE_EJECT_MAX_NS )
+    target->ejectDelay = BALANCE_EJECT_MAX_NS;
+}
+
+/******************************************************************************
+ * Fonction qui affiche l'état des serveurs amont.
+ * Prend en paramètre :
+ *     - balance    Pointeur vers le répartiteur.
+ *     - now        Instant courant en ns.
+ *****************************************************************************/
+void balance_print(struct balance *balance, uint64_t now) {
+  struct balance_upstream *upstream;
+  int i;
+
+  for ( i = 0; i < balance->count; i++ ) {
+    upstream = &balance->upstreams[i];
+    printf("Upstream %s : connections %d, requests %lu, outstanding %u, "
+           "errors %lu, ejections %lu%s\n", upstream->name, upstream->connected,
+           upstream->requests, upstream->outstanding, upstream->errors,
+           upstream->ejections, now < upstream->ejectedUntil ? " (ejected)" : "");
+  }
+}
+
+/******************************************************************************
+ * Fonction qui libère le répartiteur.
+ * Prend en paramètre :
+ *     - balance    Pointeur vers le répartiteur.
+ *****************************************************************************/
+void balance_free(struct balance *balance) {
+  free(balance->upstreams);
+  free(balance->ring);
+  balance->upstreams = NULL;
+  balance->ring = NULL;
+}
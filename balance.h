@@ -0,0 +1,76 @@
+/******************************************************************************
+ *
+ * Name File : balance.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef BALANCE_H
+#define BALANCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#define BALANCE_MAX 64			/* Serveurs amont au plus */
+#define BALANCE_VNODES 100		/* Points de chaque serveur sur l'anneau */
+#define BALANCE_FAILURES 3		/* Échecs consécutifs avant l'éviction */
+#define BALANCE_EJECT_NS 5000000000ULL	/* Première éviction : 5 s */
+#define BALANCE_EJECT_MAX_NS 60000000000ULL	/* Éviction la plus longue */
+
+/* Politiques de répartition */
+enum balance_policy {
+  BALANCE_LEAST,		/* moins de requêtes en cours par connexion */
+  BALANCE_HASH			/* hachage cohérent sur la clé du client */
+};
+
+/* Serveur amont et son état de santé, observé passivement sur le trafic */
+struct balance_upstream {
+  char name[NI_MAXHOST + NI_MAXSERV];
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int connected;		/* connexions établies vers ce serveur */
+  unsigned int outstanding;	/* requêtes en cours */
+  unsigned int failures;	/* échecs consécutifs */
+  uint64_t ejectedUntil;	/* fin de l'éviction en ns, 0 : en service */
+  uint64_t ejectDelay;		/* durée de la prochaine éviction */
+  unsigned long requests;
+  unsigned long errors;
+  unsigned long ejections;
+};
+
+/* Point de l'anneau de hachage cohérent */
+struct balance_point {
+  uint32_t hash;
+  int upstream;
+};
+
+/* Répartiteur de requêtes entre serveurs amont */
+struct balance {
+  enum balance_policy policy;
+  int count;
+  int next;			/* premier serveur examiné, à égalité */
+  struct balance_upstream *upstreams;
+  struct balance_point *ring;	/* trié par hachage croissant */
+  int points;
+};
+
+uint32_t balance_hash(const void *key, size_t length);
+int balance_init(struct balance *balance, const char *list,
+                 enum balance_policy policy);
+int balance_pick(struct balance *balance, uint32_t key, uint64_t now);
+void balance_start(struct balance *balance, int upstream);
+void balance_finish(struct balance *balance, int upstream);
+void balance_success(struct balance *balance, int upstream, uint64_t now);
+void balance_failure(struct balance *balance, int upstream, uint64_t now);
+void balance_print(struct balance *balance, uint64_t now);
+void balance_free(struct balance *balance);
+
+#endif
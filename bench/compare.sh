@@ -0,0 +1,61 @@
+#!/bin/sh
+###############################################################################
+#
+# Name File : bench/compare.sh
+# Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+# Location  : UPSSITECH - University Paul Sabatier
+# Date      : October 2018
+#
+# Compare deux fichiers de résultats produits par 'bench/run.sh' et signale
+# chaque mesure qui se dégrade de plus du seuil donné (10 % par défaut).
+# Le code de retour vaut 1 si au moins une régression est détectée.
+#
+# Utilisation : bench/compare.sh baseline.json results.json [seuil%]
+#
+###############################################################################
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 baseline.json results.json [threshold%]" >&2
+  exit 2
+fi
+
+THRESHOLD=${3:-10}
+
+awk -v threshold="$THRESHOLD" '
+  # Extrait la valeur du champ "key" d une ligne de mesure
+  function field(line, key,    re, s) {
+    re = "\"" key "\": *\"?[^,\"}]*"
+    if ( !match(line, re) ) return ""
+    s = substr(line, RSTART, RLENGTH)
+    sub(/^"[^"]*": *"?/, "", s)
+    return s
+  }
+  /"name":/ {
+    name = field($0, "name")
+    if ( FNR == NR ) {
+      base[name] = field($0, "value")
+      next
+    }
+    if ( !(name in base) ) {
+      printf "  new         %-45s %s %s\n", name, field($0, "value"), field($0, "unit")
+      next
+    }
+    old = base[name] + 0
+    cur = field($0, "value") + 0
+    if ( old == 0 ) next
+    delta = (cur - old) * 100 / old
+    if ( field($0, "better") == "higher" ) worse = -delta
+    else worse = delta
+    status = "ok"
+    if ( worse > threshold ) { status = "REGRESSION"; regressions++ }
+    else if ( worse < -threshold ) status = "improved"
+    printf "  %-11s %-45s %12.2f -> %12.2f %-6s (%+.1f%%)\n", status, name, old, cur, field($0, "unit"), delta
+  }
+  END {
+    if ( regressions > 0 ) {
+      printf "%d regression(s) above %s%%\n", regressions, threshold
+      exit 1
+    }
+    printf "No regression above %s%%\n", threshold
+  }
+' "$1" "$2"
@@ -0,0 +1,297 @@
+/******************************************************************************
+ *
+ * Name File : bench/idle.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define MSG_SIZE 80
+#define PROBE_ROUND_TRIPS 2000	/* Aller-retours de la mesure de latence */
+#define PORTS_PER_SOURCE 25000	/* Connexions par adresse source locale */
+#define SPARE_DESCRIPTORS 16	/* Descripteurs gardés hors des connexions */
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes.
+ *****************************************************************************/
+double now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui affiche une mesure au format JSON (une ligne).
+ * Prend en paramètre :
+ *     - name      Nom de la mesure, après 'idle/tcp/'.
+ *     - unit      Unité de la valeur.
+ *     - value     Valeur mesurée.
+ *     - better    'lower' ou 'higher'.
+ *****************************************************************************/
+void report(char *name, char *unit, double value, char *better) {
+  printf("{\"name\": \"idle/tcp/%s\", \"unit\": \"%s\", \"value\": %.1f, "
+         "\"better\": \"%s\"}\n", name, unit, value, better);
+}
+
+/******************************************************************************
+ * Fonction qui lit la mémoire résidente d'un processus.
+ * Prend en paramètre :
+ *     - pid    Numéro du processus.
+ * Renvoie la mémoire résidente en octets, -1 en cas d'erreur.
+ *****************************************************************************/
+long process_rss(pid_t pid) {
+  char path[64], line[256];
+  long rss = -1;
+  FILE *file;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+  if ( (file = fopen(path, "r")) == NULL )
+    return -1;
+  while ( fgets(line, sizeof(line), file) != NULL )
+    if ( sscanf(line, "VmRSS: %ld kB", &rss) == 1 )
+      break;
+  fclose(file);
+  return rss < 0 ? -1 : rss * 1024;
+}
+
+/******************************************************************************
+ * Fonction qui lit le temps CPU consommé par un processus.
+ * Prend en paramètre :
+ *     - pid    Numéro du processus.
+ * Renvoie le temps utilisateur et système en secondes, -1 en cas d'erreur.
+ *****************************************************************************/
+double process_cpu(pid_t pid) {
+  char path[64], line[1024], *fields;
+  unsigned long utime, stime;
+  FILE *file;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+  if ( (file = fopen(path, "r")) == NULL )
+    return -1;
+  if ( fgets(line, sizeof(line), file) == NULL ) {
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+
+  /* Le nom du programme peut contenir des espaces : on repart de la fin */
+  if ( (fields = strrchr(line, ')')) == NULL
+       || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                 "%lu %lu", &utime, &stime) != 2 )
+    return -1;
+  return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/******************************************************************************
+ * Fonction qui lit la mémoire des tampons des sockets TCP de la machine.
+ * Renvoie la mémoire en octets, -1 en cas d'erreur.
+ *****************************************************************************/
+long socket_memory(void) {
+  char line[256];
+  long pages = -1;
+  FILE *file;
+
+  if ( (file = fopen("/proc/net/sockstat", "r")) == NULL )
+    return -1;
+  while ( fgets(line, sizeof(line), file) != NULL )
+    if ( sscanf(line, "TCP: inuse %*d orphan %*d tw %*d alloc %*d mem %ld",
+                &pages) == 1 )
+      break;
+  fclose(file);
+  return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+/******************************************************************************
+ * Fonction qui ouvre une connexion vers le serveur depuis une adresse source
+ * de la boucle locale : le port source est choisi au connect
+ * (IP_BIND_ADDRESS_NO_PORT), ce qui dépasse la plage de ports éphémères.
+ * Prend en paramètre :
+ *     - server    Adresse du serveur.
+ *     - source    Dernier octet de l'adresse source 127.0.0.x.
+ * Renvoie le descripteur de la connexion, -1 en cas d'erreur.
+ *****************************************************************************/
+int idle_connect(struct sockaddr_in *server, int source) {
+  struct sockaddr_in local;
+  int fd, one = 1;
+
+  if ( (fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 )
+    return -1;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK - 1 + source);
+  setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if ( bind(fd, (struct sockaddr *) &local, sizeof(local)) == -1
+       || connect(fd, (struct sockaddr *) server, sizeof(*server)) == -1 ) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/******************************************************************************
+ * Fonction qui fait un aller-retour avec le serveur en mode message : un
+ * octet envoyé, MSG_SIZE octets reçus.
+ * Prend en paramètre :
+ *     - fd    Descripteur de la connexion.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+int idle_ping(int fd) {
+  char msg[MSG_SIZE];
+  ssize_t status;
+  size_t received = 0;
+
+  if ( send(fd, "x", 1, MSG_NOSIGNAL) != 1 )
+    return -1;
+  while ( received < MSG_SIZE ) {
+    status = recv(fd, msg, MSG_SIZE - received, 0);
+    if ( status <= 0 )
+      return -1;
+    received += status;
+  }
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui mesure la latence moyenne d'aller-retour sur une connexion.
+ * Prend en paramètre :
+ *     - fd    Descripteur de la connexion.
+ * Renvoie la latence en microsecondes, -1 en cas d'erreur.
+ *****************************************************************************/
+double idle_latency(int fd) {
+  double start;
+  int i;
+
+  start = now_ns();
+  for ( i = 0; i < PROBE_ROUND_TRIPS; i++ )
+    if ( idle_ping(fd) == -1 )
+      return -1;
+  return (now_ns() - start) / PROBE_ROUND_TRIPS / 1000;
+}
+
+/******************************************************************************
+ * Benchmark des connexions inactives : ouvre 'count' connexions vers un
+ * serveur TCP de la boucle locale (en mode message, délai d'inactivité plus
+ * long que la mesure), fait un aller-retour sur chacune puis mesure la
+ * mémoire du serveur par connexion, son temps CPU pendant 'seconds' secondes
+ * d'inactivité et la latence d'une connexion active parmi elles.
+ * Le programme prend en paramètre :
+ *     - count      Nombre de connexions inactives.
+ *     - seconds    Durée de la mesure d'inactivité.
+ *     - port       Port du serveur.
+ *     - pid        Numéro du processus serveur.
+ *****************************************************************************/
+int main(int argc, char *argv[]) {
+  struct sockaddr_in server;
+  struct rlimit limit;
+  struct timespec pause;
+  long count, rssBefore, rssAfter, kernelBefore, kernelAfter, i;
+  double seconds, start, elapsed, cpu, baseline, latency;
+  int *fds, probe;
+  pid_t pid;
+
+  if ( argc != 5 || (count = atol(argv[1])) < 1
+       || (seconds = atof(argv[2])) <= 0 || (pid = atoi(argv[4])) <= 0 ) {
+    fprintf(stderr, "Usage: %s count seconds port pid\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Un descripteur par connexion, dans la limite autorisée */
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  getrlimit(RLIMIT_NOFILE, &limit);
+  if ( (rlim_t) count + SPARE_DESCRIPTORS > limit.rlim_cur ) {
+    count = (long) limit.rlim_cur - SPARE_DESCRIPTORS;
+    fprintf(stderr, "idle: limited to %ld connections by RLIMIT_NOFILE\n",
+            count);
+  }
+  if ( (fds = malloc(count * sizeof(*fds))) == NULL ) {
+    perror("Error with malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(atoi(argv[3]));
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  /* Latence de référence, sans connexion inactive */
+  if ( (probe = idle_connect(&server, 1)) == -1
+       || (baseline = idle_latency(probe)) < 0 ) {
+    perror("Error with the probe connection");
+    exit(EXIT_FAILURE);
+  }
+  rssBefore = process_rss(pid);
+  kernelBefore = socket_memory();
+
+  /* Ouverture des connexions, chacune sert un message puis reste inactive */
+  start = now_ns();
+  for ( i = 0; i < count; i++ ) {
+    fds[i] = idle_connect(&server, 2 + i / PORTS_PER_SOURCE);
+    if ( fds[i] == -1 || idle_ping(fds[i]) == -1 ) {
+      fprintf(stderr, "idle: connection %ld: %s\n", i, strerror(errno));
+      count = fds[i] == -1 ? i : i + 1;
+      break;
+    }
+  }
+  elapsed = (now_ns() - start) / 1e9;
+
+  /* Laisse le serveur rendre les tampons du dernier message */
+  pause.tv_sec = 0;
+  pause.tv_nsec = 100000000;
+  nanosleep(&pause, NULL);
+  rssAfter = process_rss(pid);
+  kernelAfter = socket_memory();
+
+  /* Coût de la boucle d'événements pour des connexions qui ne font rien */
+  cpu = process_cpu(pid);
+  pause.tv_sec = (time_t) seconds;
+  pause.tv_nsec = (long) ((seconds - pause.tv_sec) * 1e9);
+  nanosleep(&pause, NULL);
+  cpu = process_cpu(pid) - cpu;
+
+  latency = idle_latency(probe);
+
+  if ( count > 0 && rssBefore >= 0 && rssAfter >= 0 && latency >= 0 ) {
+    report("connections", "conn", count, "higher");
+    report("connect", "conn/s", count / elapsed, "higher");
+    report("rss", "B/conn", (double) (rssAfter - rssBefore) / count, "lower");
+    if ( kernelBefore >= 0 && kernelAfter >= 0 )
+      report("kernel", "B/conn", (double) (kernelAfter - kernelBefore) / count,
+             "lower");
+    report("cpu", "%", cpu * 100 / seconds, "lower");
+    report("latency", "us", latency, "lower");
+    report("overhead", "us", latency - baseline, "lower");
+  }
+
+  for ( i = 0; i < count; i++ )
+    close(fds[i]);
+  close(probe);
+  free(fds);
+
+  exit(count > 0 && latency >= 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
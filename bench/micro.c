@@ -0,0 +1,161 @@
+/******************************************************************************
+ *
+ * Name File : bench/micro.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MSG_SIZE 80
+#define DEFAULT_ITERATIONS 1000000
+#define LOOKUP_DIVISOR 1000
+
+/* Appels indirects pour empêcher le compilateur de supprimer les mesures */
+static void *(*volatile memset_ptr)(void *, int, size_t) = memset;
+static size_t (*volatile strlen_ptr)(const char *) = strlen;
+static volatile size_t sink;
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes.
+ *****************************************************************************/
+double now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui affiche le résultat d'une mesure au format JSON (une ligne).
+ * Prend en paramètre :
+ *     - name          Nom de la mesure.
+ *     - elapsed       Durée totale de la mesure en nanosecondes.
+ *     - iterations    Nombre d'itérations effectuées.
+ *****************************************************************************/
+void report(char *name, double elapsed, long iterations) {
+  printf("{\"name\": \"micro/%s\", \"unit\": \"ns/op\", \"value\": %.2f, "
+         "\"better\": \"lower\"}\n", name, elapsed / iterations);
+}
+
+/******************************************************************************
+ * Remise à zéro du tampon de message, faite avant chaque réception.
+ *****************************************************************************/
+void bench_msg_reset(long iterations) {
+  char msg[MSG_SIZE];
+  double start;
+  long i;
+
+  start = now_ns();
+  for ( i = 0; i < iterations; i++ ) {
+    memset_ptr(msg, 0, sizeof(msg));
+    sink += msg[i % MSG_SIZE];
+  }
+  report("msg_reset", now_ns() - start, iterations);
+}
+
+/******************************************************************************
+ * Suppression du retour à la ligne, faite par 'message_receive' du serveur
+ * TCP sur chaque message reçu.
+ *****************************************************************************/
+void bench_msg_trim(long iterations) {
+  char msg[MSG_SIZE];
+  double start;
+  long i;
+
+  start = now_ns();
+  for ( i = 0; i < iterations; i++ ) {
+    memset(msg, 'a', 32);
+    msg[32] = '\n';
+    msg[33] = '\0';
+    if ( msg[strlen_ptr(msg)-1] == '\n' || strlen_ptr(msg) > MSG_SIZE ) {
+      msg[strlen_ptr(msg)-1] = '\0';
+    }
+    sink += msg[32];
+  }
+  report("msg_trim", now_ns() - start, iterations);
+}
+
+/******************************************************************************
+ * Nom de l'hôte distant sous forme numérique, sans résolution inverse.
+ *****************************************************************************/
+void bench_peer_numeric(long iterations) {
+  struct sockaddr_in peer;
+  char host[NI_MAXHOST], service[NI_MAXSERV];
+  double start;
+  long i;
+
+  memset(&peer, 0, sizeof(peer));
+  peer.sin_family = AF_INET;
+  peer.sin_port = htons(25555);
+  peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  start = now_ns();
+  for ( i = 0; i < iterations; i++ ) {
+    getnameinfo((struct sockaddr *) &peer, sizeof(peer), host, NI_MAXHOST,
+                service, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    sink += host[0];
+  }
+  report("peer_name_numeric", now_ns() - start, iterations);
+}
+
+/******************************************************************************
+ * Nom de l'hôte distant avec résolution inverse, comme le fait 'printClient'
+ * des serveurs pour chaque client (et chaque datagramme en UDP).
+ *****************************************************************************/
+void bench_peer_lookup(long iterations) {
+  struct sockaddr_in peer;
+  char host[NI_MAXHOST], service[NI_MAXSERV];
+  double start;
+  long i;
+
+  memset(&peer, 0, sizeof(peer));
+  peer.sin_family = AF_INET;
+  peer.sin_port = htons(25555);
+  peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  start = now_ns();
+  for ( i = 0; i < iterations; i++ ) {
+    getnameinfo((struct sockaddr *) &peer, sizeof(peer), host, NI_MAXHOST,
+                service, NI_MAXSERV, NI_NUMERICSERV);
+    sink += host[0];
+  }
+  report("peer_name_lookup", now_ns() - start, iterations);
+}
+
+/******************************************************************************
+ * Micro-benchmarks des opérations faites par message sur le chemin critique
+ * des serveurs. Chaque mesure est affichée sur une ligne JSON.
+ *   Le programme prend en paramètre (optionnel) :
+ *     - iterations : Nombre d'itérations par mesure
+ *****************************************************************************/
+int main(int argc, char *argv[]) {
+  long iterations = DEFAULT_ITERATIONS;
+
+  if ( argc > 1 )
+    iterations = atol(argv[1]);
+  if ( iterations < LOOKUP_DIVISOR ) {
+    fprintf(stderr, "Usage: %s [iterations >= %d]\n", argv[0], LOOKUP_DIVISOR);
+    exit(EXIT_FAILURE);
+  }
+
+  bench_msg_reset(iterations);
+  bench_msg_trim(iterations);
+  bench_peer_numeric(iterations / 10);
+  bench_peer_lookup(iterations / LOOKUP_DIVISOR);
+
+  exit(EXIT_SUCCESS);
+}
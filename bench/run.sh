@@ -0,0 +1,355 @@
+#!/bin/sh
+###############################################################################
+#
+# Name File : bench/run.sh
+# Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+# Location  : UPSSITECH - University Paul Sabatier
+# Date      : October 2018
+#
+# Lance les micro-benchmarks puis les benchmarks de bout en bout (serveurs CLI
+# sur la boucle locale, pilotés par les clients CLI en mode '-n') et écrit les
+# résultats au format JSON.
+#
+# Variables d'environnement :
+#     - BENCH_OUT      Fichier de résultats (bench/results.json par défaut).
+#     - BENCH_PORT     Premier port utilisé par les serveurs.
+#     - BENCH_COUNT    Nombre d'aller-retours par connexion.
+#     - BENCH_SIZES    Tailles de message testées (octets, < 80).
+#     - BENCH_CONNS    Nombres de connexions simultanées testés.
+#     - BENCH_PROTOS   Transports testés (tcp, udp).
+#     - BENCH_TLS      Modes TLS testés (ktls, user), vide pour aucun.
+#     - BENCH_BULK     Taille du flux du mode flux (K, M, G), vide pour aucun.
+#     - BENCH_ECHO     Chemins d'echo du serveur unifié en mode flux comparés
+#                      (user, kernel), vide pour aucun.
+#     - BENCH_SCALE    Modes multi-cœurs comparés (threads, processes), vide
+#                      pour aucun.
+#     - BENCH_WORKERS  Nombre de threads ou de processus workers (nombre de
+#                      CPU par défaut).
+#     - BENCH_IDLE     Nombre de connexions inactives (100000 par défaut,
+#                      borné par RLIMIT_NOFILE), vide pour aucune.
+#     - BENCH_IMPAIR   Scénarios de dégradation 'nom:options' rejoués au
+#                      travers du relais impair-proxy, options séparées par
+#                      ':' (par exemple "wan:-l10:-j2"), vide pour aucun.
+#     - BENCH_IMPAIR_COUNT  Nombre d'aller-retours par scénario.
+#     - BENCH_SEED     Germe du relais, pour rejouer les mêmes pertes.
+#
+###############################################################################
+
+cd "$(dirname "$0")/.." || exit 1
+
+OUT=${BENCH_OUT:-bench/results.json}
+PORT=${BENCH_PORT:-25600}
+COUNT=${BENCH_COUNT:-2000}
+SIZES=${BENCH_SIZES:-"8 32 79"}
+CONNS=${BENCH_CONNS:-"1 4 16"}
+PROTOS=${BENCH_PROTOS:-"tcp udp"}
+TLS=${BENCH_TLS-"ktls user"}
+BULK=${BENCH_BULK-256M}
+ECHO=${BENCH_ECHO-"user kernel"}
+SCALE=${BENCH_SCALE-"threads processes"}
+WORKERS=${BENCH_WORKERS:-$(getconf _NPROCESSORS_ONLN)}
+IDLE=${BENCH_IDLE-100000}
+ITERATIONS=${BENCH_ITERATIONS:-1000000}
+IMPAIR=${BENCH_IMPAIR-"lan:-l0.1 wan:-l5:-j1 lossy:-l1:-x2:-d1:-o1"}
+IMPAIR_COUNT=${BENCH_IMPAIR_COUNT:-500}
+SEED=${BENCH_SEED:-1}
+
+RESULTS=$(mktemp)
+CERT=$(mktemp)
+trap 'rm -f "$RESULTS" "$RESULTS".* "$CERT" "$CERT".crt' EXIT
+
+# Chaine JSON échappée
+json_string() {
+  printf '"%s"' "$(printf '%s' "$1" | sed 's/\\/\\\\/g; s/"/\\"/g')"
+}
+
+# Attend que le serveur écoute sur le port donné
+wait_port() {
+  i=0
+  while [ $i -lt 50 ]; do
+    if ss -Hln 2>/dev/null | grep -q ":$1 " || \
+       ss -Hlun 2>/dev/null | grep -q ":$1 "; then
+      return 0
+    fi
+    sleep 0.1
+    i=$((i + 1))
+  done
+  sleep 0.5
+}
+
+# Lance une série de clients en parallèle et ajoute débit et latence, sous le
+# nom donné en quatrième paramètre s'il existe
+bench_e2e() {
+  proto=$1
+  size=$2
+  conns=$3
+  name=${4:-e2e/$proto/size=$size/conns=$conns}
+  msg=$(head -c "$size" /dev/zero | tr '\0' 'x')
+
+  start=$(date +%s%N)
+  c=0
+  pids=
+  while [ "$c" -lt "$conns" ]; do
+    ./"$proto"-client-cli -n "$COUNT" 127.0.0.1 "$PORT" "$msg" \
+      > "$RESULTS.$c" 2>&1 &
+    pids="$pids $!"
+    c=$((c + 1))
+  done
+  # Le serveur tourne aussi en tâche de fond : on n'attend que les clients
+  for pid in $pids; do
+    wait "$pid"
+  done
+  end=$(date +%s%N)
+
+  cat "$RESULTS".[0-9]* | awk -v name="$name" \
+    -v total=$((COUNT * conns)) -v ns=$((end - start)) '
+    /^Round trips/ { split($0, part, ", "); sum += part[2] + 0; n++ }
+    END {
+      if ( n == 0 ) exit 1
+      printf "{\"name\": \"%s/throughput\", \"unit\": \"msg/s\", ", name
+      printf "\"value\": %.0f, \"better\": \"higher\"}\n", total / (ns / 1e9)
+      printf "{\"name\": \"%s/latency\", \"unit\": \"us\", ", name
+      printf "\"value\": %.1f, \"better\": \"lower\"}\n", sum / n
+    }' >> "$RESULTS" || echo "bench: $proto size=$size conns=$conns failed" >&2
+  rm -f "$RESULTS".[0-9]*
+}
+
+# Mesure TLS : poignées de main (une connexion par aller-retour, reprises par
+# ticket) puis débit sur une seule connexion
+bench_tls() {
+  mode=$1
+  [ "$mode" = user ] && nokernel=-K || nokernel=
+
+  ./tcp-client-cli -T $nokernel -r -n "$COUNT" 127.0.0.1 "$PORT" x \
+    > "$RESULTS.0" 2>&1
+  ./tcp-client-cli -T $nokernel -n "$COUNT" 127.0.0.1 "$PORT" x \
+    > "$RESULTS.1" 2>&1
+
+  awk -v name="tls/$mode" '
+    /^Round trips/ { split($0, part, "[(]"); rate[n++] = part[2] + 0 }
+    /^TLS handshakes/ { split($0, part, ", "); split(part[2], r, ": ");
+                        split(part[3], k, ": "); resumed += r[2]; ktls += k[2] }
+    END {
+      if ( n != 2 ) exit 1
+      printf "{\"name\": \"%s/handshake\", \"unit\": \"conn/s\", ", name
+      printf "\"value\": %.0f, \"better\": \"higher\"}\n", rate[0]
+      printf "{\"name\": \"%s/throughput\", \"unit\": \"msg/s\", ", name
+      printf "\"value\": %.0f, \"better\": \"higher\"}\n", rate[1]
+      printf "{\"name\": \"%s/resumed\", \"unit\": \"conn\", ", name
+      printf "\"value\": %d, \"better\": \"higher\"}\n", resumed
+      printf "{\"name\": \"%s/offloaded\", \"unit\": \"conn\", ", name
+      printf "\"value\": %d, \"better\": \"higher\"}\n", ktls
+    }' "$RESULTS.0" "$RESULTS.1" >> "$RESULTS" \
+    || echo "bench: tls $mode failed" >&2
+  rm -f "$RESULTS".[0-9]*
+}
+
+# Scénario de dégradation : le relais s'intercale entre le client et les
+# serveurs qui écoutent sur $PORT ; en UDP, le client fiable (-L) retransmet
+# les pertes que le client simple attendrait indéfiniment
+bench_impair() {
+  name=${1%%:*}
+  options=
+  [ "$name" = "$1" ] || options=$(printf '%s' "${1#*:}" | tr ':' ' ')
+  proxyPort=$((PORT + 1))
+
+  ./impair-proxy -s "$SEED" $options "$proxyPort" 127.0.0.1 "$PORT" \
+    > /dev/null 2>&1 &
+  proxy=$!
+  wait_port "$proxyPort"
+  for proto in $PROTOS; do
+    echo "Impairment $name $proto..." >&2
+    if [ "$proto" = udp ]; then
+      ./udp-client-cli -L 16 -n "$IMPAIR_COUNT" 127.0.0.1 "$proxyPort" x
+    else
+      ./"$proto"-client-cli -n "$IMPAIR_COUNT" 127.0.0.1 "$proxyPort" x
+    fi > "$RESULTS.0" 2>&1
+    awk -v name="impair/$name/$proto" '
+      /^Round trips/ { split($0, part, "[(]"); rate = part[2] + 0;
+                       split($0, part, ", "); latency = part[2] + 0; ok = 1 }
+      /^Reliable :/ { split($0, part, "[(]"); rate = part[2] + 0; ok = 1 }
+      /^Latency avg/ { latency = $3 + 0 }
+      /^Sent :/ { split($0, part, ", "); split(part[2], r, ": ");
+                  retransmits = r[2] + 0; reliable = 1 }
+      END {
+        if ( !ok ) exit 1
+        printf "{\"name\": \"%s/throughput\", \"unit\": \"msg/s\", ", name
+        printf "\"value\": %.0f, \"better\": \"higher\"}\n", rate
+        printf "{\"name\": \"%s/latency\", \"unit\": \"us\", ", name
+        printf "\"value\": %.1f, \"better\": \"lower\"}\n", latency
+        if ( reliable ) {
+          printf "{\"name\": \"%s/retransmits\", \"unit\": \"msg\", ", name
+          printf "\"value\": %d, \"better\": \"lower\"}\n", retransmits
+        }
+      }' "$RESULTS.0" >> "$RESULTS" \
+      || echo "bench: impair $name $proto failed" >&2
+  done
+  rm -f "$RESULTS".[0-9]*
+  kill "$proxy" 2>/dev/null
+  wait "$proxy" 2>/dev/null
+}
+
+echo "Micro-benchmarks..." >&2
+./bench/micro "$ITERATIONS" >> "$RESULTS" || exit 1
+
+for proto in $PROTOS; do
+  ./"$proto"-server-cli "$PORT" > /dev/null 2>&1 &
+  server=$!
+  wait_port "$PORT"
+  for size in $SIZES; do
+    for conns in $CONNS; do
+      echo "End-to-end $proto size=$size conns=$conns..." >&2
+      bench_e2e "$proto" "$size" "$conns"
+    done
+  done
+  kill "$server" 2>/dev/null
+  wait "$server" 2>/dev/null
+  PORT=$((PORT + 1))
+done
+
+# Threads et processus workers sur le même socket, à charge égale : une
+# connexion par worker au moins, messages de taille moyenne
+for mode in $SCALE; do
+  for proto in $PROTOS; do
+    if [ "$mode" = threads ]; then
+      [ "$proto" = tcp ] || continue
+      option=-j
+    else
+      option=-p
+    fi
+    echo "Scale $proto $mode=$WORKERS..." >&2
+    ./"$proto"-server-cli $option "$WORKERS" "$PORT" > /dev/null 2>&1 &
+    server=$!
+    wait_port "$PORT"
+    bench_e2e "$proto" 32 $((WORKERS * 4)) "scale/$proto/$mode/workers=$WORKERS"
+    kill "$server" 2>/dev/null
+    wait "$server" 2>/dev/null
+    PORT=$((PORT + 1))
+  done
+done
+
+# Connexions inactives : mémoire du serveur par connexion, coût de la boucle
+# d'événements et latence d'une connexion active parmi elles
+if [ -n "$IDLE" ]; then
+  echo "Idle $IDLE connections..." >&2
+  ./tcp-server-cli -i 3600 "$PORT" > /dev/null 2>&1 &
+  server=$!
+  wait_port "$PORT"
+  ./bench/idle "$IDLE" 5 "$PORT" "$server" >> "$RESULTS" \
+    || echo "bench: idle failed" >&2
+  kill "$server" 2>/dev/null
+  wait "$server" 2>/dev/null
+  PORT=$((PORT + 1))
+fi
+
+# Réseau dégradé : latence, gigue, pertes, duplications et réordonnancements
+# injectés par le relais, sans netem ni droits root
+if [ -n "$IMPAIR" ]; then
+  for proto in $PROTOS; do
+    ./"$proto"-server-cli "$PORT" > /dev/null 2>&1 &
+    eval "server_$proto=\$!"
+  done
+  wait_port "$PORT"
+  for scenario in $IMPAIR; do
+    bench_impair "$scenario"
+  done
+  for proto in $PROTOS; do
+    eval "kill \$server_$proto 2>/dev/null; wait \$server_$proto 2>/dev/null"
+  done
+  PORT=$((PORT + 2))
+fi
+
+# Certificat auto-signé pour le serveur TLS
+if [ -n "$TLS" ] && openssl req -x509 -newkey ec \
+     -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 -subj /CN=localhost \
+     -keyout "$CERT" -out "$CERT.crt" > /dev/null 2>&1; then
+  cat "$CERT.crt" >> "$CERT"
+  for mode in $TLS; do
+    echo "TLS $mode..." >&2
+    [ "$mode" = user ] && nokernel=-K || nokernel=
+    ./tcp-server-cli -T "$CERT" $nokernel "$PORT" > /dev/null 2>&1 &
+    server=$!
+    wait_port "$PORT"
+    bench_tls "$mode"
+    kill "$server" 2>/dev/null
+    wait "$server" 2>/dev/null
+    PORT=$((PORT + 1))
+  done
+elif [ -n "$TLS" ]; then
+  echo "bench: openssl not found, TLS skipped" >&2
+fi
+
+# Flux synthétique renvoyé par le serveur en mode flux
+if [ -n "$BULK" ]; then
+  echo "Bulk $BULK..." >&2
+  ./tcp-server-cli -s 65535 "$PORT" > /dev/null 2>&1 &
+  server=$!
+  wait_port "$PORT"
+  ./tcp-client-cli -Z "$BULK" 127.0.0.1 "$PORT" 2>&1 | awk '
+    /^Bulk :/ { split($0, part, "[(]"); rate = part[2] + 0 }
+    /^CPU :/ { split($0, part, ", "); cpu = part[3] + 0 }
+    /^Verified :/ { split($0, part, ", "); bad = part[2] + 0; ok = 1 }
+    END {
+      if ( !ok || bad != 0 ) exit 1
+      printf "{\"name\": \"bulk/tcp/throughput\", \"unit\": \"Gb/s\", "
+      printf "\"value\": %.2f, \"better\": \"higher\"}\n", rate
+      printf "{\"name\": \"bulk/tcp/cpu\", \"unit\": \"s/GB\", "
+      printf "\"value\": %.3f, \"better\": \"lower\"}\n", cpu
+    }' >> "$RESULTS" || echo "bench: bulk failed" >&2
+  kill "$server" 2>/dev/null
+  wait "$server" 2>/dev/null
+  PORT=$((PORT + 1))
+fi
+
+# Echo en mode flux par les workers ou dans le noyau (-K, BPF sockmap) :
+# aller-retours de MSG_SIZE octets, que le client attend en entier, puis
+# flux synthétique
+for mode in $ECHO; do
+  [ "$mode" = kernel ] && kernel=-K || kernel=
+  ./echo-server -t "$PORT" -s $kernel > "$RESULTS.server" 2>&1 &
+  server=$!
+  wait_port "$PORT"
+  if grep -q "Kernel echo unavailable" "$RESULTS.server"; then
+    echo "bench: kernel echo unavailable, skipped" >&2
+  else
+    for conns in $CONNS; do
+      echo "Echo $mode conns=$conns..." >&2
+      bench_e2e tcp 80 "$conns" "echo/$mode/conns=$conns"
+    done
+    if [ -n "$BULK" ]; then
+      echo "Echo $mode bulk $BULK..." >&2
+      ./tcp-client-cli -Z "$BULK" 127.0.0.1 "$PORT" 2>&1 | awk -v name="echo/$mode" '
+        /^Bulk :/ { split($0, part, "[(]"); rate = part[2] + 0 }
+        /^Verified :/ { split($0, part, ", "); bad = part[2] + 0; ok = 1 }
+        END {
+          if ( !ok || bad != 0 ) exit 1
+          printf "{\"name\": \"%s/bulk\", \"unit\": \"Gb/s\", ", name
+          printf "\"value\": %.2f, \"better\": \"higher\"}\n", rate
+        }' >> "$RESULTS" || echo "bench: echo $mode bulk failed" >&2
+    fi
+  fi
+  kill "$server" 2>/dev/null
+  wait "$server" 2>/dev/null
+  rm -f "$RESULTS.server"
+  PORT=$((PORT + 1))
+done
+
+# Document final : métadonnées de l'hôte puis une mesure par ligne
+{
+  echo "{"
+  echo "  \"host\": {"
+  echo "    \"hostname\": $(json_string "$(uname -n)"),"
+  echo "    \"kernel\": $(json_string "$(uname -srm)"),"
+  echo "    \"cpu\": $(json_string "$(grep -m1 'model name' /proc/cpuinfo | cut -d: -f2 | sed 's/^ *//')"),"
+  echo "    \"cpus\": $(getconf _NPROCESSORS_ONLN),"
+  echo "    \"compiler\": $(json_string "$(${CC:-cc} --version | head -n1)"),"
+  echo "    \"commit\": $(json_string "$(git rev-parse --short HEAD 2>/dev/null)"),"
+  echo "    \"date\": $(json_string "$(date -u +%Y-%m-%dT%H:%M:%SZ)")"
+  echo "  },"
+  echo "  \"results\": ["
+  sed '$!s/$/,/; s/^/    /' "$RESULTS"
+  echo "  ]"
+  echo "}"
+} > "$OUT"
+
+echo "Results written to $OUT" >&2
@@ -0,0 +1,355 @@
+/******************************************************************************
+ *
+ * Name File : bulk.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "bulk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/* Flux reçu en retour, vérifié par le thread de réception */
+struct bulk_state {
+  int fd;
+  const unsigned char *data;	/* flux envoyé */
+  size_t size;
+  size_t received;
+  size_t mismatches;		/* octets différents du flux envoyé */
+  size_t firstMismatch;
+  int error;			/* errno de la réception, 0 si complète */
+};
+
+/* Envois MSG_ZEROCOPY et complétions lues sur la file d'erreurs */
+struct bulk_zerocopy {
+  int enabled;
+  uint32_t sends;
+  uint32_t completed;
+  uint32_t copied;		/* envois que le noyau a quand même copiés */
+};
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en ns (CLOCK_MONOTONIC).
+ *****************************************************************************/
+static uint64_t bulk_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le temps CPU consommé par le processus, en secondes.
+ * Prend en paramètre :
+ *     - user    Pointeur vers le temps passé dans le processus.
+ *     - sys     Pointeur vers le temps passé dans le noyau.
+ *****************************************************************************/
+static void bulk_cpu(double *user, double *sys) {
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  *user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  *sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/******************************************************************************
+ * Fonction qui convertit une taille, éventuellement suivie de K, M ou G.
+ * Prend en paramètre :
+ *     - text    Chaine de caractère de la taille.
+ * Renvoie la taille en octets, 0 si elle est invalide.
+ *****************************************************************************/
+size_t bulk_size_parse(char *text) {
+  unsigned long long size;
+  char *end;
+
+  size = strtoull(text, &end, 10);
+  switch ( *end ) {
+  case 'G': case 'g':
+    size <<= 10;
+    /* fall through */
+  case 'M': case 'm':
+    size <<= 10;
+    /* fall through */
+  case 'K': case 'k':
+    size <<= 10;
+    end++;
+    break;
+  default:
+    break;
+  }
+  return *end == '\0' ? (size_t) size : 0;
+}
+
+/******************************************************************************
+ * Fonction qui projette en mémoire le flux à envoyer : le fichier donné, ou
+ * une suite pseudo-aléatoire de la taille demandée.
+ * Prend en paramètre :
+ *     - path    Chemin du fichier, NULL pour un flux synthétique.
+ *     - size    Pointeur vers la taille du flux (lue pour un flux
+ *                 synthétique, renseignée pour un fichier).
+ * Renvoie le flux projeté, NULL en cas d'erreur.
+ *****************************************************************************/
+static unsigned char *bulk_map(char *path, size_t *size) {
+  struct stat info;
+  unsigned char *data;
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  size_t i;
+  int fd;
+
+  if ( path != NULL ) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 )
+      return NULL;
+    if ( fstat(fd, &info) == -1 || info.st_size == 0 ) {
+      close(fd);
+      errno = EINVAL;
+      return NULL;
+    }
+    *size = info.st_size;
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if ( data == MAP_FAILED )
+      return NULL;
+    madvise(data, *size, MADV_SEQUENTIAL);
+    return data;
+  }
+
+  data = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+  if ( data == MAP_FAILED )
+    return NULL;
+  /* Suite xorshift64 : un décalage ou une perte d'octets se remarque */
+  for ( i = 0; i < *size; i++ ) {
+    if ( (i & 7) == 0 ) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+    }
+    data[i] = (unsigned char) (state >> ((i & 7) * 8));
+  }
+  return data;
+}
+
+/******************************************************************************
+ * Thread qui reçoit le flux renvoyé par le serveur et le compare au flux
+ * envoyé.
+ * Prend en paramètre :
+ *     - arg    Pointeur vers l'état partagé (struct bulk_state).
+ *****************************************************************************/
+static void *bulk_receive(void *arg) {
+  struct bulk_state *state = arg;
+  unsigned char *buffer;
+  size_t want, i;
+  ssize_t status;
+
+  buffer = malloc(BULK_RECV_SIZE);
+  if ( buffer == NULL ) {
+    state->error = ENOMEM;
+    return NULL;
+  }
+
+  while ( state->received < state->size ) {
+    want = state->size - state->received;
+    status = recv(state->fd, buffer, want < BULK_RECV_SIZE ? want : BULK_RECV_SIZE,
+                  0);
+    if ( status == -1 && errno == EINTR )
+      continue;
+    if ( status <= 0 ) {
+      state->error = status == 0 ? ECONNRESET : errno;
+      break;
+    }
+
+    if ( memcmp(buffer, state->data + state->received, status) != 0 ) {
+      for ( i = 0; i < (size_t) status; i++ ) {
+        if ( buffer[i] == state->data[state->received + i] )
+          continue;
+        if ( state->mismatches++ == 0 )
+          state->firstMismatch = state->received + i;
+      }
+    }
+    state->received += status;
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+/******************************************************************************
+ * Fonction qui lit les complétions des envois MSG_ZEROCOPY : chacune couvre
+ * une plage de numéros d'envoi dont les pages peuvent être libérées.
+ * Prend en paramètre :
+ *     - fd    Descripteur du socket.
+ *     - zc    Pointeur vers les compteurs d'envois.
+ *****************************************************************************/
+static void bulk_reap(int fd, struct bulk_zerocopy *zc) {
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err) + 64)];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *err;
+  uint32_t range;
+
+  while ( 1 ) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ( recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1 )
+      return;
+
+    for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+          cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+      err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+      if ( err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+        continue;
+      range = err->ee_data - err->ee_info + 1;
+      zc->completed += range;
+      if ( err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+        zc->copied += range;
+    }
+  }
+}
+
+/******************************************************************************
+ * Fonction qui attend une complétion MSG_ZEROCOPY, au plus 'timeout' ms.
+ * Prend en paramètre :
+ *     - fd         Descripteur du socket.
+ *     - zc         Pointeur vers les compteurs d'envois.
+ *     - timeout    Délai en millisecondes.
+ *****************************************************************************/
+static void bulk_wait(int fd, struct bulk_zerocopy *zc, int timeout) {
+  struct pollfd fds;
+
+  /* POLLERR signale une file d'erreurs non vide */
+  fds.fd = fd;
+  fds.events = 0;
+  poll(&fds, 1, timeout);
+  bulk_reap(fd, zc);
+}
+
+/******************************************************************************
+ * Fonction qui envoie un flux au serveur echo en mode flux (tcp-server-cli
+ * -s) et vérifie le flux renvoyé, reçu par un second thread. Les pages du
+ * flux sont envoyées sans copie (MSG_ZEROCOPY) quand le noyau le permet.
+ * Prend en paramètre :
+ *     - socketDescriptor    Socket connecté au serveur, bloquant.
+ *     - path                Fichier à envoyer, NULL pour un flux synthétique.
+ *     - size                Taille du flux synthétique.
+ * Renvoie 0 si le flux renvoyé est complet et identique, -1 sinon.
+ *****************************************************************************/
+int bulk_run(int socketDescriptor, char *path, size_t size) {
+  struct bulk_state state;
+  struct bulk_zerocopy zc;
+  pthread_t receiver;
+  unsigned char *data;
+  size_t offset, len;
+  ssize_t status;
+  uint64_t start, end, deadline;
+  double userStart, sysStart, user, sys, elapsed;
+  int one = 1;
+
+  data = bulk_map(path, &size);
+  if ( data == NULL ) {
+    perror("Error with mmap");
+    return -1;
+  }
+
+  memset(&zc, 0, sizeof(zc));
+  zc.enabled = setsockopt(socketDescriptor, SOL_SOCKET, SO_ZEROCOPY, &one,
+                          sizeof(one)) == 0;
+
+  memset(&state, 0, sizeof(state));
+  state.fd = socketDescriptor;
+  state.data = data;
+  state.size = size;
+
+  bulk_cpu(&userStart, &sysStart);
+  start = bulk_now();
+  if ( pthread_create(&receiver, NULL, bulk_receive, &state) != 0 ) {
+    perror("Error with pthread_create");
+    munmap(data, size);
+    return -1;
+  }
+
+  for ( offset = 0; offset < size; ) {
+    len = size - offset < BULK_CHUNK ? size - offset : BULK_CHUNK;
+    status = send(socketDescriptor, data + offset, len,
+                  MSG_NOSIGNAL | (zc.enabled ? MSG_ZEROCOPY : 0));
+    if ( status == -1 ) {
+      if ( errno == EINTR )
+        continue;
+      /* Trop de pages épinglées : attente des complétions */
+      if ( errno == ENOBUFS && zc.enabled ) {
+        bulk_wait(socketDescriptor, &zc, 10);
+        continue;
+      }
+      perror("Error with send");
+      break;
+    }
+    if ( zc.enabled ) {
+      zc.sends++;
+      bulk_reap(socketDescriptor, &zc);
+    }
+    offset += status;
+  }
+  shutdown(socketDescriptor, SHUT_WR);
+
+  pthread_join(receiver, NULL);
+  end = bulk_now();
+  bulk_cpu(&user, &sys);
+  user -= userStart;
+  sys -= sysStart;
+
+  /* Les pages restent épinglées jusqu'à leur complétion */
+  deadline = end + (uint64_t) BULK_REAP_MS * 1000000;
+  while ( zc.completed < zc.sends && bulk_now() < deadline )
+    bulk_wait(socketDescriptor, &zc, 10);
+
+  elapsed = (end - start) / 1e9;
+  printf("Bulk : %zu bytes sent, %zu echoed in %.3f s (%.2f Gb/s)\n",
+         offset, state.received, elapsed, state.received * 8 / elapsed / 1e9);
+  printf("CPU : %.3f s user, %.3f s sys, %.3f s per GB\n", user, sys,
+         state.received != 0 ? (user + sys) / (state.received / 1e9) : 0.0);
+  if ( zc.enabled )
+    printf("Zerocopy : %u sends, %u completed, %u copied by the kernel\n",
+           zc.sends, zc.completed, zc.copied);
+  else
+    printf("Zerocopy : unavailable, data copied by send\n");
+  printf("Verified : %zu bytes, %zu mismatches", state.received,
+         state.mismatches);
+  if ( state.mismatches != 0 )
+    printf(" (first at offset %zu)", state.firstMismatch);
+  printf("\n");
+  if ( state.error != 0 )
+    fprintf(stderr, "Echo stream incomplete: %s\n", strerror(state.error));
+
+  munmap(data, size);
+  return state.received == size && state.mismatches == 0 ? 0 : -1;
+}
@@ -0,0 +1,26 @@
+/******************************************************************************
+ *
+ * Name File : bulk.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef BULK_H
+#define BULK_H
+
+#include <stddef.h>
+
+#define BULK_CHUNK 262144	/* Octets par envoi */
+#define BULK_RECV_SIZE 262144	/* Tampon de réception */
+#define BULK_REAP_MS 1000	/* Attente des dernières complétions */
+
+size_t bulk_size_parse(char *text);
+int bulk_run(int socketDescriptor, char *path, size_t size);
+
+#endif
@@ -0,0 +1,1110 @@
+/******************************************************************************
+ *
+ * Name File : echo-server.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <numa.h>
+
+#include "arena.h"
+#include "activation.h"
+#include "sockmap.h"
+#include "wheel.h"
+#include "acceptor.h"
+
+#define MSG_SIZE 80
+#define ECHO_BUFFER 4096	/* Tampon d'une connexion en mode flux */
+#define ECHO_BATCH 64		/* Datagrammes lus et renvoyés par appel */
+#define ECHO_DATAGRAM 2048	/* Datagramme le plus long renvoyé */
+#define ECHO_BUDGET 16		/* Lectures renvoyées par connexion et par
+				   réveil */
+#define ECHO_BATCHES 4		/* Lots de datagrammes renvoyés par réveil */
+#define MAX_EVENTS 64
+#define MAX_WORKERS 256
+#define WARM_DEFAULT 256	/* Connexions préparées par worker */
+#define ECHO_LINGER_MS 5000	/* -K : attente des derniers octets renvoyés
+				   par le noyau après le FIN du client */
+#define ECHO_LINGER_CHECK 32	/* ... vérifiés au plus tous les 32 ticks */
+
+/* Transports servis */
+enum transport {
+  TRANSPORT_TCP,
+  TRANSPORT_UDP,
+  TRANSPORT_UNIX,
+  TRANSPORTS
+};
+
+static const char *transportNames[TRANSPORTS] = { "tcp", "udp", "unix" };
+
+/* Socket d'écoute d'un transport, partagé par les workers de son budget */
+struct listener {
+  int fd;			/* -1 : transport non servi */
+  enum transport transport;
+  int budget;			/* nombre de workers qui le servent */
+  int first;			/* premier de ces workers */
+};
+
+/* États d'une connexion en flux, chacun associé à une échéance */
+enum connection_state {
+  CONN_READ,			/* connectée, premier message attendu */
+  CONN_IDLE,			/* en attente du message suivant */
+  CONN_WRITE,			/* réponse en cours d'envoi */
+  CONN_STATES
+};
+
+/* Statistiques d'un transport, tenues par chaque worker */
+struct transport_stats {
+  unsigned long accepted;
+  unsigned long closed;
+  unsigned long messages;	/* lectures ou datagrammes renvoyés */
+  unsigned long long bytes;
+  unsigned long dropped;	/* datagrammes refusés par le noyau */
+  unsigned long errors;
+  unsigned long offloaded;	/* connexions renvoyées par le noyau (-K) */
+  unsigned long timeouts[CONN_STATES];	/* connexions fermées, par état */
+  struct accept_stats accept;	/* clients refusés à l'acceptation */
+};
+
+/* Statistiques d'un worker publiées à chaque tour de boucle, lues par le
+   thread principal */
+struct worker_snapshot {
+  unsigned long open;
+  struct transport_stats stats[TRANSPORTS];
+};
+
+/* Connexion en flux (TCP ou Unix) : chaque message lu est renvoyé sur
+   MSG_SIZE octets comme le fait tcp-server-cli, ou les octets lus tels quels
+   en mode flux ; la lecture reprend une fois la réponse entièrement écrite.
+   La minuterie doit rester en tête */
+struct connection {
+  struct timer timer;
+  int fd;
+  enum transport transport;
+  enum connection_state state;
+  char *buffer;			/* tampon prêté par l'arène du worker pendant
+				   un message, NULL sans données en attente */
+  size_t length;
+  size_t offset;		/* octets déjà renvoyés */
+  int writing;			/* EPOLLOUT attendu à la place d'EPOLLIN */
+  int kernel;			/* renvoyée par le noyau : seule sa fermeture
+				   est attendue */
+  uint64_t deadline;		/* fermeture en attente de l'echo du noyau,
+				   abandonnée à ce tick ; 0 sinon */
+  unsigned int check;		/* ... prochaine vérification, en ticks */
+};
+
+/* Tampons d'un lot de datagrammes */
+struct datagram_batch {
+  struct mmsghdr msgs[ECHO_BATCH];
+  struct iovec iovs[ECHO_BATCH];
+  struct sockaddr_storage addrs[ECHO_BATCH];
+  char data[ECHO_BATCH][ECHO_DATAGRAM];
+};
+
+/* Démarrage des workers : le service n'est annoncé prêt qu'une fois tous
+   les workers chauds */
+struct startup {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int ready;			/* workers prêts */
+};
+
+/* Worker : un thread épinglé, sa boucle d'événements et ses arènes, pour
+   tous les transports de son budget */
+struct worker {
+  int id;
+  int cpu;
+  int node;
+  int epollDescriptor;
+  int wakeDescriptor;
+  struct listener *listeners;
+  struct timer_wheel wheel;	/* échéances des connexions */
+  unsigned int timeouts[CONN_STATES];	/* en ticks, 0 : aucune */
+  unsigned long maxConnections;	/* part de la limite, 0 : pas de limite */
+  int reserveDescriptor;	/* libéré pour refuser un client sur EMFILE */
+  struct arena connections;
+  struct arena buffers;		/* tampons prêtés aux connexions actives */
+  struct datagram_batch *batch;
+  int stream;			/* mode flux */
+  struct sockmap *sockmap;	/* echo dans le noyau, NULL sans -K */
+  int count;			/* nombre de workers */
+  unsigned long warm;		/* connexions préparées avant d'accepter */
+  struct startup *startup;
+  unsigned long open;
+  struct transport_stats stats[TRANSPORTS];
+  pthread_mutex_t lock;		/* protège 'snapshot' */
+  struct worker_snapshot snapshot;
+  pthread_t thread;
+};
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dumpStats = 0;
+
+/******************************************************************************
+ * Fonction appelée à la réception de SIGINT ou SIGTERM, demande l'arrêt du
+ * serveur.
+ *****************************************************************************/
+void stop_handler(int signum) {
+  (void) signum;
+  running = 0;
+}
+
+/******************************************************************************
+ * Fonction appelée à la réception de SIGUSR1, demande l'affichage des
+ * statistiques.
+ *****************************************************************************/
+void stats_handler(int signum) {
+  (void) signum;
+  dumpStats = 1;
+}
+
+/******************************************************************************
+ * Fonction qui ouvre un socket d'écoute Unix en mode flux. Un fichier laissé
+ * par une exécution précédente est remplacé.
+ * Prend en paramètre :
+ *     - path    Chemin du socket.
+ * Renvoie le descripteur du socket, en mode non bloquant.
+ *****************************************************************************/
+int socket_open_unix(char *path) {
+  struct sockaddr_un addr;
+  int socketDescriptor;
+
+  if ( strlen(path) >= sizeof(addr.sun_path) ) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  socketDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if ( socketDescriptor == -1
+       || bind(socketDescriptor, (struct sockaddr *) &addr, sizeof(addr)) == -1
+       || listen(socketDescriptor, SOMAXCONN) == -1 ) {
+    perror("Error with bind");
+    exit(EXIT_FAILURE);
+  }
+  return socketDescriptor;
+}
+
+/******************************************************************************
+ * Fonction qui reconnaît le transport d'un socket d'écoute hérité.
+ * Prend en paramètre :
+ *     - fd    Descripteur hérité.
+ * Renvoie le transport, -1 si le descripteur n'en est pas un.
+ *****************************************************************************/
+int listener_transport(int fd) {
+  int type, domain;
+  socklen_t length = sizeof(int);
+
+  if ( getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == -1 )
+    return -1;
+  length = sizeof(int);
+  if ( getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &length) == -1 )
+    return -1;
+  if ( domain == AF_UNIX )
+    return type == SOCK_STREAM ? TRANSPORT_UNIX : -1;
+  if ( domain != AF_INET && domain != AF_INET6 )
+    return -1;
+  if ( type == SOCK_STREAM )
+    return TRANSPORT_TCP;
+  return type == SOCK_DGRAM ? TRANSPORT_UDP : -1;
+}
+
+/******************************************************************************
+ * Fonction qui lit les budgets de workers par transport, de la forme
+ * "tcp=2,udp=1,unix=1". Un transport absent garde son budget.
+ * Prend en paramètre :
+ *     - spec         Chaine à lire.
+ *     - listeners    Transports dont le budget est mis à jour.
+ * Renvoie 0 en cas de succès, -1 si la chaine est invalide.
+ *****************************************************************************/
+int budget_parse(char *spec, struct listener *listeners) {
+  char *item, *save = NULL, *value;
+  int i;
+
+  for ( item = strtok_r(spec, ",", &save); item != NULL;
+        item = strtok_r(NULL, ",", &save) ) {
+    if ( (value = strchr(item, '=')) == NULL )
+      return -1;
+    *value++ = '\0';
+    for ( i = 0; i < TRANSPORTS && strcmp(item, transportNames[i]) != 0; i++ )
+      ;
+    if ( i == TRANSPORTS || (listeners[i].budget = atoi(value)) < 1 )
+      return -1;
+  }
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui dit si un worker sert un transport : les budgets sont posés
+ * les uns à la suite des autres sur les workers, en reprenant au premier,
+ * pour que des budgets réduits ne tombent pas tous sur les mêmes CPU.
+ * Prend en paramètre :
+ *     - listener    Transport concerné.
+ *     - worker      Numéro du worker.
+ *     - count       Nombre de workers.
+ * Renvoie 1 si le worker sert le transport, 0 sinon.
+ *****************************************************************************/
+int budget_serves(struct listener *listener, int worker, int count) {
+  return listener->fd != -1
+         && (worker - listener->first + count) % count < listener->budget;
+}
+
+/******************************************************************************
+ * Fonction qui change les événements attendus sur une connexion : la
+ * lecture, ou l'écriture tant qu'une réponse n'est pas entièrement partie,
+ * ou seulement la fermeture d'une connexion renvoyée par le noyau.
+ * Prend en paramètre :
+ *     - worker        Pointeur vers le worker.
+ *     - connection    Pointeur vers la connexion.
+ *     - operation     EPOLL_CTL_ADD ou EPOLL_CTL_MOD.
+ *****************************************************************************/
+void connection_watch(struct worker *worker, struct connection *connection,
+                      int operation) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  if ( connection->kernel )
+    event.events = EPOLLRDHUP;
+  else
+    event.events = connection->writing ? EPOLLOUT : EPOLLIN;
+  event.data.ptr = connection;
+  epoll_ctl(worker->epollDescriptor, operation, connection->fd, &event);
+}
+
+/******************************************************************************
+ * Fonction qui change l'état d'une connexion : échéance associée et, en
+ * entrant dans l'écriture ou en en sortant, événements attendus.
+ * Prend en paramètre :
+ *     - worker        Pointeur vers le worker.
+ *     - connection    Pointeur vers la connexion.
+ *     - state         Nouvel état.
+ *****************************************************************************/
+void connection_set_state(struct worker *worker, struct connection *connection,
+                          enum connection_state state) {
+  connection->state = state;
+  wheel_schedule(&worker->wheel, &connection->timer, worker->timeouts[state]);
+  if ( connection->writing != (state == CONN_WRITE) ) {
+    connection->writing = state == CONN_WRITE;
+    connection_watch(worker, connection, EPOLL_CTL_MOD);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui prête un tampon à une connexion qui n'en a pas.
+ * Prend en paramètre :
+ *     - worker        Pointeur vers le worker.
+ *     - connection    Pointeur vers la connexion.
+ * Renvoie le tampon, NULL si la mémoire manque.
+ *****************************************************************************/
+char *connection_buffer(struct worker *worker, struct connection *connection) {
+  if ( connection->buffer == NULL )
+    connection->buffer = arena_take(&worker->buffers);
+  return connection->buffer;
+}
+
+/******************************************************************************
+ * Fonction qui rend le tampon d'une connexion qui n'a plus de données en
+ * attente : une connexion inactive n'occupe que son état.
+ * Prend en paramètre :
+ *     - worker        Pointeur vers le worker.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void connection_release(struct worker *worker, struct connection *connection) {
+  if ( connection->buffer == NULL )
+    return;
+  arena_free(&worker->buffers, connection->buffer);
+  connection->buffer = NULL;
+}
+
+/******************************************************************************
+ * Fonction qui ferme une connexion, désarme son échéance et rend son état et
+ * son tampon aux arènes.
+ * Prend en paramètre :
+ *     - worker        Pointeur vers le worker.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void connection_close(struct worker *worker, struct connection *connection) {
+  wheel_cancel(&worker->wheel, &connection->timer);
+  close(connection->fd);
+  worker->stats[connection->transport].closed++;
+  worker->open--;
+  connection_release(worker, connection);
+  arena_free(&worker->connections, connection);
+}
+
+void connection_linger(struct worker *worker, struct connection *connection,
+                       uint32_t events);
+
+/******************************************************************************
+ * Fonction qui traite l'échéance atteinte d'une connexion : ferme celle dont
+ * le premier message, le message suivant ou la réponse n'arrive pas ou ne
+ * part pas, ou revérifie une connexion renvoyée par le noyau qui attend la
+ * fin de son echo.
+ * Prend en paramètre :
+ *     - timer    Pointeur vers l'échéance, en tête de la connexion.
+ *     - arg      Pointeur vers le worker.
+ *****************************************************************************/
+void timer_expire(struct timer *timer, void *arg) {
+  struct worker *worker = arg;
+  struct connection *connection = (struct connection *) timer;
+
+  if ( connection->kernel ) {
+    connection_linger(worker, connection, 0);
+    return;
+  }
+  worker->stats[connection->transport].timeouts[connection->state]++;
+  connection_close(worker, connection);
+}
+
+/******************************************************************************
+ * Fonction qui accepte les connexions en attente sur un socket d'écoute en
+ * mode flux. Les workers du budget sont réveillés tour à tour (inscription
+ * exclusive), chacun garde les connexions qu'il accepte, dans la limite de
+ * sa part. Le tampon n'est prêté qu'à la lecture d'un message.
+ * Prend en paramètre :
+ *     - worker      Pointeur vers le worker.
+ *     - listener    Socket d'écoute prêt.
+ *****************************************************************************/
+void listener_accept(struct worker *worker, struct listener *listener) {
+  struct transport_stats *stats = &worker->stats[listener->transport];
+  struct connection *connection;
+  int client;
+  int on = 1;
+
+  while ( (client = acceptor_accept(listener->fd, &worker->reserveDescriptor,
+                                    worker->maxConnections != 0
+                                    && worker->open >= worker->maxConnections,
+                                    NULL, NULL, &stats->accept)) != -1 ) {
+    connection = arena_alloc(&worker->connections);
+    if ( connection == NULL ) {
+      stats->errors++;
+      close(client);
+      continue;
+    }
+    if ( listener->transport == TRANSPORT_TCP )
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    connection->fd = client;
+    connection->transport = listener->transport;
+    connection->state = CONN_READ;
+    /* Echo dans le noyau : la connexion reste au processus s'il la refuse ;
+       le noyau la sert sans échéance, seule sa fermeture est attendue */
+    if ( worker->sockmap != NULL && listener->transport == TRANSPORT_TCP
+         && sockmap_add(worker->sockmap, client) == 0 ) {
+      connection->kernel = 1;
+      stats->offloaded++;
+    } else {
+      wheel_schedule(&worker->wheel, &connection->timer,
+                     worker->timeouts[CONN_READ]);
+    }
+    connection_watch(worker, connection, EPOLL_CTL_ADD);
+    stats->accepted++;
+    worker->open++;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui renvoie les octets reçus sur une connexion en flux, puis
+ * reprend la lecture. Un client lent garde son tampon jusqu'à ce qu'il ait
+ * tout lu ; il est rendu dès que plus rien n'est à lire. Au plus
+ * ECHO_BUDGET lectures sont renvoyées par réveil : le reste attend le
+ * réveil suivant (epoll sans EPOLLET), pour qu'un client qui enchaîne les
+ * requêtes ne prive pas les autres connexions et transports du worker.
+ * Prend en paramètre :
+ *     - worker        Pointeur vers le worker.
+ *     - connection    Pointeur vers la connexion prête.
+ *****************************************************************************/
+void connection_handle(struct worker *worker, struct connection *connection) {
+  struct transport_stats *stats = &worker->stats[connection->transport];
+  ssize_t status;
+  int handled = 0;
+
+  while ( 1 ) {
+    /* Réponse en cours : elle part d'abord */
+    while ( connection->offset < connection->length ) {
+      status = send(connection->fd, connection->buffer + connection->offset,
+                    connection->length - connection->offset, MSG_NOSIGNAL);
+      if ( status == -1 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+          if ( connection->state != CONN_WRITE )
+            connection_set_state(worker, connection, CONN_WRITE);
+          return;
+        }
+        if ( errno != EINTR ) {
+          stats->errors++;
+          connection_close(worker, connection);
+          return;
+        }
+        continue;
+      }
+      connection->offset += status;
+      stats->bytes += status;
+    }
+    /* Tampon entièrement renvoyé : retour à la lecture */
+    if ( connection->length != 0 ) {
+      connection->length = connection->offset = 0;
+      connection_set_state(worker, connection, CONN_IDLE);
+    }
+    if ( handled == ECHO_BUDGET ) {
+      connection_release(worker, connection);
+      return;
+    }
+
+    if ( connection_buffer(worker, connection) == NULL ) {
+      stats->errors++;
+      connection_close(worker, connection);
+      return;
+    }
+    if ( !worker->stream )
+      memset(connection->buffer, 0, MSG_SIZE);
+    status = recv(connection->fd, connection->buffer,
+                  worker->stream ? ECHO_BUFFER : MSG_SIZE, 0);
+    if ( status == 0 ) {
+      connection_close(worker, connection);
+      return;
+    }
+    if ( status == -1 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+        connection_release(worker, connection);
+        return;
+      }
+      if ( errno != EINTR ) {
+        stats->errors++;
+        connection_close(worker, connection);
+        return;
+      }
+      continue;
+    }
+    connection->length = worker->stream ? (size_t) status : MSG_SIZE;
+    stats->messages++;
+    handled++;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui ferme une connexion renvoyée par le noyau, réveillée par le
+ * FIN du client : le noyau écrit encore ce qu'il a reçu tant que la file
+ * d'émission est pleine, la fermeture attend donc que tout soit reparti,
+ * au plus ECHO_LINGER_MS. Rien ne signale la fin de l'echo : l'échéance de
+ * la connexion la revérifie après 1 tick, puis un intervalle qui double
+ * jusqu'à ECHO_LINGER_CHECK ticks. Une connexion réinitialisée est fermée
+ * aussitôt.
+ * Prend en paramètre :
+ *     - worker        Pointeur vers le worker.
+ *     - connection    Pointeur vers la connexion.
+ *     - events        Événements reçus, 0 à l'échéance d'une connexion qui
+ *                       attend.
+ *****************************************************************************/
+void connection_linger(struct worker *worker, struct connection *connection,
+                       uint32_t events) {
+  struct epoll_event event;
+
+  if ( !(events & (EPOLLHUP | EPOLLERR))
+       && sockmap_pending(connection->fd) > 0 ) {
+    if ( connection->deadline == 0 ) {
+      /* EPOLLHUP et EPOLLERR seulement, reçus sans être demandés */
+      memset(&event, 0, sizeof(event));
+      event.data.ptr = connection;
+      epoll_ctl(worker->epollDescriptor, EPOLL_CTL_MOD, connection->fd, &event);
+      connection->deadline = now_tick() + ECHO_LINGER_MS / WHEEL_TICK_MS;
+      connection->check = 1;
+    }
+    if ( now_tick() < connection->deadline ) {
+      wheel_schedule(&worker->wheel, &connection->timer, connection->check);
+      if ( connection->check < ECHO_LINGER_CHECK )
+        connection->check *= 2;
+      return;
+    }
+    worker->stats[TRANSPORT_TCP].errors++;
+  }
+  connection_close(worker, connection);
+}
+
+/******************************************************************************
+ * Fonction qui renvoie les datagrammes en attente, par lots de ECHO_BATCH
+ * (recvmmsg puis sendmmsg), ECHO_BATCHES lots au plus par réveil : le reste
+ * attend le réveil suivant. Un datagramme que le noyau refuse est perdu.
+ * Prend en paramètre :
+ *     - worker      Pointeur vers le worker.
+ *     - listener    Socket UDP prêt.
+ *****************************************************************************/
+void datagram_echo(struct worker *worker, struct listener *listener) {
+  struct datagram_batch *batch = worker->batch;
+  struct transport_stats *stats = &worker->stats[TRANSPORT_UDP];
+  int received, sent, i;
+  int batches = 0;
+
+  do {
+    for ( i = 0; i < ECHO_BATCH; i++ ) {
+      batch->iovs[i].iov_base = batch->data[i];
+      batch->iovs[i].iov_len = ECHO_DATAGRAM;
+      memset(&batch->msgs[i].msg_hdr, 0, sizeof(batch->msgs[i].msg_hdr));
+      batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+      batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+      batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+      batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    received = recvmmsg(listener->fd, batch->msgs, ECHO_BATCH, MSG_DONTWAIT, NULL);
+    if ( received <= 0 )
+      return;
+    for ( i = 0; i < received; i++ )
+      batch->iovs[i].iov_len = batch->msgs[i].msg_len;
+
+    sent = sendmmsg(listener->fd, batch->msgs, received, MSG_DONTWAIT);
+    if ( sent < 0 )
+      sent = 0;
+    for ( i = 0; i < sent; i++ )
+      stats->bytes += batch->msgs[i].msg_len;
+    stats->messages += sent;
+    stats->dropped += received - sent;
+  } while ( received == ECHO_BATCH && ++batches < ECHO_BATCHES && running );
+}
+
+/******************************************************************************
+ * Fonction qui inscrit un worker sur les sockets d'écoute de son budget. Une
+ * inscription exclusive ne réveille qu'un seul worker du budget à la fois.
+ * Prend en paramètre :
+ *     - worker    Pointeur vers le worker.
+ *****************************************************************************/
+void worker_listen(struct worker *worker) {
+  struct epoll_event event;
+  int t;
+
+  memset(&event, 0, sizeof(event));
+  for ( t = 0; t < TRANSPORTS; t++ ) {
+    if ( !budget_serves(&worker->listeners[t], worker->id, worker->count) )
+      continue;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = &worker->listeners[t];
+    if ( epoll_ctl(worker->epollDescriptor, EPOLL_CTL_ADD,
+                   worker->listeners[t].fd, &event) == -1 ) {
+      perror("Error with epoll_ctl");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/******************************************************************************
+ * Fonction qui publie les statistiques d'un worker pour le thread principal.
+ * Prend en paramètre :
+ *     - worker    Pointeur vers le worker.
+ *****************************************************************************/
+void worker_publish(struct worker *worker) {
+  pthread_mutex_lock(&worker->lock);
+  worker->snapshot.open = worker->open;
+  memcpy(worker->snapshot.stats, worker->stats, sizeof(worker->stats));
+  pthread_mutex_unlock(&worker->lock);
+}
+
+/******************************************************************************
+ * Thread d'un worker : épinglage sur son CPU, arènes préparées sur le nœud
+ * NUMA de ce CPU, puis boucle d'événements sur les sockets d'écoute de son
+ * budget et les connexions qu'il a acceptées.
+ * Prend en paramètre :
+ *     - arg    Pointeur vers le worker.
+ *****************************************************************************/
+void *worker_run(void *arg) {
+  struct worker *worker = arg;
+  struct epoll_event events[MAX_EVENTS];
+  struct listener *listener;
+  struct connection *connection;
+  cpu_set_t cpus;
+  void *ptr;
+  int count, i, t;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(worker->cpu, &cpus);
+  if ( pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0 )
+    worker->cpu = -1;
+  if ( worker->cpu >= 0 && numa_available() != -1 ) {
+    worker->node = numa_node_of_cpu(worker->cpu);
+    numa_set_localalloc();
+  }
+  wheel_init(&worker->wheel);
+  arena_init(&worker->connections, sizeof(struct connection), worker->node);
+  arena_init(&worker->buffers, worker->stream ? ECHO_BUFFER : MSG_SIZE,
+             worker->node);
+  worker->batch = malloc(sizeof(struct datagram_batch));
+  if ( worker->batch == NULL
+       || arena_reserve(&worker->connections, worker->warm) == -1
+       || arena_reserve(&worker->buffers, worker->warm) == -1 ) {
+    perror("Error with malloc");
+    exit(EXIT_FAILURE);
+  }
+  /* Pages du lot de datagrammes touchées avant le premier message */
+  memset(worker->batch, 0, sizeof(struct datagram_batch));
+
+  /* Chaud : le worker commence à accepter, puis se déclare prêt */
+  worker_listen(worker);
+  pthread_mutex_lock(&worker->startup->lock);
+  worker->startup->ready++;
+  pthread_cond_signal(&worker->startup->done);
+  pthread_mutex_unlock(&worker->startup->lock);
+
+  while ( running ) {
+    count = epoll_wait(worker->epollDescriptor, events, MAX_EVENTS,
+                       wheel_timeout(&worker->wheel));
+    for ( i = 0; i < count; i++ ) {
+      ptr = events[i].data.ptr;
+      if ( ptr == &worker->wakeDescriptor )
+        continue;
+      for ( t = 0; t < TRANSPORTS && ptr != &worker->listeners[t]; t++ )
+        ;
+      if ( t == TRANSPORTS ) {
+        connection = ptr;
+        if ( connection->kernel )
+          connection_linger(worker, connection, events[i].events);
+        else
+          connection_handle(worker, connection);
+        continue;
+      }
+      listener = ptr;
+      if ( listener->transport == TRANSPORT_UDP )
+        datagram_echo(worker, listener);
+      else
+        listener_accept(worker, listener);
+    }
+    wheel_advance(&worker->wheel, timer_expire, worker);
+    worker_publish(worker);
+  }
+  return NULL;
+}
+
+/******************************************************************************
+ * Fonction qui affiche les statistiques par transport, cumulées sur tous les
+ * workers, celles de l'echo dans le noyau, puis la charge de chaque worker.
+ * Les statistiques sont celles que chaque worker a publiées à la fin de son
+ * dernier tour de boucle.
+ * Prend en paramètre :
+ *     - workers      Tableau des workers.
+ *     - count        Nombre de workers.
+ *     - listeners    Transports servis.
+ *     - sockmap      Echo dans le noyau, NULL sans -K.
+ *****************************************************************************/
+void workers_print(struct worker *workers, int count,
+                   struct listener *listeners, struct sockmap *sockmap) {
+  struct worker_snapshot *snapshots, *snapshot;
+  struct transport_stats total, *stats;
+  unsigned long messages, offloaded = 0;
+  unsigned long long packets, bytes;
+  int i, t, c;
+
+  snapshots = malloc(count * sizeof(struct worker_snapshot));
+  if ( snapshots == NULL ) {
+    perror("Error with malloc");
+    return;
+  }
+  for ( i = 0; i < count; i++ ) {
+    pthread_mutex_lock(&workers[i].lock);
+    snapshots[i] = workers[i].snapshot;
+    pthread_mutex_unlock(&workers[i].lock);
+  }
+
+  printf("\n");
+  for ( t = 0; t < TRANSPORTS; t++ ) {
+    if ( listeners[t].fd == -1 )
+      continue;
+    memset(&total, 0, sizeof(total));
+    for ( i = 0; i < count; i++ ) {
+      stats = &snapshots[i].stats[t];
+      total.accepted += stats->accepted;
+      total.closed += stats->closed;
+      total.messages += stats->messages;
+      total.bytes += stats->bytes;
+      total.dropped += stats->dropped;
+      total.errors += stats->errors + stats->accept.errors;
+      for ( c = 0; c < CONN_STATES; c++ )
+        total.timeouts[c] += stats->timeouts[c];
+      total.accept.shedCapacity += stats->accept.shedCapacity;
+      total.accept.shedFdLimit += stats->accept.shedFdLimit;
+    }
+    printf("%-4s : workers %d, accepted %lu, closed %lu, messages %lu, "
+           "bytes %llu, dropped %lu, errors %lu\n", transportNames[t],
+           listeners[t].budget, total.accepted, total.closed, total.messages,
+           total.bytes, total.dropped, total.errors);
+    if ( t != TRANSPORT_UDP )
+      printf("%-4s : timeouts read %lu, idle %lu, write %lu, shed capacity "
+             "%lu, fd limit %lu\n", transportNames[t],
+             total.timeouts[CONN_READ], total.timeouts[CONN_IDLE],
+             total.timeouts[CONN_WRITE], total.accept.shedCapacity,
+             total.accept.shedFdLimit);
+  }
+  /* Les octets renvoyés par le noyau ne passent pas par les workers */
+  if ( sockmap != NULL && sockmap_stats(sockmap, &packets, &bytes) == 0 ) {
+    for ( i = 0; i < count; i++ )
+      offloaded += snapshots[i].stats[TRANSPORT_TCP].offloaded;
+    printf("kernel : connections %lu, packets %llu, bytes %llu\n", offloaded,
+           packets, bytes);
+  }
+
+  for ( i = 0; i < count; i++ ) {
+    snapshot = &snapshots[i];
+    messages = 0;
+    for ( t = 0; t < TRANSPORTS; t++ )
+      messages += snapshot->stats[t].messages;
+    printf("Worker %d : cpu %d, node %d, open %lu, messages %lu (",
+           i, workers[i].cpu, workers[i].node, snapshot->open, messages);
+    for ( t = 0; t < TRANSPORTS; t++ )
+      if ( budget_serves(&listeners[t], i, count) )
+        printf(" %s", transportNames[t]);
+    printf(" )\n");
+  }
+  fflush(stdout);
+  free(snapshots);
+}
+
+/******************************************************************************
+ * Serveur echo unifié : un seul processus sert TCP, UDP et un socket Unix à
+ * la fois, avec les mêmes workers, leurs arènes et leurs statistiques, au
+ * lieu de deux serveurs qui se disputent les CPU.
+ * Options (au moins un transport) :
+ *     - -t port  : Port TCP
+ *     - -u port  : Port UDP
+ *     - -U path  : Chemin du socket Unix en mode flux
+ *     - -j count : Nombre de workers, un thread épinglé par CPU (nombre de
+ *                    CPU par défaut)
+ *     - -B spec  : Budget de workers de chaque transport,
+ *                    "tcp=n,udp=n,unix=n" (tous les workers par défaut) ; les
+ *                    budgets se suivent sur les workers, en reprenant au
+ *                    premier
+ *     - -s       : Mode flux : les octets reçus en TCP et Unix sont renvoyés
+ *                    tels quels, au lieu d'un message de MSG_SIZE octets
+ *     - -r read  : Délai pour recevoir le premier message, en secondes (10
+ *                    par défaut, 0 pour désactiver)
+ *     - -i idle  : Délai d'inactivité entre deux messages (60 par défaut)
+ *     - -w write : Délai pour envoyer une réponse (10 par défaut)
+ *     - -c max   : Nombre maximal de connexions TCP et Unix, partagé entre
+ *                    les workers qui les acceptent ; les clients en excès
+ *                    sont refusés aussitôt (pas de limite par défaut)
+ *     - -K       : Echo dans le noyau en mode flux : les connexions TCP
+ *                    acceptées sont confiées à un programme BPF qui renvoie
+ *                    ce qu'elles reçoivent ; les workers n'acceptent et ne
+ *                    ferment plus que les connexions. Sans BPF, le serveur
+ *                    renvoie lui-même les octets
+ *     - -W count : Connexions préparées par worker avant d'accepter (256 par
+ *                    défaut)
+ *     - -N fd    : Descripteur hérité sur lequel signaler que le service est
+ *                    prêt (une ligne, puis fermé)
+ * Les sockets d'écoute transmis par le superviseur (LISTEN_FDS, activation
+ * à la systemd) remplacent ceux des options de leur transport : ils restent
+ * ouverts d'un redémarrage à l'autre et les clients attendent dans leur file
+ * au lieu d'être refusés. Le service est annoncé prêt (NOTIFY_SOCKET, -N)
+ * une fois tous les workers lancés, épinglés, leurs arènes remplies et les
+ * sockets d'écoute inscrits.
+ * Comme dans tcp-server-cli, une connexion en flux ne garde un tampon que
+ * pendant un message, et un client qui arrive sans descripteur libre
+ * (EMFILE) est refusé grâce au descripteur de réserve de chaque worker.
+ * Les messages ne sont pas affichés.
+ *****************************************************************************/
+int main(int argc, char *argv[]) {
+  struct listener listeners[TRANSPORTS];
+  struct worker *workers;
+  struct epoll_event event;
+  struct sigaction action;
+  sigset_t blocked, previous;
+  char *ports[TRANSPORTS] = { NULL, NULL, NULL };
+  char *budgets = NULL;
+  char *unixPath = NULL;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int count = cpus > 0 ? (int) cpus : 1;
+  uint64_t wake = 1;
+  int first, stream = 0, kernel = 0, valid = 1;
+  struct sockmap sockmap;
+  struct sockmap *sockmapActive = NULL;
+  long warm = WARM_DEFAULT;
+  double readTimeout = 10, idleTimeout = 60, writeTimeout = 10;
+  long maxConnections = 0;
+  int acceptors;
+  int readyDescriptor = -1;
+  int inherited[TRANSPORTS];
+  int inheritedCount;
+  struct startup startup;
+  struct timespec start, warmed;
+  char state[128];
+  int opt, i, t;
+
+
+  /* Vérification des paramètres du programme */
+  while ( (opt = getopt(argc, argv, "t:u:U:j:B:sr:i:w:c:KW:N:")) != -1 ) {
+    switch ( opt ) {
+    case 't':
+      ports[TRANSPORT_TCP] = optarg;
+      break;
+    case 'u':
+      ports[TRANSPORT_UDP] = optarg;
+      break;
+    case 'U':
+      ports[TRANSPORT_UNIX] = optarg;
+      break;
+    case 'j':
+      count = atoi(optarg);
+      if ( count < 1 || count > MAX_WORKERS )
+        valid = 0;
+      break;
+    case 'B':
+      budgets = optarg;
+      break;
+    case 's':
+      stream = 1;
+      break;
+    case 'r':
+      readTimeout = atof(optarg);
+      break;
+    case 'i':
+      idleTimeout = atof(optarg);
+      break;
+    case 'w':
+      writeTimeout = atof(optarg);
+      break;
+    case 'c':
+      maxConnections = atol(optarg);
+      if ( maxConnections < 0 )
+        valid = 0;
+      break;
+    case 'K':
+      kernel = 1;
+      break;
+    case 'W':
+      warm = atol(optarg);
+      if ( warm < 0 )
+        valid = 0;
+      break;
+    case 'N':
+      readyDescriptor = atoi(optarg);
+      if ( readyDescriptor < 0 )
+        valid = 0;
+      break;
+    default:
+      valid = 0;
+    }
+  }
+  for ( t = 0; t < TRANSPORTS; t++ ) {
+    listeners[t].fd = -1;
+    listeners[t].transport = t;
+    listeners[t].budget = count;
+  }
+  if ( budgets != NULL && budget_parse(budgets, listeners) == -1 )
+    valid = 0;
+
+  /* Sockets d'écoute hérités, un par transport au plus */
+  inheritedCount = activation_listeners(inherited, TRANSPORTS);
+  if ( inheritedCount == -1 ) {
+    fprintf(stderr, "At most one inherited listener per transport\n");
+    exit(EXIT_FAILURE);
+  }
+  for ( i = 0; i < inheritedCount; i++ ) {
+    t = listener_transport(inherited[i]);
+    if ( t == -1 || listeners[t].fd != -1 ) {
+      fprintf(stderr, "Inherited descriptor %d is not a usable listener\n",
+              inherited[i]);
+      exit(EXIT_FAILURE);
+    }
+    listeners[t].fd = inherited[i];
+    ports[t] = NULL;
+  }
+  unixPath = ports[TRANSPORT_UNIX];
+
+  if ( !valid || argc != optind
+       || (ports[0] == NULL && ports[1] == NULL && ports[2] == NULL
+           && inheritedCount == 0) ) {
+    fprintf(stderr, "Usage: %s [-t port] [-u port] [-U path] [-j workers] "
+            "[-B tcp=n,udp=n,unix=n] [-s] [-r read] [-i idle] [-w write] "
+            "[-c max] [-K] [-W count] [-N fd]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if ( kernel && !stream ) {
+    fprintf(stderr, "Kernel echo (-K) returns bytes as received, it requires "
+            "stream mode (-s)\n");
+    exit(EXIT_FAILURE);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  printf("\n ****      Welcome to the Echo Server.      ****\n\n");
+
+  /* Arrêt propre sur SIGINT et SIGTERM pour afficher les statistiques */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_handler;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = stats_handler;
+  sigaction(SIGUSR1, &action, NULL);
+
+  /* Sockets d'écoute, budgets posés à la suite sur les workers */
+  first = 0;
+  for ( t = 0; t < TRANSPORTS; t++ ) {
+    if ( ports[t] == NULL && listeners[t].fd == -1 )
+      continue;
+    if ( listeners[t].budget > count )
+      listeners[t].budget = count;
+    listeners[t].first = first % count;
+    first += listeners[t].budget;
+    if ( listeners[t].fd != -1 ) {
+      printf("Listen on %s inherited descriptor %d, %d workers\n",
+             transportNames[t], listeners[t].fd, listeners[t].budget);
+      continue;
+    }
+    if ( t == TRANSPORT_UNIX )
+      listeners[t].fd = socket_open_unix(ports[t]);
+    else
+      listeners[t].fd = acceptor_open(ports[t], t == TRANSPORT_TCP
+                                      ? SOCK_STREAM : SOCK_DGRAM, SOMAXCONN, 0);
+    printf("Listen on %s %s, %d workers\n", transportNames[t], ports[t],
+           listeners[t].budget);
+  }
+
+  /* Echo dans le noyau, ou par les workers si BPF n'est pas disponible */
+  if ( kernel && listeners[TRANSPORT_TCP].fd != -1 ) {
+    if ( sockmap_open(&sockmap) == 0 ) {
+      sockmapActive = &sockmap;
+      printf("Kernel echo on tcp (BPF sockmap)\n");
+    } else
+      printf("Kernel echo unavailable (%s), echo in user space\n",
+             strerror(errno));
+  }
+
+  /* Limite de connexions partagée par les workers qui acceptent */
+  acceptors = 0;
+  for ( i = 0; i < count; i++ )
+    if ( budget_serves(&listeners[TRANSPORT_TCP], i, count)
+         || budget_serves(&listeners[TRANSPORT_UNIX], i, count) )
+      acceptors++;
+  if ( maxConnections > 0 && acceptors > 0 )
+    printf("Up to %ld connections, %ld per accepting worker\n",
+           maxConnections, (maxConnections + acceptors - 1) / acceptors);
+
+  workers = calloc(count, sizeof(struct worker));
+  if ( workers == NULL ) {
+    perror("Error with calloc");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init(&startup.lock, NULL);
+  pthread_cond_init(&startup.done, NULL);
+  startup.ready = 0;
+  for ( i = 0; i < count; i++ ) {
+    workers[i].id = i;
+    workers[i].count = count;
+    workers[i].warm = warm;
+    workers[i].startup = &startup;
+    workers[i].cpu = i % (cpus > 0 ? cpus : 1);
+    workers[i].node = -1;
+    workers[i].stream = stream;
+    workers[i].sockmap = sockmapActive;
+    workers[i].listeners = listeners;
+    workers[i].timeouts[CONN_READ] = seconds_to_ticks(readTimeout);
+    workers[i].timeouts[CONN_IDLE] = seconds_to_ticks(idleTimeout);
+    workers[i].timeouts[CONN_WRITE] = seconds_to_ticks(writeTimeout);
+    if ( acceptors > 0 )
+      workers[i].maxConnections = (maxConnections + acceptors - 1) / acceptors;
+    workers[i].reserveDescriptor = acceptor_reserve();
+    pthread_mutex_init(&workers[i].lock, NULL);
+    workers[i].epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+    workers[i].wakeDescriptor = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if ( workers[i].epollDescriptor == -1 || workers[i].wakeDescriptor == -1 ) {
+      perror("Error with epoll_create1");
+      exit(EXIT_FAILURE);
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &workers[i].wakeDescriptor;
+    epoll_ctl(workers[i].epollDescriptor, EPOLL_CTL_ADD,
+              workers[i].wakeDescriptor, &event);
+  }
+
+  /* Les signaux sont reçus par le thread principal seulement */
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  sigaddset(&blocked, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+  for ( i = 0; i < count; i++ ) {
+    if ( pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0 ) {
+      perror("Error with pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Prêt une fois tous les workers chauds */
+  pthread_mutex_lock(&startup.lock);
+  while ( startup.ready < count )
+    pthread_cond_wait(&startup.done, &startup.lock);
+  pthread_mutex_unlock(&startup.lock);
+  clock_gettime(CLOCK_MONOTONIC, &warmed);
+  printf("%d workers started, %ld connections ready per worker, warm in "
+         "%.1f ms\n", count, warm, (warmed.tv_sec - start.tv_sec) * 1e3
+         + (warmed.tv_nsec - start.tv_nsec) / 1e6);
+  fflush(stdout);
+  snprintf(state, sizeof(state), "READY=1\nSTATUS=%d workers\nMAINPID=%d",
+           count, (int) getpid());
+  if ( activation_notify(state) == -1 )
+    perror("Error with NOTIFY_SOCKET");
+  if ( readyDescriptor != -1 && activation_ready_fd(readyDescriptor) == -1 )
+    perror("Error with readiness descriptor");
+
+  while ( running ) {
+    sigsuspend(&previous);
+    if ( dumpStats ) {
+      dumpStats = 0;
+      workers_print(workers, count, listeners, sockmapActive);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  activation_notify("STOPPING=1");
+
+  for ( i = 0; i < count; i++ ) {
+    if ( write(workers[i].wakeDescriptor, &wake, sizeof(wake)) == -1 )
+      perror("Error with write");
+    pthread_join(workers[i].thread, NULL);
+  }
+  workers_print(workers, count, listeners, sockmapActive);
+
+  for ( i = 0; i < count; i++ ) {
+    close(workers[i].epollDescriptor);
+    close(workers[i].wakeDescriptor);
+    if ( workers[i].reserveDescriptor != -1 )
+      close(workers[i].reserveDescriptor);
+    pthread_mutex_destroy(&workers[i].lock);
+    arena_destroy(&workers[i].connections);
+    arena_destroy(&workers[i].buffers);
+    free(workers[i].batch);
+  }
+  for ( t = 0; t < TRANSPORTS; t++ )
+    if ( listeners[t].fd != -1 )
+      close(listeners[t].fd);
+  if ( unixPath != NULL )
+    unlink(unixPath);
+  if ( sockmapActive != NULL )
+    sockmap_close(sockmapActive);
+  free(workers);
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,308 @@
+/******************************************************************************
+ *
+ * Name File : happy-eyeballs.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "happy-eyeballs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+/* Adresse candidate et tentative de connexion associée */
+struct he_attempt {
+  struct addrinfo *info;
+  struct he_record *record;
+  int fd;			/* -1 : pas encore tentée ou terminée */
+  int order;			/* rang dans la réponse du résolveur */
+  uint64_t started;
+};
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en microsecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+static uint64_t he_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/******************************************************************************
+ * Fonction qui initialise l'historique des adresses.
+ *****************************************************************************/
+void he_init(struct he_history *history) {
+  memset(history, 0, sizeof(*history));
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'historique d'une adresse, en le créant au besoin à
+ * la place du moins récemment utilisé.
+ *****************************************************************************/
+static struct he_record *he_record_get(struct he_history *history,
+                                       struct addrinfo *info) {
+  struct he_record *record, *victim = NULL;
+  int i;
+
+  for ( i = 0; i < HE_HISTORY_SIZE; i++ ) {
+    record = &history->records[i];
+    if ( record->used && record->addrlen == info->ai_addrlen
+         && memcmp(&record->addr, info->ai_addr, info->ai_addrlen) == 0 )
+      return record;
+    if ( victim == NULL || !record->used
+         || (victim->used && record->lastUsed < victim->lastUsed) )
+      victim = record;
+  }
+
+  memset(victim, 0, sizeof(*victim));
+  memcpy(&victim->addr, info->ai_addr, info->ai_addrlen);
+  victim->addrlen = info->ai_addrlen;
+  victim->used = 1;
+  return victim;
+}
+
+/******************************************************************************
+ * Fonction qui compare deux candidats : les adresses en échec passent après,
+ * puis les plus rapides d'après l'historique. Une latence inconnue n'est pas
+ * pénalisée, pour que toute nouvelle adresse soit essayée.
+ *****************************************************************************/
+static int he_compare(const void *a, const void *b) {
+  const struct he_attempt *x = a, *y = b;
+
+  if ( x->record->failures != y->record->failures )
+    return x->record->failures < y->record->failures ? -1 : 1;
+  if ( x->record->latency != y->record->latency )
+    return x->record->latency < y->record->latency ? -1 : 1;
+  return x->order - y->order;
+}
+
+/******************************************************************************
+ * Fonction qui ordonne les candidats : tri selon l'historique puis
+ * alternance des familles d'adresses en commençant par celle du meilleur
+ * candidat (RFC 8305, section 4).
+ * Prend en paramètre :
+ *     - attempts    Tableau des candidats, dans l'ordre du résolveur.
+ *     - count       Nombre de candidats.
+ *****************************************************************************/
+static void he_sort(struct he_attempt *attempts, int count) {
+  struct he_attempt sorted[HE_MAX_ATTEMPTS];
+  int taken[HE_MAX_ATTEMPTS];
+  int family, i, n;
+
+  qsort(attempts, count, sizeof(*attempts), he_compare);
+
+  memset(taken, 0, sizeof(taken));
+  family = attempts[0].info->ai_family;
+  for ( n = 0; n < count; n++ ) {
+    for ( i = 0; i < count; i++ )
+      if ( !taken[i] && attempts[i].info->ai_family == family )
+        break;
+    if ( i == count )
+      for ( i = 0; taken[i]; i++ )
+        ;
+    taken[i] = 1;
+    sorted[n] = attempts[i];
+    family = sorted[n].info->ai_family == AF_INET6 ? AF_INET : AF_INET6;
+  }
+  memcpy(attempts, sorted, count * sizeof(*attempts));
+}
+
+/******************************************************************************
+ * Fonction qui lance une tentative de connexion non bloquante.
+ * Renvoie 1 si la connexion est établie immédiatement, 0 si elle est en
+ * cours, -1 en cas d'échec.
+ *****************************************************************************/
+static int he_start(struct he_attempt *attempt) {
+  attempt->started = he_now();
+  attempt->fd = socket(attempt->info->ai_family,
+                       attempt->info->ai_socktype | SOCK_NONBLOCK,
+                       attempt->info->ai_protocol);
+  if ( attempt->fd == -1 )
+    return -1;
+  if ( connect(attempt->fd, attempt->info->ai_addr,
+               attempt->info->ai_addrlen) == 0 )
+    return 1;
+  if ( errno == EINPROGRESS )
+    return 0;
+  close(attempt->fd);
+  attempt->fd = -1;
+  return -1;
+}
+
+/******************************************************************************
+ * Fonction qui enregistre l'échec d'une tentative.
+ *****************************************************************************/
+static void he_fail(struct he_attempt *attempt) {
+  if ( attempt->fd != -1 )
+    close(attempt->fd);
+  attempt->fd = -1;
+  attempt->record->failures++;
+  attempt->record->lastUsed = he_now();
+}
+
+/******************************************************************************
+ * Fonction qui enregistre la tentative gagnante : la latence de connexion
+ * entre dans la moyenne glissante de l'adresse.
+ *****************************************************************************/
+static void he_win(struct he_attempt *attempt) {
+  struct he_record *record = attempt->record;
+  uint64_t now = he_now();
+  uint32_t latency = now - attempt->started;
+
+  if ( latency == 0 )
+    latency = 1;
+  if ( record->latency == 0 )
+    record->latency = latency;
+  else
+    record->latency = (7 * (uint64_t) record->latency + latency) / 8;
+  record->failures = 0;
+  record->wins++;
+  record->lastUsed = now;
+}
+
+/******************************************************************************
+ * Fonction qui établit une connexion TCP en mettant en concurrence toutes les
+ * adresses du serveur (Happy Eyeballs, RFC 8305) : une tentative non
+ * bloquante est lancée toutes les HE_ATTEMPT_DELAY_MS millisecondes, ou dès
+ * qu'une tentative échoue. La première connexion établie est gardée, les
+ * autres sont abandonnées.
+ * Prend en paramètre :
+ *     - history    Pointeur vers l'historique des adresses, mis à jour.
+ *     - list       Liste des adresses renvoyée par le résolveur.
+ *     - winner     Pointeur vers l'adresse retenue à renseigner.
+ * Renvoie le descripteur de socket connecté (bloquant), -1 en cas d'échec.
+ *****************************************************************************/
+int he_connect(struct he_history *history, struct addrinfo *list,
+               struct addrinfo **winner) {
+  struct he_attempt attempts[HE_MAX_ATTEMPTS];
+  struct pollfd fds[HE_MAX_ATTEMPTS];
+  int slots[HE_MAX_ATTEMPTS];
+  struct addrinfo *rp;
+  uint64_t now, deadline, nextStart, wait;
+  int count = 0, next = 0, inFlight = 0;
+  int won = -1;
+  int i, n, status, error;
+  socklen_t len;
+
+  for ( rp = list; rp != NULL && count < HE_MAX_ATTEMPTS; rp = rp->ai_next ) {
+    attempts[count].info = rp;
+    attempts[count].record = he_record_get(history, rp);
+    attempts[count].fd = -1;
+    attempts[count].order = count;
+    count++;
+  }
+  if ( count == 0 ) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  he_sort(attempts, count);
+
+  deadline = he_now() + HE_CONNECT_TIMEOUT_MS * 1000;
+  nextStart = 0;
+  while ( won == -1 ) {
+    now = he_now();
+    if ( now >= deadline ) {
+      errno = ETIMEDOUT;
+      break;
+    }
+
+    /* Nouvelle tentative si le délai est écoulé ou si aucune n'est en cours */
+    if ( next < count && (inFlight == 0 || now >= nextStart) ) {
+      status = he_start(&attempts[next]);
+      if ( status == 1 ) {
+        won = next;
+        break;
+      }
+      if ( status == 0 )
+        inFlight++;
+      else
+        he_fail(&attempts[next]);
+      next++;
+      nextStart = now + HE_ATTEMPT_DELAY_MS * 1000;
+      continue;
+    }
+    if ( inFlight == 0 )
+      break;
+
+    n = 0;
+    for ( i = 0; i < next; i++ ) {
+      if ( attempts[i].fd == -1 )
+        continue;
+      fds[n].fd = attempts[i].fd;
+      fds[n].events = POLLOUT;
+      slots[n++] = i;
+    }
+    wait = deadline - now;
+    if ( next < count && nextStart - now < wait )
+      wait = nextStart - now;
+    if ( poll(fds, n, (wait + 999) / 1000) == -1 && errno != EINTR )
+      break;
+
+    for ( i = 0; i < n && won == -1; i++ ) {
+      if ( fds[i].revents == 0 )
+        continue;
+      error = 0;
+      len = sizeof(error);
+      getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
+      inFlight--;
+      if ( error == 0 ) {
+        won = slots[i];
+      } else {
+        he_fail(&attempts[slots[i]]);
+        /* Échec : la tentative suivante part sans attendre */
+        nextStart = 0;
+      }
+    }
+  }
+
+  /* Abandon des tentatives perdantes, sans les compter comme des échecs */
+  for ( i = 0; i < next; i++ ) {
+    if ( i != won && attempts[i].fd != -1 ) {
+      close(attempts[i].fd);
+      attempts[i].fd = -1;
+    }
+  }
+  if ( won == -1 )
+    return -1;
+
+  he_win(&attempts[won]);
+  fcntl(attempts[won].fd, F_SETFL,
+        fcntl(attempts[won].fd, F_GETFL) & ~O_NONBLOCK);
+  *winner = attempts[won].info;
+  return attempts[won].fd;
+}
+
+/******************************************************************************
+ * Fonction qui affiche l'historique de connexion de chaque adresse.
+ *****************************************************************************/
+void he_print(struct he_history *history) {
+  struct he_record *record;
+  char host[NI_MAXHOST];
+  int i;
+
+  for ( i = 0; i < HE_HISTORY_SIZE; i++ ) {
+    record = &history->records[i];
+    if ( !record->used )
+      continue;
+    if ( getnameinfo((struct sockaddr *) &record->addr, record->addrlen, host,
+                     NI_MAXHOST, NULL, 0, NI_NUMERICHOST) != 0 )
+      continue;
+    printf("Connect %s : %lu won, latency %u us, failures %u\n", host,
+           record->wins, record->latency, record->failures);
+  }
+}
@@ -0,0 +1,47 @@
+/******************************************************************************
+ *
+ * Name File : happy-eyeballs.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef HAPPY_EYEBALLS_H
+#define HAPPY_EYEBALLS_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#define HE_ATTEMPT_DELAY_MS 250		/* Délai entre deux tentatives (RFC 8305) */
+#define HE_CONNECT_TIMEOUT_MS 10000	/* Délai maximal de connexion */
+#define HE_MAX_ATTEMPTS 16		/* Adresses essayées au plus */
+#define HE_HISTORY_SIZE 32		/* Adresses dont l'historique est gardé */
+
+/* Historique de connexion d'une adresse */
+struct he_record {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint32_t latency;		/* moyenne glissante en us, 0 : inconnue */
+  unsigned int failures;	/* échecs consécutifs */
+  unsigned long wins;
+  uint64_t lastUsed;
+  int used;
+};
+
+/* Historique des adresses, conservé d'une connexion à l'autre */
+struct he_history {
+  struct he_record records[HE_HISTORY_SIZE];
+};
+
+void he_init(struct he_history *history);
+int he_connect(struct he_history *history, struct addrinfo *list,
+               struct addrinfo **winner);
+void he_print(struct he_history *history);
+
+#endif
@@ -0,0 +1,473 @@
+/******************************************************************************
+ *
+ * Name File : hedge.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "hedge.h"
+#include "reliable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define MSG_SIZE 80
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+static uint64_t hedge_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction de comparaison de deux latences, pour qsort.
+ *****************************************************************************/
+static int hedge_compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le centile demandé d'un tableau de latences trié.
+ *****************************************************************************/
+static uint64_t hedge_percentile(uint64_t *sorted, unsigned long count,
+                                 double percentile) {
+  unsigned long rank;
+
+  if ( count == 0 )
+    return 0;
+  rank = (unsigned long) (percentile / 100 * count);
+  return sorted[rank < count ? rank : count - 1];
+}
+
+/******************************************************************************
+ * Fonction qui enregistre la latence d'une requête et, en délai adaptatif,
+ * recalcule le délai toutes les HEDGE_UPDATE réponses sur les HEDGE_SAMPLES
+ * dernières.
+ * Prend en paramètre :
+ *     - hedge      Pointeur vers l'état des envois en double.
+ *     - latency    Latence de la requête, en ns.
+ *****************************************************************************/
+static void hedge_sample(struct hedge *hedge, uint64_t latency) {
+  uint64_t sorted[HEDGE_SAMPLES];
+  unsigned long filled;
+
+  hedge->samples[hedge->sampleCount++ & (HEDGE_SAMPLES - 1)] = latency;
+  if ( hedge->percentile == 0 || hedge->sampleCount % HEDGE_UPDATE != 0
+       || hedge->sampleCount < HEDGE_WARMUP )
+    return;
+  filled = hedge->sampleCount < HEDGE_SAMPLES ? hedge->sampleCount
+                                              : HEDGE_SAMPLES;
+  memcpy(sorted, hedge->samples, filled * sizeof(uint64_t));
+  qsort(sorted, filled, sizeof(uint64_t), hedge_compare);
+  hedge->delay = hedge_percentile(sorted, filled, hedge->percentile);
+}
+
+/******************************************************************************
+ * Fonction qui envoie la requête à un serveur : le texte seul en TCP, ou
+ * précédé d'un en-tête numéroté en UDP pour reconnaître la réponse (le
+ * serveur UDP le reprend, un serveur echo le renvoie tel quel).
+ * Prend en paramètre :
+ *     - hedge       Pointeur vers l'état des envois en double.
+ *     - endpoint    Serveur destinataire.
+ *     - sequence    Numéro de la requête.
+ *     - msg         Texte de la requête.
+ *****************************************************************************/
+static void hedge_send(struct hedge *hedge, struct hedge_endpoint *endpoint,
+                       uint32_t sequence, char *msg) {
+  struct reliable_header header;
+  unsigned char frame[RELIABLE_FRAME_MAX];
+  size_t length, size;
+  ssize_t status;
+
+  if ( hedge->socktype == SOCK_STREAM ) {
+    status = send(endpoint->fd, msg, strlen(msg), MSG_NOSIGNAL);
+  } else {
+    length = strnlen(msg, RELIABLE_MAX_PAYLOAD);
+    memset(&header, 0, sizeof(header));
+    header.type = RELIABLE_REQUEST;
+    header.length = length;
+    header.sequence = sequence;
+    size = reliable_encode(&header, frame);
+    memcpy(frame + size, msg, length);
+    status = send(endpoint->fd, frame, size + length, 0);
+  }
+  /* Un datagramme refusé (ECONNREFUSED) est une perte comme une autre */
+  if ( status == -1 && hedge->socktype == SOCK_STREAM ) {
+    fprintf(stderr, "Error with send to %s: %s\n", endpoint->name,
+            strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  endpoint->sent++;
+}
+
+/******************************************************************************
+ * Fonction qui lit une réponse prête sur un serveur.
+ * Prend en paramètre :
+ *     - hedge       Pointeur vers l'état des envois en double.
+ *     - endpoint    Serveur prêt.
+ *     - sequence    Numéro de la requête en cours.
+ * Renvoie 1 si c'est la réponse de la requête en cours, 0 pour une réponse
+ * annulée ou d'une requête précédente, qui est jetée.
+ *****************************************************************************/
+static int hedge_receive(struct hedge *hedge, struct hedge_endpoint *endpoint,
+                         uint32_t sequence) {
+  struct reliable_header header;
+  unsigned char frame[RELIABLE_FRAME_MAX];
+  ssize_t status;
+
+  /* TCP : les réponses arrivent dans l'ordre, les MSG_SIZE octets de chaque
+     réponse annulée passent avant */
+  if ( hedge->socktype == SOCK_STREAM ) {
+    status = recv(endpoint->fd, frame, MSG_SIZE, MSG_WAITALL);
+    if ( status != MSG_SIZE ) {
+      fprintf(stderr, "Connection to %s lost\n", endpoint->name);
+      exit(EXIT_FAILURE);
+    }
+    if ( endpoint->owed > 0 ) {
+      endpoint->owed--;
+      return 0;
+    }
+    return 1;
+  }
+
+  status = recv(endpoint->fd, frame, sizeof(frame), MSG_DONTWAIT);
+  if ( status == -1
+       || reliable_decode(frame, status, &header) == -1
+       || (header.type != RELIABLE_REPLY && header.type != RELIABLE_REQUEST) )
+    return 0;
+  return header.sequence == sequence;
+}
+
+/******************************************************************************
+ * Fonction qui choisit un serveur libre. En TCP, une connexion qui doit
+ * encore une réponse annulée n'est pas réutilisée : le serveur découpe les
+ * messages par lecture, une requête envoyée derrière une autre en attente
+ * pourrait lui parvenir collée à elle.
+ * Prend en paramètre :
+ *     - hedge      Pointeur vers l'état des envois en double.
+ *     - from       Premier serveur examiné.
+ *     - exclude    Serveur écarté, ou -1.
+ * Renvoie l'indice du serveur, -1 si aucun n'est libre.
+ *****************************************************************************/
+static int hedge_pick(struct hedge *hedge, int from, int exclude) {
+  int i, e;
+
+  for ( i = 0; i < hedge->count; i++ ) {
+    e = (from + i) % hedge->count;
+    if ( e != exclude && (hedge->socktype != SOCK_STREAM
+                          || hedge->endpoints[e].owed == 0) )
+      return e;
+  }
+  return -1;
+}
+
+/******************************************************************************
+ * Fonction qui attend et jette les réponses annulées, quand aucune connexion
+ * n'est libre.
+ * Prend en paramètre :
+ *     - hedge    Pointeur vers l'état des envois en double.
+ *****************************************************************************/
+static void hedge_drain(struct hedge *hedge) {
+  struct pollfd fds[HEDGE_MAX_ENDPOINTS];
+  int i;
+
+  for ( i = 0; i < hedge->count; i++ ) {
+    fds[i].fd = hedge->endpoints[i].owed > 0 ? hedge->endpoints[i].fd : -1;
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+  if ( poll(fds, hedge->count, -1) == -1 && errno != EINTR ) {
+    perror("Error with poll");
+    exit(EXIT_FAILURE);
+  }
+  for ( i = 0; i < hedge->count; i++ )
+    if ( fds[i].revents & (POLLIN | POLLERR | POLLHUP) )
+      hedge_receive(hedge, &hedge->endpoints[i], 0);
+}
+
+/******************************************************************************
+ * Fonction qui effectue une requête : envoi au serveur principal puis, sans
+ * réponse après le délai et si le budget le permet, au serveur suivant de
+ * la liste. La première réponse est retenue, les autres sont annulées : le
+ * protocole echo n'ayant pas d'annulation, elles sont jetées à leur arrivée.
+ * Prend en paramètre :
+ *     - hedge       Pointeur vers l'état des envois en double.
+ *     - sequence    Numéro de la requête.
+ *     - msg         Texte de la requête.
+ *     - latency     Pointeur vers la latence à renseigner, en ns.
+ * Le serveur principal n'est remplacé, tant qu'il doit une réponse annulée,
+ * que sur le budget. Seules les latences des requêtes parties vers lui
+ * alimentent le délai adaptatif : celle d'une requête doublée gagnée par
+ * l'autre serveur en minore la sienne.
+ * Renvoie l'indice du serveur qui a répondu, -1 si la requête est perdue.
+ *****************************************************************************/
+static int hedge_request(struct hedge *hedge, uint32_t sequence, char *msg,
+                         uint64_t *latency) {
+  struct pollfd fds[HEDGE_MAX_ENDPOINTS];
+  int waiting[HEDGE_MAX_ENDPOINTS];
+  struct timespec wait, *timeout;
+  uint64_t start, now, deadline;
+  int first, hedgeTo = -1, decided, winner = -1, i;
+
+  memset(waiting, 0, sizeof(waiting));
+  hedge->requests++;
+  hedge->tokens += hedge->budget;
+  if ( hedge->tokens > HEDGE_BURST )
+    hedge->tokens = HEDGE_BURST;
+  /* Pas d'envoi en double avant d'avoir un délai */
+  decided = hedge->count < 2 || hedge->delay == 0;
+
+  /* Le principal doit encore une réponse annulée : la requête part vers un
+     autre serveur en prenant un jeton du budget, comme un envoi en double ;
+     sans jeton, elle attend que le principal ait rendu ses réponses */
+  start = hedge_now();
+  first = 0;
+  if ( hedge->socktype == SOCK_STREAM && hedge->endpoints[0].owed > 0 ) {
+    first = hedge->tokens >= 1 ? hedge_pick(hedge, hedge->next, 0) : -1;
+    if ( first != -1 ) {
+      hedge->tokens -= 1;
+      hedge->rerouted++;
+      hedge->next = first + 1;
+    } else {
+      while ( hedge->endpoints[0].owed > 0 )
+        hedge_drain(hedge);
+      first = 0;
+    }
+  }
+  hedge_send(hedge, &hedge->endpoints[first], sequence, msg);
+  waiting[first] = 1;
+
+  while ( winner == -1 ) {
+    now = hedge_now();
+    if ( !decided )
+      deadline = start + hedge->delay;
+    else if ( hedge->socktype == SOCK_DGRAM )
+      deadline = start + HEDGE_TIMEOUT_MS * 1000000ULL;
+    else
+      deadline = 0;
+
+    if ( deadline != 0 && now >= deadline ) {
+      if ( decided ) {
+        hedge->lost++;
+        return -1;
+      }
+      decided = 1;
+      hedgeTo = hedge_pick(hedge, hedge->next, first);
+      if ( hedge->tokens < 1 || hedgeTo == -1 ) {
+        hedge->suppressed++;
+        continue;
+      }
+      hedge->tokens -= 1;
+      hedge->hedged++;
+      hedge->next = hedgeTo + 1;
+      hedge_send(hedge, &hedge->endpoints[hedgeTo], sequence, msg);
+      waiting[hedgeTo] = 1;
+      continue;
+    }
+
+    /* Serveurs attendus, et ceux dont une réponse annulée est à lire */
+    for ( i = 0; i < hedge->count; i++ ) {
+      fds[i].fd = waiting[i] || hedge->endpoints[i].owed > 0
+                  ? hedge->endpoints[i].fd : -1;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    timeout = NULL;
+    if ( deadline != 0 ) {
+      wait.tv_sec = (deadline - now) / 1000000000;
+      wait.tv_nsec = (deadline - now) % 1000000000;
+      timeout = &wait;
+    }
+    if ( ppoll(fds, hedge->count, timeout, NULL) == -1 && errno != EINTR ) {
+      perror("Error with ppoll");
+      exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < hedge->count && winner == -1; i++ )
+      if ( (fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+           && hedge_receive(hedge, &hedge->endpoints[i], sequence)
+           && waiting[i] )
+        winner = i;
+  }
+  *latency = hedge_now() - start;
+  if ( first == 0 )
+    hedge_sample(hedge, *latency);
+
+  /* Les autres envois sont annulés */
+  for ( i = 0; i < hedge->count; i++ ) {
+    if ( !waiting[i] || i == winner )
+      continue;
+    if ( hedge->socktype == SOCK_STREAM )
+      hedge->endpoints[i].owed++;
+    hedge->cancelled++;
+  }
+  if ( winner != first )
+    hedge->hedgeWins++;
+  hedge->endpoints[winner].wins++;
+  return winner;
+}
+
+/******************************************************************************
+ * Fonction qui prépare les envois en double.
+ * Prend en paramètre :
+ *     - hedge      Pointeur vers l'état à initialiser.
+ *     - socktype   SOCK_STREAM ou SOCK_DGRAM.
+ *     - delay      "pNN" pour le centile NN des latences observées, ou un
+ *                    délai fixe en millisecondes ; NULL : p95.
+ *     - budget     Part des requêtes qui peut être doublée, en %.
+ * Renvoie 0, -1 si le délai ou le budget est invalide.
+ *****************************************************************************/
+int hedge_init(struct hedge *hedge, int socktype, char *delay, double budget) {
+  char *end;
+  double value;
+
+  memset(hedge, 0, sizeof(*hedge));
+  hedge->socktype = socktype;
+  hedge->percentile = HEDGE_PERCENTILE;
+  if ( delay != NULL ) {
+    value = strtod(delay[0] == 'p' ? delay + 1 : delay, &end);
+    if ( *end != '\0' || end == delay || value <= 0
+         || (delay[0] == 'p' && value >= 100) )
+      return -1;
+    if ( delay[0] == 'p' ) {
+      hedge->percentile = value;
+    } else {
+      hedge->percentile = 0;
+      hedge->delay = (uint64_t) (value * 1e6);
+    }
+  }
+  if ( budget < 0 || budget > 100 )
+    return -1;
+  hedge->budget = budget / 100;
+  hedge->tokens = 1;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui sépare l'hôte et le port d'un serveur "hôte:port" de la liste
+ * (le dernier ':' sépare le port, pour une adresse IPv6).
+ * Prend en paramètre :
+ *     - spec    Serveur, modifié sur place.
+ *     - host    Pointeur vers l'hôte à renseigner.
+ *     - port    Pointeur vers le port à renseigner.
+ * Renvoie 0, -1 si le port manque.
+ *****************************************************************************/
+int hedge_split(char *spec, char **host, char **port) {
+  char *colon = strrchr(spec, ':');
+
+  if ( colon == NULL || colon == spec || colon[1] == '\0' )
+    return -1;
+  *colon = '\0';
+  *host = spec;
+  *port = colon + 1;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui ajoute un serveur à la liste, le premier étant le principal.
+ * Prend en paramètre :
+ *     - hedge    Pointeur vers l'état des envois en double.
+ *     - fd       Connexion TCP ou socket UDP connecté au serveur.
+ *     - name     Nom du serveur, pour l'affichage.
+ * Renvoie 0, -1 si la liste est pleine.
+ *****************************************************************************/
+int hedge_add(struct hedge *hedge, int fd, const char *name) {
+  if ( hedge->count == HEDGE_MAX_ENDPOINTS )
+    return -1;
+  hedge->endpoints[hedge->count].fd = fd;
+  hedge->endpoints[hedge->count].name = name;
+  hedge->count++;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui effectue 'count' aller-retours avec envois en double, puis
+ * affiche les centiles de latence, la part de requêtes doublées, la part
+ * de celles que l'envoi en double a gagnées et la charge de chaque serveur
+ * face à sa part attendue.
+ * Prend en paramètre :
+ *     - hedge    Pointeur vers l'état des envois en double.
+ *     - count    Nombre de requêtes.
+ *     - msg      Texte des requêtes.
+ * Renvoie 0, -1 en cas d'erreur ou de requête perdue.
+ *****************************************************************************/
+int hedge_bench(struct hedge *hedge, long count, char *msg) {
+  uint64_t *latencies, latency, start;
+  unsigned long completed = 0, extra = 0;
+  double elapsed, share, load;
+  long i;
+  int e;
+
+  latencies = malloc(count * sizeof(uint64_t));
+  if ( latencies == NULL ) {
+    perror("Error with malloc");
+    return -1;
+  }
+
+  start = hedge_now();
+  for ( i = 0; i < count; i++ ) {
+    if ( hedge_request(hedge, (uint32_t) i, msg, &latency) == -1 )
+      continue;
+    latencies[completed++] = latency;
+  }
+  elapsed = (hedge_now() - start) / 1e9;
+  qsort(latencies, completed, sizeof(uint64_t), hedge_compare);
+
+  printf("Round trips : %lu in %.6f s (%.0f msg/s, %.1f us avg)\n",
+         completed, elapsed, completed / elapsed, elapsed * 1e6 / count);
+  printf("Latency (us) : p50 %.1f, p95 %.1f, p99 %.1f, p99.9 %.1f, "
+         "max %.1f\n", hedge_percentile(latencies, completed, 50) / 1e3,
+         hedge_percentile(latencies, completed, 95) / 1e3,
+         hedge_percentile(latencies, completed, 99) / 1e3,
+         hedge_percentile(latencies, completed, 99.9) / 1e3,
+         completed > 0 ? latencies[completed - 1] / 1e3 : 0);
+  if ( hedge->percentile != 0 )
+    printf("Hedge delay : p%g of recent replies, last %.1f us\n",
+           hedge->percentile, hedge->delay / 1e3);
+  else
+    printf("Hedge delay : fixed %.3f ms\n", hedge->delay / 1e6);
+  printf("Hedged : %lu, rerouted %lu (%.1f %% of requests, budget %.0f %%), "
+         "won %lu (%.1f %% of hedges), suppressed %lu, cancelled %lu, "
+         "lost %lu\n", hedge->hedged, hedge->rerouted,
+         hedge->requests ? 100.0 * (hedge->hedged + hedge->rerouted)
+                           / hedge->requests : 0,
+         hedge->budget * 100, hedge->hedgeWins,
+         hedge->hedged ? 100.0 * hedge->hedgeWins / hedge->hedged : 0,
+         hedge->suppressed, hedge->cancelled, hedge->lost);
+  /* Part attendue : toutes les requêtes pour le principal, le budget réparti
+     entre les autres */
+  for ( e = 0; e < hedge->count; e++ ) {
+    share = e == 0 ? 100 : hedge->budget * 100 / (hedge->count - 1);
+    load = hedge->requests ? 100.0 * hedge->endpoints[e].sent
+                             / hedge->requests : 0;
+    printf("Endpoint %s : sent %lu (%.1f %% of requests, share %.1f %%), "
+           "won %lu%s\n", hedge->endpoints[e].name, hedge->endpoints[e].sent,
+           load, share, hedge->endpoints[e].wins, e == 0 ? " (primary)" : "");
+    extra += hedge->endpoints[e].sent;
+  }
+  printf("Extra load : %.1f %%\n",
+         hedge->requests ? 100.0 * (extra - hedge->requests) / hedge->requests
+                         : 0);
+  fflush(stdout);
+  free(latencies);
+  return hedge->lost == 0 ? 0 : -1;
+}
@@ -0,0 +1,69 @@
+/******************************************************************************
+ *
+ * Name File : hedge.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <stdint.h>
+
+/* Requêtes doublées : une requête sans réponse après le délai est envoyée
+   aussi à un autre serveur, la première réponse l'emporte et l'autre est
+   jetée à son arrivée. Le délai est fixe ou suit un centile des latences
+   observées ; les envois en double sont limités à une part des requêtes. */
+#define HEDGE_MAX_ENDPOINTS 8	/* Serveur principal compris */
+#define HEDGE_SAMPLES 1024	/* Latences récentes du délai adaptatif */
+#define HEDGE_WARMUP 64		/* Réponses avant le premier envoi en double */
+#define HEDGE_UPDATE 64		/* Réponses entre deux calculs du délai */
+#define HEDGE_BURST 10		/* Envois en double d'avance au plus */
+#define HEDGE_TIMEOUT_MS 1000	/* UDP : requête perdue sans réponse */
+#define HEDGE_PERCENTILE 95	/* Délai par défaut */
+#define HEDGE_BUDGET 10		/* Envois en double au plus, en % */
+
+/* Serveur : connexion TCP ou socket UDP connecté */
+struct hedge_endpoint {
+  int fd;
+  const char *name;
+  unsigned long owed;		/* TCP : réponses annulées encore à lire */
+  unsigned long sent;
+  unsigned long wins;		/* réponses retenues */
+};
+
+struct hedge {
+  int socktype;
+  struct hedge_endpoint endpoints[HEDGE_MAX_ENDPOINTS];
+  int count;			/* le premier est le serveur principal */
+  int next;			/* prochain serveur d'un envoi en double */
+  double percentile;		/* délai adaptatif, 0 : délai fixe */
+  uint64_t delay;		/* délai courant, en ns */
+  double budget;		/* part des requêtes qui peut être doublée */
+  double tokens;		/* envois en double disponibles */
+  uint64_t samples[HEDGE_SAMPLES];
+  unsigned long sampleCount;
+  /* Statistiques */
+  unsigned long requests;
+  unsigned long hedged;		/* requêtes envoyées en double */
+  unsigned long rerouted;	/* TCP : envoyées hors du principal, qui devait
+				   encore une réponse annulée */
+  unsigned long hedgeWins;	/* ... dont l'envoi en double a gagné */
+  unsigned long suppressed;	/* délai écoulé, mais budget épuisé ou aucun
+				   serveur libre */
+  unsigned long cancelled;	/* réponses perdantes jetées */
+  unsigned long lost;		/* UDP : sans aucune réponse */
+};
+
+int hedge_init(struct hedge *hedge, int socktype, char *delay, double budget);
+int hedge_split(char *spec, char **host, char **port);
+int hedge_add(struct hedge *hedge, int fd, const char *name);
+int hedge_bench(struct hedge *hedge, long count, char *msg);
+
+#endif
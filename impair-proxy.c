@@ -0,0 +1,934 @@
+/******************************************************************************
+ *
+ * Name File : impair-proxy.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "impair.h"
+
+#define PROXY_EVENTS 64		/* Événements traités par réveil */
+#define PROXY_BATCH 64		/* Datagrammes lus par réveil et par socket */
+#define PROXY_CHUNK 65536	/* Segment TCP lu en une fois */
+#define PROXY_QUEUE_MAX (4 << 20)	/* Octets en attente par sens, au-delà
+					   la lecture est suspendue */
+#define PROXY_UDP_IDLE_NS 60000000000ULL	/* Session UDP inactive libérée */
+
+/* Extrémité d'un flux, référencée par epoll */
+struct proxy_end {
+  int fd;
+  int side;			/* 0 : client, 1 : serveur */
+  struct proxy_flow *flow;
+  uint32_t events;		/* événements attendus */
+};
+
+/* Paquet retenu jusqu'à son instant de sortie ; en TCP, une longueur nulle
+   transmet la fin du flux */
+struct proxy_packet {
+  uint64_t release;
+  uint64_t order;		/* ordre d'arrivée, à instant de sortie égal */
+  struct proxy_flow *flow;
+  int direction;		/* 0 : vers le serveur, 1 : vers le client */
+  size_t length;
+  size_t offset;		/* octets déjà écrits */
+  struct proxy_packet *next;	/* file d'écriture du flux */
+  char data[];
+};
+
+/* Connexion TCP relayée, ou session UDP d'un client. En UDP, end[0] n'a
+   pas de descripteur propre : les réponses partent du socket d'écoute */
+struct proxy_flow {
+  int type;			/* SOCK_STREAM ou SOCK_DGRAM */
+  struct proxy_end end[2];
+  struct sockaddr_storage addr;	/* UDP : adresse du client */
+  socklen_t addrlen;
+  struct impair_link link[2];	/* indexé par sens */
+  size_t queued[2];		/* octets en attente, par sens */
+  struct proxy_packet *backlog[2];	/* TCP : sortis, pas encore écrits */
+  struct proxy_packet *backlogTail[2];
+  int readEof[2];		/* fin du flux lue, par sens */
+  int connecting;
+  int closed;
+  unsigned int pending;		/* paquets retenus dans le tas */
+  uint64_t lastSeen;
+  struct proxy_flow *next;
+};
+
+/* Relais et son tas de paquets retenus, trié par instant de sortie */
+struct proxy {
+  int epollDescriptor;
+  int listenDescriptor;
+  int udpDescriptor;
+  int timerDescriptor;
+  uint64_t armed;		/* échéance du minuteur, 0 : désarmé */
+  struct sockaddr_storage upstream;
+  socklen_t upstreamLen;
+  struct impair impair;
+  struct proxy_packet **heap;
+  size_t heapCount;
+  size_t heapCapacity;
+  uint64_t order;
+  struct proxy_flow *flows;
+  /* Statistiques */
+  unsigned long connections;
+  unsigned long sessions;
+  unsigned long segments;
+  unsigned long datagrams;
+  unsigned long long bytes;
+  unsigned long sendDrops;	/* datagrammes refusés par le noyau */
+  unsigned long queueDrops;	/* datagrammes perdus, PROXY_QUEUE_MAX atteint */
+};
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dumpStats = 0;
+
+/******************************************************************************
+ * Fonction appelée à la réception de SIGINT ou SIGTERM, demande l'arrêt du
+ * relais.
+ *****************************************************************************/
+void stop_handler(int signum) {
+  (void) signum;
+  running = 0;
+}
+
+/******************************************************************************
+ * Fonction appelée à la réception de SIGUSR1, demande l'affichage des
+ * statistiques.
+ *****************************************************************************/
+void stats_handler(int signum) {
+  (void) signum;
+  dumpStats = 1;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+uint64_t now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui ouvre un socket d'écoute sur le port donné.
+ * Prend en paramètre :
+ *     - port    Pointeur vers une chaine de caractère pour le numéro de port.
+ *     - type    SOCK_STREAM ou SOCK_DGRAM.
+ * Renvoie le descripteur du socket, en mode non bloquant.
+ *****************************************************************************/
+int socket_listen(char *port, int type) {
+  struct addrinfo hints, *servInfo, *rp;
+  int socketDescriptor = -1;
+  int status;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  hints.ai_flags = AI_PASSIVE;
+  status = getaddrinfo(NULL, port, &hints, &servInfo);
+  if ( status != 0 ) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+    exit(EXIT_FAILURE);
+  }
+
+  for ( rp = servInfo; rp != NULL; rp = rp->ai_next ) {
+    socketDescriptor = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK,
+                              rp->ai_protocol);
+    if ( socketDescriptor == -1 )
+      continue;
+    if ( bind(socketDescriptor, rp->ai_addr, rp->ai_addrlen) == 0
+         && (type != SOCK_STREAM || listen(socketDescriptor, SOMAXCONN) == 0) )
+      break;
+    close(socketDescriptor);
+  }
+  freeaddrinfo(servInfo);
+
+  if ( rp == NULL ) {
+    fprintf(stderr, "Could not bind\n");
+    fprintf(stderr, "Port number is already used.\n");
+    exit(EXIT_FAILURE);
+  }
+  return socketDescriptor;
+}
+
+/******************************************************************************
+ * Fonction qui résout l'adresse du serveur relayé.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *     - host     Nom ou adresse IP du serveur.
+ *     - port     Port du serveur.
+ *****************************************************************************/
+void upstream_resolve(struct proxy *proxy, char *host, char *port) {
+  struct addrinfo hints, *servInfo;
+  int status;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  status = getaddrinfo(host, port, &hints, &servInfo);
+  if ( status != 0 ) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&proxy->upstream, servInfo->ai_addr, servInfo->ai_addrlen);
+  proxy->upstreamLen = servInfo->ai_addrlen;
+  freeaddrinfo(servInfo);
+}
+
+/******************************************************************************
+ * Fonction qui inscrit un descripteur auprès d'epoll.
+ * Prend en paramètre :
+ *     - proxy     Pointeur vers le relais.
+ *     - fd        Descripteur à surveiller.
+ *     - events    Événements attendus.
+ *     - ptr       Pointeur rendu avec les événements.
+ *****************************************************************************/
+void proxy_watch(struct proxy *proxy, int fd, uint32_t events, void *ptr) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.ptr = ptr;
+  if ( epoll_ctl(proxy->epollDescriptor, EPOLL_CTL_ADD, fd, &event) == -1 ) {
+    perror("Error with epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui met à jour les événements attendus sur une extrémité TCP : la
+ * lecture tant que le sens qui en part n'est pas saturé, l'écriture tant que
+ * des segments sortis attendent vers elle.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *     - end      Pointeur vers l'extrémité.
+ *****************************************************************************/
+void end_update(struct proxy *proxy, struct proxy_end *end) {
+  struct proxy_flow *flow = end->flow;
+  struct epoll_event event;
+  uint32_t events = 0;
+
+  if ( flow->closed )
+    return;
+  if ( !flow->readEof[end->side] && flow->queued[end->side] < PROXY_QUEUE_MAX
+       && !(end->side == 1 && flow->connecting) )
+    events |= EPOLLIN;
+  if ( flow->backlog[1 - end->side] != NULL
+       || (end->side == 1 && flow->connecting) )
+    events |= EPOLLOUT;
+  if ( events == end->events )
+    return;
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.ptr = end;
+  epoll_ctl(proxy->epollDescriptor, EPOLL_CTL_MOD, end->fd, &event);
+  end->events = events;
+}
+
+/******************************************************************************
+ * Fonction qui ajoute un paquet au tas des paquets retenus.
+ * Prend en paramètre :
+ *     - proxy     Pointeur vers le relais.
+ *     - packet    Paquet à retenir.
+ *****************************************************************************/
+void heap_push(struct proxy *proxy, struct proxy_packet *packet) {
+  struct proxy_packet **items;
+  size_t i, parent;
+
+  if ( proxy->heapCount == proxy->heapCapacity ) {
+    proxy->heapCapacity = proxy->heapCapacity ? 2 * proxy->heapCapacity : 256;
+    items = realloc(proxy->heap, proxy->heapCapacity * sizeof(*items));
+    if ( items == NULL ) {
+      perror("Error with realloc");
+      exit(EXIT_FAILURE);
+    }
+    proxy->heap = items;
+  }
+
+  packet->order = proxy->order++;
+  for ( i = proxy->heapCount++; i > 0; i = parent ) {
+    parent = (i - 1) / 2;
+    if ( proxy->heap[parent]->release < packet->release
+         || (proxy->heap[parent]->release == packet->release
+             && proxy->heap[parent]->order < packet->order) )
+      break;
+    proxy->heap[i] = proxy->heap[parent];
+  }
+  proxy->heap[i] = packet;
+}
+
+/******************************************************************************
+ * Fonction qui retire du tas le paquet qui sort le premier.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ * Renvoie le paquet retiré.
+ *****************************************************************************/
+struct proxy_packet *heap_pop(struct proxy *proxy) {
+  struct proxy_packet *top = proxy->heap[0];
+  struct proxy_packet *last = proxy->heap[--proxy->heapCount];
+  struct proxy_packet *child;
+  size_t i = 0, c;
+
+  while ( (c = 2 * i + 1) < proxy->heapCount ) {
+    if ( c + 1 < proxy->heapCount
+         && (proxy->heap[c + 1]->release < proxy->heap[c]->release
+             || (proxy->heap[c + 1]->release == proxy->heap[c]->release
+                 && proxy->heap[c + 1]->order < proxy->heap[c]->order)) )
+      c++;
+    child = proxy->heap[c];
+    if ( last->release < child->release
+         || (last->release == child->release && last->order < child->order) )
+      break;
+    proxy->heap[i] = child;
+    i = c;
+  }
+  proxy->heap[i] = last;
+  return top;
+}
+
+/******************************************************************************
+ * Fonction qui retient une copie d'un message jusqu'à son instant de sortie.
+ * Prend en paramètre :
+ *     - proxy        Pointeur vers le relais.
+ *     - flow         Flux du message.
+ *     - direction    Sens du message.
+ *     - data         Contenu du message.
+ *     - length       Taille du message, 0 pour la fin d'un flux TCP.
+ *     - release      Instant de sortie, en ns.
+ *****************************************************************************/
+void packet_schedule(struct proxy *proxy, struct proxy_flow *flow,
+                     int direction, const char *data, size_t length,
+                     uint64_t release) {
+  struct proxy_packet *packet;
+
+  packet = malloc(sizeof(*packet) + length);
+  if ( packet == NULL ) {
+    perror("Error with malloc");
+    exit(EXIT_FAILURE);
+  }
+  packet->release = release;
+  packet->flow = flow;
+  packet->direction = direction;
+  packet->length = length;
+  packet->offset = 0;
+  packet->next = NULL;
+  memcpy(packet->data, data, length);
+  flow->pending++;
+  flow->queued[direction] += length;
+  heap_push(proxy, packet);
+}
+
+/******************************************************************************
+ * Fonction qui libère les flux fermés dont plus aucun paquet n'est retenu,
+ * après le traitement des événements qui peuvent encore les désigner.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *****************************************************************************/
+void flow_sweep(struct proxy *proxy) {
+  struct proxy_flow **link = &proxy->flows;
+  struct proxy_flow *flow;
+
+  while ( (flow = *link) != NULL ) {
+    if ( flow->closed && flow->pending == 0 ) {
+      *link = flow->next;
+      free(flow);
+    } else {
+      link = &flow->next;
+    }
+  }
+}
+
+/******************************************************************************
+ * Fonction qui ferme un flux. Ses paquets encore retenus seront abandonnés à
+ * leur sortie, flow_sweep libère ensuite le flux.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *     - flow     Flux à fermer.
+ *****************************************************************************/
+void flow_close(struct proxy_flow *flow) {
+  struct proxy_packet *packet;
+  int i;
+
+  if ( flow->closed )
+    return;
+  flow->closed = 1;
+  for ( i = 0; i < 2; i++ ) {
+    if ( flow->end[i].fd != -1 )
+      close(flow->end[i].fd);
+    while ( (packet = flow->backlog[i]) != NULL ) {
+      flow->backlog[i] = packet->next;
+      free(packet);
+    }
+  }
+}
+
+/******************************************************************************
+ * Fonction qui crée un flux et le chaîne aux flux du relais.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *     - type     SOCK_STREAM ou SOCK_DGRAM.
+ * Renvoie le flux créé.
+ *****************************************************************************/
+struct proxy_flow *flow_create(struct proxy *proxy, int type) {
+  struct proxy_flow *flow;
+  int i;
+
+  flow = calloc(1, sizeof(*flow));
+  if ( flow == NULL ) {
+    perror("Error with calloc");
+    exit(EXIT_FAILURE);
+  }
+  flow->type = type;
+  for ( i = 0; i < 2; i++ ) {
+    flow->end[i].fd = -1;
+    flow->end[i].side = i;
+    flow->end[i].flow = flow;
+  }
+  flow->next = proxy->flows;
+  proxy->flows = flow;
+  return flow;
+}
+
+/******************************************************************************
+ * Fonction qui accepte les clients TCP en attente et ouvre pour chacun une
+ * connexion non bloquante vers le serveur.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *****************************************************************************/
+void tcp_accept(struct proxy *proxy) {
+  struct proxy_flow *flow;
+  int client, server;
+  int on = 1;
+
+  while ( (client = accept4(proxy->listenDescriptor, NULL, NULL,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1 ) {
+    server = socket(proxy->upstream.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( server == -1 || (connect(server, (struct sockaddr *) &proxy->upstream,
+                                  proxy->upstreamLen) == -1
+                          && errno != EINPROGRESS) ) {
+      perror("Error with connect");
+      if ( server != -1 )
+        close(server);
+      close(client);
+      continue;
+    }
+    /* Le relais ne doit pas ajouter le délai de Nagle à celui simulé */
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    flow = flow_create(proxy, SOCK_STREAM);
+    flow->connecting = 1;
+    flow->end[0].fd = client;
+    flow->end[0].events = EPOLLIN;
+    flow->end[1].fd = server;
+    flow->end[1].events = EPOLLOUT;
+    proxy_watch(proxy, client, EPOLLIN, &flow->end[0]);
+    proxy_watch(proxy, server, EPOLLOUT, &flow->end[1]);
+    proxy->connections++;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui écrit les segments sortis d'un sens TCP, dans l'ordre, tant
+ * que le socket les accepte. La fin du flux est transmise par shutdown.
+ * Prend en paramètre :
+ *     - proxy        Pointeur vers le relais.
+ *     - flow         Flux concerné.
+ *     - direction    Sens à écrire.
+ *****************************************************************************/
+void tcp_flush(struct proxy *proxy, struct proxy_flow *flow, int direction) {
+  struct proxy_packet *packet;
+  int fd = flow->end[1 - direction].fd;
+  ssize_t written;
+
+  while ( !flow->connecting && (packet = flow->backlog[direction]) != NULL ) {
+    if ( packet->length == 0 ) {
+      shutdown(fd, SHUT_WR);
+    } else {
+      written = send(fd, packet->data + packet->offset,
+                     packet->length - packet->offset, MSG_NOSIGNAL);
+      if ( written == -1 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+          break;
+        flow_close(flow);
+        return;
+      }
+      packet->offset += written;
+      flow->queued[direction] -= written;
+      proxy->bytes += written;
+      if ( packet->offset < packet->length )
+        break;
+      proxy->segments++;
+    }
+    flow->backlog[direction] = packet->next;
+    if ( packet->next == NULL )
+      flow->backlogTail[direction] = NULL;
+    free(packet);
+  }
+
+  /* Les deux fins de flux transmises : la connexion est terminée */
+  if ( flow->readEof[0] && flow->readEof[1] && flow->pending == 0
+       && flow->backlog[0] == NULL && flow->backlog[1] == NULL ) {
+    flow_close(flow);
+    return;
+  }
+  end_update(proxy, &flow->end[0]);
+  end_update(proxy, &flow->end[1]);
+}
+
+/******************************************************************************
+ * Fonction qui lit une extrémité TCP et retient chaque segment lu selon les
+ * dégradations du lien.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *     - end      Pointeur vers l'extrémité lisible.
+ *****************************************************************************/
+void tcp_read(struct proxy *proxy, struct proxy_end *end) {
+  struct proxy_flow *flow = end->flow;
+  char buffer[PROXY_CHUNK];
+  int direction = end->side;
+  uint64_t now;
+  ssize_t length;
+
+  while ( !flow->readEof[direction] && flow->queued[direction] < PROXY_QUEUE_MAX ) {
+    length = recv(end->fd, buffer, sizeof(buffer), 0);
+    if ( length == -1 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+        break;
+      flow_close(flow);
+      return;
+    }
+    now = now_ns();
+    if ( length == 0 )
+      flow->readEof[direction] = 1;
+    packet_schedule(proxy, flow, direction, buffer, length,
+                    impair_stream(&proxy->impair, &flow->link[direction],
+                                  length, now));
+  }
+  end_update(proxy, end);
+}
+
+/******************************************************************************
+ * Fonction qui traite les événements d'une extrémité TCP.
+ * Prend en paramètre :
+ *     - proxy     Pointeur vers le relais.
+ *     - end       Pointeur vers l'extrémité.
+ *     - events    Événements signalés par epoll.
+ *****************************************************************************/
+void tcp_event(struct proxy *proxy, struct proxy_end *end, uint32_t events) {
+  struct proxy_flow *flow = end->flow;
+  socklen_t length = sizeof(int);
+  int error = 0;
+
+  if ( flow->closed )
+    return;
+  if ( end->side == 1 && flow->connecting ) {
+    if ( !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) )
+      return;
+    getsockopt(end->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if ( error != 0 ) {
+      fprintf(stderr, "Error with connect: %s\n", strerror(error));
+      flow_close(flow);
+      return;
+    }
+    flow->connecting = 0;
+    tcp_flush(proxy, flow, 0);
+    if ( flow->closed )
+      return;
+  }
+  if ( events & EPOLLOUT ) {
+    tcp_flush(proxy, flow, 1 - end->side);
+    if ( flow->closed )
+      return;
+  }
+  if ( events & (EPOLLIN | EPOLLHUP | EPOLLERR) )
+    tcp_read(proxy, end);
+}
+
+/******************************************************************************
+ * Fonction qui cherche la session UDP d'un client, ou en ouvre une : un
+ * socket connecté au serveur, dont les réponses reviennent au client. Les
+ * sessions inactives sans paquet retenu sont libérées au passage.
+ * Prend en paramètre :
+ *     - proxy      Pointeur vers le relais.
+ *     - addr       Adresse du client.
+ *     - addrlen    Taille de l'adresse.
+ *     - now        Instant courant en ns.
+ * Renvoie la session, NULL si le socket n'a pu être ouvert.
+ *****************************************************************************/
+struct proxy_flow *udp_session(struct proxy *proxy,
+                               struct sockaddr_storage *addr,
+                               socklen_t addrlen, uint64_t now) {
+  struct proxy_flow *flow, *next;
+  int fd;
+
+  for ( flow = proxy->flows; flow != NULL; flow = next ) {
+    next = flow->next;
+    if ( flow->type != SOCK_DGRAM || flow->closed )
+      continue;
+    if ( flow->addrlen == addrlen && memcmp(&flow->addr, addr, addrlen) == 0 ) {
+      flow->lastSeen = now;
+      return flow;
+    }
+    if ( now - flow->lastSeen > PROXY_UDP_IDLE_NS )
+      flow_close(flow);
+  }
+
+  fd = socket(proxy->upstream.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if ( fd == -1 || connect(fd, (struct sockaddr *) &proxy->upstream,
+                           proxy->upstreamLen) == -1 ) {
+    perror("Error with connect");
+    if ( fd != -1 )
+      close(fd);
+    return NULL;
+  }
+  flow = flow_create(proxy, SOCK_DGRAM);
+  memcpy(&flow->addr, addr, addrlen);
+  flow->addrlen = addrlen;
+  flow->lastSeen = now;
+  flow->end[1].fd = fd;
+  flow->end[1].events = EPOLLIN;
+  proxy_watch(proxy, fd, EPOLLIN, &flow->end[1]);
+  proxy->sessions++;
+  return flow;
+}
+
+/******************************************************************************
+ * Fonction qui retient un datagramme, ses copies éventuelles, ou le perd.
+ * Au-delà de PROXY_QUEUE_MAX octets retenus dans son sens, le datagramme
+ * est perdu à l'entrée, pour que la mémoire du relais reste bornée.
+ * Prend en paramètre :
+ *     - proxy        Pointeur vers le relais.
+ *     - flow         Session du datagramme.
+ *     - direction    Sens du datagramme.
+ *     - data         Contenu du datagramme.
+ *     - length       Taille du datagramme.
+ *     - now          Instant de réception, en ns.
+ *****************************************************************************/
+void udp_schedule(struct proxy *proxy, struct proxy_flow *flow, int direction,
+                  const char *data, size_t length, uint64_t now) {
+  uint64_t release[2];
+  int copies, i;
+
+  if ( flow->queued[direction] + length > PROXY_QUEUE_MAX ) {
+    proxy->queueDrops++;
+    return;
+  }
+  copies = impair_datagram(&proxy->impair, &flow->link[direction], length, now,
+                           release);
+  for ( i = 0; i < copies; i++ )
+    packet_schedule(proxy, flow, direction, data, length, release[i]);
+}
+
+/******************************************************************************
+ * Fonction qui lit les datagrammes des clients sur le socket d'écoute.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *****************************************************************************/
+void udp_receive(struct proxy *proxy) {
+  struct sockaddr_storage addr;
+  struct proxy_flow *flow;
+  socklen_t addrlen;
+  char buffer[PROXY_CHUNK];
+  ssize_t length;
+  uint64_t now;
+  int batch;
+
+  for ( batch = 0; batch < PROXY_BATCH; batch++ ) {
+    addrlen = sizeof(addr);
+    length = recvfrom(proxy->udpDescriptor, buffer, sizeof(buffer), 0,
+                      (struct sockaddr *) &addr, &addrlen);
+    if ( length == -1 )
+      break;
+    now = now_ns();
+    if ( (flow = udp_session(proxy, &addr, addrlen, now)) != NULL )
+      udp_schedule(proxy, flow, 0, buffer, length, now);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui lit les réponses du serveur à une session UDP.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *     - flow     Session lisible.
+ *****************************************************************************/
+void udp_reply(struct proxy *proxy, struct proxy_flow *flow) {
+  char buffer[PROXY_CHUNK];
+  ssize_t length;
+  int batch;
+
+  for ( batch = 0; batch < PROXY_BATCH && !flow->closed; batch++ ) {
+    length = recv(flow->end[1].fd, buffer, sizeof(buffer), 0);
+    if ( length == -1 )
+      break;
+    flow->lastSeen = now_ns();
+    udp_schedule(proxy, flow, 1, buffer, length, flow->lastSeen);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui fait sortir les paquets dont l'instant est passé. Un
+ * datagramme refusé par le noyau est perdu, comme sur un lien saturé ; un
+ * segment TCP rejoint la file d'écriture de son flux.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *     - now      Instant courant en ns.
+ *****************************************************************************/
+void proxy_release(struct proxy *proxy, uint64_t now) {
+  struct proxy_packet *packet;
+  struct proxy_flow *flow;
+  ssize_t status;
+
+  while ( proxy->heapCount > 0 && proxy->heap[0]->release <= now ) {
+    packet = heap_pop(proxy);
+    flow = packet->flow;
+    flow->pending--;
+
+    if ( flow->closed ) {
+      free(packet);
+      continue;
+    }
+
+    if ( flow->type == SOCK_DGRAM ) {
+      if ( packet->direction == 0 )
+        status = send(flow->end[1].fd, packet->data, packet->length, 0);
+      else
+        status = sendto(proxy->udpDescriptor, packet->data, packet->length, 0,
+                        (struct sockaddr *) &flow->addr, flow->addrlen);
+      if ( status == -1 ) {
+        proxy->sendDrops++;
+      } else {
+        proxy->datagrams++;
+        proxy->bytes += status;
+      }
+      flow->queued[packet->direction] -= packet->length;
+      free(packet);
+      continue;
+    }
+
+    if ( flow->backlogTail[packet->direction] != NULL )
+      flow->backlogTail[packet->direction]->next = packet;
+    else
+      flow->backlog[packet->direction] = packet;
+    flow->backlogTail[packet->direction] = packet;
+    tcp_flush(proxy, flow, packet->direction);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui arme le minuteur sur la sortie du prochain paquet retenu.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *****************************************************************************/
+void proxy_arm(struct proxy *proxy) {
+  struct itimerspec timer;
+  uint64_t deadline = proxy->heapCount > 0 ? proxy->heap[0]->release : 0;
+
+  if ( deadline == proxy->armed )
+    return;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_sec = deadline / 1000000000;
+  timer.it_value.tv_nsec = deadline % 1000000000;
+  timerfd_settime(proxy->timerDescriptor, TFD_TIMER_ABSTIME, &timer, NULL);
+  proxy->armed = deadline;
+}
+
+/******************************************************************************
+ * Fonction qui affiche les dégradations appliquées et les statistiques.
+ * Prend en paramètre :
+ *     - proxy    Pointeur vers le relais.
+ *****************************************************************************/
+void stats_print(struct proxy *proxy) {
+  struct impair_config *config = &proxy->impair.config;
+
+  printf("\nImpairment : latency %.3f ms, jitter %.3f ms, rate %.1f Mbit/s, "
+         "loss %.2f %%, duplicate %.2f %%, reorder %.2f %%, seed %llu\n",
+         config->latency / 1e6, config->jitter / 1e6, config->rate * 8 / 1e6,
+         config->loss * 100, config->duplicate * 100, config->reorder * 100,
+         (unsigned long long) config->seed);
+  printf("TCP : connections %lu, segments %lu, retransmission delays %lu\n",
+         proxy->connections, proxy->segments, proxy->impair.retransmitted);
+  printf("UDP : sessions %lu, datagrams %lu, lost %lu, queue drops %lu, "
+         "duplicated %lu, reordered %lu, send drops %lu\n", proxy->sessions,
+         proxy->datagrams, proxy->impair.lost,
+         proxy->impair.overflowed + proxy->queueDrops,
+         proxy->impair.duplicated, proxy->impair.reordered, proxy->sendDrops);
+  printf("Forwarded : %llu bytes, held : %zu packets\n", proxy->bytes,
+         proxy->heapCount);
+  fflush(stdout);
+}
+
+/******************************************************************************
+ * Relais de dégradation réseau : s'intercale entre les clients et un serveur
+ * echo, en TCP et en UDP sur le même port, et retarde, limite, perd,
+ * duplique ou réordonne les messages dans les deux sens. Le tirage est
+ * reproductible : le même germe redonne les mêmes décisions pour la même
+ * suite de messages.
+ * Le programme prend en paramètre :
+ *     - port : Port d'écoute du relais (TCP et UDP).
+ *     - host : Adresse du serveur relayé.
+ *     - hostport : Port du serveur relayé.
+ * Options :
+ *     - -l ms    : Latence d'un sens, en millisecondes (0 par défaut)
+ *     - -j ms    : Gigue uniforme de plus ou moins 'ms' autour de la latence
+ *     - -b mbps  : Débit de chaque sens, en Mbit/s (illimité par défaut)
+ *     - -q ms    : File de chaque sens, en millisecondes d'émission au débit
+ *                    fixé (100 par défaut, 0 : illimitée) ; un datagramme
+ *                    qui la trouve pleine est perdu (UDP seulement)
+ *     - -x pct   : Pourcentage de datagrammes perdus ; en TCP, un segment
+ *                    perdu est retardé d'une retransmission
+ *     - -d pct   : Pourcentage de datagrammes dupliqués (UDP seulement)
+ *     - -o pct   : Pourcentage de datagrammes envoyés sans délai, qui
+ *                    doublent les précédents (UDP seulement)
+ *     - -s seed  : Germe du tirage (instant de démarrage par défaut, affiché)
+ *****************************************************************************/
+int main(int argc, char *argv[]) {
+  struct proxy proxy;
+  struct impair_config config;
+  struct epoll_event events[PROXY_EVENTS];
+  struct sigaction action;
+  struct proxy_end *end;
+  uint64_t expirations;
+  double value;
+  int count, i;
+  int valid = 1;
+  int opt;
+
+
+  memset(&config, 0, sizeof(config));
+  config.seed = (uint64_t) time(NULL);
+  config.queueLimit = IMPAIR_QUEUE_NS;
+
+  /* Vérification des paramètres du programme */
+  while ( (opt = getopt(argc, argv, "l:j:b:q:x:d:o:s:")) != -1 ) {
+    value = opt != 's' ? atof(optarg) : 0;
+    if ( value < 0 || (value > 100 && (opt == 'x' || opt == 'd' || opt == 'o')) )
+      valid = 0;
+    switch ( opt ) {
+    case 'l':
+      config.latency = (uint64_t) (value * 1e6);
+      break;
+    case 'j':
+      config.jitter = (uint64_t) (value * 1e6);
+      break;
+    case 'b':
+      config.rate = value * 1e6 / 8;
+      break;
+    case 'q':
+      config.queueLimit = (uint64_t) (value * 1e6);
+      break;
+    case 'x':
+      config.loss = value / 100;
+      break;
+    case 'd':
+      config.duplicate = value / 100;
+      break;
+    case 'o':
+      config.reorder = value / 100;
+      break;
+    case 's':
+      config.seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      valid = 0;
+    }
+  }
+  if ( argc - optind != 3 || !valid ) {
+    fprintf(stderr, "Usage: %s [-l ms] [-j ms] [-b mbps] [-q ms] [-x loss%%] "
+            "[-d duplicate%%] [-o reorder%%] [-s seed] port host hostport\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("\n ****      Welcome to the Impairment Proxy.      ****\n\n");
+
+  /* Arrêt propre sur SIGINT et SIGTERM pour afficher les statistiques */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_handler;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = stats_handler;
+  sigaction(SIGUSR1, &action, NULL);
+
+  memset(&proxy, 0, sizeof(proxy));
+  impair_init(&proxy.impair, &config);
+
+  upstream_resolve(&proxy, argv[optind+1], argv[optind+2]);
+  proxy.listenDescriptor = socket_listen(argv[optind], SOCK_STREAM);
+  proxy.udpDescriptor = socket_listen(argv[optind], SOCK_DGRAM);
+  proxy.timerDescriptor = timerfd_create(CLOCK_MONOTONIC,
+                                         TFD_NONBLOCK | TFD_CLOEXEC);
+  proxy.epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+  if ( proxy.timerDescriptor == -1 || proxy.epollDescriptor == -1 ) {
+    perror("Error with epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  proxy_watch(&proxy, proxy.listenDescriptor, EPOLLIN, &proxy.listenDescriptor);
+  proxy_watch(&proxy, proxy.udpDescriptor, EPOLLIN, &proxy.udpDescriptor);
+  proxy_watch(&proxy, proxy.timerDescriptor, EPOLLIN, &proxy.timerDescriptor);
+
+  printf("Listen on %s, forward to %s:%s, seed %llu\n", argv[optind],
+         argv[optind+1], argv[optind+2], (unsigned long long) config.seed);
+  fflush(stdout);
+
+  while ( running ) {
+    if ( dumpStats ) {
+      dumpStats = 0;
+      stats_print(&proxy);
+    }
+    count = epoll_wait(proxy.epollDescriptor, events, PROXY_EVENTS, -1);
+    for ( i = 0; i < count; i++ ) {
+      if ( events[i].data.ptr == &proxy.listenDescriptor ) {
+        tcp_accept(&proxy);
+      } else if ( events[i].data.ptr == &proxy.udpDescriptor ) {
+        udp_receive(&proxy);
+      } else if ( events[i].data.ptr == &proxy.timerDescriptor ) {
+        if ( read(proxy.timerDescriptor, &expirations, sizeof(expirations)) > 0 )
+          proxy.armed = 0;
+      } else {
+        end = events[i].data.ptr;
+        if ( end->flow->type == SOCK_DGRAM )
+          udp_reply(&proxy, end->flow);
+        else
+          tcp_event(&proxy, end, events[i].events);
+      }
+    }
+    proxy_release(&proxy, now_ns());
+    flow_sweep(&proxy);
+    proxy_arm(&proxy);
+  }
+
+  stats_print(&proxy);
+  close(proxy.epollDescriptor);
+  close(proxy.timerDescriptor);
+  close(proxy.listenDescriptor);
+  close(proxy.udpDescriptor);
+  exit(EXIT_SUCCESS);
+}
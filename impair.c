@@ -0,0 +1,157 @@
+/******************************************************************************
+ *
+ * Name File : impair.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#include "impair.h"
+
+#include <string.h>
+
+/******************************************************************************
+ * Fonction qui initialise le modèle de dégradation. L'état du générateur est
+ * dérivé du germe (splitmix64), un germe nul donnant lui aussi une suite
+ * utilisable.
+ * Prend en paramètre :
+ *     - impair    Pointeur vers le modèle à initialiser.
+ *     - config    Pointeur vers les dégradations à appliquer.
+ *****************************************************************************/
+void impair_init(struct impair *impair, struct impair_config *config) {
+  uint64_t z = config->seed + 0x9e3779b97f4a7c15ULL;
+
+  memset(impair, 0, sizeof(*impair));
+  impair->config = *config;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  impair->state = (z ^ (z >> 31)) | 1;
+}
+
+/******************************************************************************
+ * Fonction qui tire un nombre pseudo-aléatoire (xorshift64*).
+ * Prend en paramètre :
+ *     - impair    Pointeur vers le modèle.
+ * Renvoie un nombre uniforme dans [0, 1[.
+ *****************************************************************************/
+double impair_random(struct impair *impair) {
+  impair->state ^= impair->state >> 12;
+  impair->state ^= impair->state << 25;
+  impair->state ^= impair->state >> 27;
+  return ((impair->state * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+/******************************************************************************
+ * Fonction qui calcule la fin d'émission d'un paquet sur le lien : il attend
+ * que les précédents soient passés, puis occupe le lien le temps de sa
+ * taille au débit fixé.
+ *****************************************************************************/
+static uint64_t impair_serialize(struct impair *impair,
+                                 struct impair_link *link, size_t size,
+                                 uint64_t now) {
+  uint64_t start = link->busyUntil > now ? link->busyUntil : now;
+
+  if ( impair->config.rate > 0 )
+    start += (uint64_t) (size * 1e9 / impair->config.rate);
+  link->busyUntil = start;
+  return start;
+}
+
+/******************************************************************************
+ * Fonction qui tire le délai de propagation d'un paquet : la latence, plus
+ * ou moins la gigue.
+ *****************************************************************************/
+static uint64_t impair_delay(struct impair *impair) {
+  double offset;
+
+  if ( impair->config.jitter == 0 )
+    return impair->config.latency;
+  offset = (2 * impair_random(impair) - 1) * impair->config.jitter;
+  if ( offset < 0 && (uint64_t) -offset > impair->config.latency )
+    return 0;
+  return impair->config.latency + (int64_t) offset;
+}
+
+/******************************************************************************
+ * Fonction qui décide du sort d'un datagramme. La gigue ne change pas
+ * l'ordre des datagrammes, comme sur un lien réel : un datagramme ne sort
+ * pas avant le précédent. Seul un datagramme réordonné, envoyé sans délai de
+ * propagation, double ceux qui le précèdent. Quand l'émission en attente
+ * sur le lien dépasse la file fixée, le datagramme est perdu à l'entrée,
+ * comme sur un routeur saturé.
+ * Prend en paramètre :
+ *     - impair     Pointeur vers le modèle.
+ *     - link       Pointeur vers le sens du lien emprunté.
+ *     - size       Taille du datagramme.
+ *     - now        Instant de réception, en ns.
+ *     - release    Instants de sortie des copies à remplir.
+ * Renvoie le nombre de copies à envoyer : 0 si le datagramme est perdu, 2
+ * s'il est dupliqué.
+ *****************************************************************************/
+int impair_datagram(struct impair *impair, struct impair_link *link,
+                    size_t size, uint64_t now, uint64_t release[2]) {
+  uint64_t sent;
+  int copies = 1, i;
+
+  if ( impair->config.queueLimit != 0
+       && link->busyUntil > now + impair->config.queueLimit ) {
+    impair->overflowed++;
+    return 0;
+  }
+  if ( impair->config.loss > 0 && impair_random(impair) < impair->config.loss ) {
+    impair->lost++;
+    return 0;
+  }
+  if ( impair->config.duplicate > 0
+       && impair_random(impair) < impair->config.duplicate ) {
+    impair->duplicated++;
+    copies = 2;
+  }
+
+  for ( i = 0; i < copies; i++ ) {
+    sent = impair_serialize(impair, link, size, now);
+    if ( impair->config.reorder > 0
+         && impair_random(impair) < impair->config.reorder ) {
+      impair->reordered++;
+      release[i] = sent;
+      continue;
+    }
+    release[i] = sent + impair_delay(impair);
+    if ( release[i] < link->lastRelease )
+      release[i] = link->lastRelease;
+    link->lastRelease = release[i];
+  }
+  return copies;
+}
+
+/******************************************************************************
+ * Fonction qui calcule l'instant de sortie d'un segment de flux. Les octets
+ * d'un flux ne peuvent être ni perdus, ni dupliqués, ni réordonnés sans le
+ * corrompre : une perte devient le retard d'une retransmission TCP (délai
+ * minimal plus un aller-retour), que les segments suivants subissent aussi.
+ * Prend en paramètre :
+ *     - impair    Pointeur vers le modèle.
+ *     - link      Pointeur vers le sens du lien emprunté.
+ *     - size      Taille du segment.
+ *     - now       Instant de réception, en ns.
+ * Renvoie l'instant de sortie du segment, jamais avant le précédent.
+ *****************************************************************************/
+uint64_t impair_stream(struct impair *impair, struct impair_link *link,
+                       size_t size, uint64_t now) {
+  uint64_t release;
+
+  release = impair_serialize(impair, link, size, now) + impair_delay(impair);
+  if ( impair->config.loss > 0 && impair_random(impair) < impair->config.loss ) {
+    impair->retransmitted++;
+    release += IMPAIR_TCP_RTO_NS + 2 * impair->config.latency;
+  }
+  if ( release < link->lastRelease )
+    release = link->lastRelease;
+  link->lastRelease = release;
+  return release;
+}
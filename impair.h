@@ -0,0 +1,63 @@
+/******************************************************************************
+ *
+ * Name File : impair.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMPAIR_TCP_RTO_NS 200000000ULL	/* Délai de retransmission minimal
+					   d'une pile TCP (Linux : 200 ms) */
+#define IMPAIR_QUEUE_NS 100000000ULL	/* Attente d'émission au-delà de
+					   laquelle un datagramme est perdu */
+
+/* Dégradations d'un lien, identiques dans les deux sens */
+struct impair_config {
+  uint64_t latency;		/* délai d'un sens, en ns */
+  uint64_t jitter;		/* variation uniforme de +/- jitter, en ns */
+  double rate;			/* débit en octets par seconde, 0 : illimité */
+  double loss;			/* probabilités, entre 0 et 1 */
+  double duplicate;
+  double reorder;		/* paquet envoyé sans délai, il double les
+				   précédents */
+  uint64_t queueLimit;		/* file du lien, en ns d'émission, 0 :
+				   illimitée */
+  uint64_t seed;		/* germe du générateur, pour rejouer un essai */
+};
+
+/* Modèle de dégradation : générateur pseudo-aléatoire et compteurs */
+struct impair {
+  struct impair_config config;
+  uint64_t state;		/* xorshift64* */
+  unsigned long lost;
+  unsigned long overflowed;	/* datagrammes perdus, file du lien pleine */
+  unsigned long duplicated;
+  unsigned long reordered;
+  unsigned long retransmitted;	/* pertes TCP changées en retard */
+};
+
+/* Sens d'un lien : file d'attente de sérialisation et ordre des sorties */
+struct impair_link {
+  uint64_t busyUntil;		/* fin d'émission du dernier paquet, en ns */
+  uint64_t lastRelease;		/* sortie du dernier paquet dans l'ordre */
+};
+
+void impair_init(struct impair *impair, struct impair_config *config);
+double impair_random(struct impair *impair);
+int impair_datagram(struct impair *impair, struct impair_link *link,
+                    size_t size, uint64_t now, uint64_t release[2]);
+uint64_t impair_stream(struct impair *impair, struct impair_link *link,
+                       size_t size, uint64_t now);
+
+#endif
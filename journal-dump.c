@@ -0,0 +1,118 @@
+/******************************************************************************
+ *
+ * Name File : journal-dump.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "journal.h"
+
+/******************************************************************************
+ * Fonction qui lit l'instant de départ : secondes depuis l'époque, ou
+ * secondes avant maintenant si la valeur est négative.
+ * Prend en paramètre :
+ *     - spec    Chaine à lire.
+ *     - time    Instant CLOCK_REALTIME en ns à remplir.
+ * Renvoie 0 en cas de succès, -1 si la chaine est invalide.
+ *****************************************************************************/
+int since_parse(char *spec, uint64_t *time) {
+  struct timespec now;
+  double seconds;
+  char *end;
+
+  seconds = strtod(spec, &end);
+  if ( end == spec || *end != '\0' )
+    return -1;
+  if ( seconds < 0 ) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    seconds += now.tv_sec + now.tv_nsec / 1e9;
+    if ( seconds < 0 )
+      seconds = 0;
+  }
+  *time = (uint64_t) (seconds * 1e9);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui affiche un enregistrement sur une ligne : instant UTC,
+ * client, worker, taille, puis le message, les octets non imprimables
+ * échappés en \xNN.
+ * Prend en paramètre :
+ *     - record    Enregistrement suivi de son message.
+ *****************************************************************************/
+void record_print(struct journal_record *record) {
+  unsigned char *data = (unsigned char *) (record + 1);
+  time_t seconds = record->time / 1000000000ULL;
+  struct tm date;
+  char stamp[32];
+  int i;
+
+  gmtime_r(&seconds, &date);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &date);
+  printf("%s.%09luZ peer %u log %u size %u : ", stamp,
+         (unsigned long) (record->time % 1000000000ULL), record->peer,
+         record->log, record->size);
+  for ( i = 0; i < record->size; i++ ) {
+    if ( isprint(data[i]) && data[i] != '\\' )
+      putchar(data[i]);
+    else
+      printf("\\x%02x", data[i]);
+  }
+  putchar('\n');
+}
+
+/******************************************************************************
+ * Lecture d'un journal écrit par tcp-server-cli -J : affiche les
+ * enregistrements de tous les segments, dans l'ordre, à partir d'un instant
+ * trouvé par dichotomie sur les index (journal_seek) sans lire ce qui
+ * précède.
+ * Paramètres :
+ *     - dir      Répertoire du journal.
+ *     - since    Instant de départ, optionnel : secondes depuis l'époque
+ *                  (décimales admises), ou secondes avant maintenant si
+ *                  négatif ("-60" : la dernière minute).
+ *****************************************************************************/
+int main(int argc, char *argv[]) {
+  struct journal_reader reader;
+  struct journal_record *record;
+  unsigned long long records = 0;
+  uint64_t since = 0;
+
+  if ( argc < 2 || argc > 3
+       || (argc == 3 && since_parse(argv[2], &since) == -1) ) {
+    fprintf(stderr, "Usage: %s dir [since]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if ( journal_reader_open(&reader, argv[1]) == -1 ) {
+    perror("Error with journal_reader_open");
+    exit(EXIT_FAILURE);
+  }
+  if ( argc == 3 && journal_seek(&reader, since) == -1 ) {
+    fprintf(stderr, "Journal %s is empty\n", argv[1]);
+    journal_reader_close(&reader);
+    exit(EXIT_FAILURE);
+  }
+
+  while ( (record = journal_next(&reader)) != NULL ) {
+    record_print(record);
+    records++;
+  }
+  fprintf(stderr, "Records : %llu in %d segments\n", records, reader.count);
+  journal_reader_close(&reader);
+
+  exit(EXIT_SUCCESS);
+}
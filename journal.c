@@ -0,0 +1,831 @@
+/******************************************************************************
+ *
+ * Name File : journal.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_RETRY_MS 100	/* Pause avant de réessayer une écriture */
+#define JOURNAL_FAIL_MS 5000	/* Échecs au-delà desquels le journal est
+				   désactivé */
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes.
+ *****************************************************************************/
+static uint64_t journal_now(clockid_t clock) {
+  struct timespec now;
+
+  clock_gettime(clock, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie la taille d'un enregistrement, complétée à 8 octets.
+ *****************************************************************************/
+static size_t journal_record_size(uint16_t size) {
+  return (sizeof(struct journal_record) + size + 7) & ~(size_t) 7;
+}
+
+/******************************************************************************
+ * Fonction qui calcule l'empreinte d'un enregistrement (FNV-1a 32 bits), son
+ * champ check compté nul.
+ *****************************************************************************/
+static uint32_t journal_checksum(struct journal_record *record) {
+  struct journal_record header = *record;
+  const unsigned char *bytes;
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  header.check = 0;
+  bytes = (const unsigned char *) &header;
+  for ( i = 0; i < sizeof(header); i++ ) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  bytes = (const unsigned char *) (record + 1);
+  for ( i = 0; i < record->size; i++ ) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/******************************************************************************
+ * Fonction qui construit le chemin d'un fichier du journal.
+ *****************************************************************************/
+static void journal_path(char *path, size_t size, const char *dir,
+                         uint32_t segment, const char *suffix) {
+  snprintf(path, size, "%s/journal-%08u.%s", dir, segment, suffix);
+}
+
+/******************************************************************************
+ * Fonction qui liste les segments d'un répertoire de journal.
+ * Prend en paramètre :
+ *     - dir         Répertoire du journal.
+ *     - segments    Pointeur vers le tableau alloué des numéros, croissants.
+ * Renvoie le nombre de segments, -1 en cas d'erreur.
+ *****************************************************************************/
+static int journal_list(const char *dir, uint32_t **segments) {
+  struct dirent *entry;
+  uint32_t number, *list = NULL, *grown, swap;
+  int count = 0, capacity = 0, i, j;
+  char suffix[8];
+  DIR *handle;
+
+  if ( (handle = opendir(dir)) == NULL )
+    return -1;
+  while ( (entry = readdir(handle)) != NULL ) {
+    if ( sscanf(entry->d_name, "journal-%8u.%7s", &number, suffix) != 2
+         || strcmp(suffix, "log") != 0 )
+      continue;
+    if ( count == capacity ) {
+      capacity = capacity == 0 ? 16 : 2 * capacity;
+      if ( (grown = realloc(list, capacity * sizeof(*list))) == NULL ) {
+        free(list);
+        closedir(handle);
+        return -1;
+      }
+      list = grown;
+    }
+    list[count++] = number;
+  }
+  closedir(handle);
+
+  /* Peu de segments : un tri par insertion suffit */
+  for ( i = 1; i < count; i++ ) {
+    for ( j = i; j > 0 && list[j - 1] > list[j]; j-- ) {
+      swap = list[j];
+      list[j] = list[j - 1];
+      list[j - 1] = swap;
+    }
+  }
+  *segments = list;
+  return count;
+}
+
+/******************************************************************************
+ * Fonction qui ferme le segment courant et ouvre le suivant : préalloué
+ * (fallocate) pour que les écritures ne modifient pas les métadonnées du
+ * fichier, ouvert en écriture directe (O_DIRECT) et synchrone (O_DSYNC) pour
+ * qu'une écriture terminée soit durable, sans fsync. Sans segment ouvert
+ * (échec précédent), le même segment est retenté.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+static int journal_rotate(struct journal *journal) {
+  struct journal_segment *header;
+  char path[4096];
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DSYNC;
+
+  if ( journal->fd != -1 ) {
+    close(journal->fd);
+    close(journal->indexFd);
+    journal->fd = -1;
+    journal->indexFd = -1;
+    journal->segment++;
+  }
+
+  journal_path(path, sizeof(path), journal->dir, journal->segment, "log");
+  journal->fd = open(path, flags | (journal->direct ? O_DIRECT : 0), 0644);
+  if ( journal->fd == -1 && journal->direct && errno == EINVAL ) {
+    /* Système de fichiers sans écriture directe (tmpfs) */
+    journal->direct = 0;
+    journal->fd = open(path, flags, 0644);
+  }
+  if ( journal->fd == -1 ) {
+    if ( !journal->failed )
+      perror("Error with open");
+    return -1;
+  }
+  if ( fallocate(journal->fd, 0, 0, JOURNAL_SEGMENT_SIZE) == -1
+       && errno != EOPNOTSUPP && !journal->failed )
+    perror("Error with fallocate");
+
+  journal_path(path, sizeof(path), journal->dir, journal->segment, "idx");
+  journal->indexFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND
+                          | O_CLOEXEC, 0644);
+  if ( journal->indexFd == -1 && !journal->failed )
+    perror("Error with open");
+
+  /* Le dernier bloc partiel du segment précédent n'a plus lieu d'être */
+  memset(journal->staging, 0, JOURNAL_BLOCK_SIZE);
+  header = (struct journal_segment *) journal->staging;
+  memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  header->version = JOURNAL_VERSION;
+  header->number = journal->segment;
+  header->startTime = journal_now(CLOCK_REALTIME);
+  header->size = JOURNAL_SEGMENT_SIZE;
+  if ( pwrite(journal->fd, journal->staging, JOURNAL_BLOCK_SIZE, 0)
+       != JOURNAL_BLOCK_SIZE ) {
+    if ( !journal->failed )
+      perror("Error with pwrite");
+    close(journal->fd);
+    journal->fd = -1;
+    if ( journal->indexFd != -1 )
+      close(journal->indexFd);
+    journal->indexFd = -1;
+    return -1;
+  }
+  memset(journal->staging, 0, JOURNAL_BLOCK_SIZE);
+  journal->offset = JOURNAL_BLOCK_SIZE;
+  journal->fill = 0;
+  journal->indexed = 0;
+  journal->segments++;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui écrit le tampon du rédacteur dans le segment. Les écritures
+ * directes portent sur des blocs entiers : le dernier bloc, partiel, est
+ * complété de zéros puis gardé en tête du tampon pour être réécrit, complété,
+ * à la validation suivante.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+static int journal_write(struct journal *journal) {
+  size_t length, aligned;
+
+  length = (journal->fill + JOURNAL_BLOCK_SIZE - 1)
+           & ~(size_t) (JOURNAL_BLOCK_SIZE - 1);
+  aligned = journal->fill & ~(size_t) (JOURNAL_BLOCK_SIZE - 1);
+  memset(journal->staging + journal->fill, 0, length - journal->fill);
+  if ( journal->fd == -1
+       || pwrite(journal->fd, journal->staging, length, journal->offset)
+          != (ssize_t) length ) {
+    if ( !journal->failed )
+      perror("Error with journal write");
+    journal->failed = 1;
+    journal->errors++;
+    return -1;
+  }
+  journal->failed = 0;
+
+  memmove(journal->staging, journal->staging + aligned, journal->fill - aligned);
+  journal->offset += aligned;
+  journal->fill -= aligned;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui retire les enregistrements du tampon d'un worker et les copie
+ * dans le tampon du rédacteur, le verrou du worker tenu le temps d'une copie.
+ * Une entrée d'index est ajoutée tous les JOURNAL_INDEX_BYTES octets, datée
+ * d'avant la copie : tout ce qui la précède dans le segment est antérieur.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ *     - log        Pointeur vers le tampon du worker.
+ * Renvoie 0 si le tampon est vide, 1 s'il faut d'abord écrire (tampon du
+ * rédacteur ou segment plein), 2 si des enregistrements ont été copiés.
+ *****************************************************************************/
+static int journal_collect(struct journal *journal, struct journal_log *log) {
+  struct journal_index entry;
+  struct journal_record *record;
+  size_t start, position;
+
+  entry.time = journal_now(CLOCK_REALTIME);
+  pthread_mutex_lock(&log->lock);
+  if ( log->used == 0 ) {
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+  }
+  if ( journal->fill + log->used > JOURNAL_STAGING
+       || journal->offset + journal->fill + log->used > JOURNAL_SEGMENT_SIZE ) {
+    pthread_mutex_unlock(&log->lock);
+    return 1;
+  }
+  start = journal->fill;
+  memcpy(journal->staging + start, log->buffer, log->used);
+  journal->fill += log->used;
+  journal->bytes += log->used;
+  log->staged = log->appended;
+  log->used = 0;
+  pthread_cond_broadcast(&log->space);
+  pthread_mutex_unlock(&log->lock);
+
+  /* Empreintes calculées ici plutôt que dans le chemin critique */
+  for ( position = start; position < journal->fill;
+        position += journal_record_size(record->size) ) {
+    record = (struct journal_record *) (journal->staging + position);
+    record->check = journal_checksum(record);
+    journal->records++;
+  }
+
+  entry.offset = journal->offset + start;
+  if ( journal->indexFd != -1 && (journal->indexed == 0
+       || entry.offset - journal->indexed >= JOURNAL_INDEX_BYTES) ) {
+    if ( write(journal->indexFd, &entry, sizeof(entry)) != sizeof(entry) )
+      perror("Error with write");
+    journal->indexed = entry.offset;
+  }
+  return 2;
+}
+
+/******************************************************************************
+ * Fonction qui valide un groupe : tous les enregistrements en attente dans
+ * les tampons des workers sont écrits d'un coup, puis chaque worker apprend
+ * jusqu'où ses enregistrements sont durables. Un segment qui n'a pas pu
+ * être ouvert est d'abord retenté.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ *     - count      Nombre de tampons de workers.
+ * Renvoie 0, -1 si l'écriture a échoué.
+ *****************************************************************************/
+static int journal_batch(struct journal *journal, int count) {
+  struct journal_log *log;
+  uint64_t start, elapsed, one = 1;
+  int i, status, copied = 0;
+
+  start = journal_now(CLOCK_MONOTONIC);
+  if ( journal->fd == -1 && journal_rotate(journal) == -1 ) {
+    journal->failed = 1;
+    journal->errors++;
+    return -1;
+  }
+  for ( i = 0; i < count; i++ ) {
+    while ( (status = journal_collect(journal, journal->logs[i])) == 1 ) {
+      if ( journal_write(journal) == -1 )
+        return -1;
+      if ( journal->offset + journal->fill + JOURNAL_LOG_BUFFER
+           > JOURNAL_SEGMENT_SIZE && journal_rotate(journal) == -1 ) {
+        journal->failed = 1;
+        journal->errors++;
+        return -1;
+      }
+    }
+    copied |= status == 2;
+  }
+  /* Après un échec, les enregistrements restés dans le tampon sont réécrits
+     même sans nouvel ajout */
+  if ( !copied && !journal->failed )
+    return 0;
+  if ( journal_write(journal) == -1 )
+    return -1;
+
+  for ( i = 0; i < count; i++ ) {
+    log = journal->logs[i];
+    if ( log->staged == log->committed )
+      continue;
+    __atomic_store_n(&log->committed, log->staged, __ATOMIC_RELEASE);
+    if ( log->notify != -1 && write(log->notify, &one, sizeof(one)) == -1 )
+      perror("Error with write");
+  }
+
+  elapsed = journal_now(CLOCK_MONOTONIC) - start;
+  journal->batches++;
+  journal->commitTime += elapsed;
+  if ( elapsed > journal->commitMax )
+    journal->commitMax = elapsed;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui désactive un journal en échec depuis JOURNAL_FAIL_MS : les
+ * enregistrements non durables sont perdus, les tampons vidés et les workers
+ * réveillés, qu'un tampon plein ne bloque plus. Les ajouts suivants sont
+ * abandonnés et comptés.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ *     - count      Nombre de tampons de workers.
+ *****************************************************************************/
+static void journal_disable(struct journal *journal, int count) {
+  struct journal_log *log;
+  uint64_t one = 1;
+  int i;
+
+  fprintf(stderr, "Journal %s disabled after %d ms of write errors\n",
+          journal->dir, JOURNAL_FAIL_MS);
+  __atomic_store_n(&journal->disabled, 1, __ATOMIC_RELEASE);
+  for ( i = 0; i < count; i++ ) {
+    log = journal->logs[i];
+    pthread_mutex_lock(&log->lock);
+    __atomic_fetch_add(&journal->dropped, log->appended - log->committed,
+                       __ATOMIC_RELAXED);
+    log->used = 0;
+    pthread_cond_broadcast(&log->space);
+    pthread_mutex_unlock(&log->lock);
+    if ( log->notify != -1 && write(log->notify, &one, sizeof(one)) == -1 )
+      perror("Error with write");
+  }
+}
+
+/******************************************************************************
+ * Thread rédacteur : attend des enregistrements et les valide par groupes.
+ * Les enregistrements ajoutés pendant une écriture attendent la suivante,
+ * ce qui fait grossir les groupes avec la charge. À l'arrêt, tout ce qui est
+ * en attente est validé. Une écriture en échec est retentée toutes les
+ * JOURNAL_RETRY_MS, jusqu'à la désactivation du journal.
+ * Prend en paramètre :
+ *     - arg    Pointeur vers le journal.
+ *****************************************************************************/
+static void *journal_run(void *arg) {
+  struct journal *journal = arg;
+  struct timespec pause;
+  uint64_t now;
+  int running, count;
+
+  do {
+    pthread_mutex_lock(&journal->lock);
+    while ( !journal->pending && journal->running )
+      pthread_cond_wait(&journal->wake, &journal->lock);
+    journal->pending = 0;
+    running = journal->running;
+    count = journal->logCount;
+    pthread_mutex_unlock(&journal->lock);
+
+    if ( journal->disabled )
+      continue;
+    if ( journal_batch(journal, count) == 0 ) {
+      journal->failingSince = 0;
+      continue;
+    }
+    now = journal_now(CLOCK_MONOTONIC);
+    if ( journal->failingSince == 0 )
+      journal->failingSince = now;
+    if ( now - journal->failingSince >= JOURNAL_FAIL_MS * 1000000ULL ) {
+      journal_disable(journal, count);
+      continue;
+    }
+    if ( running ) {
+      pause.tv_sec = 0;
+      pause.tv_nsec = JOURNAL_RETRY_MS * 1000000L;
+      nanosleep(&pause, NULL);
+      pthread_mutex_lock(&journal->lock);
+      journal->pending = 1;
+      pthread_mutex_unlock(&journal->lock);
+    }
+  } while ( running );
+  return NULL;
+}
+
+/******************************************************************************
+ * Fonction qui réveille le rédacteur.
+ *****************************************************************************/
+static void journal_wake(struct journal *journal) {
+  pthread_mutex_lock(&journal->lock);
+  journal->pending = 1;
+  pthread_cond_signal(&journal->wake);
+  pthread_mutex_unlock(&journal->lock);
+}
+
+/******************************************************************************
+ * Fonction qui ouvre un journal et lance son rédacteur. Les segments déjà
+ * présents sont gardés, la numérotation reprend après le dernier.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ *     - dir        Répertoire des segments, créé au besoin.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+int journal_open(struct journal *journal, const char *dir) {
+  uint32_t *segments = NULL;
+  int count;
+
+  memset(journal, 0, sizeof(*journal));
+  journal->fd = -1;
+  journal->indexFd = -1;
+  journal->direct = 1;
+  if ( mkdir(dir, 0755) == -1 && errno != EEXIST )
+    return -1;
+  if ( (count = journal_list(dir, &segments)) == -1 )
+    return -1;
+  if ( count > 0 )
+    journal->segment = segments[count - 1] + 1;
+  free(segments);
+
+  if ( (journal->dir = strdup(dir)) == NULL )
+    return -1;
+  if ( posix_memalign((void **) &journal->staging, JOURNAL_BLOCK_SIZE,
+                      JOURNAL_STAGING) != 0 ) {
+    free(journal->dir);
+    return -1;
+  }
+  if ( journal_rotate(journal) == -1 ) {
+    free(journal->staging);
+    free(journal->dir);
+    return -1;
+  }
+
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->wake, NULL);
+  journal->running = 1;
+  if ( pthread_create(&journal->thread, NULL, journal_run, journal) != 0 ) {
+    close(journal->fd);
+    close(journal->indexFd);
+    free(journal->staging);
+    free(journal->dir);
+    return -1;
+  }
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui ajoute le tampon d'un worker au journal.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ *     - notify     eventfd signalé à chaque validation, ou -1 ; il est fermé
+ *                    par journal_close.
+ * Renvoie le tampon, NULL en cas d'erreur.
+ *****************************************************************************/
+struct journal_log *journal_log_open(struct journal *journal, int notify) {
+  struct journal_log *log;
+
+  if ( (log = calloc(1, sizeof(*log))) == NULL )
+    return NULL;
+  if ( (log->buffer = malloc(JOURNAL_LOG_BUFFER)) == NULL ) {
+    free(log);
+    return NULL;
+  }
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->space, NULL);
+  log->notify = notify;
+  log->journal = journal;
+
+  pthread_mutex_lock(&journal->lock);
+  if ( journal->logCount == JOURNAL_MAX_LOGS ) {
+    pthread_mutex_unlock(&journal->lock);
+    free(log->buffer);
+    free(log);
+    return NULL;
+  }
+  log->index = journal->logCount;
+  journal->logs[journal->logCount++] = log;
+  pthread_mutex_unlock(&journal->lock);
+  return log;
+}
+
+/******************************************************************************
+ * Fonction qui ajoute un message au journal. Le chemin critique se limite à
+ * une lecture de l'horloge et une copie dans le tampon du worker ; il n'attend
+ * le rédacteur que si le tampon est plein.
+ * Prend en paramètre :
+ *     - log     Pointeur vers le tampon du worker.
+ *     - peer    Identifiant du client.
+ *     - data    Contenu du message.
+ *     - size    Taille du message.
+ * Renvoie le numéro de l'enregistrement dans le tampon, à comparer à
+ * journal_committed, 0 si le journal est désactivé.
+ *****************************************************************************/
+uint64_t journal_append(struct journal_log *log, uint32_t peer,
+                        const char *data, uint16_t size) {
+  size_t length = journal_record_size(size);
+  struct journal_record *record;
+  uint64_t sequence;
+  int wasEmpty;
+
+  pthread_mutex_lock(&log->lock);
+  while ( log->used + length > JOURNAL_LOG_BUFFER
+          && !journal_disabled(log->journal) ) {
+    journal_wake(log->journal);
+    pthread_cond_wait(&log->space, &log->lock);
+  }
+  if ( journal_disabled(log->journal) ) {
+    pthread_mutex_unlock(&log->lock);
+    __atomic_fetch_add(&log->journal->dropped, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  record = (struct journal_record *) (log->buffer + log->used);
+  memset(record, 0, length);
+  record->time = journal_now(CLOCK_REALTIME);
+  record->peer = peer;
+  record->size = size;
+  record->log = log->index;
+  memcpy(record + 1, data, size);
+  wasEmpty = log->used == 0;
+  log->used += length;
+  sequence = ++log->appended;
+  pthread_mutex_unlock(&log->lock);
+
+  /* Le rédacteur n'est réveillé que pour le premier enregistrement d'un
+     groupe, les suivants partent avec lui */
+  if ( wasEmpty )
+    journal_wake(log->journal);
+  return sequence;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le numéro du dernier enregistrement durable d'un
+ * tampon de worker.
+ * Prend en paramètre :
+ *     - log    Pointeur vers le tampon du worker.
+ *****************************************************************************/
+uint64_t journal_committed(struct journal_log *log) {
+  return __atomic_load_n(&log->committed, __ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+ * Fonction qui indique si le journal a été désactivé après des échecs
+ * persistants.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ *****************************************************************************/
+int journal_disabled(struct journal *journal) {
+  return __atomic_load_n(&journal->disabled, __ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+ * Fonction qui affiche les statistiques du journal.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ *****************************************************************************/
+void journal_print(struct journal *journal) {
+  printf("Journal : records %llu, bytes %llu, commits %lu (%.1f records, "
+         "%.1f us avg, %.1f us max), segments %lu, errors %lu, %s\n",
+         journal->records, journal->bytes, journal->batches,
+         journal->batches > 0 ? (double) journal->records / journal->batches : 0,
+         journal->batches > 0 ? journal->commitTime / 1e3 / journal->batches : 0,
+         journal->commitMax / 1e3, journal->segments, journal->errors,
+         journal->direct ? "O_DIRECT" : "buffered");
+  if ( journal_disabled(journal) )
+    printf("Journal disabled after write errors, records dropped %llu\n",
+           __atomic_load_n(&journal->dropped, __ATOMIC_RELAXED));
+}
+
+/******************************************************************************
+ * Fonction qui arrête le rédacteur après une dernière validation, puis ferme
+ * le journal. Les statistiques restent lisibles.
+ * Prend en paramètre :
+ *     - journal    Pointeur vers le journal.
+ *****************************************************************************/
+void journal_close(struct journal *journal) {
+  struct journal_log *log;
+  int i;
+
+  pthread_mutex_lock(&journal->lock);
+  journal->running = 0;
+  pthread_cond_signal(&journal->wake);
+  pthread_mutex_unlock(&journal->lock);
+  pthread_join(journal->thread, NULL);
+
+  for ( i = 0; i < journal->logCount; i++ ) {
+    log = journal->logs[i];
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->space);
+    if ( log->notify != -1 )
+      close(log->notify);
+    free(log->buffer);
+    free(log);
+  }
+  journal->logCount = 0;
+  if ( journal->fd != -1 )
+    close(journal->fd);
+  if ( journal->indexFd != -1 )
+    close(journal->indexFd);
+  pthread_mutex_destroy(&journal->lock);
+  pthread_cond_destroy(&journal->wake);
+  free(journal->staging);
+  free(journal->dir);
+}
+
+/******************************************************************************
+ * Fonction qui ouvre un journal en lecture, placé sur son premier
+ * enregistrement.
+ * Prend en paramètre :
+ *     - reader    Pointeur vers la lecture à initialiser.
+ *     - dir       Répertoire du journal.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+int journal_reader_open(struct journal_reader *reader, const char *dir) {
+  memset(reader, 0, sizeof(*reader));
+  if ( (reader->count = journal_list(dir, &reader->segments)) == -1 )
+    return -1;
+  if ( (reader->dir = strdup(dir)) == NULL ) {
+    free(reader->segments);
+    return -1;
+  }
+  reader->offset = JOURNAL_BLOCK_SIZE;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui lit l'index d'un segment.
+ * Prend en paramètre :
+ *     - reader     Pointeur vers la lecture.
+ *     - segment    Rang du segment.
+ *     - index      Pointeur vers le tableau alloué des entrées.
+ * Renvoie le nombre d'entrées, 0 si l'index est absent ou vide.
+ *****************************************************************************/
+static size_t journal_index_read(struct journal_reader *reader, int segment,
+                                 struct journal_index **index) {
+  char path[4096];
+  struct stat status;
+  ssize_t length;
+  int fd;
+
+  *index = NULL;
+  journal_path(path, sizeof(path), reader->dir, reader->segments[segment],
+               "idx");
+  if ( (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 )
+    return 0;
+  if ( fstat(fd, &status) == -1 || status.st_size < (off_t) sizeof(**index)
+       || (*index = malloc(status.st_size)) == NULL ) {
+    close(fd);
+    return 0;
+  }
+  length = read(fd, *index, status.st_size);
+  close(fd);
+  if ( length < (ssize_t) sizeof(**index) ) {
+    free(*index);
+    *index = NULL;
+    return 0;
+  }
+  return length / sizeof(**index);
+}
+
+/******************************************************************************
+ * Fonction qui place la lecture avant le premier enregistrement postérieur
+ * ou égal à un instant : le segment puis la position sont trouvés par
+ * dichotomie sur les index, sans lire les enregistrements qui précèdent.
+ * Prend en paramètre :
+ *     - reader    Pointeur vers la lecture.
+ *     - time      Instant CLOCK_REALTIME en ns.
+ * Renvoie 0, -1 si le journal est vide.
+ *****************************************************************************/
+int journal_seek(struct journal_reader *reader, uint64_t time) {
+  struct journal_index *index;
+  size_t entries, low, high, middle;
+  int segment, later, chosen = 0;
+
+  if ( reader->count == 0 )
+    return -1;
+  if ( reader->map != NULL )
+    munmap(reader->map, reader->mapSize);
+  reader->map = NULL;
+
+  /* Dernier segment dont la première entrée d'index précède l'instant */
+  for ( segment = 0; segment < reader->count; segment++ ) {
+    entries = journal_index_read(reader, segment, &index);
+    later = entries > 0 && index[0].time > time;
+    free(index);
+    if ( later )
+      break;
+    if ( entries > 0 )
+      chosen = segment;
+  }
+
+  reader->current = chosen;
+  reader->offset = JOURNAL_BLOCK_SIZE;
+  reader->from = time;
+  entries = journal_index_read(reader, chosen, &index);
+  low = 0;
+  high = entries;
+  while ( low < high ) {
+    middle = (low + high) / 2;
+    if ( index[middle].time <= time )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if ( low > 0 )
+    reader->offset = index[low - 1].offset;
+  free(index);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui projette le segment courant en mémoire.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+static int journal_reader_map(struct journal_reader *reader) {
+  struct journal_segment *header;
+  struct stat status;
+  char path[4096];
+  int fd;
+
+  journal_path(path, sizeof(path), reader->dir,
+               reader->segments[reader->current], "log");
+  if ( (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 )
+    return -1;
+  if ( fstat(fd, &status) == -1 || status.st_size < JOURNAL_BLOCK_SIZE ) {
+    close(fd);
+    return -1;
+  }
+  reader->mapSize = status.st_size;
+  reader->map = mmap(NULL, reader->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if ( reader->map == MAP_FAILED ) {
+    reader->map = NULL;
+    return -1;
+  }
+  header = (struct journal_segment *) reader->map;
+  if ( memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0
+       || header->version != JOURNAL_VERSION ) {
+    munmap(reader->map, reader->mapSize);
+    reader->map = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'enregistrement suivant, segment après segment. Un
+ * segment s'arrête à son premier enregistrement nul ou invalide.
+ * Prend en paramètre :
+ *     - reader    Pointeur vers la lecture.
+ * Renvoie l'enregistrement, suivi du message, NULL à la fin du journal.
+ *****************************************************************************/
+struct journal_record *journal_next(struct journal_reader *reader) {
+  struct journal_record *record;
+  size_t length;
+
+  while ( reader->current < reader->count ) {
+    if ( reader->map == NULL && journal_reader_map(reader) == -1 ) {
+      reader->current++;
+      reader->offset = JOURNAL_BLOCK_SIZE;
+      continue;
+    }
+
+    if ( reader->offset + sizeof(*record) <= reader->mapSize ) {
+      record = (struct journal_record *) (reader->map + reader->offset);
+      length = journal_record_size(record->size);
+      if ( record->time != 0 && reader->offset + length <= reader->mapSize
+           && record->check == journal_checksum(record) ) {
+        reader->offset += length;
+        /* Les workers s'entrelacent : quelques enregistrements qui suivent
+           l'entrée d'index peuvent la précéder */
+        if ( record->time < reader->from )
+          continue;
+        return record;
+      }
+    }
+
+    munmap(reader->map, reader->mapSize);
+    reader->map = NULL;
+    reader->current++;
+    reader->offset = JOURNAL_BLOCK_SIZE;
+  }
+  return NULL;
+}
+
+/******************************************************************************
+ * Fonction qui ferme la lecture d'un journal.
+ * Prend en paramètre :
+ *     - reader    Pointeur vers la lecture.
+ *****************************************************************************/
+void journal_reader_close(struct journal_reader *reader) {
+  if ( reader->map != NULL )
+    munmap(reader->map, reader->mapSize);
+  free(reader->segments);
+  free(reader->dir);
+}
@@ -0,0 +1,142 @@
+/******************************************************************************
+ *
+ * Name File : journal.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Journal : répertoire de segments 'journal-NNNNNNNN.log', chacun préalloué,
+   avec un en-tête de JOURNAL_BLOCK_SIZE octets puis les enregistrements, et
+   son index 'journal-NNNNNNNN.idx' : des couples (instant, position) tels que
+   tous les enregistrements qui suivent la position sont postérieurs à
+   l'instant, et tous ceux qui la précèdent antérieurs. */
+#define JOURNAL_MAGIC "ECHOJRN"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BLOCK_SIZE 4096		/* Alignement des écritures directes */
+#define JOURNAL_SEGMENT_SIZE (64UL << 20)	/* Rotation des segments : 64 Mio */
+#define JOURNAL_LOG_BUFFER (256UL << 10)	/* Tampon d'un worker : 256 Kio */
+#define JOURNAL_STAGING (1UL << 20)	/* Tampon d'écriture du rédacteur */
+#define JOURNAL_INDEX_BYTES 65536	/* Écart minimal entre deux entrées */
+#define JOURNAL_MAX_LOGS 256		/* Workers au plus */
+#define JOURNAL_MAX_MESSAGE 65535
+
+/* En-tête d'un segment */
+struct journal_segment {
+  char magic[8];
+  uint32_t version;
+  uint32_t number;		/* numéro du segment */
+  uint64_t startTime;		/* CLOCK_REALTIME de l'ouverture, en ns */
+  uint64_t size;		/* taille préallouée */
+};
+
+/* Enregistrement, suivi du message complété à un multiple de 8 octets. Un
+   enregistrement nul marque la fin des données ; une empreinte fausse, une
+   écriture interrompue */
+struct journal_record {
+  uint64_t time;		/* CLOCK_REALTIME de l'ajout, en ns */
+  uint32_t check;		/* FNV-1a de l'enregistrement, check nul */
+  uint32_t peer;		/* identifiant du client */
+  uint16_t size;		/* taille du message */
+  uint16_t log;			/* worker qui l'a reçu */
+  uint32_t reserved;
+};
+
+/* Entrée de l'index d'un segment */
+struct journal_index {
+  uint64_t time;
+  uint64_t offset;		/* position dans le segment */
+};
+
+struct journal;
+
+/* Tampon d'ajout d'un worker : le chemin critique y copie ses
+   enregistrements, le rédacteur les en retire à chaque validation */
+struct journal_log {
+  pthread_mutex_t lock;
+  pthread_cond_t space;		/* signalée quand le tampon est vidé */
+  char *buffer;
+  size_t used;
+  uint64_t appended;		/* enregistrements ajoutés */
+  uint64_t staged;		/* enregistrements de la validation en cours */
+  uint64_t committed;		/* enregistrements durables, lu sans verrou */
+  int notify;			/* eventfd signalé à chaque validation, ou -1 */
+  int index;
+  struct journal *journal;
+};
+
+/* Journal et son thread rédacteur, qui valide par groupes : tous les
+   enregistrements arrivés pendant une écriture partent avec la suivante */
+struct journal {
+  char *dir;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int running;
+  int pending;			/* des tampons ont des enregistrements */
+  struct journal_log *logs[JOURNAL_MAX_LOGS];
+  int logCount;
+  /* Rédacteur */
+  int fd;			/* segment courant */
+  int indexFd;
+  int direct;			/* O_DIRECT accepté par le système de fichiers */
+  uint32_t segment;
+  uint64_t offset;		/* position de staging[0] dans le segment */
+  char *staging;		/* aligné, commence par le dernier bloc partiel */
+  size_t fill;
+  uint64_t indexed;		/* position de la dernière entrée d'index */
+  int failed;			/* dernière écriture en échec */
+  uint64_t failingSince;	/* début des échecs en cours, 0 sinon */
+  int disabled;			/* échecs persistants : plus rien n'est écrit,
+				   les ajouts sont abandonnés */
+  unsigned long long dropped;	/* enregistrements perdus à la désactivation
+				   ou abandonnés depuis */
+  /* Statistiques */
+  unsigned long long records;
+  unsigned long long bytes;
+  unsigned long batches;
+  unsigned long segments;
+  unsigned long errors;
+  uint64_t commitTime;		/* durée cumulée des écritures, en ns */
+  uint64_t commitMax;
+};
+
+/* Lecture d'un journal */
+struct journal_reader {
+  char *dir;
+  uint32_t *segments;		/* numéros des segments, croissants */
+  int count;
+  int current;
+  char *map;			/* segment courant projeté en mémoire */
+  size_t mapSize;
+  size_t offset;
+  uint64_t from;		/* enregistrements antérieurs ignorés */
+};
+
+int journal_open(struct journal *journal, const char *dir);
+struct journal_log *journal_log_open(struct journal *journal, int notify);
+uint64_t journal_append(struct journal_log *log, uint32_t peer,
+                        const char *data, uint16_t size);
+uint64_t journal_committed(struct journal_log *log);
+int journal_disabled(struct journal *journal);
+void journal_print(struct journal *journal);
+void journal_close(struct journal *journal);
+
+int journal_reader_open(struct journal_reader *reader, const char *dir);
+int journal_seek(struct journal_reader *reader, uint64_t time);
+struct journal_record *journal_next(struct journal_reader *reader);
+void journal_reader_close(struct journal_reader *reader);
+
+#endif
@@ -0,0 +1,445 @@
+/******************************************************************************
+ *
+ * Name File : mux.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "mux.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* État d'un banc d'essai multiplexé */
+struct mux_bench_state {
+  uint64_t sentAt[MUX_WINDOW];	/* instant d'envoi, indexé par id */
+  uint64_t latencySum;
+  uint64_t latencyMax;
+  uint32_t lastId;		/* plus grand identifiant répondu */
+  unsigned long completed;
+  unsigned long outOfOrder;	/* réponses dépassées par une plus récente */
+  unsigned long errors;
+};
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+static uint64_t mux_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui écrit un en-tête de trame en ordre réseau.
+ * Prend en paramètre :
+ *     - header    Pointeur vers l'en-tête.
+ *     - buffer    Zone de MUX_HEADER_SIZE octets à remplir.
+ *****************************************************************************/
+void mux_encode(struct mux_header *header, unsigned char *buffer) {
+  uint16_t flags = htons(header->flags);
+  uint32_t id = htonl(header->id);
+  uint32_t length = htonl(header->length);
+
+  buffer[0] = header->version;
+  buffer[1] = header->opcode;
+  memcpy(buffer + 2, &flags, sizeof(flags));
+  memcpy(buffer + 4, &id, sizeof(id));
+  memcpy(buffer + 8, &length, sizeof(length));
+}
+
+/******************************************************************************
+ * Fonction qui lit un en-tête de trame.
+ * Prend en paramètre :
+ *     - buffer    Zone de MUX_HEADER_SIZE octets reçus.
+ *     - header    Pointeur vers l'en-tête à remplir.
+ * Renvoie 0 si l'en-tête est valide, -1 si la version n'est pas gérée ou si
+ * la charge utile dépasse MUX_MAX_PAYLOAD : le découpage en trames n'est
+ * alors plus fiable et la connexion doit être fermée.
+ *****************************************************************************/
+int mux_decode(const unsigned char *buffer, struct mux_header *header) {
+  uint16_t flags;
+  uint32_t id, length;
+
+  memcpy(&flags, buffer + 2, sizeof(flags));
+  memcpy(&id, buffer + 4, sizeof(id));
+  memcpy(&length, buffer + 8, sizeof(length));
+  header->version = buffer[0];
+  header->opcode = buffer[1];
+  header->flags = ntohs(flags);
+  header->id = ntohl(id);
+  header->length = ntohl(length);
+
+  if ( header->version != MUX_VERSION || header->length > MUX_MAX_PAYLOAD )
+    return -1;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui initialise un client multiplexé sur une connexion établie.
+ * Prend en paramètre :
+ *     - client    Pointeur vers le client.
+ *     - fd        Descripteur de la connexion.
+ *****************************************************************************/
+void mux_client_init(struct mux_client *client, int fd) {
+  memset(client, 0, sizeof(*client));
+  client->fd = fd;
+}
+
+/******************************************************************************
+ * Fonction qui réserve la place de la charge utile de la prochaine requête
+ * dans le tampon d'envoi, pour l'y écrire sans copie intermédiaire (par
+ * exemple en y recevant directement des données).
+ * Prend en paramètre :
+ *     - client    Pointeur vers le client.
+ *     - length    Taille maximale de la charge utile.
+ * Renvoie l'emplacement de la charge utile, NULL en cas d'erreur : errno vaut
+ * EAGAIN si la fenêtre ou le tampon d'envoi est plein, EMSGSIZE si la charge
+ * utile est trop grande.
+ *****************************************************************************/
+unsigned char *mux_prepare(struct mux_client *client, uint32_t length) {
+  if ( length > MUX_MAX_PAYLOAD ) {
+    errno = EMSGSIZE;
+    return NULL;
+  }
+  /* L'emplacement est encore pris par une requête plus ancienne, lente */
+  if ( client->requests[client->nextId & (MUX_WINDOW - 1)].pending
+       || MUX_BUFFER - client->outLen < MUX_HEADER_SIZE + length ) {
+    errno = EAGAIN;
+    return NULL;
+  }
+  return client->out + client->outLen + MUX_HEADER_SIZE;
+}
+
+/******************************************************************************
+ * Fonction qui valide la requête dont la charge utile a été écrite à
+ * l'emplacement renvoyé par mux_prepare. La requête part au prochain envoi.
+ * Prend en paramètre :
+ *     - client      Pointeur vers le client.
+ *     - opcode      Opération demandée.
+ *     - length      Taille de la charge utile écrite.
+ *     - callback    Fonction appelée avec la réponse.
+ *     - arg         Argument passé à callback.
+ * Renvoie l'identifiant de la requête.
+ *****************************************************************************/
+uint32_t mux_commit(struct mux_client *client, uint8_t opcode, uint32_t length,
+                    mux_callback callback, void *arg) {
+  struct mux_request *request;
+  struct mux_header header;
+
+  request = &client->requests[client->nextId & (MUX_WINDOW - 1)];
+  header.version = MUX_VERSION;
+  header.opcode = opcode;
+  header.flags = 0;
+  header.id = client->nextId++;
+  header.length = length;
+  mux_encode(&header, client->out + client->outLen);
+  client->outLen += MUX_HEADER_SIZE + length;
+
+  request->callback = callback;
+  request->arg = arg;
+  request->id = header.id;
+  request->pending = 1;
+  client->inFlight++;
+  return header.id;
+}
+
+/******************************************************************************
+ * Fonction qui prépare l'envoi d'une requête, sans attendre les précédentes.
+ * La requête part au prochain appel de mux_poll.
+ * Prend en paramètre :
+ *     - client      Pointeur vers le client.
+ *     - opcode      Opération demandée.
+ *     - payload     Charge utile.
+ *     - length      Taille de la charge utile.
+ *     - callback    Fonction appelée avec la réponse.
+ *     - arg         Argument passé à callback.
+ * Renvoie l'identifiant de la requête (31 bits de poids faible), -1 en cas
+ * d'erreur : errno vaut EAGAIN si la fenêtre ou le tampon d'envoi est plein
+ * (appeler mux_poll), EMSGSIZE si la charge utile est trop grande.
+ *****************************************************************************/
+int mux_submit(struct mux_client *client, uint8_t opcode, const void *payload,
+               uint32_t length, mux_callback callback, void *arg) {
+  unsigned char *buffer;
+
+  if ( (buffer = mux_prepare(client, length)) == NULL )
+    return -1;
+  memcpy(buffer, payload, length);
+  return (int) (mux_commit(client, opcode, length, callback, arg) & 0x7fffffff);
+}
+
+/******************************************************************************
+ * Fonction qui abandonne une requête en attente : sa réponse, si elle arrive,
+ * sera comptée comme inattendue.
+ * Prend en paramètre :
+ *     - client    Pointeur vers le client.
+ *     - id        Identifiant de la requête.
+ *****************************************************************************/
+void mux_cancel(struct mux_client *client, uint32_t id) {
+  struct mux_request *request = &client->requests[id & (MUX_WINDOW - 1)];
+
+  if ( request->pending && request->id == id ) {
+    request->pending = 0;
+    client->inFlight--;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui termine en échec toutes les requêtes en attente, après la
+ * perte de la connexion : leurs fonctions de rappel reçoivent un en-tête NULL.
+ * Les tampons sont vidés.
+ * Prend en paramètre :
+ *     - client    Pointeur vers le client.
+ *****************************************************************************/
+void mux_fail(struct mux_client *client) {
+  struct mux_request *request;
+  int i;
+
+  client->inLen = 0;
+  client->outLen = 0;
+  for ( i = 0; i < MUX_WINDOW && client->inFlight > 0; i++ ) {
+    request = &client->requests[i];
+    if ( !request->pending )
+      continue;
+    request->pending = 0;
+    client->inFlight--;
+    request->callback(client, request->arg, NULL, NULL);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui associe les trames reçues à leurs requêtes et appelle leurs
+ * fonctions de rappel, dans l'ordre d'arrivée des réponses.
+ * Prend en paramètre :
+ *     - client    Pointeur vers le client.
+ * Renvoie le nombre de réponses traitées, -1 si une trame est invalide.
+ *****************************************************************************/
+static int mux_dispatch(struct mux_client *client) {
+  struct mux_request *request;
+  struct mux_header header;
+  size_t offset = 0;
+  int completed = 0;
+
+  while ( client->inLen - offset >= MUX_HEADER_SIZE ) {
+    if ( mux_decode(client->in + offset, &header) == -1 ) {
+      errno = EPROTO;
+      return -1;
+    }
+    if ( client->inLen - offset < MUX_HEADER_SIZE + header.length )
+      break;
+
+    request = &client->requests[header.id & (MUX_WINDOW - 1)];
+    if ( request->pending && request->id == header.id
+         && (header.flags & MUX_FLAG_RESPONSE) ) {
+      request->pending = 0;
+      client->inFlight--;
+      request->callback(client, request->arg, &header,
+                        (char *) client->in + offset + MUX_HEADER_SIZE);
+      completed++;
+    } else {
+      client->unexpected++;
+    }
+    offset += MUX_HEADER_SIZE + header.length;
+  }
+
+  memmove(client->in, client->in + offset, client->inLen - offset);
+  client->inLen -= offset;
+  return completed;
+}
+
+/******************************************************************************
+ * Fonction qui envoie, sans bloquer, ce qui peut partir du tampon d'envoi.
+ * Prend en paramètre :
+ *     - client    Pointeur vers le client.
+ * Renvoie 0, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+int mux_flush(struct mux_client *client) {
+  ssize_t status;
+
+  if ( client->outLen == 0 )
+    return 0;
+  status = send(client->fd, client->out, client->outLen,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+  if ( status == -1 )
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  memmove(client->out, client->out + status, client->outLen - status);
+  client->outLen -= status;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui reçoit, sans bloquer, les réponses disponibles et appelle
+ * leurs fonctions de rappel.
+ * Prend en paramètre :
+ *     - client    Pointeur vers le client.
+ * Renvoie le nombre de réponses traitées, -1 en cas d'erreur ou de fermeture
+ * de la connexion (errno).
+ *****************************************************************************/
+int mux_receive(struct mux_client *client) {
+  ssize_t status;
+
+  status = recv(client->fd, client->in + client->inLen,
+                MUX_BUFFER - client->inLen, MSG_DONTWAIT);
+  if ( status == 0 ) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  if ( status == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+    return -1;
+  if ( status > 0 )
+    client->inLen += status;
+  return mux_dispatch(client);
+}
+
+/******************************************************************************
+ * Fonction qui envoie les requêtes préparées et traite les réponses reçues.
+ * Prend en paramètre :
+ *     - client     Pointeur vers le client.
+ *     - timeout    Attente maximale en millisecondes, comme poll.
+ * Renvoie le nombre de réponses traitées, -1 en cas d'erreur ou de fermeture
+ * de la connexion (errno).
+ *****************************************************************************/
+int mux_poll(struct mux_client *client, int timeout) {
+  struct pollfd pfd;
+
+  pfd.fd = client->fd;
+  pfd.events = POLLIN | (client->outLen > 0 ? POLLOUT : 0);
+  if ( poll(&pfd, 1, timeout) == -1 )
+    return errno == EINTR ? 0 : -1;
+
+  if ( (pfd.revents & POLLOUT) && mux_flush(client) == -1 )
+    return -1;
+  if ( pfd.revents & (POLLIN | POLLERR | POLLHUP) )
+    return mux_receive(client);
+  return mux_dispatch(client);
+}
+
+/******************************************************************************
+ * Fonction de rappel du banc d'essai : latence et ordre des réponses.
+ *****************************************************************************/
+static void mux_bench_complete(struct mux_client *client, void *arg,
+                               struct mux_header *header, char *payload) {
+  struct mux_bench_state *state = arg;
+  uint64_t latency;
+
+  (void) client;
+  (void) payload;
+  latency = mux_now() - state->sentAt[header->id & (MUX_WINDOW - 1)];
+  state->latencySum += latency;
+  if ( latency > state->latencyMax )
+    state->latencyMax = latency;
+  if ( state->completed > 0 && header->id < state->lastId )
+    state->outOfOrder++;
+  else
+    state->lastId = header->id;
+  if ( header->flags & MUX_FLAG_ERROR )
+    state->errors++;
+  state->completed++;
+}
+
+/******************************************************************************
+ * Fonction qui envoie 'count' requêtes sur une seule connexion en gardant
+ * 'depth' requêtes en vol. Avec un délai, une requête sur deux est différée
+ * par le serveur : les suivantes sont répondues avant elle.
+ * Prend en paramètre :
+ *     - fd       Descripteur de la connexion au serveur (option -m).
+ *     - count    Nombre de requêtes.
+ *     - depth    Requêtes en vol au plus (MUX_WINDOW au plus).
+ *     - delay    Délai en ms des requêtes différées, 0 : aucune.
+ *     - msg      Charge utile des requêtes.
+ * Renvoie 0 si toutes les réponses ont été reçues, -1 sinon.
+ *****************************************************************************/
+int mux_bench(int fd, long count, int depth, int delay, char *msg) {
+  struct mux_client *client;
+  struct mux_bench_state *state;
+  unsigned char payload[MUX_MAX_PAYLOAD];
+  uint32_t length, delayField;
+  uint64_t start, progress, now;
+  uint8_t opcode;
+  long submitted = 0;
+  double elapsed;
+  int status, result = 0;
+
+  client = malloc(sizeof(*client));
+  state = calloc(1, sizeof(*state));
+  if ( client == NULL || state == NULL ) {
+    perror("Error with malloc");
+    free(client);
+    return -1;
+  }
+  mux_client_init(client, fd);
+
+  length = strlen(msg);
+  if ( length > MUX_MAX_PAYLOAD - sizeof(delayField) )
+    length = MUX_MAX_PAYLOAD - sizeof(delayField);
+  delayField = htonl(delay);
+  memcpy(payload, &delayField, sizeof(delayField));
+  memcpy(payload + sizeof(delayField), msg, length);
+
+  start = progress = mux_now();
+  while ( state->completed < (unsigned long) count ) {
+    while ( submitted < count && client->inFlight < (unsigned int) depth ) {
+      opcode = delay > 0 && submitted % 2 == 0 ? MUX_OP_DELAY : MUX_OP_ECHO;
+      now = mux_now();
+      if ( opcode == MUX_OP_DELAY )
+        status = mux_submit(client, opcode, payload,
+                            length + sizeof(delayField),
+                            mux_bench_complete, state);
+      else
+        status = mux_submit(client, opcode, payload + sizeof(delayField),
+                            length, mux_bench_complete, state);
+      if ( status == -1 )
+        break;
+      /* Enregistré une fois la requête acceptée : un refus (EAGAIN) laisse
+         l'instant d'envoi de la requête qui occupe encore la place */
+      state->sentAt[status & (MUX_WINDOW - 1)] = now;
+      submitted++;
+    }
+
+    status = mux_poll(client, 100);
+    now = mux_now();
+    if ( status == -1 ) {
+      perror("Error with mux_poll");
+      result = -1;
+      break;
+    }
+    if ( status > 0 ) {
+      progress = now;
+    } else if ( now - progress > (uint64_t) MUX_TIMEOUT_MS * 1000000 ) {
+      fprintf(stderr, "No response for %d ms, %u requests lost.\n",
+              MUX_TIMEOUT_MS, client->inFlight);
+      result = -1;
+      break;
+    }
+  }
+  elapsed = (mux_now() - start) / 1e9;
+
+  printf("Multiplexed : %lu requests in %.6f s (%.0f req/s), depth %d\n",
+         state->completed, elapsed, state->completed / elapsed, depth);
+  if ( state->completed > 0 )
+    printf("Latency avg %.1f us, max %.1f us\n",
+           state->latencySum / 1e3 / state->completed,
+           state->latencyMax / 1e3);
+  printf("Out of order : %lu, errors : %lu, unexpected : %lu\n",
+         state->outOfOrder, state->errors, client->unexpected);
+
+  free(client);
+  free(state);
+  return result;
+}
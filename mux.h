@@ -0,0 +1,90 @@
+/******************************************************************************
+ *
+ * Name File : mux.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef MUX_H
+#define MUX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MUX_VERSION 1
+#define MUX_HEADER_SIZE 12	/* version, opcode, flags, id, length */
+#define MUX_MAX_PAYLOAD 4096
+#define MUX_FRAME_MAX (MUX_HEADER_SIZE + MUX_MAX_PAYLOAD)
+#define MUX_BUFFER 16384	/* Tampon de réception, et d'envoi */
+#define MUX_WINDOW 1024		/* Requêtes en vol au plus, puissance de 2 */
+#define MUX_TIMEOUT_MS 5000	/* Attente maximale d'une réponse */
+
+/* Opérations */
+#define MUX_OP_ECHO 1		/* renvoie la charge utile */
+#define MUX_OP_DELAY 2		/* idem après le délai en ms des 4 premiers
+				   octets de la charge utile */
+
+/* Drapeaux */
+#define MUX_FLAG_RESPONSE 0x0001
+#define MUX_FLAG_ERROR 0x0002	/* opération inconnue ou refusée */
+
+/* En-tête d'une trame, en ordre réseau sur le fil */
+struct mux_header {
+  uint8_t version;
+  uint8_t opcode;
+  uint16_t flags;
+  uint32_t id;			/* choisi par le client, repris par la réponse */
+  uint32_t length;		/* taille de la charge utile */
+};
+
+struct mux_client;
+
+/* Fonction appelée à la réception de la réponse d'une requête, avec un
+   en-tête NULL si la connexion est perdue avant (mux_fail) */
+typedef void (*mux_callback)(struct mux_client *client, void *arg,
+                             struct mux_header *header, char *payload);
+
+/* Requête en attente de sa réponse */
+struct mux_request {
+  mux_callback callback;
+  void *arg;
+  uint32_t id;
+  int pending;
+};
+
+/* Client multiplexé : requêtes indépendantes sur une seule connexion, les
+   réponses sont associées aux requêtes par leur identifiant */
+struct mux_client {
+  int fd;
+  uint32_t nextId;
+  unsigned int inFlight;
+  struct mux_request requests[MUX_WINDOW];	/* indexé par id */
+  unsigned char in[MUX_BUFFER];
+  size_t inLen;
+  unsigned char out[MUX_BUFFER];
+  size_t outLen;
+  unsigned long unexpected;	/* réponses sans requête en attente */
+};
+
+void mux_encode(struct mux_header *header, unsigned char *buffer);
+int mux_decode(const unsigned char *buffer, struct mux_header *header);
+void mux_client_init(struct mux_client *client, int fd);
+unsigned char *mux_prepare(struct mux_client *client, uint32_t length);
+uint32_t mux_commit(struct mux_client *client, uint8_t opcode, uint32_t length,
+                    mux_callback callback, void *arg);
+int mux_submit(struct mux_client *client, uint8_t opcode, const void *payload,
+               uint32_t length, mux_callback callback, void *arg);
+void mux_cancel(struct mux_client *client, uint32_t id);
+void mux_fail(struct mux_client *client);
+int mux_flush(struct mux_client *client);
+int mux_receive(struct mux_client *client);
+int mux_poll(struct mux_client *client, int timeout);
+int mux_bench(int fd, long count, int depth, int delay, char *msg);
+
+#endif
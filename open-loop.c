@@ -0,0 +1,474 @@
+/******************************************************************************
+ *
+ * Name File : open-loop.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "open-loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MSG_SIZE 80
+
+/* Requête envoyée, en attente de sa réponse */
+struct ol_request {
+  uint64_t seq;
+  uint64_t intended;		/* instant prévu par le calendrier */
+  uint64_t actual;		/* instant de l'envoi effectif */
+  int phase;
+  int used;
+};
+
+/* Statistiques d'une phase du calendrier */
+struct ol_phase_stats {
+  struct ol_histogram latency;	/* mesurée depuis l'instant prévu */
+  uint64_t sent;
+  uint64_t received;
+  uint64_t lost;
+};
+
+/* État d'une exécution en boucle ouverte */
+struct ol_state {
+  int fd;
+  int stream;			/* 1 : mode connecté (TCP) */
+  struct ol_schedule *schedule;
+  struct ol_phase_stats *stats;
+  struct ol_request *requests;
+  struct ol_histogram corrected;
+  struct ol_histogram uncorrected;
+  uint64_t outstanding;
+  uint64_t unexpected;
+  uint64_t errors;
+  char out[OL_OUT_SIZE];
+  int outLen;
+  char in[MSG_SIZE * 64];
+  int inLen;
+};
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+static uint64_t ol_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'indice de l'intervalle d'une valeur : exact en
+ * dessous de OL_HIST_SUB, puis OL_HIST_SUB intervalles par puissance de 2.
+ *****************************************************************************/
+static int histogram_index(uint64_t value) {
+  int shift;
+
+  if ( value < OL_HIST_SUB )
+    return value;
+  shift = 63 - __builtin_clzll(value) - 5;
+  return (shift + 1) * OL_HIST_SUB + (value >> shift) - OL_HIST_SUB;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie la borne supérieure de l'intervalle d'indice donné.
+ *****************************************************************************/
+static uint64_t histogram_value(int index) {
+  int shift;
+
+  if ( index < OL_HIST_SUB )
+    return index;
+  shift = index / OL_HIST_SUB - 1;
+  return (((uint64_t) (index % OL_HIST_SUB + OL_HIST_SUB + 1)) << shift) - 1;
+}
+
+/******************************************************************************
+ * Fonction qui enregistre une valeur dans un histogramme.
+ *****************************************************************************/
+static void histogram_record(struct ol_histogram *histogram, uint64_t value) {
+  histogram->counts[histogram_index(value)]++;
+  histogram->total++;
+  if ( value > histogram->max )
+    histogram->max = value;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le centile demandé d'un histogramme.
+ * Prend en paramètre :
+ *     - histogram     Pointeur vers l'histogramme.
+ *     - percentile    Centile entre 0 et 100.
+ * Renvoie la valeur du centile en ns, 0 si l'histogramme est vide.
+ *****************************************************************************/
+static uint64_t histogram_percentile(struct ol_histogram *histogram,
+                                     double percentile) {
+  uint64_t rank, seen = 0;
+  int i;
+
+  if ( histogram->total == 0 )
+    return 0;
+  rank = (uint64_t) (percentile / 100 * histogram->total);
+  if ( rank == 0 )
+    rank = 1;
+  for ( i = 0; i < OL_HIST_SIZE; i++ ) {
+    seen += histogram->counts[i];
+    if ( seen >= rank )
+      return histogram_value(i) < histogram->max ? histogram_value(i)
+                                                 : histogram->max;
+  }
+  return histogram->max;
+}
+
+/******************************************************************************
+ * Fonction qui affiche les centiles d'un histogramme en microsecondes.
+ *****************************************************************************/
+static void histogram_print(struct ol_histogram *histogram) {
+  printf("%9.1f %9.1f %9.1f %9.1f %9.1f\n",
+         histogram_percentile(histogram, 50) / 1e3,
+         histogram_percentile(histogram, 90) / 1e3,
+         histogram_percentile(histogram, 99) / 1e3,
+         histogram_percentile(histogram, 99.9) / 1e3,
+         histogram->max / 1e3);
+}
+
+/******************************************************************************
+ * Fonction qui lit un calendrier d'envoi.
+ * Prend en paramètre :
+ *     - schedule    Pointeur vers le calendrier à remplir.
+ *     - spec        Description du calendrier :
+ *                     "rate"            débit constant pendant 'duration',
+ *                     "from:to:step"    paliers de 'duration' chacun,
+ *                     "from-to"         rampe linéaire sur 'duration',
+ *                                         découpée en phases d'une seconde.
+ *     - duration    Durée en secondes.
+ * Renvoie 0 en cas de succès, -1 si la description est invalide.
+ *****************************************************************************/
+int ol_schedule_parse(struct ol_schedule *schedule, char *spec,
+                      double duration) {
+  double from, to, step, rate;
+  int i, count;
+  char end;
+
+  memset(schedule, 0, sizeof(*schedule));
+  if ( duration <= 0 )
+    return -1;
+
+  if ( sscanf(spec, "%lf:%lf:%lf%c", &from, &to, &step, &end) == 3 ) {
+    if ( from <= 0 || step <= 0 || to < from )
+      return -1;
+    for ( rate = from; rate <= to + step / 2 && schedule->count < OL_MAX_PHASES;
+          rate += step ) {
+      schedule->phases[schedule->count].startRate = rate;
+      schedule->phases[schedule->count].endRate = rate;
+      schedule->phases[schedule->count].duration = duration;
+      schedule->count++;
+    }
+    return 0;
+  }
+
+  if ( sscanf(spec, "%lf-%lf%c", &from, &to, &end) == 2 ) {
+    if ( from <= 0 || to <= 0 )
+      return -1;
+    count = (int) (duration + 0.999);
+    if ( count > OL_MAX_PHASES )
+      count = OL_MAX_PHASES;
+    for ( i = 0; i < count; i++ ) {
+      schedule->phases[i].startRate = from + (to - from) * i / count;
+      schedule->phases[i].endRate = from + (to - from) * (i + 1) / count;
+      schedule->phases[i].duration = duration / count;
+    }
+    schedule->count = count;
+    return 0;
+  }
+
+  if ( sscanf(spec, "%lf%c", &rate, &end) == 1 && rate > 0 ) {
+    schedule->phases[0].startRate = rate;
+    schedule->phases[0].endRate = rate;
+    schedule->phases[0].duration = duration;
+    schedule->count = 1;
+    return 0;
+  }
+
+  return -1;
+}
+
+/******************************************************************************
+ * Fonction qui enregistre la réponse à une requête.
+ * Prend en paramètre :
+ *     - state    Pointeur vers l'état de l'exécution.
+ *     - reply    Début de la réponse, qui commence par le numéro de requête.
+ *     - now      Instant de réception.
+ *****************************************************************************/
+static void ol_complete(struct ol_state *state, char *reply, uint64_t now) {
+  struct ol_request *request;
+  char *end;
+  uint64_t seq;
+
+  seq = strtoull(reply, &end, 10);
+  request = &state->requests[seq & (OL_WINDOW - 1)];
+  if ( end == reply || *end != ' ' || !request->used || request->seq != seq ) {
+    state->unexpected++;
+    return;
+  }
+
+  histogram_record(&state->stats[request->phase].latency, now - request->intended);
+  histogram_record(&state->corrected, now - request->intended);
+  histogram_record(&state->uncorrected, now - request->actual);
+  state->stats[request->phase].received++;
+  state->outstanding--;
+  request->used = 0;
+}
+
+/******************************************************************************
+ * Fonction qui lit toutes les réponses disponibles, sans bloquer.
+ *****************************************************************************/
+static void ol_receive(struct ol_state *state) {
+  char msg[MSG_SIZE + 1];
+  uint64_t now;
+  int status, offset;
+
+  while ( 1 ) {
+    if ( state->stream ) {
+      status = recv(state->fd, state->in + state->inLen,
+                    sizeof(state->in) - state->inLen, 0);
+    } else {
+      status = recv(state->fd, msg, MSG_SIZE, 0);
+    }
+    if ( status <= 0 ) {
+      if ( status == 0 || (errno != EAGAIN && errno != EWOULDBLOCK
+                           && errno != EINTR && errno != ECONNREFUSED) )
+        state->errors++;
+      return;
+    }
+    now = ol_now();
+
+    if ( !state->stream ) {
+      msg[status] = '\0';
+      ol_complete(state, msg, now);
+      continue;
+    }
+
+    /* Mode connecté : une réponse tous les MSG_SIZE octets */
+    state->inLen += status;
+    for ( offset = 0; state->inLen - offset >= MSG_SIZE; offset += MSG_SIZE ) {
+      state->in[offset + MSG_SIZE - 1] = '\0';
+      ol_complete(state, state->in + offset, now);
+    }
+    memmove(state->in, state->in + offset, state->inLen - offset);
+    state->inLen -= offset;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui envoie le contenu du tampon d'envoi, sans bloquer.
+ *****************************************************************************/
+static void ol_flush(struct ol_state *state) {
+  int status;
+
+  if ( state->outLen == 0 )
+    return;
+  status = send(state->fd, state->out, state->outLen, MSG_NOSIGNAL);
+  if ( status == -1 ) {
+    if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+      state->errors++;
+    return;
+  }
+  memmove(state->out, state->out + status, state->outLen - status);
+  state->outLen -= status;
+}
+
+/******************************************************************************
+ * Fonction qui envoie une requête. En mode connecté, la requête occupe
+ * MSG_SIZE octets, comme la réponse du serveur.
+ * Renvoie 1 si la requête est partie, 0 si elle doit attendre.
+ *****************************************************************************/
+static int ol_send(struct ol_state *state, uint64_t seq, char *msg) {
+  char buffer[MSG_SIZE];
+  int len;
+
+  memset(buffer, 0, sizeof(buffer));
+  len = snprintf(buffer, MSG_SIZE, "%llu %s", (unsigned long long) seq, msg);
+  if ( len >= MSG_SIZE )
+    len = MSG_SIZE - 1;
+
+  if ( state->stream ) {
+    if ( state->outLen + MSG_SIZE > OL_OUT_SIZE )
+      return 0;
+    memcpy(state->out + state->outLen, buffer, MSG_SIZE);
+    state->outLen += MSG_SIZE;
+    return 1;
+  }
+
+  if ( send(state->fd, buffer, len, 0) == -1 ) {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+      return 0;
+    state->errors++;
+  }
+  return 1;
+}
+
+/******************************************************************************
+ * Fonction qui affiche le résultat de l'exécution : une ligne par phase puis
+ * les latences globales, mesurées depuis l'instant prévu (corrigées de
+ * l'omission coordonnée) et depuis l'envoi effectif.
+ *****************************************************************************/
+static void ol_print(struct ol_state *state) {
+  struct ol_phase *phase;
+  struct ol_phase_stats *stats;
+  int i;
+
+  printf("%12s %9s %9s %7s %9s %9s %9s %9s %9s\n", "rate (msg/s)", "sent",
+         "received", "lost", "p50 (us)", "p90", "p99", "p99.9", "max");
+  for ( i = 0; i < state->schedule->count; i++ ) {
+    phase = &state->schedule->phases[i];
+    stats = &state->stats[i];
+    printf("%12.0f %9llu %9llu %7llu ", (phase->startRate + phase->endRate) / 2,
+           (unsigned long long) stats->sent, (unsigned long long) stats->received,
+           (unsigned long long) stats->lost);
+    histogram_print(&stats->latency);
+  }
+  printf("%-40s ", "Latency from intended send (corrected)");
+  histogram_print(&state->corrected);
+  printf("%-40s ", "Latency from actual send (uncorrected)");
+  histogram_print(&state->uncorrected);
+  if ( state->unexpected != 0 || state->errors != 0 )
+    printf("Unexpected replies : %llu, socket errors : %llu\n",
+           (unsigned long long) state->unexpected,
+           (unsigned long long) state->errors);
+}
+
+/******************************************************************************
+ * Fonction qui exécute un test de charge en boucle ouverte : les requêtes
+ * partent aux instants fixés par le calendrier, sans attendre les réponses,
+ * et la latence est mesurée depuis l'instant prévu. Un retard de l'envoi
+ * (tampon plein, client en retard) est ainsi compté dans la latence.
+ * Prend en paramètre :
+ *     - socketDescriptor    Socket connecté au serveur.
+ *     - socktype            SOCK_STREAM ou SOCK_DGRAM.
+ *     - schedule            Pointeur vers le calendrier d'envoi.
+ *     - msg                 Message envoyé, précédé du numéro de requête.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur : mémoire, erreur du
+ * socket pendant le test (connexion fermée) ou aucune réponse reçue
+ * (serveur absent).
+ *****************************************************************************/
+int ol_run(int socketDescriptor, int socktype, struct ol_schedule *schedule,
+           char *msg) {
+  struct ol_state *state;
+  struct ol_request *request;
+  struct ol_phase *phase;
+  struct pollfd fds;
+  struct timespec timeout;
+  uint64_t now, next, phaseStart, phaseEnd, drainDeadline = 0, wait, seq = 0;
+  double rate;
+  int current = 0, sending = 1;
+  int i, status;
+
+  state = calloc(1, sizeof(*state));
+  if ( state != NULL ) {
+    state->stats = calloc(schedule->count, sizeof(*state->stats));
+    state->requests = calloc(OL_WINDOW, sizeof(*state->requests));
+  }
+  if ( state == NULL || state->stats == NULL || state->requests == NULL ) {
+    perror("Error with calloc");
+    return -1;
+  }
+  state->fd = socketDescriptor;
+  state->stream = socktype == SOCK_STREAM;
+  state->schedule = schedule;
+  fcntl(socketDescriptor, F_SETFL, fcntl(socketDescriptor, F_GETFL) | O_NONBLOCK);
+  /* Pas d'algorithme de Nagle : chaque requête part à son instant prévu */
+  if ( state->stream )
+    setsockopt(socketDescriptor, IPPROTO_TCP, TCP_NODELAY, &sending,
+               sizeof(sending));
+
+  phase = &schedule->phases[0];
+  phaseStart = ol_now();
+  phaseEnd = phaseStart + (uint64_t) (phase->duration * 1e9);
+  next = phaseStart;
+
+  while ( 1 ) {
+    now = ol_now();
+
+    /* Envoi de toutes les requêtes dont l'instant prévu est passé */
+    while ( sending && next <= now ) {
+      if ( !ol_send(state, seq, msg) )
+        break;
+      request = &state->requests[seq & (OL_WINDOW - 1)];
+      if ( request->used ) {
+        state->stats[request->phase].lost++;
+        state->outstanding--;
+      }
+      request->seq = seq++;
+      request->intended = next;
+      request->actual = now;
+      request->phase = current;
+      request->used = 1;
+      state->stats[current].sent++;
+      state->outstanding++;
+
+      /* Instant prévu de la requête suivante, au débit de la phase */
+      rate = phase->startRate + (phase->endRate - phase->startRate)
+             * (next - phaseStart) / (phase->duration * 1e9);
+      next += (uint64_t) (1e9 / rate);
+      while ( next >= phaseEnd ) {
+        if ( ++current == schedule->count ) {
+          sending = 0;
+          drainDeadline = now + (uint64_t) OL_DRAIN_MS * 1000000;
+          break;
+        }
+        phase = &schedule->phases[current];
+        phaseStart = phaseEnd;
+        phaseEnd = phaseStart + (uint64_t) (phase->duration * 1e9);
+        next = phaseStart;
+      }
+    }
+
+    if ( state->stream )
+      ol_flush(state);
+    ol_receive(state);
+
+    now = ol_now();
+    if ( !sending && (state->outstanding == 0 || now >= drainDeadline) )
+      break;
+
+    /* Attente de la prochaine requête ou d'une réponse, puis attente active */
+    wait = sending ? (next > now ? next - now : 0) : drainDeadline - now;
+    if ( wait > OL_SPIN_NS ) {
+      wait -= OL_SPIN_NS;
+      fds.fd = socketDescriptor;
+      fds.events = POLLIN | (state->outLen != 0 ? POLLOUT : 0);
+      timeout.tv_sec = wait / 1000000000;
+      timeout.tv_nsec = wait % 1000000000;
+      ppoll(&fds, 1, &timeout, NULL);
+    }
+  }
+
+  for ( i = 0; i < OL_WINDOW; i++ ) {
+    if ( state->requests[i].used )
+      state->stats[state->requests[i].phase].lost++;
+  }
+
+  ol_print(state);
+  status = state->errors != 0 || state->corrected.total == 0 ? -1 : 0;
+
+  free(state->requests);
+  free(state->stats);
+  free(state);
+  return status;
+}
@@ -0,0 +1,52 @@
+/******************************************************************************
+ *
+ * Name File : open-loop.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef OPEN_LOOP_H
+#define OPEN_LOOP_H
+
+#include <stdint.h>
+
+#define OL_WINDOW 65536		/* Requêtes en vol au plus, puissance de 2 */
+#define OL_SPIN_NS 50000	/* Attente active avant un envoi */
+#define OL_DRAIN_MS 1000	/* Attente des dernières réponses */
+#define OL_MAX_PHASES 256
+#define OL_HIST_SUB 32		/* Sous-intervalles par puissance de 2 */
+#define OL_HIST_SIZE (60 * OL_HIST_SUB)
+#define OL_OUT_SIZE 65536	/* Tampon d'envoi en mode connecté */
+
+/* Histogramme log-linéaire des latences en ns (précision ~3 %) */
+struct ol_histogram {
+  uint64_t counts[OL_HIST_SIZE];
+  uint64_t total;
+  uint64_t max;
+};
+
+/* Phase du calendrier : débit évoluant linéairement de start à end */
+struct ol_phase {
+  double startRate;		/* messages par seconde */
+  double endRate;
+  double duration;		/* secondes */
+};
+
+/* Calendrier d'envoi : constant, par paliers ou en rampe */
+struct ol_schedule {
+  struct ol_phase phases[OL_MAX_PHASES];
+  int count;
+};
+
+int ol_schedule_parse(struct ol_schedule *schedule, char *spec,
+                      double duration);
+int ol_run(int socketDescriptor, int socktype, struct ol_schedule *schedule,
+           char *msg);
+
+#endif
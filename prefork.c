@@ -0,0 +1,232 @@
+/******************************************************************************
+ *
+ * Name File : prefork.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "prefork.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+static uint64_t prefork_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Gestionnaire de SIGCHLD : sans lui le signal est ignoré et n'interrompt pas
+ * l'attente du superviseur.
+ *****************************************************************************/
+static void prefork_child_handler(int signum) {
+  (void) signum;
+}
+
+/******************************************************************************
+ * Fonction qui prépare les emplacements partagés des workers. Elle doit être
+ * appelée avant prefork_run, une fois le socket d'écoute ouvert.
+ * Prend en paramètre :
+ *     - prefork     Pointeur vers le superviseur.
+ *     - count       Nombre de workers (PREFORK_MAX au plus).
+ *     - dataSize    Taille des statistiques d'un worker.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur.
+ *****************************************************************************/
+int prefork_init(struct prefork *prefork, int count, size_t dataSize) {
+  size_t size;
+
+  if ( count < 1 || count > PREFORK_MAX ) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* Un emplacement par ligne de cache, pour que les workers ne se gênent
+     pas en écrivant leurs statistiques */
+  prefork->slotSize = (sizeof(struct prefork_slot) + dataSize + 63) & ~(size_t) 63;
+  prefork->count = count;
+  size = prefork->slotSize * count;
+  prefork->slots = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if ( prefork->slots == MAP_FAILED ) {
+    prefork->slots = NULL;
+    return -1;
+  }
+  memset(prefork->slots, 0, size);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'emplacement d'un worker.
+ * Prend en paramètre :
+ *     - prefork    Pointeur vers le superviseur.
+ *     - index      Numéro du worker.
+ *****************************************************************************/
+struct prefork_slot *prefork_slot(struct prefork *prefork, int index) {
+  return (struct prefork_slot *) (prefork->slots + prefork->slotSize * index);
+}
+
+/******************************************************************************
+ * Fonction qui lance un worker.
+ * Prend en paramètre :
+ *     - prefork     Pointeur vers le superviseur.
+ *     - index       Numéro du worker.
+ *     - previous    Masque de signaux à rétablir dans le worker.
+ * Renvoie 0 dans le worker, 1 dans le superviseur, -1 en cas d'erreur.
+ *****************************************************************************/
+static int prefork_spawn(struct prefork *prefork, int index, sigset_t *previous) {
+  struct prefork_slot *slot = prefork_slot(prefork, index);
+  struct sigaction action;
+  pid_t pid;
+
+  /* Les messages en attente ne doivent pas être affichés deux fois */
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
+  if ( pid == -1 ) {
+    perror("Error with fork");
+    return -1;
+  }
+
+  if ( pid == 0 ) {
+    /* Le worker s'arrête avec le superviseur, même tué par SIGKILL */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &action, NULL);
+    sigprocmask(SIG_SETMASK, previous, NULL);
+    return 0;
+  }
+
+  slot->pid = pid;
+  slot->started = prefork_now();
+  return 1;
+}
+
+/******************************************************************************
+ * Fonction qui supervise les workers : lance 'count' processus qui héritent
+ * du socket d'écoute, relance ceux qui meurent et affiche les statistiques
+ * agrégées sur demande (SIGUSR1) et à l'arrêt (SIGINT, SIGTERM), après avoir
+ * arrêté les workers.
+ * Prend en paramètre :
+ *     - prefork      Pointeur vers le superviseur.
+ *     - running      Indicateur de marche, remis à 0 par les signaux d'arrêt.
+ *     - dumpStats    Indicateur de demande d'affichage (SIGUSR1).
+ *     - print        Fonction d'affichage des statistiques.
+ *     - arg          Argument passé à print.
+ * Renvoie, dans un worker, ses statistiques partagées : le worker sert alors
+ * les clients. Renvoie NULL dans le superviseur, une fois arrêté.
+ *****************************************************************************/
+void *prefork_run(struct prefork *prefork, volatile sig_atomic_t *running,
+                  volatile sig_atomic_t *dumpStats, prefork_print print,
+                  void *arg) {
+  struct prefork_slot *slot;
+  struct sigaction action;
+  struct timespec backoff;
+  sigset_t blocked, previous;
+  pid_t pid;
+  int i, status;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = prefork_child_handler;
+  sigaction(SIGCHLD, &action, NULL);
+
+  /* Les signaux ne sont reçus que pendant l'attente, pas entre deux tests */
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  sigaddset(&blocked, SIGUSR1);
+  sigaddset(&blocked, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &blocked, &previous);
+
+  for ( i = 0; i < prefork->count; i++ ) {
+    if ( prefork_spawn(prefork, i, &previous) == 0 )
+      return prefork_slot(prefork, i)->data;
+  }
+  printf("%d worker processes started\n", prefork->count);
+  fflush(stdout);
+
+  while ( *running ) {
+    sigsuspend(&previous);
+
+    while ( *running && (pid = waitpid(-1, &status, WNOHANG)) > 0 ) {
+      for ( i = 0; i < prefork->count; i++ ) {
+        slot = prefork_slot(prefork, i);
+        if ( slot->pid == pid )
+          break;
+      }
+      if ( i == prefork->count )
+        continue;
+      slot->pid = 0;
+
+      if ( WIFSIGNALED(status) )
+        fprintf(stderr, "Worker %d (pid %d) killed by signal %d, restarting\n",
+                i, (int) pid, WTERMSIG(status));
+      else
+        fprintf(stderr, "Worker %d (pid %d) exited with status %d, "
+                "restarting\n", i, (int) pid, WEXITSTATUS(status));
+
+      /* Un worker qui meurt aussitôt lancé n'est pas relancé en boucle */
+      if ( prefork_now() - slot->started < 1000000000ULL ) {
+        backoff.tv_sec = PREFORK_BACKOFF_MS / 1000;
+        backoff.tv_nsec = (PREFORK_BACKOFF_MS % 1000) * 1000000L;
+        nanosleep(&backoff, NULL);
+      }
+      slot->restarts++;
+      if ( prefork_spawn(prefork, i, &previous) == 0 )
+        return slot->data;
+    }
+
+    if ( *dumpStats ) {
+      *dumpStats = 0;
+      print(prefork, arg);
+    }
+  }
+
+  /* Arrêt : chaque worker termine sa boucle et publie ses statistiques */
+  for ( i = 0; i < prefork->count; i++ ) {
+    slot = prefork_slot(prefork, i);
+    if ( slot->pid != 0 )
+      kill(slot->pid, SIGTERM);
+  }
+  while ( (pid = wait(&status)) > 0 || (pid == -1 && errno == EINTR) ) {
+    for ( i = 0; i < prefork->count; i++ ) {
+      slot = prefork_slot(prefork, i);
+      if ( slot->pid == pid )
+        slot->pid = 0;
+    }
+  }
+  sigprocmask(SIG_SETMASK, &previous, NULL);
+
+  print(prefork, arg);
+  return NULL;
+}
+
+/******************************************************************************
+ * Fonction qui libère les emplacements partagés.
+ * Prend en paramètre :
+ *     - prefork    Pointeur vers le superviseur.
+ *****************************************************************************/
+void prefork_free(struct prefork *prefork) {
+  if ( prefork->slots != NULL )
+    munmap(prefork->slots, prefork->slotSize * prefork->count);
+  prefork->slots = NULL;
+}
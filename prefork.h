@@ -0,0 +1,53 @@
+/******************************************************************************
+ *
+ * Name File : prefork.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#define PREFORK_MAX 256		/* Processus workers au plus */
+#define PREFORK_BACKOFF_MS 1000	/* Pause avant de relancer un worker mort
+				   moins d'une seconde après son démarrage */
+
+/* Emplacement d'un worker en mémoire partagée : le worker y recopie ses
+   statistiques, qui survivent à sa mort et sont reprises par son
+   remplaçant */
+struct prefork_slot {
+  pid_t pid;			/* 0 : pas de worker vivant */
+  unsigned long restarts;
+  uint64_t started;		/* instant du dernier démarrage, en ns */
+  unsigned char data[];		/* statistiques propres au serveur */
+};
+
+/* Superviseur des processus workers */
+struct prefork {
+  int count;
+  size_t slotSize;
+  unsigned char *slots;		/* projection partagée avec les workers */
+};
+
+/* Fonction d'affichage des statistiques agrégées */
+typedef void (*prefork_print)(struct prefork *prefork, void *arg);
+
+int prefork_init(struct prefork *prefork, int count, size_t dataSize);
+struct prefork_slot *prefork_slot(struct prefork *prefork, int index);
+void *prefork_run(struct prefork *prefork, volatile sig_atomic_t *running,
+                  volatile sig_atomic_t *dumpStats, prefork_print print,
+                  void *arg);
+void prefork_free(struct prefork *prefork);
+
+#endif
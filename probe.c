@@ -0,0 +1,198 @@
+/******************************************************************************
+ *
+ * Name File : probe.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "probe.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define PROBE_CALIBRATION_NS 20000000	/* Mesure de la fréquence : 20 ms */
+
+static const char *stageNames[PROBE_STAGES] = {
+  "accept", "recv", "decode", "handler", "encode", "send", "flush"
+};
+
+/* Anneaux de tous les threads, relus par le thread qui écrit la trace */
+static struct probe_ring *rings[PROBE_MAX_RINGS];
+static int ringCount = 0;
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Origine des instants de la trace et fréquence du compteur */
+static uint64_t baseCycles = 0;
+static double cyclesPerUs = 1000;
+
+/******************************************************************************
+ * Fonction qui lit l'horloge monotone.
+ * Renvoie l'instant en ns.
+ *****************************************************************************/
+static uint64_t probe_now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui indique si les sondes ont été compilées (make PROBES=1).
+ * Renvoie 1 si oui, 0 sinon.
+ *****************************************************************************/
+int probe_compiled(void) {
+#ifdef PROBES
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/******************************************************************************
+ * Fonction qui mesure la fréquence du compteur de cycles contre l'horloge
+ * monotone et fixe l'origine de la trace. À appeler avant de créer les
+ * anneaux.
+ *****************************************************************************/
+void probe_calibrate(void) {
+  uint64_t startNs, endNs, startCycles, endCycles;
+
+  startNs = probe_now_ns();
+  startCycles = probe_cycles();
+  do {
+    endNs = probe_now_ns();
+    endCycles = probe_cycles();
+  } while ( endNs - startNs < PROBE_CALIBRATION_NS );
+  cyclesPerUs = (double) (endCycles - startCycles) * 1000 / (endNs - startNs);
+  baseCycles = startCycles;
+}
+
+/******************************************************************************
+ * Fonction qui crée l'anneau du thread appelant et l'inscrit pour la trace.
+ * Renvoie l'anneau, NULL en cas d'erreur (errno).
+ *****************************************************************************/
+struct probe_ring *probe_ring_create(void) {
+  struct probe_ring *ring;
+
+  ring = calloc(1, sizeof(*ring));
+  if ( ring == NULL )
+    return NULL;
+  ring->tid = (int) syscall(SYS_gettid);
+
+  pthread_mutex_lock(&ringLock);
+  if ( ringCount == PROBE_MAX_RINGS ) {
+    pthread_mutex_unlock(&ringLock);
+    free(ring);
+    errno = EMFILE;
+    return NULL;
+  }
+  rings[ringCount++] = ring;
+  pthread_mutex_unlock(&ringLock);
+  return ring;
+}
+
+/******************************************************************************
+ * Fonction qui écrit les événements gardés par les anneaux au format JSON
+ * des traces Chrome, lu par chrome://tracing et Perfetto : une tranche par
+ * étape, sur la ligne de son thread. Les anneaux sont relus pendant que les
+ * threads écrivent : les événements écrasés pendant la copie sont écartés.
+ * Un résumé par étape est affiché.
+ * Prend en paramètre :
+ *     - path    Chemin du fichier, remplacé.
+ * Renvoie le nombre d'événements écrits, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+int probe_dump(const char *path) {
+  struct probe_event *copy;
+  unsigned long counts[PROBE_STAGES];
+  double totals[PROBE_STAGES];
+  uint64_t head, first, after, valid, i;
+  struct probe_event *event;
+  FILE *file;
+  int r, s, written = 0, events = 0;
+
+  copy = malloc(PROBE_RING_SIZE * sizeof(*copy));
+  file = fopen(path, "w");
+  if ( copy == NULL || file == NULL ) {
+    free(copy);
+    if ( file != NULL )
+      fclose(file);
+    return -1;
+  }
+  memset(counts, 0, sizeof(counts));
+  memset(totals, 0, sizeof(totals));
+
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"otherData\":"
+          "{\"cyclesPerUs\":%.3f},\"traceEvents\":[\n", cyclesPerUs);
+  pthread_mutex_lock(&ringLock);
+  for ( r = 0; r < ringCount; r++ ) {
+    fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"loop %d\"}}", written ? ",\n" : "",
+            (int) getpid(), rings[r]->tid, r);
+    written++;
+
+    head = __atomic_load_n(&rings[r]->head, __ATOMIC_ACQUIRE);
+    first = head > PROBE_RING_SIZE ? head - PROBE_RING_SIZE : 0;
+    for ( i = first; i < head; i++ )
+      copy[i - first] = rings[r]->events[i & (PROBE_RING_SIZE - 1)];
+    /* Événements écrasés pendant la copie, ou en cours d'écriture */
+    after = __atomic_load_n(&rings[r]->head, __ATOMIC_ACQUIRE);
+    valid = after + 1 > PROBE_RING_SIZE ? after + 1 - PROBE_RING_SIZE : 0;
+
+    for ( i = valid > first ? valid : first; i < head; i++ ) {
+      event = &copy[i - first];
+      if ( event->stage >= PROBE_STAGES || event->start < baseCycles )
+        continue;
+      s = event->stage;
+      counts[s]++;
+      totals[s] += event->cycles;
+      fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\","
+              "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+              "\"args\":{\"cycles\":%u}}", stageNames[s],
+              (event->start - baseCycles) / cyclesPerUs,
+              event->cycles / cyclesPerUs, (int) getpid(), rings[r]->tid,
+              event->cycles);
+      events++;
+    }
+  }
+  pthread_mutex_unlock(&ringLock);
+  fprintf(file, "\n]}\n");
+  free(copy);
+  if ( fclose(file) != 0 )
+    return -1;
+
+  printf("Probes : %d events to %s, %.0f cycles per us\n", events, path,
+         cyclesPerUs);
+  for ( s = 0; s < PROBE_STAGES; s++ )
+    if ( counts[s] > 0 )
+      printf("  %-8s : %lu, mean %.0f cycles (%.3f us)\n", stageNames[s],
+             counts[s], totals[s] / counts[s],
+             totals[s] / counts[s] / cyclesPerUs);
+  fflush(stdout);
+  return events;
+}
+
+/******************************************************************************
+ * Fonction qui libère les anneaux, une fois les threads arrêtés.
+ *****************************************************************************/
+void probe_free(void) {
+  int r;
+
+  pthread_mutex_lock(&ringLock);
+  for ( r = 0; r < ringCount; r++ )
+    free(rings[r]);
+  ringCount = 0;
+  pthread_mutex_unlock(&ringLock);
+}
@@ -0,0 +1,152 @@
+/******************************************************************************
+ *
+ * Name File : probe.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/* Sondes du chemin d'un message : compilées seulement avec -DPROBES
+   (make PROBES=1). Compilées mais inactives, elles coûtent un test du
+   pointeur de l'anneau, NULL sauf avec l'option qui les active. */
+
+#define PROBE_RING_SIZE 65536	/* Événements gardés par thread, puissance
+				   de 2 : 1 Mio par anneau */
+#define PROBE_MAX_RINGS 256
+
+/* Étapes du traitement d'un message */
+enum probe_stage {
+  PROBE_ACCEPT,
+  PROBE_RECV,
+  PROBE_DECODE,
+  PROBE_HANDLER,
+  PROBE_ENCODE,
+  PROBE_SEND,
+  PROBE_FLUSH,
+  PROBE_STAGES
+};
+
+/* Étape mesurée, en cycles du compteur d'horodatage (TSC) */
+struct probe_event {
+  uint64_t start;
+  uint32_t cycles;
+  uint32_t stage;
+};
+
+/* Anneau d'un thread : écrit par son thread seulement, les plus anciens
+   événements sont écrasés. 'head' est publié après chaque événement pour
+   qu'un autre thread puisse le relire. */
+struct probe_ring {
+  uint64_t head;		/* événements écrits depuis la création */
+  uint64_t open[PROBE_STAGES];	/* début de l'étape en cours */
+  int tid;
+  struct probe_event events[PROBE_RING_SIZE];
+};
+
+/******************************************************************************
+ * Fonction qui lit le compteur de cycles (TSC), ou l'horloge monotone en ns
+ * sur une autre architecture.
+ *****************************************************************************/
+static inline uint64_t probe_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/******************************************************************************
+ * Fonction qui enregistre la fin d'une étape commencée par PROBE_BEGIN.
+ * Prend en paramètre :
+ *     - ring     Anneau du thread.
+ *     - stage    Étape terminée.
+ *****************************************************************************/
+static inline void probe_record(struct probe_ring *ring, int stage) {
+  struct probe_event *event;
+  uint64_t now = probe_cycles();
+
+  event = &ring->events[ring->head & (PROBE_RING_SIZE - 1)];
+  event->start = ring->open[stage];
+  event->cycles = (uint32_t) (now - ring->open[stage]);
+  event->stage = stage;
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Marqueurs USDT (note .note.stapsdt, comme <sys/sdt.h>) : un nop par
+   marqueur, sur lequel perf et bpftrace posent leur point d'arrêt ;
+   l'argument est le numéro de l'étape.
+     bpftrace -e 'usdt:./tcp-server-cli:tcp_server:stage_end { ... }' */
+#if defined(PROBES) && defined(__x86_64__) && defined(__GNUC__)
+#define PROBE_USDT(name, stage)						\
+  __asm__ __volatile__ (						\
+    "990: nop\n"							\
+    ".pushsection .note.stapsdt,\"\",\"note\"\n"			\
+    ".balign 4\n"							\
+    ".4byte 992f-991f, 994f-993f, 3\n"					\
+    "991: .asciz \"stapsdt\"\n"						\
+    "992: .balign 4\n"							\
+    "993: .8byte 990b\n"						\
+    ".8byte _.stapsdt.base\n"						\
+    ".8byte 0\n"							\
+    ".asciz \"tcp_server\"\n"						\
+    ".asciz \"" #name "\"\n"						\
+    ".asciz \"-4@%0\"\n"						\
+    "994: .balign 4\n"							\
+    ".popsection\n"							\
+    ".ifndef _.stapsdt.base\n"						\
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"						\
+    ".hidden _.stapsdt.base\n"						\
+    "_.stapsdt.base: .space 1\n"					\
+    ".size _.stapsdt.base, 1\n"						\
+    ".popsection\n"							\
+    ".endif\n"								\
+    : : "n" ((int) (stage)))
+#else
+#define PROBE_USDT(name, stage) do { } while ( 0 )
+#endif
+
+#ifdef PROBES
+#define PROBE_BEGIN(ring, stage)					\
+  do {									\
+    PROBE_USDT(stage_begin, stage);					\
+    if ( __builtin_expect((ring) != NULL, 0) )				\
+      (ring)->open[stage] = probe_cycles();				\
+  } while ( 0 )
+#define PROBE_END(ring, stage)						\
+  do {									\
+    PROBE_USDT(stage_end, stage);					\
+    if ( __builtin_expect((ring) != NULL, 0) )				\
+      probe_record((ring), (stage));					\
+  } while ( 0 )
+#else
+#define PROBE_BEGIN(ring, stage) do { } while ( 0 )
+#define PROBE_END(ring, stage) do { } while ( 0 )
+#endif
+
+int probe_compiled(void);
+void probe_calibrate(void);
+struct probe_ring *probe_ring_create(void);
+int probe_dump(const char *path);
+void probe_free(void);
+
+#endif
@@ -0,0 +1,566 @@
+/******************************************************************************
+ *
+ * Name File : reliable.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "reliable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define RELIABLE_BACKOFF_MAX 10	/* Doublements du délai au plus */
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+static uint64_t reliable_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonctions qui écrivent et lisent un entier de 32 bits en ordre réseau.
+ *****************************************************************************/
+static void reliable_put32(unsigned char *buffer, uint32_t value) {
+  value = htonl(value);
+  memcpy(buffer, &value, sizeof(value));
+}
+
+static uint32_t reliable_get32(const unsigned char *buffer) {
+  uint32_t value;
+
+  memcpy(&value, buffer, sizeof(value));
+  return ntohl(value);
+}
+
+/******************************************************************************
+ * Fonction qui écrit l'en-tête d'une requête ou d'une réponse.
+ * Prend en paramètre :
+ *     - header    Pointeur vers l'en-tête.
+ *     - buffer    Zone de RELIABLE_HEADER_MAX octets à remplir.
+ * Renvoie la taille de l'en-tête écrit, la charge utile le suit.
+ *****************************************************************************/
+size_t reliable_encode(struct reliable_header *header, unsigned char *buffer) {
+  uint16_t length = htons(header->length);
+  size_t size = RELIABLE_REQUEST_SIZE;
+  int i;
+
+  buffer[0] = RELIABLE_MAGIC;
+  buffer[1] = (RELIABLE_VERSION << 4) | header->type;
+  memcpy(buffer + 2, &length, sizeof(length));
+  reliable_put32(buffer + 4, header->sequence);
+  reliable_put32(buffer + 8, header->timestamp);
+  if ( header->type == RELIABLE_REPLY ) {
+    reliable_put32(buffer + 12, header->cumulative);
+    buffer[16] = header->ranges;
+    memset(buffer + 17, 0, 3);
+    for ( i = 0; i < header->ranges; i++ ) {
+      reliable_put32(buffer + 20 + 8 * i, header->range[i].start);
+      reliable_put32(buffer + 24 + 8 * i, header->range[i].end);
+    }
+    size = RELIABLE_REPLY_SIZE + 8 * header->ranges;
+  }
+  return size;
+}
+
+/******************************************************************************
+ * Fonction qui reconnaît et lit l'en-tête d'un datagramme fiable.
+ * Prend en paramètre :
+ *     - buffer    Datagramme reçu.
+ *     - size      Taille du datagramme.
+ *     - header    Pointeur vers l'en-tête à remplir.
+ * Renvoie la taille de l'en-tête, -1 si le datagramme n'en a pas ou s'il est
+ * invalide.
+ *****************************************************************************/
+int reliable_decode(const unsigned char *buffer, size_t size,
+                    struct reliable_header *header) {
+  uint16_t length;
+  size_t headerSize = RELIABLE_REQUEST_SIZE;
+  int i;
+
+  if ( size < RELIABLE_REQUEST_SIZE || buffer[0] != RELIABLE_MAGIC
+       || buffer[1] >> 4 != RELIABLE_VERSION )
+    return -1;
+  header->type = buffer[1] & 0x0F;
+  memcpy(&length, buffer + 2, sizeof(length));
+  header->length = ntohs(length);
+  header->sequence = reliable_get32(buffer + 4);
+  header->timestamp = reliable_get32(buffer + 8);
+  header->cumulative = 0;
+  header->ranges = 0;
+
+  if ( header->type == RELIABLE_REPLY ) {
+    if ( size < RELIABLE_REPLY_SIZE || buffer[16] > RELIABLE_SACK_MAX )
+      return -1;
+    header->cumulative = reliable_get32(buffer + 12);
+    header->ranges = buffer[16];
+    headerSize = RELIABLE_REPLY_SIZE + 8 * header->ranges;
+    if ( size < headerSize )
+      return -1;
+    for ( i = 0; i < header->ranges; i++ ) {
+      header->range[i].start = reliable_get32(buffer + 20 + 8 * i);
+      header->range[i].end = reliable_get32(buffer + 24 + 8 * i);
+    }
+  } else if ( header->type != RELIABLE_REQUEST ) {
+    return -1;
+  }
+
+  if ( header->length > RELIABLE_MAX_PAYLOAD
+       || headerSize + header->length > size )
+    return -1;
+  return (int) headerSize;
+}
+
+/******************************************************************************
+ * Fonction qui avance l'acquittement cumulatif d'une requête, puis de toutes
+ * celles déjà reçues qui la suivent.
+ *****************************************************************************/
+static void reliable_advance(struct reliable_receiver *receiver) {
+  receiver->cumulative++;
+  while ( receiver->window & 1 ) {
+    receiver->window >>= 1;
+    receiver->cumulative++;
+  }
+  receiver->window >>= 1;
+}
+
+/******************************************************************************
+ * Fonction qui note la réception d'une requête côté serveur. Une requête
+ * trop en avance fait glisser la fenêtre : les trous qu'elle laisse derrière
+ * elle sont abandonnés, le client a renoncé à ces requêtes.
+ * Prend en paramètre :
+ *     - receiver    Pointeur vers l'état du client.
+ *     - sequence    Numéro de la requête.
+ * Renvoie 1 pour une nouvelle requête, 0 pour une retransmission déjà reçue.
+ *****************************************************************************/
+int reliable_receive(struct reliable_receiver *receiver, uint32_t sequence) {
+  uint64_t bit;
+
+  if ( (int32_t) (sequence - receiver->cumulative) < 0 )
+    return 0;
+  if ( (int32_t) (sequence - receiver->cumulative) > 2 * 64 ) {
+    receiver->cumulative = sequence - 64;
+    receiver->window = 0;
+  }
+  while ( (int32_t) (sequence - receiver->cumulative) > 64 )
+    reliable_advance(receiver);
+  if ( sequence == receiver->cumulative ) {
+    reliable_advance(receiver);
+    return 1;
+  }
+  bit = (uint64_t) 1 << (sequence - receiver->cumulative - 1);
+  if ( receiver->window & bit )
+    return 0;
+  receiver->window |= bit;
+  return 1;
+}
+
+/******************************************************************************
+ * Fonction qui remplit l'acquittement d'une réponse : le cumul, puis les
+ * plages de requêtes reçues au-delà, des plus anciennes aux plus récentes.
+ * Prend en paramètre :
+ *     - receiver    Pointeur vers l'état du client.
+ *     - header      Pointeur vers l'en-tête de la réponse.
+ *****************************************************************************/
+void reliable_ack(struct reliable_receiver *receiver,
+                  struct reliable_header *header) {
+  uint64_t window = receiver->window;
+  uint32_t base = receiver->cumulative + 1;
+  int bit = 0;
+
+  header->cumulative = receiver->cumulative;
+  header->ranges = 0;
+  while ( window != 0 && header->ranges < RELIABLE_SACK_MAX ) {
+    while ( !(window & 1) ) {
+      window >>= 1;
+      bit++;
+    }
+    header->range[header->ranges].start = base + bit;
+    while ( window & 1 ) {
+      window >>= 1;
+      bit++;
+    }
+    header->range[header->ranges].end = base + bit;
+    header->ranges++;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le délai de retransmission courant, doublé à chaque
+ * expiration sans réponse.
+ * Prend en paramètre :
+ *     - sender    Pointeur vers l'émetteur.
+ * Renvoie le délai en ns.
+ *****************************************************************************/
+static uint64_t reliable_timeout(struct reliable_sender *sender) {
+  double rto = sender->rto * (1u << sender->backoff);
+
+  if ( rto > RELIABLE_RTO_MAX_US )
+    rto = RELIABLE_RTO_MAX_US;
+  return (uint64_t) (rto * 1000);
+}
+
+/******************************************************************************
+ * Fonction qui envoie, ou renvoie, une requête.
+ * Prend en paramètre :
+ *     - sender     Pointeur vers l'émetteur.
+ *     - slot       Pointeur vers la requête.
+ *     - msg        Charge utile.
+ *     - length     Taille de la charge utile.
+ *     - now        Instant courant en ns.
+ *****************************************************************************/
+static void reliable_send(struct reliable_sender *sender,
+                          struct reliable_slot *slot, const char *msg,
+                          uint16_t length, uint64_t now) {
+  unsigned char frame[RELIABLE_FRAME_MAX];
+  struct reliable_header header;
+  size_t size;
+
+  header.type = RELIABLE_REQUEST;
+  header.length = length;
+  header.sequence = slot->sequence;
+  header.timestamp = (uint32_t) (now / 1000);
+  size = reliable_encode(&header, frame);
+  memcpy(frame + size, msg, length);
+
+  /* Un envoi refusé (ECONNREFUSED, ENOBUFS) est une perte comme une autre */
+  if ( send(sender->fd, frame, size + length, 0) == -1
+       && errno != ECONNREFUSED && errno != ENOBUFS && errno != EAGAIN )
+    perror("Error with send");
+  sender->sent++;
+  slot->deadline = now + reliable_timeout(sender);
+}
+
+/******************************************************************************
+ * Fonction qui renvoie une requête présumée perdue.
+ *****************************************************************************/
+static void reliable_resend(struct reliable_sender *sender,
+                            struct reliable_slot *slot, const char *msg,
+                            uint16_t length, uint64_t now) {
+  slot->retries++;
+  sender->retransmits++;
+  if ( slot->acked )
+    sender->lostReplies++;
+  else
+    sender->lostRequests++;
+  reliable_send(sender, slot, msg, length, now);
+}
+
+/******************************************************************************
+ * Fonction qui réduit la fenêtre de congestion sur une perte, une fois par
+ * fenêtre de requêtes.
+ * Prend en paramètre :
+ *     - sender     Pointeur vers l'émetteur.
+ *     - timeout    1 si la perte est détectée par expiration du délai.
+ *****************************************************************************/
+static void reliable_loss(struct reliable_sender *sender, int timeout) {
+  if ( timeout ) {
+    sender->ssthresh = sender->inFlight / 2.0;
+    sender->cwnd = 1;
+  } else {
+    if ( sender->recovering )
+      return;
+    sender->ssthresh = sender->cwnd / 2;
+    sender->cwnd = sender->ssthresh;
+  }
+  if ( sender->ssthresh < 2 )
+    sender->ssthresh = 2;
+  if ( sender->cwnd < 1 )
+    sender->cwnd = 1;
+  sender->recovering = 1;
+  sender->recovery = sender->nextSequence;
+}
+
+/******************************************************************************
+ * Fonction qui met à jour l'estimation du temps d'aller-retour (RFC 6298).
+ * Prend en paramètre :
+ *     - sender    Pointeur vers l'émetteur.
+ *     - rtt       Mesure en us.
+ *****************************************************************************/
+static void reliable_sample(struct reliable_sender *sender, double rtt) {
+  double error;
+
+  if ( sender->srtt == 0 ) {
+    sender->srtt = rtt;
+    sender->rttvar = rtt / 2;
+  } else {
+    error = sender->srtt - rtt;
+    sender->rttvar = 0.75 * sender->rttvar + 0.25 * (error < 0 ? -error : error);
+    sender->srtt = 0.875 * sender->srtt + 0.125 * rtt;
+  }
+  sender->rto = sender->srtt + 4 * sender->rttvar;
+  if ( sender->rto < RELIABLE_RTO_MIN_US )
+    sender->rto = RELIABLE_RTO_MIN_US;
+  if ( sender->rto > RELIABLE_RTO_MAX_US )
+    sender->rto = RELIABLE_RTO_MAX_US;
+}
+
+/******************************************************************************
+ * Fonction qui exploite l'acquittement d'une réponse : les requêtes reçues
+ * par le serveur sont marquées, et une requête dépassée par plus de
+ * RELIABLE_REORDER requêtes reçues ou répondues est renvoyée sans attendre
+ * son délai.
+ * Prend en paramètre :
+ *     - sender     Pointeur vers l'émetteur.
+ *     - header     En-tête de la réponse.
+ *     - msg        Charge utile des requêtes.
+ *     - length     Taille de la charge utile.
+ *     - now        Instant courant en ns.
+ *****************************************************************************/
+static void reliable_sack(struct reliable_sender *sender,
+                          struct reliable_header *header, const char *msg,
+                          uint16_t length, uint64_t now) {
+  struct reliable_slot *slot;
+  uint32_t highest = header->cumulative;
+  int i, j;
+
+  if ( (int32_t) (header->sequence + 1 - highest) > 0 )
+    highest = header->sequence + 1;
+  for ( j = 0; j < header->ranges; j++ )
+    if ( (int32_t) (header->range[j].end - highest) > 0 )
+      highest = header->range[j].end;
+
+  for ( i = 0; i < RELIABLE_WINDOW; i++ ) {
+    slot = &sender->slots[i];
+    if ( !slot->pending )
+      continue;
+    if ( (int32_t) (slot->sequence - header->cumulative) < 0 )
+      slot->acked = 1;
+    for ( j = 0; j < header->ranges && !slot->acked; j++ )
+      if ( (int32_t) (slot->sequence - header->range[j].start) >= 0
+           && (int32_t) (slot->sequence - header->range[j].end) < 0 )
+        slot->acked = 1;
+
+    if ( !slot->fastRetransmitted
+         && (int32_t) (highest - slot->sequence) > RELIABLE_REORDER ) {
+      slot->fastRetransmitted = 1;
+      sender->fastRetransmits++;
+      reliable_loss(sender, 0);
+      reliable_resend(sender, slot, msg, length, now);
+    }
+  }
+}
+
+/******************************************************************************
+ * Fonction qui traite une réponse : mesure du temps d'aller-retour sur
+ * l'instant repris par le serveur (valable même après une retransmission),
+ * puis ouverture de la fenêtre de congestion.
+ * Prend en paramètre :
+ *     - sender     Pointeur vers l'émetteur.
+ *     - header     En-tête de la réponse.
+ *     - msg        Charge utile des requêtes.
+ *     - length     Taille de la charge utile.
+ *     - now        Instant courant en ns.
+ *****************************************************************************/
+static void reliable_reply(struct reliable_sender *sender,
+                           struct reliable_header *header, const char *msg,
+                           uint16_t length, uint64_t now) {
+  struct reliable_slot *slot;
+  uint64_t latency;
+
+  slot = &sender->slots[header->sequence & (RELIABLE_WINDOW - 1)];
+  if ( !slot->pending || slot->sequence != header->sequence ) {
+    sender->duplicates++;
+    return;
+  }
+  slot->pending = 0;
+  sender->inFlight--;
+  sender->completed++;
+  latency = now - slot->firstSent;
+  sender->latencySum += latency;
+  if ( latency > sender->latencyMax )
+    sender->latencyMax = latency;
+
+  reliable_sample(sender, (uint32_t) (now / 1000) - header->timestamp);
+  sender->backoff = 0;
+
+  if ( sender->recovering
+       && (int32_t) (header->sequence - sender->recovery) >= 0 )
+    sender->recovering = 0;
+  if ( !sender->recovering ) {
+    if ( sender->cwnd < sender->ssthresh )
+      sender->cwnd += 1;
+    else
+      sender->cwnd += 1 / sender->cwnd;
+    if ( sender->cwnd > RELIABLE_WINDOW )
+      sender->cwnd = RELIABLE_WINDOW;
+  }
+
+  reliable_sack(sender, header, msg, length, now);
+}
+
+/******************************************************************************
+ * Fonction qui renvoie les requêtes dont le délai a expiré, ou les abandonne
+ * après RELIABLE_RETRIES retransmissions. Une expiration réduit la fenêtre à
+ * une requête et double le délai.
+ * Prend en paramètre :
+ *     - sender     Pointeur vers l'émetteur.
+ *     - msg        Charge utile des requêtes.
+ *     - length     Taille de la charge utile.
+ *     - now        Instant courant en ns.
+ *****************************************************************************/
+static void reliable_expire(struct reliable_sender *sender, const char *msg,
+                            uint16_t length, uint64_t now) {
+  struct reliable_slot *slot;
+  int i, expired = 0;
+
+  for ( i = 0; i < RELIABLE_WINDOW; i++ ) {
+    slot = &sender->slots[i];
+    if ( !slot->pending || now < slot->deadline )
+      continue;
+    if ( slot->retries >= RELIABLE_RETRIES ) {
+      slot->pending = 0;
+      sender->inFlight--;
+      sender->failed++;
+      continue;
+    }
+    if ( !expired ) {
+      expired = 1;
+      reliable_loss(sender, 1);
+      if ( sender->backoff < RELIABLE_BACKOFF_MAX )
+        sender->backoff++;
+    }
+    sender->timeouts++;
+    slot->fastRetransmitted = 0;
+    reliable_resend(sender, slot, msg, length, now);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'espacement entre deux nouvelles requêtes : la
+ * fenêtre est répartie sur un temps d'aller-retour, deux fois plus vite
+ * pendant le démarrage lent pour laisser la fenêtre grandir.
+ * Prend en paramètre :
+ *     - sender    Pointeur vers l'émetteur.
+ * Renvoie l'espacement en ns, 0 avant la première mesure.
+ *****************************************************************************/
+static uint64_t reliable_pacing(struct reliable_sender *sender) {
+  double gain = sender->cwnd < sender->ssthresh ? 2 : 1.25;
+
+  return (uint64_t) (sender->srtt * 1000 / (sender->cwnd * gain));
+}
+
+/******************************************************************************
+ * Fonction qui envoie 'count' requêtes fiables à un serveur UDP, au plus
+ * 'depth' en vol et dans la limite de la fenêtre de congestion, et attend
+ * toutes les réponses en retransmettant les requêtes perdues.
+ * Prend en paramètre :
+ *     - fd       Socket UDP associé au serveur (connect).
+ *     - count    Nombre de requêtes.
+ *     - depth    Requêtes en vol au plus (RELIABLE_WINDOW au plus).
+ *     - msg      Charge utile des requêtes.
+ * Renvoie 0 si toutes les réponses ont été reçues, -1 sinon.
+ *****************************************************************************/
+int reliable_bench(int fd, long count, int depth, char *msg) {
+  struct reliable_sender *sender;
+  struct reliable_header header;
+  struct reliable_slot *slot;
+  unsigned char frame[RELIABLE_FRAME_MAX];
+  struct pollfd pfd;
+  struct timespec wait;
+  uint64_t start, now, wake;
+  unsigned int window;
+  uint16_t length;
+  ssize_t size;
+  long submitted = 0;
+  double elapsed;
+  int i, result;
+
+  sender = calloc(1, sizeof(*sender));
+  if ( sender == NULL ) {
+    perror("Error with calloc");
+    return -1;
+  }
+  sender->fd = fd;
+  sender->rto = RELIABLE_RTO_INITIAL_US;
+  sender->cwnd = RELIABLE_CWND_INITIAL;
+  sender->ssthresh = RELIABLE_WINDOW;
+  length = strnlen(msg, RELIABLE_MAX_PAYLOAD);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  start = reliable_now();
+  while ( sender->completed + sender->failed < (unsigned long) count ) {
+    now = reliable_now();
+    reliable_expire(sender, msg, length, now);
+
+    /* Nouvelles requêtes, dans la fenêtre et à leur tour d'espacement */
+    window = sender->cwnd < depth ? (unsigned int) sender->cwnd : (unsigned int) depth;
+    while ( submitted < count && sender->inFlight < window
+            && now >= sender->nextSend ) {
+      slot = &sender->slots[sender->nextSequence & (RELIABLE_WINDOW - 1)];
+      if ( slot->pending )
+        break;
+      memset(slot, 0, sizeof(*slot));
+      slot->sequence = sender->nextSequence++;
+      slot->pending = 1;
+      slot->firstSent = now;
+      reliable_send(sender, slot, msg, length, now);
+      sender->inFlight++;
+      submitted++;
+      sender->nextSend = now + reliable_pacing(sender);
+    }
+
+    /* Attente d'une réponse, de la prochaine expiration ou du prochain
+       envoi espacé */
+    wake = now + reliable_timeout(sender);
+    for ( i = 0; i < RELIABLE_WINDOW; i++ )
+      if ( sender->slots[i].pending && sender->slots[i].deadline < wake )
+        wake = sender->slots[i].deadline;
+    if ( submitted < count && sender->inFlight < window
+         && sender->nextSend < wake )
+      wake = sender->nextSend;
+    wake = wake > now ? wake - now : 0;
+    wait.tv_sec = wake / 1000000000;
+    wait.tv_nsec = wake % 1000000000;
+    if ( ppoll(&pfd, 1, &wait, NULL) == -1 && errno != EINTR ) {
+      perror("Error with ppoll");
+      break;
+    }
+
+    while ( (size = recv(fd, frame, sizeof(frame), MSG_DONTWAIT)) != -1
+            || errno == ECONNREFUSED ) {
+      if ( size == -1 )
+        continue;
+      if ( reliable_decode(frame, size, &header) == -1
+           || header.type != RELIABLE_REPLY )
+        continue;
+      reliable_reply(sender, &header, msg, length, reliable_now());
+    }
+  }
+  elapsed = (reliable_now() - start) / 1e9;
+
+  printf("Reliable : %lu requests in %.6f s (%.0f req/s), depth %d\n",
+         sender->completed, elapsed, sender->completed / elapsed, depth);
+  if ( sender->completed > 0 )
+    printf("Latency avg %.1f us, max %.1f us, srtt %.1f us, rto %.1f us, "
+           "cwnd %.1f\n", sender->latencySum / 1e3 / sender->completed,
+           sender->latencyMax / 1e3, sender->srtt, sender->rto, sender->cwnd);
+  printf("Sent : %lu, retransmits : %lu (fast %lu, timeouts %lu), lost "
+         "requests : %lu, lost replies : %lu, duplicates : %lu, failed : %lu\n",
+         sender->sent, sender->retransmits, sender->fastRetransmits,
+         sender->timeouts, sender->lostRequests, sender->lostReplies,
+         sender->duplicates, sender->failed);
+
+  result = sender->failed == 0 ? 0 : -1;
+  free(sender);
+  return result;
+}
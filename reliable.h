@@ -0,0 +1,117 @@
+/******************************************************************************
+ *
+ * Name File : reliable.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef RELIABLE_H
+#define RELIABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Datagrammes fiables : chaque requête porte un numéro de séquence et
+   l'instant de son envoi ; la réponse du serveur la reprend, avec l'état des
+   requêtes reçues (acquittement cumulatif et plages sélectives). Le client
+   retransmet sur délai adaptatif ou dès qu'une plage révèle une perte. */
+#define RELIABLE_MAGIC 0xD5	/* premier octet, jamais celui d'un texte */
+#define RELIABLE_VERSION 1
+#define RELIABLE_REQUEST 1
+#define RELIABLE_REPLY 2
+#define RELIABLE_REQUEST_SIZE 12	/* en-tête d'une requête */
+#define RELIABLE_REPLY_SIZE 20		/* en-tête d'une réponse, sans plages */
+#define RELIABLE_SACK_MAX 4		/* plages sélectives par réponse */
+#define RELIABLE_HEADER_MAX (RELIABLE_REPLY_SIZE + 8 * RELIABLE_SACK_MAX)
+#define RELIABLE_MAX_PAYLOAD 80
+#define RELIABLE_FRAME_MAX (RELIABLE_HEADER_MAX + RELIABLE_MAX_PAYLOAD)
+#define RELIABLE_WINDOW 64	/* Requêtes en vol au plus, puissance de 2 */
+#define RELIABLE_REORDER 3	/* Requêtes plus récentes acquittées avant de
+				   déclarer une perte */
+#define RELIABLE_RETRIES 8	/* Retransmissions avant l'abandon */
+#define RELIABLE_RTO_INITIAL_US 200000	/* Avant la première mesure */
+#define RELIABLE_RTO_MIN_US 1000
+#define RELIABLE_RTO_MAX_US 2000000
+#define RELIABLE_CWND_INITIAL 4
+
+/* Plage de numéros reçus, fin exclue */
+struct reliable_range {
+  uint32_t start;
+  uint32_t end;
+};
+
+/* En-tête d'une requête ou d'une réponse, en ordre réseau sur le fil */
+struct reliable_header {
+  uint8_t type;
+  uint8_t ranges;		/* réponse : plages sélectives */
+  uint16_t length;		/* taille de la charge utile */
+  uint32_t sequence;		/* numéro de la requête */
+  uint32_t timestamp;		/* envoi de la requête en us, repris tel quel */
+  uint32_t cumulative;		/* réponse : requêtes antérieures reçues */
+  struct reliable_range range[RELIABLE_SACK_MAX];
+};
+
+/* Requêtes reçues d'un client, côté serveur : tout ce qui précède
+   'cumulative' et les bits de la fenêtre qui suit */
+struct reliable_receiver {
+  uint32_t cumulative;
+  uint64_t window;		/* bit i : requête cumulative + 1 + i reçue */
+};
+
+/* Requête en vol, côté client */
+struct reliable_slot {
+  uint32_t sequence;
+  int pending;
+  int acked;			/* reçue par le serveur, réponse attendue */
+  int fastRetransmitted;	/* déjà retransmise sur plage sélective */
+  unsigned int retries;
+  uint64_t firstSent;		/* instant du premier envoi, en ns */
+  uint64_t deadline;		/* instant de la retransmission, en ns */
+};
+
+/* Émetteur fiable : estimation du temps d'aller-retour (RFC 6298), fenêtre
+   de congestion et espacement des envois */
+struct reliable_sender {
+  int fd;
+  uint32_t nextSequence;
+  unsigned int inFlight;
+  struct reliable_slot slots[RELIABLE_WINDOW];	/* indexé par numéro */
+  double srtt;			/* en us, 0 avant la première mesure */
+  double rttvar;
+  double rto;
+  unsigned int backoff;		/* doublements du délai depuis la dernière
+				   réponse */
+  double cwnd;			/* en requêtes */
+  double ssthresh;
+  uint32_t recovery;		/* fin de la reprise en cours */
+  int recovering;
+  uint64_t nextSend;		/* espacement : prochain envoi, en ns */
+  /* Statistiques */
+  unsigned long sent;
+  unsigned long retransmits;
+  unsigned long fastRetransmits;
+  unsigned long timeouts;
+  unsigned long lostRequests;	/* retransmises sans acquittement du serveur */
+  unsigned long lostReplies;	/* retransmises, acquittées mais sans réponse */
+  unsigned long duplicates;	/* réponses déjà reçues */
+  unsigned long completed;
+  unsigned long failed;		/* requêtes abandonnées */
+  uint64_t latencySum;		/* depuis le premier envoi, en ns */
+  uint64_t latencyMax;
+};
+
+size_t reliable_encode(struct reliable_header *header, unsigned char *buffer);
+int reliable_decode(const unsigned char *buffer, size_t size,
+                    struct reliable_header *header);
+int reliable_receive(struct reliable_receiver *receiver, uint32_t sequence);
+void reliable_ack(struct reliable_receiver *receiver,
+                  struct reliable_header *header);
+int reliable_bench(int fd, long count, int depth, char *msg);
+
+#endif
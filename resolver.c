@@ -0,0 +1,300 @@
+/******************************************************************************
+ *
+ * Name File : resolver.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#include "resolver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en millisecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+static uint64_t resolver_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/******************************************************************************
+ * Fonction qui initialise le résolveur.
+ * Prend en paramètre :
+ *     - resolver    Pointeur vers le résolveur, qui ne doit plus être déplacé
+ *                     en mémoire (les requêtes en cours y font référence).
+ *****************************************************************************/
+void resolver_init(struct resolver *resolver) {
+  memset(resolver, 0, sizeof(*resolver));
+}
+
+/******************************************************************************
+ * Fonction qui cherche une entrée du cache.
+ * Renvoie l'entrée correspondante, NULL si elle n'existe pas.
+ *****************************************************************************/
+static struct resolver_entry *entry_find(struct resolver *resolver, char *host,
+                                         char *port, int family, int socktype) {
+  struct resolver_entry *entry;
+  int i;
+
+  for ( i = 0; i < RESOLVER_CACHE_SIZE; i++ ) {
+    entry = &resolver->entries[i];
+    if ( entry->used && entry->family == family && entry->socktype == socktype
+         && strcmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0 )
+      return entry;
+  }
+  return NULL;
+}
+
+/******************************************************************************
+ * Fonction qui réserve une entrée du cache : une entrée libre ou, à défaut,
+ * la moins récemment utilisée qui n'a pas de résolution en cours.
+ * Renvoie l'entrée réservée, NULL si toutes ont une résolution en cours.
+ *****************************************************************************/
+static struct resolver_entry *entry_alloc(struct resolver *resolver, char *host,
+                                          char *port, int family, int socktype) {
+  struct resolver_entry *entry, *victim = NULL;
+  int i;
+
+  for ( i = 0; i < RESOLVER_CACHE_SIZE; i++ ) {
+    entry = &resolver->entries[i];
+    if ( entry->pending )
+      continue;
+    if ( !entry->used ) {
+      victim = entry;
+      break;
+    }
+    if ( victim == NULL || entry->lastUsed < victim->lastUsed )
+      victim = entry;
+  }
+  if ( victim == NULL )
+    return NULL;
+
+  if ( victim->result != NULL )
+    freeaddrinfo(victim->result);
+  memset(victim, 0, sizeof(*victim));
+  snprintf(victim->host, sizeof(victim->host), "%s", host);
+  snprintf(victim->port, sizeof(victim->port), "%s", port);
+  victim->family = family;
+  victim->socktype = socktype;
+  victim->used = 1;
+  victim->lastUsed = resolver_now();
+  return victim;
+}
+
+/******************************************************************************
+ * Fonction qui lance la résolution d'une entrée dans un thread de la libc
+ * (getaddrinfo_a), sans attendre son résultat.
+ * Renvoie 0 si la résolution est lancée, un code EAI_* sinon.
+ *****************************************************************************/
+static int entry_start(struct resolver_entry *entry) {
+  struct gaicb *list[1];
+  int status;
+
+  memset(&entry->hints, 0, sizeof(entry->hints));
+  entry->hints.ai_family = entry->family;
+  entry->hints.ai_socktype = entry->socktype;
+  memset(&entry->request, 0, sizeof(entry->request));
+  entry->request.ar_name = entry->host;
+  entry->request.ar_service = entry->port;
+  entry->request.ar_request = &entry->hints;
+
+  list[0] = &entry->request;
+  status = getaddrinfo_a(GAI_NOWAIT, list, 1, NULL);
+  if ( status == 0 )
+    entry->pending = 1;
+  return status;
+}
+
+/******************************************************************************
+ * Fonction qui enregistre le résultat d'une résolution terminée. Un échec est
+ * gardé en cache (cache négatif), sauf si une ancienne réponse existe : elle
+ * reste alors servie jusqu'au prochain essai.
+ * Prend en paramètre :
+ *     - resolver    Pointeur vers le résolveur.
+ *     - entry       Pointeur vers l'entrée à mettre à jour.
+ *     - status      Code de retour de la résolution.
+ *****************************************************************************/
+static void entry_complete(struct resolver *resolver,
+                           struct resolver_entry *entry, int status) {
+  entry->pending = 0;
+  if ( status == 0 ) {
+    if ( entry->result != NULL )
+      freeaddrinfo(entry->result);
+    entry->result = entry->request.ar_result;
+    entry->error = 0;
+    entry->expires = resolver_now() + RESOLVER_TTL_MS;
+    return;
+  }
+
+  resolver->failures++;
+  if ( entry->result == NULL )
+    entry->error = status;
+  entry->expires = resolver_now() + RESOLVER_NEGATIVE_TTL_MS;
+}
+
+/******************************************************************************
+ * Fonction qui relève les résolutions terminées, sans jamais bloquer.
+ * Prend en paramètre :
+ *     - resolver    Pointeur vers le résolveur.
+ *****************************************************************************/
+void resolver_poll(struct resolver *resolver) {
+  struct resolver_entry *entry;
+  int i, status;
+
+  for ( i = 0; i < RESOLVER_CACHE_SIZE; i++ ) {
+    entry = &resolver->entries[i];
+    if ( !entry->pending )
+      continue;
+    status = gai_error(&entry->request);
+    if ( status != EAI_INPROGRESS )
+      entry_complete(resolver, entry, status);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui attend la fin de la résolution d'une entrée, au plus
+ * RESOLVER_TIMEOUT_MS millisecondes.
+ * Renvoie le code de la résolution, EAI_AGAIN si le délai est dépassé.
+ *****************************************************************************/
+static int entry_wait(struct resolver *resolver, struct resolver_entry *entry) {
+  const struct gaicb *list[1];
+  struct timespec timeout;
+  uint64_t deadline = resolver_now() + RESOLVER_TIMEOUT_MS;
+  uint64_t now;
+  int status;
+
+  list[0] = &entry->request;
+  while ( (status = gai_error(&entry->request)) == EAI_INPROGRESS ) {
+    now = resolver_now();
+    if ( now >= deadline )
+      return EAI_AGAIN;
+    timeout.tv_sec = (deadline - now) / 1000;
+    timeout.tv_nsec = (deadline - now) % 1000 * 1000000;
+    gai_suspend(list, 1, &timeout);
+  }
+
+  entry_complete(resolver, entry, status);
+  return entry->error;
+}
+
+/******************************************************************************
+ * Fonction qui résout un nom d'hôte et un port.
+ * Une adresse numérique est convertie directement, sans thread. Une réponse
+ * en cache est servie immédiatement, même expirée : la nouvelle résolution
+ * est alors lancée en tâche de fond. Seul un nom jamais résolu fait attendre
+ * l'appelant, au plus RESOLVER_TIMEOUT_MS millisecondes.
+ * Prend en paramètre :
+ *     - resolver    Pointeur vers le résolveur.
+ *     - host        Nom ou adresse IP de l'hôte.
+ *     - port        Numéro de port ou nom de service.
+ *     - family      Famille d'adresses (AF_INET, AF_INET6, AF_UNSPEC).
+ *     - socktype    Type de socket (SOCK_STREAM, SOCK_DGRAM).
+ *     - result      Pointeur vers la liste d'adresses à renseigner, valide
+ *                     jusqu'au prochain appel au résolveur.
+ * Renvoie 0 en cas de succès, un code EAI_* sinon.
+ *****************************************************************************/
+int resolver_lookup(struct resolver *resolver, char *host, char *port,
+                    int family, int socktype, struct addrinfo **result) {
+  struct resolver_entry *entry;
+  struct addrinfo hints;
+  struct addrinfo *numeric;
+  uint64_t now;
+  int status;
+
+  resolver_poll(resolver);
+  now = resolver_now();
+
+  entry = entry_find(resolver, host, port, family, socktype);
+  if ( entry != NULL ) {
+    entry->lastUsed = now;
+    if ( entry->result != NULL ) {
+      /* Réponse expirée : servie quand même, rafraîchie en tâche de fond */
+      if ( entry->expires != 0 && now >= entry->expires && !entry->pending
+           && entry_start(entry) == 0 )
+        resolver->refreshes++;
+      resolver->hits++;
+      *result = entry->result;
+      return 0;
+    }
+    if ( !entry->pending && now < entry->expires ) {
+      resolver->failures++;
+      return entry->error;
+    }
+  } else {
+    /* Adresse numérique : conversion immédiate, gardée sans expiration */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    status = getaddrinfo(host, port, &hints, &numeric);
+    if ( status != EAI_NONAME ) {
+      if ( status != 0 )
+        return status;
+      entry = entry_alloc(resolver, host, port, family, socktype);
+      if ( entry == NULL ) {
+        freeaddrinfo(numeric);
+        return EAI_AGAIN;
+      }
+      entry->result = numeric;
+      resolver->numeric++;
+      *result = numeric;
+      return 0;
+    }
+
+    entry = entry_alloc(resolver, host, port, family, socktype);
+    if ( entry == NULL )
+      return EAI_AGAIN;
+  }
+
+  /* Aucune réponse disponible : lancement de la résolution et attente */
+  resolver->misses++;
+  if ( !entry->pending ) {
+    status = entry_start(entry);
+    if ( status != 0 ) {
+      entry_complete(resolver, entry, status);
+      return status;
+    }
+  }
+  status = entry_wait(resolver, entry);
+  if ( status == 0 )
+    *result = entry->result;
+  return status;
+}
+
+/******************************************************************************
+ * Fonction qui libère les réponses du cache. Une résolution en cours qui ne
+ * peut être annulée est abandonnée.
+ * Prend en paramètre :
+ *     - resolver    Pointeur vers le résolveur.
+ *****************************************************************************/
+void resolver_free(struct resolver *resolver) {
+  struct resolver_entry *entry;
+  int i;
+
+  for ( i = 0; i < RESOLVER_CACHE_SIZE; i++ ) {
+    entry = &resolver->entries[i];
+    if ( entry->pending && gai_cancel(&entry->request) != EAI_CANCELED
+         && gai_error(&entry->request) == EAI_INPROGRESS )
+      continue;
+    if ( entry->pending && gai_error(&entry->request) == 0 )
+      freeaddrinfo(entry->request.ar_result);
+    if ( entry->result != NULL )
+      freeaddrinfo(entry->result);
+    entry->result = NULL;
+    entry->pending = 0;
+    entry->used = 0;
+  }
+}
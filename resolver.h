@@ -0,0 +1,61 @@
+/******************************************************************************
+ *
+ * Name File : resolver.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <netdb.h>
+
+#define RESOLVER_CACHE_SIZE 16
+#define RESOLVER_TTL_MS 30000		/* Durée de vie d'une résolution */
+#define RESOLVER_NEGATIVE_TTL_MS 5000	/* Durée de vie d'un échec */
+#define RESOLVER_TIMEOUT_MS 5000	/* Attente maximale d'une résolution */
+
+/* Entrée du cache : résultat d'une résolution et requête en cours */
+struct resolver_entry {
+  char host[NI_MAXHOST];
+  char port[NI_MAXSERV];
+  int family;
+  int socktype;
+  struct addrinfo *result;	/* NULL si la dernière résolution a échoué */
+  int error;			/* code EAI_* de la dernière résolution */
+  uint64_t expires;		/* 0 : pas d'expiration (adresse numérique) */
+  uint64_t lastUsed;
+  int used;
+  int pending;			/* résolution en cours dans un thread */
+  struct gaicb request;
+  struct addrinfo hints;
+};
+
+/* Résolveur asynchrone avec cache */
+struct resolver {
+  struct resolver_entry entries[RESOLVER_CACHE_SIZE];
+  unsigned long numeric;	/* adresses numériques, sans résolution */
+  unsigned long hits;		/* réponses servies par le cache */
+  unsigned long misses;		/* résolutions attendues */
+  unsigned long refreshes;	/* résolutions lancées en tâche de fond */
+  unsigned long failures;	/* échecs, y compris servis par le cache */
+};
+
+void resolver_init(struct resolver *resolver);
+int resolver_lookup(struct resolver *resolver, char *host, char *port,
+                    int family, int socktype, struct addrinfo **result);
+void resolver_poll(struct resolver *resolver);
+void resolver_free(struct resolver *resolver);
+
+#endif
@@ -0,0 +1,298 @@
+/******************************************************************************
+ *
+ * Name File : secure.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#include "secure.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <openssl/err.h>
+
+/******************************************************************************
+ * Fonction qui configure le contexte commun au client et au serveur : TLS 1.2
+ * au minimum et, si demandé, chiffrement confié au noyau après la poignée de
+ * main (kTLS), quand le noyau et OpenSSL le permettent.
+ * Prend en paramètre :
+ *     - secure    Pointeur vers le contexte à initialiser.
+ *     - method    Méthode TLS (client ou serveur).
+ *     - ktls      1 pour activer kTLS, 0 pour chiffrer dans le processus.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur.
+ *****************************************************************************/
+static int secure_init(struct secure *secure, const SSL_METHOD *method,
+                       int ktls) {
+  memset(secure, 0, sizeof(*secure));
+  secure->ctx = SSL_CTX_new(method);
+  if ( secure->ctx == NULL ) {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(secure->ctx, TLS1_2_VERSION);
+  SSL_CTX_set_mode(secure->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if ( ktls )
+    SSL_CTX_set_options(secure->ctx, SSL_OP_ENABLE_KTLS);
+  SSL_CTX_set_app_data(secure->ctx, secure);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui initialise le contexte TLS du serveur. Les tickets de session
+ * sont chiffrés par une clé propre au processus : un client qui se reconnecte
+ * avec un ticket évite l'échange de clés complet.
+ * Prend en paramètre :
+ *     - secure      Pointeur vers le contexte à initialiser.
+ *     - certFile    Fichier PEM contenant le certificat et sa clé privée.
+ *     - ktls        1 pour activer kTLS, 0 pour chiffrer dans le processus.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur.
+ *****************************************************************************/
+int secure_server_init(struct secure *secure, char *certFile, int ktls) {
+  if ( secure_init(secure, TLS_server_method(), ktls) == -1 )
+    return -1;
+
+  if ( SSL_CTX_use_certificate_chain_file(secure->ctx, certFile) != 1
+       || SSL_CTX_use_PrivateKey_file(secure->ctx, certFile,
+                                      SSL_FILETYPE_PEM) != 1 ) {
+    ERR_print_errors_fp(stderr);
+    secure_free(secure);
+    return -1;
+  }
+  SSL_CTX_set_num_tickets(secure->ctx, SECURE_TICKETS);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction appelée par OpenSSL à la réception d'un ticket de session : le
+ * ticket remplace le précédent et servira à la prochaine connexion.
+ * Renvoie 1, le contexte garde la session.
+ *****************************************************************************/
+static int secure_new_session(SSL *ssl, SSL_SESSION *session) {
+  struct secure *secure = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+  if ( secure->session != NULL )
+    SSL_SESSION_free(secure->session);
+  secure->session = session;
+  return 1;
+}
+
+/******************************************************************************
+ * Fonction qui initialise le contexte TLS du client. Le certificat du serveur
+ * n'est pas vérifié : le serveur echo utilise un certificat auto-signé.
+ * Prend en paramètre :
+ *     - secure    Pointeur vers le contexte à initialiser.
+ *     - ktls      1 pour activer kTLS, 0 pour chiffrer dans le processus.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur.
+ *****************************************************************************/
+int secure_client_init(struct secure *secure, int ktls) {
+  if ( secure_init(secure, TLS_client_method(), ktls) == -1 )
+    return -1;
+
+  SSL_CTX_set_verify(secure->ctx, SSL_VERIFY_NONE, NULL);
+  SSL_CTX_set_session_cache_mode(secure->ctx, SSL_SESS_CACHE_CLIENT
+                                 | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(secure->ctx, secure_new_session);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui prépare la poignée de main d'un client accepté par le serveur.
+ * Prend en paramètre :
+ *     - secure    Pointeur vers le contexte du serveur.
+ *     - fd        Descripteur de la connexion, non bloquant.
+ * Renvoie la session TLS, NULL en cas d'erreur.
+ *****************************************************************************/
+SSL *secure_accept(struct secure *secure, int fd) {
+  SSL *ssl;
+
+  ssl = SSL_new(secure->ctx);
+  if ( ssl == NULL )
+    return NULL;
+  if ( SSL_set_fd(ssl, fd) != 1 ) {
+    SSL_free(ssl);
+    return NULL;
+  }
+  SSL_set_accept_state(ssl);
+  return ssl;
+}
+
+/******************************************************************************
+ * Fonction qui fait avancer une poignée de main sur un socket non bloquant.
+ * Prend en paramètre :
+ *     - secure    Pointeur vers le contexte.
+ *     - ssl       Session TLS.
+ * Renvoie 0 quand la poignée de main est terminée, SSL_ERROR_WANT_READ ou
+ * SSL_ERROR_WANT_WRITE si elle attend le socket, -1 en cas d'échec.
+ *****************************************************************************/
+int secure_handshake(struct secure *secure, SSL *ssl) {
+  int status;
+
+  status = SSL_do_handshake(ssl);
+  if ( status == 1 ) {
+    secure->handshakes++;
+    if ( SSL_session_reused(ssl) )
+      secure->resumed++;
+    if ( secure_offload(ssl) )
+      secure->offloaded++;
+    return 0;
+  }
+
+  status = SSL_get_error(ssl, status);
+  if ( status == SSL_ERROR_WANT_READ || status == SSL_ERROR_WANT_WRITE )
+    return status;
+  secure->failures++;
+  ERR_clear_error();
+  return -1;
+}
+
+/******************************************************************************
+ * Fonction qui établit une session TLS sur un socket bloquant connecté, en
+ * reprenant la session précédente si un ticket a été reçu.
+ * Prend en paramètre :
+ *     - secure    Pointeur vers le contexte du client.
+ *     - fd        Descripteur du socket connecté.
+ * Renvoie la session TLS, NULL en cas d'échec.
+ *****************************************************************************/
+SSL *secure_connect(struct secure *secure, int fd) {
+  SSL *ssl;
+
+  ssl = SSL_new(secure->ctx);
+  if ( ssl == NULL || SSL_set_fd(ssl, fd) != 1 ) {
+    SSL_free(ssl);
+    return NULL;
+  }
+  if ( secure->session != NULL )
+    SSL_set_session(ssl, secure->session);
+
+  if ( SSL_connect(ssl) != 1 ) {
+    ERR_print_errors_fp(stderr);
+    secure->failures++;
+    SSL_free(ssl);
+    return NULL;
+  }
+  secure->handshakes++;
+  if ( SSL_session_reused(ssl) )
+    secure->resumed++;
+  if ( secure_offload(ssl) )
+    secure->offloaded++;
+  return ssl;
+}
+
+/******************************************************************************
+ * Fonction qui indique si le noyau chiffre et déchiffre la connexion (kTLS) :
+ * les données applicatives passent alors par send et recv sur le socket.
+ * Prend en paramètre :
+ *     - ssl    Session TLS dont la poignée de main est terminée.
+ * Renvoie 1 si kTLS est actif dans les deux sens, 0 sinon.
+ *****************************************************************************/
+int secure_offload(SSL *ssl) {
+  return BIO_get_ktls_send(SSL_get_wbio(ssl))
+         && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+/******************************************************************************
+ * Fonction qui reçoit des données sur une session TLS, comme recv.
+ * Prend en paramètre :
+ *     - ssl       Session TLS.
+ *     - buffer    Pointeur vers la zone à remplir.
+ *     - len       Taille de la zone.
+ * Renvoie le nombre d'octets reçus, 0 à la fermeture, -1 en cas d'erreur
+ * (errno vaut EAGAIN si le socket non bloquant n'a rien à lire).
+ *****************************************************************************/
+ssize_t secure_recv(SSL *ssl, void *buffer, size_t len) {
+  int status;
+
+  status = SSL_read(ssl, buffer, len);
+  if ( status > 0 )
+    return status;
+
+  switch ( SSL_get_error(ssl, status) ) {
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_SYSCALL:
+    return -1;
+  default:
+    ERR_clear_error();
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui envoie des données sur une session TLS, comme send. Après un
+ * échec EAGAIN, l'appel doit être répété avec les mêmes données.
+ * Prend en paramètre :
+ *     - ssl       Session TLS.
+ *     - buffer    Pointeur vers les données à envoyer.
+ *     - len       Nombre d'octets à envoyer.
+ * Renvoie le nombre d'octets envoyés, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+ssize_t secure_send(SSL *ssl, const void *buffer, size_t len) {
+  int status;
+
+  status = SSL_write(ssl, buffer, len);
+  if ( status > 0 )
+    return status;
+
+  switch ( SSL_get_error(ssl, status) ) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_SYSCALL:
+    return -1;
+  default:
+    ERR_clear_error();
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui annonce la fermeture de la session au pair, sans attendre sa
+ * réponse, puis libère la session. Le socket reste ouvert.
+ * Prend en paramètre :
+ *     - ssl    Session TLS, ou NULL.
+ *****************************************************************************/
+void secure_close(SSL *ssl) {
+  if ( ssl == NULL )
+    return;
+  SSL_shutdown(ssl);
+  ERR_clear_error();
+  SSL_free(ssl);
+}
+
+/******************************************************************************
+ * Fonction qui affiche les compteurs TLS.
+ * Prend en paramètre :
+ *     - secure    Pointeur vers le contexte.
+ *****************************************************************************/
+void secure_print(struct secure *secure) {
+  printf("TLS handshakes : %lu, resumed : %lu, kTLS : %lu, failures : %lu\n",
+         secure->handshakes, secure->resumed, secure->offloaded,
+         secure->failures);
+}
+
+/******************************************************************************
+ * Fonction qui libère le contexte TLS et le dernier ticket reçu.
+ * Prend en paramètre :
+ *     - secure    Pointeur vers le contexte.
+ *****************************************************************************/
+void secure_free(struct secure *secure) {
+  if ( secure->session != NULL )
+    SSL_SESSION_free(secure->session);
+  SSL_CTX_free(secure->ctx);
+  secure->session = NULL;
+  secure->ctx = NULL;
+}
@@ -0,0 +1,44 @@
+/******************************************************************************
+ *
+ * Name File : secure.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef SECURE_H
+#define SECURE_H
+
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+#define SECURE_TICKETS 1	/* Tickets de session envoyés par connexion */
+
+/* Contexte TLS partagé par toutes les connexions, et ses compteurs */
+struct secure {
+  SSL_CTX *ctx;
+  SSL_SESSION *session;		/* client : dernier ticket reçu, ou NULL */
+  unsigned long handshakes;
+  unsigned long resumed;	/* poignées de main abrégées par un ticket */
+  unsigned long offloaded;	/* chiffrement confié au noyau (kTLS) */
+  unsigned long failures;
+};
+
+int secure_server_init(struct secure *secure, char *certFile, int ktls);
+int secure_client_init(struct secure *secure, int ktls);
+SSL *secure_accept(struct secure *secure, int fd);
+int secure_handshake(struct secure *secure, SSL *ssl);
+SSL *secure_connect(struct secure *secure, int fd);
+int secure_offload(SSL *ssl);
+ssize_t secure_recv(SSL *ssl, void *buffer, size_t len);
+ssize_t secure_send(SSL *ssl, const void *buffer, size_t len);
+void secure_close(SSL *ssl);
+void secure_print(struct secure *secure);
+void secure_free(struct secure *secure);
+
+#endif
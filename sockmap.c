@@ -0,0 +1,329 @@
+/******************************************************************************
+ *
+ * Name File : sockmap.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "sockmap.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+
+/******************************************************************************
+ * Fonction qui appelle bpf(), que la bibliothèque C n'enveloppe pas.
+ * Prend en paramètre :
+ *     - command    Commande BPF_*.
+ *     - attr       Paramètres de la commande.
+ * Renvoie le résultat de la commande, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+static int sockmap_bpf(int command, union bpf_attr *attr) {
+  return (int) syscall(SYS_bpf, command, attr, sizeof(*attr));
+}
+
+/******************************************************************************
+ * Fonction qui crée une table BPF.
+ * Prend en paramètre :
+ *     - type       Type de la table.
+ *     - key        Taille d'une clé.
+ *     - value      Taille d'une valeur.
+ *     - entries    Nombre d'entrées.
+ * Renvoie le descripteur de la table, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+static int sockmap_map_create(int type, int key, int value, int entries) {
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key;
+  attr.value_size = value;
+  attr.max_entries = entries;
+  return sockmap_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/******************************************************************************
+ * Fonction qui charge le programme de renvoi (BPF_PROG_TYPE_SK_SKB), appelé
+ * pour chaque paquet reçu sur une connexion de la table :
+ *     clé = { remote_ip4, remote_port, local_port } du paquet
+ *     stats[0].packets += 1, stats[0].bytes += len
+ *     return bpf_sk_redirect_hash(skb, map, &clé, 0)
+ * Sans drapeau BPF_F_INGRESS, le paquet part vers l'émission du socket de
+ * la clé, c'est-à-dire vers le client qui l'a envoyé.
+ * Prend en paramètre :
+ *     - sockmap    Tables déjà créées.
+ * Renvoie le descripteur du programme, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+static int sockmap_program_load(struct sockmap *sockmap) {
+  struct bpf_insn code[] = {
+    /* r6 = skb ; clé sur la pile en fp-16, index des statistiques en fp-4 */
+    { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0 },
+    { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+      offsetof(struct __sk_buff, remote_ip4), 0 },
+    { BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -16, 0 },
+    { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+      offsetof(struct __sk_buff, remote_port), 0 },
+    { BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -12, 0 },
+    { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+      offsetof(struct __sk_buff, local_port), 0 },
+    { BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -8, 0 },
+    { BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, 0 },
+    /* r0 = bpf_map_lookup_elem(stats, fp-4) */
+    { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+      sockmap->statsDescriptor },
+    { 0, 0, 0, 0, 0 },
+    { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0 },
+    { BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4 },
+    { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem },
+    /* Compteurs partagés par les CPU : additions atomiques */
+    { BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 4, 0 },
+    { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1 },
+    { BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_0, BPF_REG_1, 0, BPF_ADD },
+    { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_6,
+      offsetof(struct __sk_buff, len), 0 },
+    { BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_0, BPF_REG_1, 8, BPF_ADD },
+    /* return bpf_sk_redirect_hash(skb, map, fp-16, 0) */
+    { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0 },
+    { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0,
+      sockmap->mapDescriptor },
+    { 0, 0, 0, 0, 0 },
+    { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0 },
+    { BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16 },
+    { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0 },
+    { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash },
+    { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 }
+  };
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+  attr.insns = (uintptr_t) code;
+  attr.insn_cnt = sizeof(code) / sizeof(code[0]);
+  attr.license = (uintptr_t) "Dual BSD/GPL";
+  return sockmap_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/******************************************************************************
+ * Fonction qui prépare l'echo dans le noyau : table des connexions,
+ * compteurs, programme de renvoi attaché à la table (BPF_SK_SKB_VERDICT,
+ * sans découpage des messages). Il faut CAP_BPF et CAP_NET_ADMIN, et un
+ * noyau 5.13 ou plus récent.
+ * Prend en paramètre :
+ *     - sockmap    Structure remplie.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur (errno), rien n'est alors
+ * gardé ouvert.
+ *****************************************************************************/
+int sockmap_open(struct sockmap *sockmap) {
+  union bpf_attr attr;
+  int error;
+
+  sockmap->statsDescriptor = -1;
+  sockmap->programDescriptor = -1;
+  sockmap->mapDescriptor = sockmap_map_create(BPF_MAP_TYPE_SOCKHASH,
+                                              sizeof(struct sockmap_key),
+                                              sizeof(uint32_t),
+                                              SOCKMAP_MAX_ENTRIES);
+  if ( sockmap->mapDescriptor == -1 )
+    return -1;
+  sockmap->statsDescriptor = sockmap_map_create(BPF_MAP_TYPE_ARRAY,
+                                                sizeof(uint32_t),
+                                                2 * sizeof(uint64_t), 1);
+  if ( sockmap->statsDescriptor != -1 )
+    sockmap->programDescriptor = sockmap_program_load(sockmap);
+  if ( sockmap->programDescriptor != -1 ) {
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd = sockmap->mapDescriptor;
+    attr.attach_bpf_fd = sockmap->programDescriptor;
+    attr.attach_type = BPF_SK_SKB_VERDICT;
+    if ( sockmap_bpf(BPF_PROG_ATTACH, &attr) == 0 )
+      return 0;
+  }
+  error = errno;
+  sockmap_close(sockmap);
+  errno = error;
+  return -1;
+}
+
+/******************************************************************************
+ * Fonction qui calcule la clé d'une connexion telle que le programme la lit
+ * dans le contexte d'un paquet. Seuls les clients IPv4 (ou IPv6 de la forme
+ * ::ffff:a.b.c.d) ont une clé : elle ne porte que l'adresse IPv4.
+ * Prend en paramètre :
+ *     - fd     Connexion acceptée.
+ *     - key    Clé remplie.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur (errno, EAFNOSUPPORT pour
+ * un client IPv6).
+ *****************************************************************************/
+static int sockmap_key_of(int fd, struct sockmap_key *key) {
+  struct sockaddr_storage peer, local;
+  struct sockaddr_in *peer4;
+  struct sockaddr_in6 *peer6;
+  socklen_t length;
+  uint16_t port;
+
+  length = sizeof(peer);
+  if ( getpeername(fd, (struct sockaddr *) &peer, &length) == -1 )
+    return -1;
+  length = sizeof(local);
+  if ( getsockname(fd, (struct sockaddr *) &local, &length) == -1 )
+    return -1;
+
+  memset(key, 0, sizeof(*key));
+  if ( peer.ss_family == AF_INET ) {
+    peer4 = (struct sockaddr_in *) &peer;
+    memcpy(&key->remoteAddress, &peer4->sin_addr, sizeof(key->remoteAddress));
+    port = peer4->sin_port;
+    key->localPort = ntohs(((struct sockaddr_in *) &local)->sin_port);
+  } else {
+    peer6 = (struct sockaddr_in6 *) &peer;
+    if ( peer.ss_family != AF_INET6
+         || !IN6_IS_ADDR_V4MAPPED(&peer6->sin6_addr) ) {
+      errno = EAFNOSUPPORT;
+      return -1;
+    }
+    memcpy(&key->remoteAddress, &peer6->sin6_addr.s6_addr[12],
+           sizeof(key->remoteAddress));
+    port = peer6->sin6_port;
+    key->localPort = ntohs(((struct sockaddr_in6 *) &local)->sin6_port);
+  }
+  /* Le noyau rend le port du client dans les 16 bits de poids fort */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+  key->remotePort = (uint32_t) port << 16;
+#else
+  key->remotePort = port;
+#endif
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui confie une connexion TCP acceptée au noyau : dès son
+ * inscription, ce qu'elle reçoit est renvoyé sans passer par le processus,
+ * qui n'attend plus que sa fermeture. Elle quitte la table à sa fermeture.
+ * Une clé déjà prise n'est pas remplacée.
+ * Les octets reçus avant l'inscription attendraient le paquet suivant : une
+ * lecture non bloquante les fait passer par le programme. Si elle les rend
+ * au lieu de cela, la connexion est retirée de la table et reste au
+ * processus, qui les lira.
+ * Prend en paramètre :
+ *     - sockmap    Echo dans le noyau ouvert.
+ *     - fd         Connexion acceptée, avant toute lecture.
+ * Renvoie 0 en cas de succès, -1 si la connexion reste au processus
+ * (errno, EAFNOSUPPORT pour un client IPv6, EBUSY pour des octets en
+ * attente).
+ *****************************************************************************/
+int sockmap_add(struct sockmap *sockmap, int fd) {
+  struct sockmap_key key;
+  uint32_t value = fd;
+  union bpf_attr attr;
+  char byte;
+
+  if ( sockmap_key_of(fd, &key) == -1 )
+    return -1;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = sockmap->mapDescriptor;
+  attr.key = (uintptr_t) &key;
+  attr.value = (uintptr_t) &value;
+  attr.flags = BPF_NOEXIST;
+  if ( sockmap_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1 )
+    return -1;
+
+  if ( recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) <= 0 )
+    return 0;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = sockmap->mapDescriptor;
+  attr.key = (uintptr_t) &key;
+  sockmap_bpf(BPF_MAP_DELETE_ELEM, &attr);
+  errno = EBUSY;
+  return -1;
+}
+
+/******************************************************************************
+ * Fonction qui mesure ce qu'une connexion inscrite a reçu sans l'avoir
+ * encore remis à sa file d'émission : le programme ne fait que passer les
+ * paquets à un travail du noyau qui les écrit quand il y a de la place, et
+ * les fermer avant les perdrait. À appeler une fois le FIN du client reçu,
+ * compté par le noyau dans les octets reçus.
+ * Prend en paramètre :
+ *     - fd    Connexion inscrite.
+ * Renvoie le nombre d'octets encore à renvoyer, -1 si le noyau ne sait pas
+ * le dire (errno).
+ *****************************************************************************/
+long long sockmap_pending(int fd) {
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+  int queued;
+
+  memset(&info, 0, sizeof(info));
+  if ( getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1
+       || ioctl(fd, SIOCOUTQ, &queued) == -1 )
+    return -1;
+  if ( length < offsetof(struct tcp_info, tcpi_bytes_received)
+                + sizeof(info.tcpi_bytes_received) ) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  /* Octets reçus, moins le FIN, moins ceux acquittés ou en file d'émission */
+  return (long long) (info.tcpi_bytes_received - 1 - info.tcpi_bytes_acked)
+         - queued;
+}
+
+/******************************************************************************
+ * Fonction qui lit les compteurs du programme de renvoi.
+ * Prend en paramètre :
+ *     - sockmap    Echo dans le noyau ouvert.
+ *     - packets    Paquets renvoyés.
+ *     - bytes      Octets renvoyés.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+int sockmap_stats(struct sockmap *sockmap, unsigned long long *packets,
+                  unsigned long long *bytes) {
+  union bpf_attr attr;
+  uint64_t value[2];
+  uint32_t key = 0;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = sockmap->statsDescriptor;
+  attr.key = (uintptr_t) &key;
+  attr.value = (uintptr_t) value;
+  if ( sockmap_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == -1 )
+    return -1;
+  *packets = value[0];
+  *bytes = value[1];
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui ferme le programme et les tables. Les connexions encore
+ * inscrites quittent la table quand elle est détruite.
+ * Prend en paramètre :
+ *     - sockmap    Echo dans le noyau.
+ *****************************************************************************/
+void sockmap_close(struct sockmap *sockmap) {
+  if ( sockmap->programDescriptor != -1 )
+    close(sockmap->programDescriptor);
+  if ( sockmap->statsDescriptor != -1 )
+    close(sockmap->statsDescriptor);
+  if ( sockmap->mapDescriptor != -1 )
+    close(sockmap->mapDescriptor);
+  sockmap->programDescriptor = -1;
+  sockmap->statsDescriptor = -1;
+  sockmap->mapDescriptor = -1;
+}
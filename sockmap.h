@@ -0,0 +1,46 @@
+/******************************************************************************
+ *
+ * Name File : sockmap.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef SOCKMAP_H
+#define SOCKMAP_H
+
+/* Echo dans le noyau : les connexions TCP inscrites dans une table de
+   sockets (BPF_MAP_TYPE_SOCKHASH) passent par un programme BPF qui renvoie
+   chaque paquet reçu vers l'émission du même socket, sans réveiller le
+   processus. Le programme est assemblé ici et chargé par l'appel système
+   bpf(), sans libbpf. */
+#define SOCKMAP_MAX_ENTRIES 65536	/* Connexions inscrites au plus */
+
+/* Clé d'une connexion, lue par le programme dans le contexte du paquet :
+   adresse IPv4 du client, port du client (ordre réseau, décalé comme le
+   rend le noyau) et port local (ordre de l'hôte) */
+struct sockmap_key {
+  unsigned int remoteAddress;
+  unsigned int remotePort;
+  unsigned int localPort;
+};
+
+struct sockmap {
+  int mapDescriptor;		/* connexions servies par le noyau */
+  int statsDescriptor;		/* paquets et octets renvoyés */
+  int programDescriptor;
+};
+
+int sockmap_open(struct sockmap *sockmap);
+int sockmap_add(struct sockmap *sockmap, int fd);
+long long sockmap_pending(int fd);
+int sockmap_stats(struct sockmap *sockmap, unsigned long long *packets,
+                  unsigned long long *bytes);
+void sockmap_close(struct sockmap *sockmap);
+
+#endif
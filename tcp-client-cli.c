@@ -11,39 +11,46 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <time.h>
+
+#include "resolver.h"
+#include "happy-eyeballs.h"
+#include "open-loop.h"
+#include "trace.h"
+#include "secure.h"
+#include "bulk.h"
+#include "mux.h"
+#include "tstamp.h"
+#include "hedge.h"
 
 #define MSG_SIZE 80
 
 /******************************************************************************
  * Fonction qui récupère les informations du serveur en mode datagramme.
  * Prend en paramètre :
+ *     - resolver      Pointeur vers le résolveur et son cache.
  *     - serverName    Pointeur vers une chaine de caractère pour le nom ou
  *                       l'adresse IP du serveur.
  *     - serverPort    Pointeur vers une chaine de caractère pour le numéro de
  *                       port du serveur.
  * Renvoie la structure d'information addrinfo.
  *****************************************************************************/
-struct addrinfo get_info(char *serverName, char *serverPort) {
+struct addrinfo get_info(struct resolver *resolver, char *serverName,
+                         char *serverPort) {
   int status;
-  struct addrinfo hints;
   struct addrinfo *servInfo;
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-  hints.ai_canonname = NULL;
-  hints.ai_addr = NULL;
-  hints.ai_next = NULL;
-
-  /* Ouverture et récupération des informations de connexion au serveur */
-  status = getaddrinfo(serverName, serverPort, &hints, &servInfo);
+  /* Résolution servie par le cache si possible, sans bloquer */
+  status = resolver_lookup(resolver, serverName, serverPort, AF_UNSPEC,
+                           SOCK_STREAM, &servInfo);
   if ( status != 0 ) {
     fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
     exit(EXIT_FAILURE);
@@ -52,24 +59,6 @@ struct addrinfo get_info(char *serverName, char *serverPort) {
   return *servInfo;
 }
 
-/******************************************************************************
- * Fonction qui permet d'ouvrir le socket.
- * Prend en paramètre la structure récupérée par la fonction 'get_info'.
- * Renvoie le descripteur du socket.
- *****************************************************************************/
-int socket_open(struct addrinfo *servInfo) {
-  int socketDescriptor;
-
-  socketDescriptor = socket(servInfo->ai_family, servInfo->ai_socktype,
-                            servInfo->ai_protocol);
-  if ( socketDescriptor == -1) {
-    perror("Error with socket");
-    exit(EXIT_FAILURE);
-  }
-
-  return socketDescriptor;
-}
-
 /******************************************************************************
  * Fonction qui ferme le socket.
  * Prend en paramètre le descripteur du socket.
@@ -80,30 +69,44 @@ void socket_close(int socketDescriptor) {
 
 /******************************************************************************
  * Fonction qui permet de créer le flux TCP entre le client et le serveur.
+ * Toutes les adresses du serveur (IPv6 et IPv4) sont mises en concurrence,
+ * la première connexion établie est retenue.
  * Prend en paramètre :
- *     - socketDescriptor    Numéro du descripteur de socket.
- *     - servInfo            Pointeur vers les informations récupérées par la
- *                             fonction 'get_info'.
+ *     - history     Pointeur vers l'historique de connexion des adresses.
+ *     - servInfo    Pointeur vers les informations récupérées par la
+ *                     fonction 'get_info'.
+ *     - winner      Pointeur vers l'adresse retenue à renseigner.
+ * Renvoie le descripteur du socket connecté.
  *****************************************************************************/
-void client_connect(int socketDescriptor, struct addrinfo *servInfo) {
-  if (connect(socketDescriptor, servInfo->ai_addr, servInfo->ai_addrlen) == -1) {
-    close(socketDescriptor);
+int client_connect(struct he_history *history, struct addrinfo *servInfo,
+                   struct addrinfo **winner) {
+  int socketDescriptor;
+
+  socketDescriptor = he_connect(history, servInfo, winner);
+  if ( socketDescriptor == -1 ) {
     perror("Error with connect");
     exit(EXIT_FAILURE);
   }
+
+  return socketDescriptor;
 }
 
 /******************************************************************************
  * Fonction qui envoie un message sur le flux du client.
  * Prend en paramètre :
  *     - socketDescriptor    Numéro du descripteur de socket.
+ *     - ssl                 Session TLS, ou NULL.
  *     - msg                 Pointeur vers la chaine de caractère à envoyer.
  * Renvoie le code de la fonction sendTo.
  *****************************************************************************/
-int message_send(int socketDescriptor, struct addrinfo *servInfo, char *msg) {
+int message_send(int socketDescriptor, SSL *ssl, struct addrinfo *servInfo,
+                 char *msg) {
   int status;
 
-  status = sendto(socketDescriptor, msg, strlen(msg), 0, servInfo->ai_addr, servInfo->ai_addrlen);
+  if ( ssl != NULL )
+    status = secure_send(ssl, msg, strlen(msg));
+  else
+    status = sendto(socketDescriptor, msg, strlen(msg), 0, servInfo->ai_addr, servInfo->ai_addrlen);
   if ( status == -1 ) {
     perror("Error with sendto");
     close(socketDescriptor);
@@ -117,20 +120,50 @@ int message_send(int socketDescriptor, struct addrinfo *servInfo, char *msg) {
  * Fonction qui reçoit un message du flux du client.
  * Il prend en paramètre :
  *     - socketDescriptor    Numéro du descripteur de socket.
+ *     - ssl                 Session TLS, ou NULL.
  *     - msg                 Pointeur vers la chaine de caractère à récupérer.
+ *     - stamp               Horodatages de réception du début de la réponse
+ *                             à remplir, ou NULL.
  * Renvoie le code de la fonction recv.
  *****************************************************************************/
-int message_receive(int socketDescriptor, char *msg) {
+int message_receive(int socketDescriptor, SSL *ssl, char *msg,
+                    struct tstamp *stamp) {
   int status;
+  int received = 0;
 
-  status = recv(socketDescriptor, msg, MSG_SIZE, 0);
-  if ( status == -1 ) {
-    perror("Error with recv");
-    close(socketDescriptor);
-    exit(EXIT_FAILURE);
+  /* Le serveur renvoie toujours MSG_SIZE octets, lecture jusqu'au dernier */
+  while ( received < MSG_SIZE ) {
+    if ( ssl != NULL )
+      status = secure_recv(ssl, msg + received, MSG_SIZE - received);
+    else if ( stamp != NULL && received == 0 )
+      status = tstamp_recv(socketDescriptor, msg, MSG_SIZE, 0, NULL, NULL,
+                           stamp);
+    else
+      status = recv(socketDescriptor, msg + received, MSG_SIZE - received, 0);
+    if ( status == -1 ) {
+      perror("Error with recv");
+      close(socketDescriptor);
+      exit(EXIT_FAILURE);
+    }
+    if ( status == 0 )
+      break;
+    received += status;
   }
 
-  return status;
+  return received;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le temps écoulé depuis un instant donné.
+ * Prend en paramètre :
+ *     - start    Pointeur vers l'instant de départ (CLOCK_MONOTONIC).
+ * Renvoie le temps écoulé en secondes.
+ *****************************************************************************/
+double elapsed_since(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
 /******************************************************************************
@@ -140,40 +173,344 @@ int message_receive(int socketDescriptor, char *msg) {
  *     - host : Adresse de destination (adresse IP ou nom de domaine)
  *     - port : Port du serveur de destination
  *     - msg : Message à envoyer au serveur
+ *   Options :
+ *     - -n count : Nombre d'aller-retours à effectuer (1 par défaut), un
+ *                    résumé du débit et de la latence est affiché si > 1
+ *     - -r       : Ouvre une nouvelle connexion pour chaque aller-retour, le
+ *                    nom du serveur est alors résolu par le cache
+ *     - -R sched : Mode boucle ouverte : les messages partent au débit fixé
+ *                    par le calendrier, sans attendre les réponses. 'sched'
+ *                    vaut "rate", "from:to:step" (paliers) ou "from-to"
+ *                    (rampe), en messages par seconde
+ *     - -d sec   : Durée du mode boucle ouverte, par palier (10 par défaut)
+ *     - -P file  : Rejoue vers le serveur une trace capturée par un serveur
+ *                    (option -C), 'msg' est alors facultatif
+ *     - -S speed : Vitesse du rejeu (1 : temps réel par défaut, 0 : au plus
+ *                    vite)
+ *     - -W from:to : Fenêtre rejouée, en secondes depuis le début de la trace
+ *     - -F file  : Mode flux : envoie le fichier au serveur lancé en mode
+ *                    flux (-s) et vérifie le flux renvoyé, 'msg' est alors
+ *                    facultatif
+ *     - -Z size  : Mode flux avec un flux synthétique de 'size' octets
+ *                    (suffixes K, M et G acceptés)
+ *     - -T       : Chiffre les aller-retours avec TLS ; avec -r, chaque
+ *                    reconnexion reprend la session par son ticket
+ *     - -K       : Chiffrement dans le processus, sans kTLS
+ *     - -m depth : Protocole multiplexé : les 'count' requêtes partent sur
+ *                    une seule connexion, 'depth' à la fois au plus, vers un
+ *                    serveur lancé avec -m
+ *     - -D ms    : Avec -m, une requête sur deux est différée de 'ms'
+ *                    millisecondes par le serveur, les suivantes la doublent
+ *     - -X       : Découpe chaque aller-retour grâce aux horodatages du
+ *                    noyau (SO_TIMESTAMPING) : pile d'envoi, file de la
+ *                    carte, réseau et serveur, réveil à la réception
+ *     - -E list  : Requêtes doublées : une requête sans réponse après le
+ *                    délai part aussi vers le serveur suivant de la liste
+ *                    'hôte:port,...', la première réponse est retenue
+ *     - -H delay : Délai avant l'envoi en double, "pNN" pour le centile NN
+ *                    des latences observées (p95 par défaut) ou en ms
+ *     - -B pct   : Part maximale des requêtes envoyées en double (10 %
+ *                    par défaut)
  *****************************************************************************/
 int main(int argc, char *argv[]) {
   struct addrinfo servInfo;
-  int socketDescriptor;
+  struct addrinfo *winner;
+  struct resolver resolver;
+  struct he_history history;
+  int socketDescriptor = -1;
   char msg[MSG_SIZE];
+  struct timespec start;
+  double elapsed;
+  long count = 1;
+  long i;
+  int reconnect = 0;
+  struct secure secure;
+  SSL *ssl = NULL;
+  int tls = 0, ktls = 1;
+  char *bulkFile = NULL;
+  size_t bulkSize = 0;
+  int depth = 0, delay = 0;
+  struct tstamp_stats tstats;
+  struct timespec before, after;
+  struct tstamp_tx tx;
+  struct tstamp rx;
+  uint32_t txBytes = 0;
+  int timestamps = 0;
+  struct ol_schedule schedule;
+  char *scheduleSpec = NULL;
+  double duration = 10;
+  char *replay = NULL;
+  double speed = 1, from = 0, to = 0;
+  char *endpoints = NULL, *hedgeDelay = NULL;
+  double hedgeBudget = HEDGE_BUDGET;
+  struct hedge hedge;
+  char primary[NI_MAXHOST + NI_MAXSERV + 1];
+  char *copy, *name, *host, *port, *saveptr;
+  int status;
+  int opt, e;
 
 
   /* Vérification des paramètres du programme */
-  if ( argc < 4 ) {
-    fprintf(stderr, "Usage %s host port msg\n", argv[0]);
+  while ( (opt = getopt(argc, argv, "n:rR:d:P:S:W:TKF:Z:m:D:XE:H:B:")) != -1 ) {
+    switch ( opt ) {
+    case 'n':
+      count = atol(optarg);
+      break;
+    case 'r':
+      reconnect = 1;
+      break;
+    case 'T':
+      tls = 1;
+      break;
+    case 'K':
+      ktls = 0;
+      break;
+    case 'F':
+      bulkFile = optarg;
+      break;
+    case 'Z':
+      if ( (bulkSize = bulk_size_parse(optarg)) == 0 )
+        count = 0;
+      break;
+    case 'm':
+      depth = atoi(optarg);
+      if ( depth < 1 || depth > MUX_WINDOW )
+        count = 0;
+      break;
+    case 'D':
+      delay = atoi(optarg);
+      if ( delay < 0 )
+        count = 0;
+      break;
+    case 'X':
+      timestamps = 1;
+      break;
+    case 'E':
+      endpoints = optarg;
+      break;
+    case 'H':
+      hedgeDelay = optarg;
+      break;
+    case 'B':
+      hedgeBudget = atof(optarg);
+      break;
+    case 'R':
+      scheduleSpec = optarg;
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'P':
+      replay = optarg;
+      break;
+    case 'S':
+      speed = atof(optarg);
+      break;
+    case 'W':
+      if ( sscanf(optarg, "%lf:%lf", &from, &to) != 2 || to < from )
+        count = 0;
+      break;
+    default:
+      count = 0;
+    }
+  }
+  if ( scheduleSpec != NULL
+       && ol_schedule_parse(&schedule, scheduleSpec, duration) == -1 )
+    count = 0;
+  if ( endpoints != NULL
+       && hedge_init(&hedge, SOCK_STREAM, hedgeDelay, hedgeBudget) == -1 )
+    count = 0;
+  if ( argc - optind < (replay != NULL || bulkFile != NULL || bulkSize != 0
+                        ? 2 : 3) || count < 1 || speed < 0 ) {
+    fprintf(stderr, "Usage %s [-n count] [-r] [-R rate|from:to:step|from-to] "
+            "[-d sec] [-P file] [-S speed] [-W from:to] [-F file|-Z size] "
+            "[-T [-K]] [-m depth [-D ms]] [-X] [-E host:port,... [-H pNN|ms] "
+            "[-B pct]] host port [msg]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if ( endpoints != NULL && (reconnect || tls || timestamps || replay != NULL
+                             || scheduleSpec != NULL || bulkFile != NULL
+                             || bulkSize != 0 || depth != 0) ) {
+    fprintf(stderr, "Hedging is only available for plain round trips (-n).\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( tls && (replay != NULL || scheduleSpec != NULL || bulkFile != NULL
+              || bulkSize != 0 || depth != 0) ) {
+    fprintf(stderr, "TLS is only available for round trips (-n).\n");
     exit(EXIT_FAILURE);
   }
+  if ( timestamps && (tls || replay != NULL || scheduleSpec != NULL
+                     || bulkFile != NULL || bulkSize != 0 || depth != 0) ) {
+    fprintf(stderr, "Timestamps are only available for plain round trips (-n).\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( timestamps )
+    tstamp_client_init(&tstats);
+  if ( tls && secure_client_init(&secure, ktls) == -1 )
+    exit(EXIT_FAILURE);
 
   printf("\n ****      Welcome to the TCP Client.      ****\n\n");
 
-  /* Récupération des informations du serveur */
-  servInfo = get_info(argv[1], argv[2]);
+  resolver_init(&resolver);
+  he_init(&history);
+
+  /* Requêtes multiplexées sur une seule connexion */
+  if ( depth != 0 ) {
+    servInfo = get_info(&resolver, argv[optind], argv[optind+1]);
+    socketDescriptor = client_connect(&history, &servInfo, &winner);
+    printf("Connected to the server.\n");
+    i = mux_bench(socketDescriptor, count, depth, delay, argv[optind+2]);
+    socket_close(socketDescriptor);
+    resolver_free(&resolver);
+    exit(i == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  /* Requêtes doublées : une connexion par serveur de la liste */
+  if ( endpoints != NULL ) {
+    servInfo = get_info(&resolver, argv[optind], argv[optind+1]);
+    snprintf(primary, sizeof(primary), "%s:%s", argv[optind], argv[optind+1]);
+    hedge_add(&hedge, client_connect(&history, &servInfo, &winner), primary);
+    for ( name = strtok_r(endpoints, ",", &saveptr); name != NULL;
+          name = strtok_r(NULL, ",", &saveptr) ) {
+      copy = strdup(name);
+      if ( copy == NULL || hedge_split(copy, &host, &port) == -1 ) {
+        fprintf(stderr, "Invalid endpoint %s\n", name);
+        exit(EXIT_FAILURE);
+      }
+      servInfo = get_info(&resolver, host, port);
+      if ( hedge_add(&hedge, client_connect(&history, &servInfo, &winner),
+                     name) == -1 ) {
+        fprintf(stderr, "At most %d endpoints\n", HEDGE_MAX_ENDPOINTS);
+        exit(EXIT_FAILURE);
+      }
+      free(copy);
+    }
+    printf("Connected to %d servers.\n", hedge.count);
+    i = hedge_bench(&hedge, count, argv[optind+2]);
+    for ( e = 0; e < hedge.count; e++ )
+      socket_close(hedge.endpoints[e].fd);
+    resolver_free(&resolver);
+    exit(i == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  /* Mode flux sur une seule connexion */
+  if ( bulkFile != NULL || bulkSize != 0 ) {
+    servInfo = get_info(&resolver, argv[optind], argv[optind+1]);
+    socketDescriptor = client_connect(&history, &servInfo, &winner);
+    printf("Connected to the server.\n");
+    i = bulk_run(socketDescriptor, bulkFile, bulkSize);
+    socket_close(socketDescriptor);
+    resolver_free(&resolver);
+    exit(i == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
 
-  /* Ouverture du socket */
-  socketDescriptor = socket_open(&servInfo);
+  /* Rejeu d'une trace sur une seule connexion */
+  if ( replay != NULL ) {
+    servInfo = get_info(&resolver, argv[optind], argv[optind+1]);
+    socketDescriptor = client_connect(&history, &servInfo, &winner);
+    printf("Connected to the server.\n");
+    if ( trace_replay(socketDescriptor, SOCK_STREAM, replay, speed, from, to) == -1 ) {
+      perror("Error with trace_replay");
+      exit(EXIT_FAILURE);
+    }
+    socket_close(socketDescriptor);
+    resolver_free(&resolver);
+    exit(EXIT_SUCCESS);
+  }
 
-  /* Connexion au serveur */
-  client_connect(socketDescriptor, &servInfo);
-  printf("Connected to the server.\n");
+  /* Mode boucle ouverte sur une seule connexion */
+  if ( scheduleSpec != NULL ) {
+    servInfo = get_info(&resolver, argv[optind], argv[optind+1]);
+    socketDescriptor = client_connect(&history, &servInfo, &winner);
+    printf("Connected to the server.\n");
+    if ( ol_run(socketDescriptor, SOCK_STREAM, &schedule, argv[optind+2]) == -1 ) {
+      fprintf(stderr, "Open-loop run failed\n");
+      exit(EXIT_FAILURE);
+    }
+    socket_close(socketDescriptor);
+    resolver_free(&resolver);
+    exit(EXIT_SUCCESS);
+  }
 
-  /* Envoie du message */
-  message_send(socketDescriptor, &servInfo, argv[3]);
-  printf("Message sent : %s\n", argv[3]);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for ( i = 0; i < count; i++ ) {
+    if ( socketDescriptor == -1 ) {
+      /* Récupération des informations du serveur */
+      servInfo = get_info(&resolver, argv[optind], argv[optind+1]);
 
-  /* Reception du message envoyé par le serveur echo */
-  message_receive(socketDescriptor, msg);
-  printf("Message received : %s\n", msg);
+      /* Connexion au serveur, sur la première de ses adresses qui répond */
+      socketDescriptor = client_connect(&history, &servInfo, &winner);
+      if ( tls && (ssl = secure_connect(&secure, socketDescriptor)) == NULL ) {
+        fprintf(stderr, "TLS handshake failed.\n");
+        exit(EXIT_FAILURE);
+      }
+      /* Les envois sont numérotés par octet depuis l'activation */
+      if ( timestamps ) {
+        if ( tstamp_enable(socketDescriptor, 1) == -1 ) {
+          perror("Error with SO_TIMESTAMPING");
+          exit(EXIT_FAILURE);
+        }
+        txBytes = 0;
+      }
+      if ( i == 0 )
+        printf("Connected to the server.\n");
+    }
 
-  close(socketDescriptor);
+    if ( timestamps ) {
+      memset(&tx, 0, sizeof(tx));
+      tstamp_now(&before);
+    }
+
+    /* Envoie du message */
+    status = message_send(socketDescriptor, ssl, winner, argv[optind+2]);
+
+    /* Reception du message envoyé par le serveur echo */
+    message_receive(socketDescriptor, ssl, msg, timestamps ? &rx : NULL);
+
+    /* Horodatages d'émission, repérés par le dernier octet envoyé */
+    if ( timestamps ) {
+      tstamp_now(&after);
+      /* Un envoi raté ne décale pas les numéros des suivants */
+      if ( status > 0 ) {
+        txBytes += status;
+        tstamp_tx_read(socketDescriptor, txBytes - 1, &tx);
+      }
+      tstamp_client_add(&tstats, &before, &tx, &rx, &after);
+    }
+
+    if ( reconnect ) {
+      secure_close(ssl);
+      ssl = NULL;
+      socket_close(socketDescriptor);
+      socketDescriptor = -1;
+    }
+  }
+  elapsed = elapsed_since(&start);
+
+  if ( count == 1 ) {
+    printf("Message sent : %s\n", argv[optind+2]);
+    printf("Message received : %s\n", msg);
+  } else {
+    printf("Round trips : %ld in %.6f s (%.0f msg/s, %.1f us avg)\n",
+           count, elapsed, count / elapsed, elapsed * 1e6 / count);
+    printf("Resolver : numeric %lu, hits %lu, misses %lu, refreshes %lu, "
+           "failures %lu\n", resolver.numeric, resolver.hits, resolver.misses,
+           resolver.refreshes, resolver.failures);
+    he_print(&history);
+    if ( tls )
+      secure_print(&secure);
+  }
+  if ( timestamps ) {
+    tstamp_print(&tstats);
+    tstamp_stats_free(&tstats);
+  }
+
+  secure_close(ssl);
+  if ( socketDescriptor != -1 )
+    socket_close(socketDescriptor);
+  if ( tls )
+    secure_free(&secure);
+  resolver_free(&resolver);
 
   exit(EXIT_SUCCESS);
 }
@@ -18,6 +18,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 
+#include "happy-eyeballs.h"
+
 #define MSG_SIZE 80
 #define NAME_ARRAY_SIZE 80
 #define PORT_ARRAY_SIZE 8
@@ -52,7 +54,7 @@ struct addrinfo get_info(char *serverName, char *serverPort) {
   struct addrinfo *servInfo;
 
   memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
+  hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_flags = AI_PASSIVE;
   hints.ai_canonname = NULL;
@@ -69,24 +71,6 @@ struct addrinfo get_info(char *serverName, char *serverPort) {
   return *servInfo;
 }
 
-/******************************************************************************
- * Fonction qui permet d'ouvrir le socket.
- * Prend en paramètre la structure récupérée par la fonction 'get_info'.
- * Renvoie le descripteur du socket.
- *****************************************************************************/
-int socket_open(struct addrinfo *servInfo) {
-  int socketDescriptor;
-
-  socketDescriptor = socket(servInfo->ai_family, servInfo->ai_socktype,
-                            servInfo->ai_protocol);
-  if ( socketDescriptor == -1) {
-    perror("Error with socket");
-    exit(EXIT_FAILURE);
-  }
-
-  return socketDescriptor;
-}
-
 /******************************************************************************
  * Fonction qui ferme le socket.
  * Prend en paramètre le descripteur du socket.
@@ -97,17 +81,26 @@ void socket_close(int socketDescriptor) {
 
 /******************************************************************************
  * Fonction qui permet de créer le flux TCP entre le client et le serveur.
+ * Toutes les adresses du serveur (IPv6 et IPv4) sont mises en concurrence,
+ * la première connexion établie est retenue.
  * Prend en paramètre :
- *     - socketDescriptor    Numéro du descripteur de socket.
- *     - servInfo            Pointeur vers les informations récupérées par la
- *                             fonction 'get_info'.
+ *     - history     Pointeur vers l'historique de connexion des adresses.
+ *     - servInfo    Pointeur vers les informations récupérées par la
+ *                     fonction 'get_info'.
+ *     - winner      Pointeur vers l'adresse retenue à renseigner.
+ * Renvoie le descripteur du socket connecté.
  *****************************************************************************/
-void client_connect(int socketDescriptor, struct addrinfo *servInfo) {
-  if (connect(socketDescriptor, servInfo->ai_addr, servInfo->ai_addrlen) == -1) {
-    close(socketDescriptor);
+int client_connect(struct he_history *history, struct addrinfo *servInfo,
+                   struct addrinfo **winner) {
+  int socketDescriptor;
+
+  socketDescriptor = he_connect(history, servInfo, winner);
+  if ( socketDescriptor == -1 ) {
     perror("Error with connect");
     exit(EXIT_FAILURE);
   }
+
+  return socketDescriptor;
 }
 
 /******************************************************************************
@@ -160,6 +153,8 @@ int message_receive(int socketDescriptor, char *msg) {
  *****************************************************************************/
 int main() {
   struct addrinfo servInfo;
+  struct addrinfo *winner;
+  struct he_history history;
   int socketDescriptor;
   char msg[MSG_SIZE];
   char serverName[NAME_ARRAY_SIZE];
@@ -179,11 +174,9 @@ int main() {
   /* Récupération des informations du serveur */
   servInfo = get_info(serverName, serverPort);
 
-  /* Ouverture du socket */
-  socketDescriptor = socket_open(&servInfo);
-
-  /* Connexion au serveur */
-  client_connect(socketDescriptor, &servInfo);
+  /* Connexion au serveur, sur la première de ses adresses qui répond */
+  he_init(&history);
+  socketDescriptor = client_connect(&history, &servInfo, &winner);
   printf("Connected to the server.\n");
 
   printf("\n **** Enter the character '.' to stop the program  ****\n\n");
@@ -193,7 +186,7 @@ int main() {
 
   while ( strcmp(msg, ".") ) {
     /* Envoie du message */
-    message_send(socketDescriptor, &servInfo, msg);
+    message_send(socketDescriptor, winner, msg);
     printf("Message sent : %s\n", msg);
 
     /* Reception du message envoyé par le serveur echo */
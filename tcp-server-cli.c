@@ -11,166 +11,608 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#include <numa.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "trace.h"
+#include "secure.h"
+#include "arena.h"
+#include "mux.h"
+#include "tstamp.h"
+#include "prefork.h"
+#include "balance.h"
+#include "journal.h"
+#include "probe.h"
+#include "wheel.h"
+#include "acceptor.h"
 
 #define MSG_SIZE 80
-#define SIZE_WATING_LIST 5
+#define STREAM_MAX_BUFFER 65535	/* Tampon maximal du mode flux */
+#define SIZE_WATING_LIST 128
+#define PUBLISH_RETRIES 1000	/* Relectures d'une copie en cours */
+#define MAX_EVENTS 64
+#define CODEL_INTERVAL_NS 100000000	/* Fenêtre de CoDel : 100 ms */
+#define MAX_WORKERS 256
+#define MUX_MAX_DEFERRED 1024	/* Requêtes différées par connexion */
+#define RELAY_POOL_DEFAULT 2	/* Connexions du relais par serveur amont */
+#define RELAY_POOL_MAX 64
+#define RELAY_RETRY_MS 500	/* Attente avant de rouvrir une connexion amont */
+
+/* États d'une connexion, chacun associé à une échéance */
+enum connection_state {
+  CONN_READ,			/* connectée, premier message attendu */
+  CONN_IDLE,			/* en attente du message suivant */
+  CONN_WRITE,			/* réponse en cours d'envoi */
+  CONN_HANDSHAKE		/* poignée de main TLS en cours */
+};
+
+/* Objets portant une échéance */
+enum timer_kind {
+  TIMER_CONNECTION,		/* délai d'une connexion, qui est fermée */
+  TIMER_DEFERRED,		/* requête multiplexée différée, répondue */
+  TIMER_UPSTREAM		/* connexion amont du relais, rouverte */
+};
+
+/* Champs d'une connexion lus hors du chemin d'un message en clair, alloués
+   seulement avec TLS, le mode multiplexé, le relais, la capture ou le
+   journal */
+struct connection_cold {
+  SSL *ssl;			/* TLS chiffré dans le processus, ou NULL */
+  struct deferred *deferred;	/* mode multiplexé : requêtes différées */
+  struct upstream *upstream;	/* relais : connexion amont de la requête en
+				   cours, ou NULL */
+  uint32_t request;		/* relais : identifiant de la requête amont */
+  int waiting;			/* relais : lecture suspendue, faute de place
+				   sur une connexion amont */
+  struct connection *waitPrev;	/* file des clients suspendus */
+  struct connection *waitNext;
+  uint32_t key;			/* relais : hachage de l'adresse du client */
+  uint32_t id;			/* numéro d'acceptation, pour la capture */
+  int received;			/* mode multiplexé : octets reçus en attente */
+  uint64_t journalSeq;		/* journal synchrone : enregistrement dont la
+				   validation retient la réponse, 0 sinon */
+  struct connection *journalPrev;	/* file des réponses retenues */
+  struct connection *journalNext;
+};
+
+/* État d'une connexion client, la minuterie doit rester en tête. Il tient
+   dans une ligne de cache : le tampon n'est emprunté que pendant qu'un
+   message est en cours, et les champs froids sont à part */
+struct connection {
+  struct timer timer;
+  int fd;
+  uint32_t events;		/* événements attendus par epoll */
+  enum connection_state state;
+  uint16_t len;			/* taille de la réponse */
+  uint16_t sent;		/* octets de la réponse déjà envoyés */
+  char *buffer;			/* MSG_SIZE octets, le tampon du mode flux, ou
+				   les tampons de réception et d'envoi du mode
+				   multiplexé ; NULL sans données en attente */
+  struct connection_cold *cold;	/* NULL pour un écho en clair */
+};
+
+/* Requête multiplexée dont la réponse est différée, la minuterie doit
+   rester en tête */
+struct deferred {
+  struct timer timer;
+  struct connection *connection;
+  struct deferred *next;
+  struct deferred *prev;
+  struct mux_header header;
+  char payload[];
+};
+
+/* Connexion persistante et multiplexée du relais vers un serveur amont, la
+   minuterie (réouverture) doit rester en tête */
+struct upstream {
+  struct timer timer;
+  struct server *server;
+  int index;			/* serveur amont dans le répartiteur */
+  int connected;		/* 0 : connexion en cours ou fermée */
+  int queued;			/* dans la liste des envois de fin de tour */
+  uint32_t events;		/* événements attendus par epoll */
+  struct mux_client mux;
+};
+
+/* Relais d'une boucle d'événements : répartiteur et connexions amont */
+struct relay {
+  struct balance balance;
+  struct upstream *upstreams;	/* 'pool' connexions par serveur amont */
+  int pool;
+  int count;
+  struct upstream **flush;	/* connexions à vider en fin de tour */
+  int flushCount;
+  struct connection *waitFirst;	/* clients suspendus, relus dès qu'une
+				   connexion amont se libère */
+  unsigned int next;		/* première connexion examinée, à égalité */
+};
+
+/* Contrôle du délai d'attente des événements (CoDel) */
+struct codel {
+  uint64_t target;		/* délai acceptable en ns, 0 : désactivé */
+  uint64_t firstAbove;		/* instant où le délai sera resté trop long */
+  uint64_t dropNext;		/* instant du prochain délestage */
+  unsigned int count;		/* délestages depuis l'entrée en surcharge */
+  int dropping;
+};
+
+/* Statistiques du serveur, affichées à l'arrêt et sur SIGUSR1 */
+struct server_stats {
+  unsigned long accepted;
+  unsigned long closed;
+  unsigned long messages;
+  unsigned long long bytes;
+  unsigned long readTimeouts;
+  unsigned long idleTimeouts;
+  unsigned long writeTimeouts;
+  struct accept_stats accept;	/* clients refusés à l'acceptation */
+  unsigned long shedQueueDelay;	/* délestage CoDel */
+  unsigned long local;		/* connexions reçues par le CPU du worker */
+  unsigned long remote;		/* connexions reçues par un autre CPU */
+  unsigned long deferred;	/* requêtes multiplexées différées */
+  unsigned long protocolErrors;	/* trames multiplexées invalides */
+  unsigned long relayed;	/* réponses amont renvoyées aux clients */
+  unsigned long relayErrors;	/* requêtes sans serveur amont ou perdues */
+};
+
+/* Statistiques d'un worker, recopiées à chaque tour de boucle : en mémoire
+   partagée pour un processus worker, sous verrou pour un thread worker */
+struct process_stats {
+  unsigned long sequence;	/* processus worker : impaire pendant une
+				   copie (seqlock) */
+  unsigned long connections;
+  struct server_stats stats;
+  unsigned long handshakes;
+  unsigned long resumed;
+  unsigned long offloaded;
+  unsigned long failures;
+  int cpu;			/* place du worker */
+  int node;
+};
+
+/* Serveur : socket d'écoute, boucle d'événements et échéances */
+struct server {
+  int socketDescriptor;
+  int epollDescriptor;
+  struct timer_wheel wheel;
+  unsigned int timeouts[4];	/* en ticks, indexé par état, 0 : aucune */
+  unsigned long connections;	/* connexions ouvertes */
+  unsigned long maxConnections;	/* 0 : pas de limite */
+  int reserveDescriptor;	/* libéré pour refuser un client sur EMFILE */
+  struct codel codel;
+  struct trace_writer *trace;	/* capture des messages reçus, ou NULL */
+  struct journal *journal;	/* journal des messages reçus, ou NULL */
+  struct journal_log *journalLog;	/* tampon d'ajout de la boucle */
+  int journalSync;		/* réponses retenues jusqu'à la validation */
+  int journalDescriptor;	/* eventfd des validations, ou -1 */
+  struct connection *journalFirst;	/* réponses retenues, par numéro */
+  struct connection *journalLast;	/* d'enregistrement croissant */
+  struct secure *secure;	/* contexte TLS, ou NULL */
+  struct tstamp_stats *tstamp;	/* découpage par horodatage, ou NULL */
+  int bufferSize;		/* taille du tampon de connexion */
+  int stream;			/* renvoie les octets reçus, sans message */
+  int mux;			/* protocole binaire multiplexé */
+  const char *upstreams;	/* relais : serveurs amont, ou NULL */
+  enum balance_policy policy;	/* relais : répartition des requêtes */
+  int pool;			/* relais : connexions par serveur amont */
+  struct relay *relay;		/* relais de la boucle, NULL sinon */
+  struct arena arena;		/* connexions, sur le nœud NUMA du worker */
+  struct arena colds;		/* champs froids des connexions */
+  struct arena buffers;		/* tampons prêtés aux connexions actives */
+  int cpu;			/* CPU du worker, -1 : pas d'épinglage */
+  int node;			/* nœud NUMA du CPU, -1 : inconnu */
+  int wakeDescriptor;		/* eventfd de réveil des workers, ou -1 */
+  struct process_stats *shared;	/* worker : statistiques publiées, ou NULL */
+  pthread_mutex_t *lock;	/* thread worker : verrou de 'shared', ou NULL */
+  const char *probeFile;	/* trace des sondes, ou NULL : inactives */
+  struct probe_ring *probes;	/* anneau des sondes de la boucle, ou NULL */
+  struct server_stats stats;
+};
+
+/* Worker : boucle d'événements épinglée sur un CPU, avec son propre socket
+   d'écoute (SO_REUSEPORT), ses connexions et ses statistiques */
+struct worker {
+  struct server server;
+  struct secure secure;		/* contexte TLS partagé, compteurs propres */
+  pthread_t thread;
+  pthread_mutex_t lock;		/* protège 'snapshot' */
+  struct process_stats snapshot;	/* statistiques lues par le thread
+					   principal */
+};
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dumpStats = 0;
+static volatile sig_atomic_t dumpProbes = 0;
 
 /******************************************************************************
- * Fonction qui récupère les informations du serveur en mode datagramme.
- * Prend en paramètre :
- *     - serverName    Pointeur vers une chaine de caractère pour le nom ou
- *                       l'adresse IP du serveur.
- *     - serverPort    Pointeur vers une chaine de caractère pour le numéro de
- *                       port du serveur.
- * Renvoie la structure d'information addrinfo.
+ * Fonction qui ferme le socket.
+ * Prend en paramètre le descripteur du socket.
  *****************************************************************************/
-struct addrinfo get_info(char *serverPort) {
-  int status;
-  struct addrinfo hints;
-  struct addrinfo *servInfo;
-
-  /* Configuration des paramètre du socket pour le serveur */
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;		/* IPv4 et IPv6 ou autre protocole */
-  hints.ai_socktype = SOCK_STREAM;	/* socket TCP */
-  hints.ai_flags = AI_PASSIVE;		/* écoute sur toute les interfaces */
-  hints.ai_protocol = 0;
-  hints.ai_canonname = NULL;
-  hints.ai_addr = NULL;
-  hints.ai_next = NULL;
-
-  /* Ouverture et récupération des informations de connexion au serveur */
-  status = getaddrinfo(NULL, serverPort, &hints, &servInfo);
-  if ( status != 0 ) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-    exit(EXIT_FAILURE);
-  }
+void socket_close(int socketDescriptor) {
+  close(socketDescriptor);
+}
 
-  return *servInfo;
+/******************************************************************************
+ * Fonction appelée à la réception de SIGINT ou SIGTERM, demande l'arrêt du
+ * serveur à la fin du traitement en cours.
+ *****************************************************************************/
+void stop_handler(int signum) {
+  (void) signum;
+  running = 0;
 }
 
 /******************************************************************************
- * Fonction qui permet d'ouvrir le socket.
- * Prend en paramètre la structure récupérée par la fonction 'get_info'.
- * Renvoie le descripteur du socket.
+ * Fonction appelée à la réception de SIGUSR1, demande l'affichage des
+ * statistiques.
  *****************************************************************************/
-int socket_open(struct addrinfo *servInfo) {
-  int socketDescriptor;
-  struct addrinfo *rp;
+void stats_handler(int signum) {
+  (void) signum;
+  dumpStats = 1;
+}
 
-  /* Ouverture du socket sur le port d'écoute passé en paramètre */
-  for ( rp = servInfo; rp != NULL; rp = rp->ai_next ) {
-    socketDescriptor = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if ( socketDescriptor == -1 )
-      continue;
-    if ( bind(socketDescriptor, rp->ai_addr, rp->ai_addrlen) == 0 )
-      break;
-    close(socketDescriptor);
+/******************************************************************************
+ * Fonction appelée à la réception de SIGUSR2, demande l'écriture de la trace
+ * des sondes.
+ *****************************************************************************/
+void probes_handler(int signum) {
+  (void) signum;
+  dumpProbes = 1;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+uint64_t now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie la racine carrée entière d'un nombre.
+ *****************************************************************************/
+unsigned int isqrt(unsigned int n) {
+  unsigned int root = 0, bit = 1u << 30;
+
+  while ( bit > n )
+    bit >>= 2;
+  while ( bit != 0 ) {
+    if ( n >= root + bit ) {
+      n -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
   }
+  return root;
+}
 
-  if ( rp == NULL ) {
-    fprintf(stderr, "Could not bind\n");
-    fprintf(stderr, "Port number is already used.\n");
-    exit(EXIT_FAILURE);
+/******************************************************************************
+ * Fonction qui décide du délestage d'un événement selon l'algorithme CoDel :
+ * tant que le délai d'attente reste au-dessus de la cible pendant toute une
+ * fenêtre, un événement est délesté à un rythme qui croît comme la racine
+ * carrée du nombre de délestages.
+ * Prend en paramètre :
+ *     - codel      Pointeur vers l'état de CoDel.
+ *     - sojourn    Délai d'attente de l'événement en nanosecondes.
+ *     - now        Instant courant en nanosecondes.
+ * Renvoie 1 si l'événement doit être délesté, 0 sinon.
+ *****************************************************************************/
+int codel_should_drop(struct codel *codel, uint64_t sojourn, uint64_t now) {
+  if ( codel->target == 0 || sojourn < codel->target ) {
+    codel->firstAbove = 0;
+    codel->dropping = 0;
+    return 0;
   }
 
-  if (listen(socketDescriptor, SIZE_WATING_LIST) == -1) {
-    perror("Error with listen");
-    exit(EXIT_FAILURE);
+  if ( codel->firstAbove == 0 ) {
+    codel->firstAbove = now + CODEL_INTERVAL_NS;
+    return 0;
+  }
+
+  if ( !codel->dropping ) {
+    if ( now < codel->firstAbove )
+      return 0;
+    /* Reprise du rythme précédent si la surcharge vient de s'arrêter */
+    if ( codel->count > 2 && now - codel->dropNext < 8 * CODEL_INTERVAL_NS )
+      codel->count -= 2;
+    else
+      codel->count = 1;
+    codel->dropping = 1;
+    codel->dropNext = now + CODEL_INTERVAL_NS / isqrt(codel->count);
+    return 1;
   }
 
-  return socketDescriptor;
+  if ( now < codel->dropNext )
+    return 0;
+  codel->count++;
+  codel->dropNext += CODEL_INTERVAL_NS / isqrt(codel->count);
+  return 1;
 }
 
 /******************************************************************************
- * Fonction qui ferme le socket.
- * Prend en paramètre le descripteur du socket.
+ * Fonction qui renvoie la session TLS d'une connexion, NULL en clair ou une
+ * fois le chiffrement confié au noyau.
+ * Prend en paramètre :
+ *     - connection    Pointeur vers la connexion.
  *****************************************************************************/
-void socket_close(int socketDescriptor) {
-  close(socketDescriptor);
+SSL *connection_ssl(struct connection *connection) {
+  return connection->cold != NULL ? connection->cold->ssl : NULL;
 }
 
 /******************************************************************************
- * Fonction qui permet attend de recevoir un flux d'un client.
+ * Fonction qui prête un tampon à une connexion qui n'en a pas.
  * Prend en paramètre :
- *     - socketDescriptor    Numéro du descripteur de socket.
- *     - servInfo            Pointeur vers les informations récupérées par la
- *                             fonction 'get_info'.
- * Renvoie le numéro de flux du client connecté.
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ * Renvoie le tampon, NULL si la mémoire manque.
  *****************************************************************************/
-int client_connect(int socketDescriptor, struct addrinfo *servInfo) {
-  int streamClient;
+char *connection_buffer(struct server *server, struct connection *connection) {
+  if ( connection->buffer == NULL )
+    connection->buffer = arena_take(&server->buffers);
+  return connection->buffer;
+}
 
-  /* Action bloquante */
-  streamClient = accept(socketDescriptor, (struct sockaddr *) &servInfo->ai_addr,
-                         &servInfo->ai_addrlen);
-  if ( streamClient == -1) {
-    perror("Error with accept");
-    close(socketDescriptor);
-    exit(EXIT_FAILURE);
+/******************************************************************************
+ * Fonction qui rend le tampon d'une connexion qui n'a plus de données en
+ * attente : une connexion inactive n'occupe que son état.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void connection_release(struct server *server, struct connection *connection) {
+  if ( connection->buffer == NULL )
+    return;
+  arena_free(&server->buffers, connection->buffer);
+  connection->buffer = NULL;
+}
+
+/******************************************************************************
+ * Fonction qui retire une requête différée de sa connexion et la libère.
+ * Prend en paramètre :
+ *     - server      Pointeur vers le serveur.
+ *     - deferred    Pointeur vers la requête.
+ *****************************************************************************/
+void deferred_free(struct server *server, struct deferred *deferred) {
+  if ( deferred->prev != NULL )
+    deferred->prev->next = deferred->next;
+  else
+    deferred->connection->cold->deferred = deferred->next;
+  if ( deferred->next != NULL )
+    deferred->next->prev = deferred->prev;
+  wheel_cancel(&server->wheel, &deferred->timer);
+  free(deferred);
+}
+
+/******************************************************************************
+ * Fonction qui indique si les connexions d'un serveur ont des champs froids.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+int server_cold(struct server *server) {
+  return server->secure != NULL || server->mux || server->relay != NULL
+         || server->trace != NULL || server->journal != NULL;
+}
+
+/******************************************************************************
+ * Fonction qui retient la réponse d'une connexion jusqu'à la validation de
+ * son message dans le journal. La lecture reste armée pour voir le client
+ * fermer ; l'échéance est celle de l'envoi.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion, réponse prête.
+ *     - sequence      Numéro de l'enregistrement du message.
+ *****************************************************************************/
+void journal_park(struct server *server, struct connection *connection,
+                  uint64_t sequence) {
+  struct connection_cold *cold = connection->cold;
+
+  cold->journalSeq = sequence;
+  cold->journalNext = NULL;
+  cold->journalPrev = server->journalLast;
+  if ( server->journalLast != NULL )
+    server->journalLast->cold->journalNext = connection;
+  else
+    server->journalFirst = connection;
+  server->journalLast = connection;
+  connection->state = CONN_WRITE;
+  wheel_schedule(&server->wheel, &connection->timer,
+                 server->timeouts[CONN_WRITE]);
+}
+
+/******************************************************************************
+ * Fonction qui retire une connexion de la file des réponses retenues.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void journal_unpark(struct server *server, struct connection *connection) {
+  struct connection_cold *cold = connection->cold;
+
+  if ( cold->journalPrev != NULL )
+    cold->journalPrev->cold->journalNext = cold->journalNext;
+  else
+    server->journalFirst = cold->journalNext;
+  if ( cold->journalNext != NULL )
+    cold->journalNext->cold->journalPrev = cold->journalPrev;
+  else
+    server->journalLast = cold->journalPrev;
+  cold->journalSeq = 0;
+}
+
+void relay_abandon(struct server *server, struct connection *connection);
+void relay_unpark(struct server *server, struct connection *connection);
+
+/******************************************************************************
+ * Fonction qui ferme une connexion client et libère son état.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion à fermer.
+ *****************************************************************************/
+void connection_close(struct server *server, struct connection *connection) {
+  struct connection_cold *cold = connection->cold;
+
+  if ( cold != NULL ) {
+    if ( cold->upstream != NULL )
+      relay_abandon(server, connection);
+    if ( cold->waiting )
+      relay_unpark(server, connection);
+    if ( cold->journalSeq != 0 )
+      journal_unpark(server, connection);
+    while ( cold->deferred != NULL )
+      deferred_free(server, cold->deferred);
+    secure_close(cold->ssl);
+    arena_free(&server->colds, cold);
   }
+  wheel_cancel(&server->wheel, &connection->timer);
+  socket_close(connection->fd);
+  connection_release(server, connection);
+  arena_free(&server->arena, connection);
+  server->connections--;
+  server->stats.closed++;
+}
+
+void deferred_expire(struct server *server, struct deferred *deferred);
+void upstream_connect(struct server *server, struct upstream *upstream);
+
+/******************************************************************************
+ * Fonction qui traite une échéance atteinte de la roue : ferme la connexion
+ * dont le délai est dépassé, répond à la requête différée ou rouvre la
+ * connexion amont perdue du relais. Une réponse amont hors délai compte
+ * comme un échec du serveur amont.
+ * Prend en paramètre :
+ *     - timer    Pointeur vers l'échéance, en tête de son objet.
+ *     - arg      Pointeur vers le serveur.
+ *****************************************************************************/
+void timer_expire(struct timer *timer, void *arg) {
+  struct server *server = arg;
+  struct connection *connection;
 
-  return streamClient;
+  if ( timer->kind == TIMER_DEFERRED ) {
+    deferred_expire(server, (struct deferred *) timer);
+  } else if ( timer->kind == TIMER_UPSTREAM ) {
+    upstream_connect(server, (struct upstream *) timer);
+  } else {
+    connection = (struct connection *) timer;
+    if ( connection->state == CONN_READ
+         || connection->state == CONN_HANDSHAKE )
+      server->stats.readTimeouts++;
+    else if ( connection->state == CONN_IDLE )
+      server->stats.idleTimeouts++;
+    else
+      server->stats.writeTimeouts++;
+    if ( connection->cold != NULL && connection->cold->upstream != NULL )
+      balance_failure(&server->relay->balance,
+                      connection->cold->upstream->index, now_ns());
+    connection_close(server, connection);
+  }
 }
 
 /******************************************************************************
  * Fonction qui reçoit un message du flux du client.
  * Il prend en paramètre :
  *     - streamClient    Numéro du flux du client.
+ *     - ssl             Session TLS chiffrée dans le processus, ou NULL.
  *     - msg             Pointeur vers la chaine de caractère à récupérer.
+ *     - size            Taille de la zone pointée par msg.
+ *     - stamp           Horodatages de réception à remplir, ou NULL.
+ * Renvoie le code de la fonction recv.
  *****************************************************************************/
-int message_receive(int streamClient, char *msg) {
+int message_receive(int streamClient, SSL *ssl, char *msg, int size,
+                    struct tstamp *stamp) {
   int status;
 
-  status = recv(streamClient, msg, MSG_SIZE, 0);
-  if ( status == -1 ) {
+  if ( ssl != NULL )
+    status = secure_recv(ssl, msg, size);
+  else if ( stamp != NULL )
+    status = tstamp_recv(streamClient, msg, size, 0, NULL, NULL, stamp);
+  else
+    status = recv(streamClient, msg, size, 0);
+  /* EIO : enregistrement TLS de contrôle (fermeture) reçu par kTLS */
+  if ( status == -1 && errno != EAGAIN && errno != EWOULDBLOCK
+       && errno != EIO ) {
     perror("Error with recv");
   }
-  if ( msg[strlen(msg)-1] == '\n' || strlen(msg) > MSG_SIZE ) {
-    msg[strlen(msg)-1] = '\0';
-  }
 
   return status;
 }
 
 /******************************************************************************
- * Fonction qui envoie un message sur le flux du client.
+ * Fonction qui retire le retour à la ligne final d'un message reçu, pour
+ * l'afficher.
+ * Il prend en paramètre :
+ *     - msg    Pointeur vers le message, de MSG_SIZE octets.
+ *****************************************************************************/
+void message_trim(char *msg) {
+  size_t len;
+
+  /* Un message de MSG_SIZE octets n'a pas de zéro terminal */
+  len = strnlen(msg, MSG_SIZE);
+  if ( len > 0 && ( msg[len-1] == '\n' || len == MSG_SIZE ) ) {
+    msg[len-1] = '\0';
+  }
+}
+
+/******************************************************************************
+ * Fonction qui envoie la suite d'un message sur le flux du client.
  * Prend en paramètre :
  *     - streamClient    Numéro du flux du client.
- *     - msg                 Pointeur vers la chaine de caractère à envoyer.
- * Renvoie 1 si le message à bien été envoyé, 0 sinon.
+ *     - ssl             Session TLS chiffrée dans le processus, ou NULL.
+ *     - msg             Pointeur vers la chaine de caractère à envoyer.
+ *     - len             Taille du message.
+ *     - sent            Nombre d'octets déjà envoyés.
+ * Renvoie le nombre d'octets envoyés au total, -1 en cas d'erreur.
  *****************************************************************************/
-int message_send(int streamClient, char *msg) {
+int message_send(int streamClient, SSL *ssl, char *msg, int len, int sent) {
   int status;
 
-  status = send(streamClient, msg, MSG_SIZE, 0);
+  if ( ssl != NULL )
+    status = secure_send(ssl, msg + sent, len - sent);
+  else
+    status = send(streamClient, msg + sent, len - sent, MSG_NOSIGNAL);
   if ( status == -1 ) {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK )
+      return sent;
     perror("Error with send");
-    return 0;
+    return -1;
   }
-  return 1;
+  return sent + status;
 }
 
 /******************************************************************************
  * Fonction qui affiche les informations du client connecter au serveur.
  * Prend en paramètre :
- *     - servInfo    Pointeur vers les informations récupérées par la
- *                     fonction 'get_info'.
+ *     - addr       Pointeur vers l'adresse du client.
+ *     - addrlen    Taille de l'adresse du client.
  *****************************************************************************/
-void printClient(struct addrinfo *servInfo) {
+void printClient(struct sockaddr *addr, socklen_t addrlen) {
   int status;
   char host[NI_MAXHOST], service[NI_MAXHOST];
 
-  status = getnameinfo((struct sockaddr *) &servInfo->ai_addr,
-                         servInfo->ai_addrlen, host, NI_MAXHOST, 
+  status = getnameinfo(addr, addrlen, host, NI_MAXHOST, 
                          service, NI_MAXSERV, NI_NUMERICSERV);
   if ( status == 0 ) {
     printf("%s:%s connected.\n", host, service);
@@ -180,51 +622,2179 @@ void printClient(struct addrinfo *servInfo) {
 }
 
 /******************************************************************************
- * Serveur CLI TCP, reçoit une chaine de caractère d'un client et lui renvoie.
- *   Le programme prend en paramètre :
- *     - port : Port d'écoute du serveur
+ * Fonction qui change les événements attendus par epoll pour une connexion.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *     - events        EPOLLIN ou EPOLLOUT.
  *****************************************************************************/
+void connection_watch(struct server *server, struct connection *connection,
+                      uint32_t events) {
+  struct epoll_event event;
 
-int main(int argc, char *argv[]) {
-  struct addrinfo servInfo;
-  int socketDescriptor;
+  if ( connection->events == events )
+    return;
+  event.events = events;
+  event.data.ptr = connection;
+  epoll_ctl(server->epollDescriptor, EPOLL_CTL_MOD, connection->fd, &event);
+  connection->events = events;
+}
+
+/******************************************************************************
+ * Fonction qui change l'état d'une connexion : événements attendus par epoll
+ * et échéance associée.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *     - state         Nouvel état.
+ *****************************************************************************/
+void connection_set_state(struct server *server, struct connection *connection,
+                          enum connection_state state) {
+  connection_watch(server, connection, state == CONN_WRITE ? EPOLLOUT : EPOLLIN);
+  connection->state = state;
+  wheel_schedule(&server->wheel, &connection->timer, server->timeouts[state]);
+}
+
+/******************************************************************************
+ * Fonction qui compte si une connexion a été reçue par le CPU du worker qui la
+ * sert (SO_INCOMING_CPU), ce qui vérifie l'aiguillage des connexions.
+ * Prend en paramètre :
+ *     - server          Pointeur vers le serveur.
+ *     - streamClient    Numéro du flux du client.
+ *****************************************************************************/
+void connection_locality(struct server *server, int streamClient) {
+  socklen_t len = sizeof(int);
+  int cpu;
+
+  if ( getsockopt(streamClient, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1
+       || cpu < 0 )
+    return;
+  if ( cpu == server->cpu )
+    server->stats.local++;
+  else
+    server->stats.remote++;
+}
+
+/******************************************************************************
+ * Fonction qui calcule la clé de répartition d'un client : le hachage de son
+ * adresse IP, sans le port, pour que ses connexions aillent au même serveur
+ * amont.
+ * Prend en paramètre :
+ *     - addr    Pointeur vers l'adresse du client.
+ *****************************************************************************/
+uint32_t connection_key(struct sockaddr_storage *addr) {
+  if ( addr->ss_family == AF_INET6 )
+    return balance_hash(&((struct sockaddr_in6 *) addr)->sin6_addr,
+                        sizeof(struct in6_addr));
+  return balance_hash(&((struct sockaddr_in *) addr)->sin_addr,
+                      sizeof(struct in_addr));
+}
+
+/******************************************************************************
+ * Fonction qui accepte tous les clients en attente.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+void server_accept(struct server *server) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct connection *connection;
+  struct epoll_event event;
   int streamClient;
-  char msg[MSG_SIZE];
+  int noDelay = 1;
 
+  while ( 1 ) {
+    PROBE_BEGIN(server->probes, PROBE_ACCEPT);
+    streamClient = acceptor_accept(server->socketDescriptor,
+                                   &server->reserveDescriptor,
+                                   server->maxConnections != 0
+                                   && server->connections
+                                      >= server->maxConnections,
+                                   &addr, &addrlen, &server->stats.accept);
+    if ( streamClient == -1 )
+      return;
 
-  printf("\n ****      Welcome to the TCP Server.      ****\n\n");
+    connection = arena_alloc(&server->arena);
+    if ( connection == NULL ) {
+      perror("Error with arena_alloc");
+      close(streamClient);
+      continue;
+    }
+    connection->fd = streamClient;
+    connection->state = CONN_READ;
+    connection->events = EPOLLIN;
+    if ( server_cold(server) ) {
+      connection->cold = arena_alloc(&server->colds);
+      if ( connection->cold == NULL ) {
+        perror("Error with arena_alloc");
+        close(streamClient);
+        arena_free(&server->arena, connection);
+        continue;
+      }
+      connection->cold->id = (uint32_t) server->stats.accepted;
+      if ( server->relay != NULL )
+        connection->cold->key = connection_key(&addr);
+    }
+    if ( server->secure != NULL ) {
+      connection->cold->ssl = secure_accept(server->secure, streamClient);
+      if ( connection->cold->ssl == NULL ) {
+        close(streamClient);
+        arena_free(&server->colds, connection->cold);
+        arena_free(&server->arena, connection);
+        continue;
+      }
+      connection->state = CONN_HANDSHAKE;
+    }
 
-  /* Vérification des paramètres du programme */
-  if ( argc != 2 ) {
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
-    exit(EXIT_FAILURE);
+    /* Réponse envoyée aussitôt, sans attendre l'acquittement de la
+       précédente (algorithme de Nagle) */
+    setsockopt(streamClient, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    if ( server->tstamp != NULL )
+      tstamp_enable(streamClient, 1);
+
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if ( epoll_ctl(server->epollDescriptor, EPOLL_CTL_ADD, streamClient,
+                   &event) == -1 ) {
+      perror("Error with epoll_ctl");
+      if ( connection->cold != NULL ) {
+        SSL_free(connection->cold->ssl);
+        arena_free(&server->colds, connection->cold);
+      }
+      close(streamClient);
+      arena_free(&server->arena, connection);
+      continue;
+    }
+
+    server->connections++;
+    server->stats.accepted++;
+    if ( server->cpu >= 0 )
+      connection_locality(server, streamClient);
+    printClient((struct sockaddr *) &addr, addrlen);
+    wheel_schedule(&server->wheel, &connection->timer,
+                   server->timeouts[connection->state]);
+    PROBE_END(server->probes, PROBE_ACCEPT);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui fait avancer la poignée de main TLS d'une connexion. Une fois
+ * terminée, si le noyau a pris en charge le chiffrement (kTLS), la session
+ * est libérée : la connexion est servie par send et recv comme en clair.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void connection_handshake(struct server *server, struct connection *connection) {
+  int status;
+
+  status = secure_handshake(server->secure, connection->cold->ssl);
+  if ( status == -1 ) {
+    connection_close(server, connection);
+    return;
+  }
+  if ( status != 0 ) {
+    connection_watch(server, connection,
+                     status == SSL_ERROR_WANT_WRITE ? EPOLLOUT : EPOLLIN);
+    return;
   }
 
-  /* Récupération des informations du serveur */
-  servInfo = get_info(argv[1]);
+  if ( secure_offload(connection->cold->ssl) ) {
+    SSL_free(connection->cold->ssl);
+    connection->cold->ssl = NULL;
+  }
+  connection_set_state(server, connection, CONN_READ);
+}
 
-  /* Ouverture du socket */
-  socketDescriptor = socket_open(&servInfo);
+/******************************************************************************
+ * Fonction qui ajoute une réponse au tampon d'envoi d'une connexion
+ * multiplexée, qui doit pouvoir recevoir MUX_FRAME_MAX octets.
+ * Prend en paramètre :
+ *     - connection    Pointeur vers la connexion.
+ *     - request       En-tête de la requête.
+ *     - flags         Drapeaux ajoutés à MUX_FLAG_RESPONSE.
+ *     - payload       Charge utile de la réponse.
+ *     - length        Taille de la charge utile.
+ *****************************************************************************/
+void mux_respond(struct connection *connection, struct mux_header *request,
+                 uint16_t flags, char *payload, uint32_t length) {
+  char *out = connection->buffer + MUX_BUFFER + connection->len;
+  struct mux_header header;
 
-  printf("Listen on %s\n", argv[1]);
+  header.version = MUX_VERSION;
+  header.opcode = request->opcode;
+  header.flags = MUX_FLAG_RESPONSE | flags;
+  header.id = request->id;
+  header.length = length;
+  mux_encode(&header, (unsigned char *) out);
+  if ( length > 0 )
+    memcpy(out + MUX_HEADER_SIZE, payload, length);
+  connection->len += MUX_HEADER_SIZE + length;
+}
 
-  /* Traitement de tous message reçu, renvoie au client le message reçu */
-  while ( 1 ) {
-    printf("\nWainting to connect to server.\n");
+/******************************************************************************
+ * Fonction qui envoie les réponses en attente d'une connexion multiplexée ;
+ * ce qui n'est pas parti est ramené en tête du tampon.
+ * Prend en paramètre :
+ *     - connection    Pointeur vers la connexion.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+int connection_mux_flush(struct connection *connection) {
+  char *out = connection->buffer + MUX_BUFFER;
+  int sent;
 
-    streamClient = client_connect(socketDescriptor, &servInfo);
-    printClient(&servInfo);
+  if ( connection->len == 0 )
+    return 0;
+  sent = message_send(connection->fd, connection->cold->ssl, out,
+                      connection->len, 0);
+  if ( sent == -1 )
+    return -1;
+  memmove(out, out + sent, connection->len - sent);
+  connection->len -= sent;
+  return 0;
+}
 
-    memset(&msg, 0, sizeof(msg));
-    while ( message_receive(streamClient, msg) > 0 ) {
-      printf(">> %s\n", msg);
-      if ( message_send(streamClient, msg) )
-        printf(">> # Same message sent.\n");
-      memset(&msg, 0, sizeof(msg));
+/******************************************************************************
+ * Fonction qui met à jour les événements attendus et l'échéance d'une
+ * connexion multiplexée : la lecture est suspendue tant que le tampon
+ * d'envoi ne peut pas recevoir une réponse complète. Le tampon est rendu
+ * quand plus rien n'est en attente.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *     - active        1 si une requête vient d'être traitée.
+ *****************************************************************************/
+void connection_mux_watch(struct server *server, struct connection *connection,
+                          int active) {
+  uint32_t events = 0;
+
+  if ( connection->cold->received == 0 && connection->len == 0 )
+    connection_release(server, connection);
+  if ( connection->cold->received < MUX_BUFFER
+       && MUX_BUFFER - connection->len >= MUX_FRAME_MAX )
+    events |= EPOLLIN;
+  if ( connection->len > 0 ) {
+    events |= EPOLLOUT;
+    connection->state = CONN_WRITE;
+  } else if ( active || connection->state != CONN_READ ) {
+    connection->state = CONN_IDLE;
+  }
+  connection_watch(server, connection, events);
+  wheel_schedule(&server->wheel, &connection->timer,
+                 server->timeouts[connection->state]);
+}
+
+/******************************************************************************
+ * Fonction qui diffère la réponse d'une requête MUX_OP_DELAY : les requêtes
+ * suivantes de la connexion sont servies sans l'attendre.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *     - header        En-tête de la requête.
+ *     - payload       Charge utile : délai en ms puis données à renvoyer.
+ * Renvoie 0, -1 si la requête est refusée.
+ *****************************************************************************/
+int mux_defer(struct server *server, struct connection *connection,
+              struct mux_header *header, char *payload) {
+  struct deferred *deferred, *last;
+  uint32_t delay;
+  unsigned int count = 0;
+
+  if ( header->length < sizeof(delay) )
+    return -1;
+  for ( last = connection->cold->deferred; last != NULL; last = last->next )
+    if ( ++count >= MUX_MAX_DEFERRED )
+      return -1;
+
+  deferred = malloc(sizeof(*deferred) + header->length - sizeof(delay));
+  if ( deferred == NULL )
+    return -1;
+  memcpy(&delay, payload, sizeof(delay));
+  delay = ntohl(delay);
+  memset(&deferred->timer, 0, sizeof(deferred->timer));
+  deferred->timer.kind = TIMER_DEFERRED;
+  deferred->connection = connection;
+  deferred->header = *header;
+  deferred->header.length -= sizeof(delay);
+  memcpy(deferred->payload, payload + sizeof(delay), deferred->header.length);
+
+  deferred->prev = NULL;
+  deferred->next = connection->cold->deferred;
+  if ( deferred->next != NULL )
+    deferred->next->prev = deferred;
+  connection->cold->deferred = deferred;
+  wheel_schedule(&server->wheel, &deferred->timer,
+                 delay / WHEEL_TICK_MS > 0 ? delay / WHEEL_TICK_MS : 1);
+  server->stats.deferred++;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui répond aux requêtes différées échues d'une connexion (échéance
+ * désarmée), tant que le tampon d'envoi peut recevoir une réponse.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ * Renvoie le nombre de réponses ajoutées, -1 si la mémoire manque.
+ *****************************************************************************/
+int connection_mux_ready(struct server *server, struct connection *connection) {
+  struct deferred *deferred, *next;
+  int count = 0;
+
+  for ( deferred = connection->cold->deferred; deferred != NULL;
+        deferred = next ) {
+    next = deferred->next;
+    if ( deferred->timer.expires != 0 )
+      continue;
+    if ( MUX_BUFFER - connection->len < MUX_FRAME_MAX )
+      break;
+    if ( connection_buffer(server, connection) == NULL )
+      return -1;
+    mux_respond(connection, &deferred->header, 0, deferred->payload,
+                deferred->header.length);
+    deferred_free(server, deferred);
+    count++;
+  }
+  return count;
+}
+
+/******************************************************************************
+ * Fonction qui répond à une requête différée arrivée à échéance. La réponse
+ * est envoyée par la boucle d'événements ; si le tampon d'envoi est plein,
+ * la requête reste échue et part dès que le tampon se vide.
+ * Prend en paramètre :
+ *     - server      Pointeur vers le serveur.
+ *     - deferred    Pointeur vers la requête.
+ *****************************************************************************/
+void deferred_expire(struct server *server, struct deferred *deferred) {
+  struct connection *connection = deferred->connection;
+
+  wheel_cancel(&server->wheel, &deferred->timer);
+  switch ( connection_mux_ready(server, connection) ) {
+  case -1:
+    connection_close(server, connection);
+    break;
+  case 0:
+    break;
+  default:
+    connection_mux_watch(server, connection, 1);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui traite les trames complètes reçues sur une connexion
+ * multiplexée, tant que le tampon d'envoi peut recevoir une réponse.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ * Renvoie le nombre de requêtes traitées, -1 si une trame est invalide.
+ *****************************************************************************/
+int connection_mux_process(struct server *server, struct connection *connection) {
+  struct connection_cold *cold = connection->cold;
+  char *in = connection->buffer;
+  struct mux_header header;
+  char *payload;
+  int offset = 0, count = 0;
+
+  while ( cold->received - offset >= MUX_HEADER_SIZE
+          && MUX_BUFFER - connection->len >= MUX_FRAME_MAX ) {
+    PROBE_BEGIN(server->probes, PROBE_DECODE);
+    if ( mux_decode((unsigned char *) in + offset, &header) == -1 ) {
+      server->stats.protocolErrors++;
+      return -1;
+    }
+    if ( cold->received - offset < (int) (MUX_HEADER_SIZE + header.length) )
+      break;
+    PROBE_END(server->probes, PROBE_DECODE);
+
+    PROBE_BEGIN(server->probes, PROBE_HANDLER);
+    payload = in + offset + MUX_HEADER_SIZE;
+    server->stats.messages++;
+    if ( server->trace != NULL )
+      trace_append(server->trace, cold->id, payload, header.length);
+    if ( server->journal != NULL )
+      journal_append(server->journalLog, cold->id, payload, header.length);
+    PROBE_END(server->probes, PROBE_HANDLER);
+    PROBE_BEGIN(server->probes, PROBE_ENCODE);
+    if ( header.opcode == MUX_OP_ECHO )
+      mux_respond(connection, &header, 0, payload, header.length);
+    else if ( header.opcode != MUX_OP_DELAY
+              || mux_defer(server, connection, &header, payload) == -1 )
+      mux_respond(connection, &header, MUX_FLAG_ERROR, NULL, 0);
+    PROBE_END(server->probes, PROBE_ENCODE);
+    offset += MUX_HEADER_SIZE + header.length;
+    count++;
+  }
+
+  if ( offset > 0 ) {
+    memmove(in, in + offset, cold->received - offset);
+    cold->received -= offset;
+  }
+  return count;
+}
+
+/******************************************************************************
+ * Fonction qui traite un événement sur une connexion multiplexée : envoi des
+ * réponses en attente, réception et traitement des requêtes. Les réponses
+ * partent dans l'ordre où elles sont prêtes, pas dans celui des requêtes.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void connection_mux(struct server *server, struct connection *connection) {
+  struct connection_cold *cold = connection->cold;
+  int status, count, progress;
+
+  PROBE_BEGIN(server->probes, PROBE_FLUSH);
+  if ( connection_mux_flush(connection) == -1 ) {
+    connection_close(server, connection);
+    return;
+  }
+  PROBE_END(server->probes, PROBE_FLUSH);
+
+  if ( cold->received < MUX_BUFFER
+       && MUX_BUFFER - connection->len >= MUX_FRAME_MAX ) {
+    if ( connection_buffer(server, connection) == NULL ) {
+      connection_close(server, connection);
+      return;
+    }
+    PROBE_BEGIN(server->probes, PROBE_RECV);
+    status = message_receive(connection->fd, cold->ssl,
+                             connection->buffer + cold->received,
+                             MUX_BUFFER - cold->received, NULL);
+    PROBE_END(server->probes, PROBE_RECV);
+    if ( status == 0 || (status == -1 && errno != EAGAIN
+                         && errno != EWOULDBLOCK) ) {
+      connection_close(server, connection);
+      return;
+    }
+    if ( status > 0 ) {
+      cold->received += status;
+      server->stats.bytes += status;
+    }
+  }
+
+  /* Les réponses prêtes peuvent occuper tout le tampon d'envoi : les
+     requêtes reçues sont traitées une fois les réponses parties */
+  count = 0;
+  do {
+    progress = connection_mux_ready(server, connection);
+    status = connection_mux_process(server, connection);
+    if ( progress == -1 || status == -1 ) {
+      connection_close(server, connection);
+      return;
     }
+    PROBE_BEGIN(server->probes, PROBE_SEND);
+    if ( connection_mux_flush(connection) == -1 ) {
+      connection_close(server, connection);
+      return;
+    }
+    PROBE_END(server->probes, PROBE_SEND);
+    progress += status;
+    count += progress;
+  } while ( progress > 0 && connection->len == 0 );
+  connection_mux_watch(server, connection, count > 0);
+}
+
+/******************************************************************************
+ * Fonction qui change les événements attendus par epoll pour une connexion
+ * amont du relais.
+ * Prend en paramètre :
+ *     - server      Pointeur vers le serveur.
+ *     - upstream    Pointeur vers la connexion amont.
+ *     - events      Événements attendus.
+ *****************************************************************************/
+void upstream_watch(struct server *server, struct upstream *upstream,
+                    uint32_t events) {
+  struct epoll_event event;
+
+  if ( upstream->events == events )
+    return;
+  event.events = events;
+  event.data.ptr = upstream;
+  epoll_ctl(server->epollDescriptor, EPOLL_CTL_MOD, upstream->mux.fd, &event);
+  upstream->events = events;
+}
+
+int relay_connected(struct server *server);
+void relay_resume(struct server *server);
+
+/******************************************************************************
+ * Fonction qui ferme une connexion amont perdue ou refusée : les requêtes en
+ * attente échouent et la connexion est rouverte après RELAY_RETRY_MS. L'échec
+ * compte pour l'éviction du serveur amont, sauf pour une connexion établie
+ * sans requête en vol, que le serveur amont a pu fermer pour inactivité. Si
+ * c'était la dernière connexion établie, les clients suspendus sont relus
+ * pour être refusés.
+ * Prend en paramètre :
+ *     - server      Pointeur vers le serveur.
+ *     - upstream    Pointeur vers la connexion amont.
+ *****************************************************************************/
+void upstream_lost(struct server *server, struct upstream *upstream) {
+  struct balance *balance = &server->relay->balance;
+
+  if ( upstream->mux.fd != -1 )
+    close(upstream->mux.fd);
+  upstream->mux.fd = -1;
+  if ( !upstream->connected || upstream->mux.inFlight > 0 )
+    balance_failure(balance, upstream->index, now_ns());
+  if ( upstream->connected ) {
+    balance->upstreams[upstream->index].connected--;
+    upstream->connected = 0;
   }
+  mux_fail(&upstream->mux);
+  wheel_schedule(&server->wheel, &upstream->timer,
+                 RELAY_RETRY_MS / WHEEL_TICK_MS);
+  if ( !relay_connected(server) )
+    relay_resume(server);
+}
+
+/******************************************************************************
+ * Fonction qui ouvre, sans bloquer, une connexion vers un serveur amont : elle
+ * est utilisable une fois établie (EPOLLOUT).
+ * Prend en paramètre :
+ *     - server      Pointeur vers le serveur.
+ *     - upstream    Pointeur vers la connexion amont.
+ *****************************************************************************/
+void upstream_connect(struct server *server, struct upstream *upstream) {
+  struct balance_upstream *target;
+  struct epoll_event event;
+  int fd, noDelay = 1;
+
+  target = &server->relay->balance.upstreams[upstream->index];
+  fd = socket(target->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+              0);
+  mux_client_init(&upstream->mux, fd);
+  if ( fd == -1 ) {
+    perror("Error with socket");
+    upstream_lost(server, upstream);
+    return;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
 
-  socket_close(socketDescriptor);
+  upstream->events = EPOLLOUT;
+  event.events = EPOLLOUT;
+  event.data.ptr = upstream;
+  if ( (connect(fd, (struct sockaddr *) &target->addr, target->addrlen) == -1
+        && errno != EINPROGRESS)
+       || epoll_ctl(server->epollDescriptor, EPOLL_CTL_ADD, fd, &event) == -1 )
+    upstream_lost(server, upstream);
+}
+
+/******************************************************************************
+ * Fonction qui traite un événement sur une connexion amont : fin de la
+ * connexion, envoi des requêtes en attente et réception des réponses, qui
+ * sont renvoyées aux clients par relay_complete. La place libérée rend la
+ * lecture aux clients suspendus.
+ * Prend en paramètre :
+ *     - server      Pointeur vers le serveur.
+ *     - upstream    Pointeur vers la connexion amont.
+ *     - events      Événements signalés par epoll.
+ *****************************************************************************/
+void upstream_handle(struct server *server, struct upstream *upstream,
+                     uint32_t events) {
+  socklen_t len = sizeof(int);
+  unsigned int inFlight;
+  size_t outLen;
+  int error = 0;
+
+  /* Événement d'une connexion fermée plus tôt dans le même tour */
+  if ( upstream->mux.fd == -1 )
+    return;
+
+  if ( !upstream->connected ) {
+    if ( getsockopt(upstream->mux.fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1
+         || error != 0 ) {
+      upstream_lost(server, upstream);
+      return;
+    }
+    upstream->connected = 1;
+    server->relay->balance.upstreams[upstream->index].connected++;
+    upstream_watch(server, upstream, EPOLLIN);
+    relay_resume(server);
+    return;
+  }
+
+  inFlight = upstream->mux.inFlight;
+  outLen = upstream->mux.outLen;
+  if ( ((events & EPOLLOUT) && mux_flush(&upstream->mux) == -1)
+       || ((events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+           && mux_receive(&upstream->mux) == -1) ) {
+    upstream_lost(server, upstream);
+    return;
+  }
+  upstream_watch(server, upstream,
+                 upstream->mux.outLen > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+  if ( upstream->mux.inFlight < inFlight || upstream->mux.outLen < outLen )
+    relay_resume(server);
+}
+
+/******************************************************************************
+ * Fonction qui abandonne un client dont la requête a échoué, sans le libérer :
+ * d'autres événements du tour en cours peuvent encore le désigner. Il est
+ * fermé par son prochain événement, la lecture de la fin du flux.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void relay_drop(struct server *server, struct connection *connection) {
+  server->stats.relayErrors++;
+  shutdown(connection->fd, SHUT_RDWR);
+  connection_release(server, connection);
+  connection_set_state(server, connection, CONN_IDLE);
+}
+
+/******************************************************************************
+ * Fonction appelée à la réponse d'un serveur amont, ou à la perte de la
+ * connexion amont (en-tête NULL). La réponse est envoyée au client depuis le
+ * tampon de réception amont ; seul un envoi partiel est recopié dans le
+ * tampon du client.
+ * Prend en paramètre :
+ *     - client     Pointeur vers le client multiplexé de la connexion amont.
+ *     - arg        Pointeur vers la connexion du client.
+ *     - header     En-tête de la réponse, ou NULL.
+ *     - payload    Charge utile de la réponse.
+ *****************************************************************************/
+void relay_complete(struct mux_client *client, void *arg,
+                    struct mux_header *header, char *payload) {
+  struct upstream *upstream;
+  struct connection *connection = arg;
+  struct server *server;
+  int sent;
+
+  upstream = (struct upstream *) ((char *) client
+                                  - offsetof(struct upstream, mux));
+  server = upstream->server;
+  connection->cold->upstream = NULL;
+  balance_finish(&server->relay->balance, upstream->index);
+  if ( header == NULL || (header->flags & MUX_FLAG_ERROR)
+       || header->length != MSG_SIZE ) {
+    relay_drop(server, connection);
+    return;
+  }
+  balance_success(&server->relay->balance, upstream->index, now_ns());
+  server->stats.relayed++;
+
+  sent = message_send(connection->fd, connection_ssl(connection), payload,
+                      MSG_SIZE, 0);
+  if ( sent == -1 ) {
+    relay_drop(server, connection);
+    return;
+  }
+  if ( sent < MSG_SIZE ) {
+    if ( connection_buffer(server, connection) == NULL ) {
+      relay_drop(server, connection);
+      return;
+    }
+    memcpy(connection->buffer, payload, MSG_SIZE);
+    connection->len = MSG_SIZE;
+    connection->sent = sent;
+    connection_set_state(server, connection, CONN_WRITE);
+    return;
+  }
+  connection_set_state(server, connection, CONN_IDLE);
+}
+
+/******************************************************************************
+ * Fonction qui retire la requête en cours d'un client qui se ferme : sa
+ * réponse, si elle arrive, sera ignorée.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void relay_abandon(struct server *server, struct connection *connection) {
+  struct upstream *upstream = connection->cold->upstream;
+
+  mux_cancel(&upstream->mux, connection->cold->request);
+  balance_finish(&server->relay->balance, upstream->index);
+  connection->cold->upstream = NULL;
+}
+
+/******************************************************************************
+ * Fonction qui choisit la connexion amont d'une requête : le serveur amont
+ * selon la politique du répartiteur, puis la connexion de ce serveur qui a le
+ * moins de requêtes en vol et de la place pour un message ; à égalité, les
+ * connexions sont prises tour à tour.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *     - key       Clé de répartition du client.
+ * Renvoie la connexion amont, NULL si aucune n'est disponible.
+ *****************************************************************************/
+struct upstream *relay_pick(struct server *server, uint32_t key) {
+  struct relay *relay = server->relay;
+  struct upstream *candidate, *best = NULL;
+  int index, i;
+
+  index = balance_pick(&relay->balance, key, now_ns());
+  if ( index == -1 )
+    return NULL;
+  relay->next++;
+  for ( i = 0; i < relay->pool; i++ ) {
+    candidate = &relay->upstreams[index * relay->pool
+                                  + (relay->next + i) % relay->pool];
+    if ( !candidate->connected
+         || mux_prepare(&candidate->mux, MSG_SIZE) == NULL )
+      continue;
+    if ( best == NULL || candidate->mux.inFlight < best->mux.inFlight )
+      best = candidate;
+  }
+  return best;
+}
+
+/******************************************************************************
+ * Fonction qui indique si le relais a au moins une connexion amont établie.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+int relay_connected(struct server *server) {
+  struct relay *relay = server->relay;
+  int i;
+
+  for ( i = 0; i < relay->count; i++ ) {
+    if ( relay->upstreams[i].connected )
+      return 1;
+  }
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui suspend la lecture d'un client faute de place sur les
+ * connexions amont : son message attend dans le socket, et l'échéance de
+ * la connexion continue de courir.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void relay_park(struct server *server, struct connection *connection) {
+  struct connection_cold *cold = connection->cold;
+  struct relay *relay = server->relay;
+
+  connection_watch(server, connection, 0);
+  cold->waiting = 1;
+  cold->waitPrev = NULL;
+  cold->waitNext = relay->waitFirst;
+  if ( relay->waitFirst != NULL )
+    relay->waitFirst->cold->waitPrev = connection;
+  relay->waitFirst = connection;
+}
+
+/******************************************************************************
+ * Fonction qui retire un client de la file des clients suspendus.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void relay_unpark(struct server *server, struct connection *connection) {
+  struct connection_cold *cold = connection->cold;
+
+  if ( cold->waitPrev != NULL )
+    cold->waitPrev->cold->waitNext = cold->waitNext;
+  else
+    server->relay->waitFirst = cold->waitNext;
+  if ( cold->waitNext != NULL )
+    cold->waitNext->cold->waitPrev = cold->waitPrev;
+  cold->waiting = 0;
+}
+
+/******************************************************************************
+ * Fonction qui rend la lecture aux clients suspendus, quand une connexion
+ * amont a envoyé des requêtes, reçu des réponses ou vient de s'établir ; un
+ * client qui ne trouve toujours pas de place est suspendu à nouveau.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+void relay_resume(struct server *server) {
+  struct connection *connection;
+
+  while ( (connection = server->relay->waitFirst) != NULL ) {
+    relay_unpark(server, connection);
+    connection_watch(server, connection, EPOLLIN);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui envoie les requêtes accumulées pendant le tour de boucle : un
+ * seul envoi par connexion amont, quel que soit le nombre de clients servis.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+void relay_flush(struct server *server) {
+  struct relay *relay = server->relay;
+  struct upstream *upstream;
+  int i, freed = 0;
+  size_t outLen;
+
+  for ( i = 0; i < relay->flushCount; i++ ) {
+    upstream = relay->flush[i];
+    upstream->queued = 0;
+    if ( !upstream->connected )
+      continue;
+    outLen = upstream->mux.outLen;
+    if ( mux_flush(&upstream->mux) == -1 ) {
+      upstream_lost(server, upstream);
+      continue;
+    }
+    if ( upstream->mux.outLen < outLen )
+      freed = 1;
+    if ( upstream->mux.outLen > 0 )
+      upstream_watch(server, upstream, EPOLLIN | EPOLLOUT);
+  }
+  relay->flushCount = 0;
+  if ( freed )
+    relay_resume(server);
+}
+
+/******************************************************************************
+ * Fonction qui traite un événement sur une connexion client du relais : le
+ * message est reçu directement dans la trame de la requête amont, sans copie,
+ * puis envoyé en fin de tour. La lecture reste armée pendant l'attente de la
+ * réponse : un client qui attend ne réveille la boucle qu'en fermant, et un
+ * client qui envoie sans attendre n'est plus lu jusqu'à la réponse. Un
+ * serveur amont lent suspend de même la lecture des nouveaux clients.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void connection_relay(struct server *server, struct connection *connection) {
+  struct connection_cold *cold = connection->cold;
+  struct upstream *upstream;
+  char *msg, peek;
+  int status;
+
+  /* Client suspendu réveillé par sa fermeture : il sera relu ou refusé */
+  if ( cold->waiting )
+    relay_unpark(server, connection);
+
+  if ( cold->upstream != NULL ) {
+    status = recv(connection->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    if ( status > 0 )
+      connection_watch(server, connection, 0);
+    else if ( status == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) )
+      connection_close(server, connection);
+    return;
+  }
+
+  /* Suite d'une réponse partiellement envoyée */
+  if ( connection->state == CONN_WRITE ) {
+    status = message_send(connection->fd, connection_ssl(connection),
+                          connection->buffer, connection->len,
+                          connection->sent);
+    if ( status == -1 ) {
+      connection_close(server, connection);
+      return;
+    }
+    connection->sent = status;
+    if ( connection->sent < connection->len )
+      return;
+    connection_release(server, connection);
+    connection_set_state(server, connection, CONN_IDLE);
+    return;
+  }
+
+  /* Sans place sur les connexions amont, le client n'est plus lu jusqu'à ce
+     qu'elles se libèrent ; sans connexion amont établie, un client qui
+     envoie est refusé */
+  upstream = relay_pick(server, cold->key);
+  if ( upstream == NULL && relay_connected(server) ) {
+    relay_park(server, connection);
+    return;
+  }
+  if ( upstream == NULL ) {
+    if ( recv(connection->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) > 0 )
+      server->stats.relayErrors++;
+    connection_close(server, connection);
+    return;
+  }
+  msg = (char *) mux_prepare(&upstream->mux, MSG_SIZE);
+  memset(msg, 0, MSG_SIZE);
+  status = message_receive(connection->fd, connection_ssl(connection), msg,
+                           MSG_SIZE, NULL);
+  if ( status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    return;
+  if ( status <= 0 ) {
+    connection_close(server, connection);
+    return;
+  }
+  server->stats.messages++;
+  server->stats.bytes += status;
+  if ( server->trace != NULL )
+    trace_append(server->trace, cold->id, msg, status);
+  if ( server->journal != NULL )
+    journal_append(server->journalLog, cold->id, msg, status);
+  message_trim(msg);
+
+  cold->request = mux_commit(&upstream->mux, MUX_OP_ECHO, MSG_SIZE,
+                             relay_complete, connection);
+  cold->upstream = upstream;
+  balance_start(&server->relay->balance, upstream->index);
+  if ( !upstream->queued ) {
+    upstream->queued = 1;
+    server->relay->flush[server->relay->flushCount++] = upstream;
+  }
+  connection->state = CONN_WRITE;
+  wheel_schedule(&server->wheel, &connection->timer,
+                 server->timeouts[CONN_WRITE]);
+}
+
+/******************************************************************************
+ * Fonction qui prépare le relais d'une boucle d'événements et ouvre ses
+ * connexions amont. La roue doit être initialisée.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ * Renvoie 0, -1 en cas d'erreur.
+ *****************************************************************************/
+int relay_init(struct server *server) {
+  struct relay *relay;
+  int i;
+
+  relay = calloc(1, sizeof(*relay));
+  if ( relay == NULL )
+    return -1;
+  if ( balance_init(&relay->balance, server->upstreams, server->policy) == -1 ) {
+    free(relay);
+    return -1;
+  }
+  relay->pool = server->pool;
+  relay->count = relay->balance.count * relay->pool;
+  relay->upstreams = calloc(relay->count, sizeof(*relay->upstreams));
+  relay->flush = calloc(relay->count, sizeof(*relay->flush));
+  if ( relay->upstreams == NULL || relay->flush == NULL ) {
+    free(relay->upstreams);
+    free(relay->flush);
+    balance_free(&relay->balance);
+    free(relay);
+    return -1;
+  }
+
+  server->relay = relay;
+  for ( i = 0; i < relay->count; i++ ) {
+    relay->upstreams[i].timer.kind = TIMER_UPSTREAM;
+    relay->upstreams[i].server = server;
+    relay->upstreams[i].index = i / relay->pool;
+    upstream_connect(server, &relay->upstreams[i]);
+  }
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui ferme les connexions amont et libère le relais.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+void relay_free(struct server *server) {
+  struct relay *relay = server->relay;
+  int i;
+
+  if ( relay == NULL )
+    return;
+  for ( i = 0; i < relay->count; i++ )
+    if ( relay->upstreams[i].mux.fd != -1 )
+      close(relay->upstreams[i].mux.fd);
+  balance_free(&relay->balance);
+  free(relay->upstreams);
+  free(relay->flush);
+  free(relay);
+  server->relay = NULL;
+}
+
+/******************************************************************************
+ * Fonction qui traite un événement sur une connexion client : réception d'un
+ * message puis renvoi au client, ou suite d'un envoi bloqué.
+ * Prend en paramètre :
+ *     - server        Pointeur vers le serveur.
+ *     - connection    Pointeur vers la connexion.
+ *****************************************************************************/
+void connection_handle(struct server *server, struct connection *connection) {
+  struct timespec receivedAt, before;
+  struct tstamp_tx tx;
+  struct tstamp rx;
+  uint64_t sequence = 0;
+  char *msg, peek;
+  int status;
+
+  if ( connection->state == CONN_HANDSHAKE ) {
+    connection_handshake(server, connection);
+    return;
+  }
+  if ( server->mux ) {
+    connection_mux(server, connection);
+    return;
+  }
+  if ( server->relay != NULL ) {
+    connection_relay(server, connection);
+    return;
+  }
+
+  /* Réponse retenue par le journal : le client n'est lu que pour voir s'il
+     ferme, et plus du tout s'il envoie la suite sans attendre */
+  if ( connection->cold != NULL && connection->cold->journalSeq != 0 ) {
+    status = recv(connection->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    if ( status > 0 )
+      connection_watch(server, connection, 0);
+    else if ( status == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) )
+      connection_close(server, connection);
+    return;
+  }
+
+  /* Horodatages d'émission arrivés en retard : ils réveilleraient la boucle
+     (EPOLLERR) tant qu'ils ne sont pas lus */
+  if ( server->tstamp != NULL ) {
+    memset(&tx, 0, sizeof(tx));
+    tstamp_tx_read(connection->fd, TSTAMP_ANY_KEY, &tx);
+  }
+
+  /* Le tampon n'est emprunté que le temps de recevoir et de renvoyer */
+  msg = connection_buffer(server, connection);
+  if ( msg == NULL ) {
+    connection_close(server, connection);
+    return;
+  }
+
+  if ( connection->state != CONN_WRITE ) {
+    PROBE_BEGIN(server->probes, PROBE_RECV);
+    if ( !server->stream )
+      memset(msg, 0, MSG_SIZE);
+    status = message_receive(connection->fd, connection_ssl(connection), msg,
+                             server->bufferSize,
+                             server->tstamp != NULL ? &rx : NULL);
+    PROBE_END(server->probes, PROBE_RECV);
+    if ( status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+      connection_release(server, connection);
+      return;
+    }
+    if ( status <= 0 ) {
+      connection_close(server, connection);
+      return;
+    }
+    if ( server->tstamp != NULL )
+      tstamp_now(&receivedAt);
+    PROBE_BEGIN(server->probes, PROBE_HANDLER);
+    server->stats.messages++;
+    server->stats.bytes += status;
+    if ( server->trace != NULL )
+      trace_append(server->trace, connection->cold->id, msg, status);
+    if ( server->journal != NULL )
+      sequence = journal_append(server->journalLog, connection->cold->id, msg,
+                                status);
+
+    /* Mode flux : les octets reçus sont renvoyés tels quels */
+    if ( server->stream ) {
+      connection->len = status;
+    } else {
+      message_trim(msg);
+      printf(">> %s\n", msg);
+      connection->len = MSG_SIZE;
+    }
+    PROBE_END(server->probes, PROBE_HANDLER);
+    connection->sent = 0;
+    if ( server->tstamp != NULL ) {
+      memset(&tx, 0, sizeof(tx));
+      tstamp_now(&before);
+    }
+    if ( server->journalSync ) {
+      /* Journal désactivé : le message ne sera jamais durable */
+      if ( sequence == 0 ) {
+        connection_close(server, connection);
+        return;
+      }
+      journal_park(server, connection, sequence);
+      return;
+    }
+  }
+
+  PROBE_BEGIN(server->probes, PROBE_SEND);
+  status = message_send(connection->fd, connection_ssl(connection), msg,
+                        connection->len, connection->sent);
+  if ( status == -1 ) {
+    connection_close(server, connection);
+    return;
+  }
+  PROBE_END(server->probes, PROBE_SEND);
+  connection->sent = status;
+  if ( connection->sent < connection->len ) {
+    connection_set_state(server, connection, CONN_WRITE);
+    return;
+  }
+
+  /* Seules les réponses envoyées d'un coup sont découpées ; le dernier
+     horodatage lu est celui de la réponse */
+  if ( server->tstamp != NULL && connection->state != CONN_WRITE ) {
+    tstamp_tx_read(connection->fd, TSTAMP_ANY_KEY, &tx);
+    tstamp_server_add(server->tstamp, &rx, &receivedAt, &before, &tx);
+  }
+
+  if ( !server->stream )
+    printf(">> # Same message sent.\n");
+  connection_release(server, connection);
+  connection_set_state(server, connection, CONN_IDLE);
+}
+
+/******************************************************************************
+ * Fonction qui envoie les réponses dont le message est devenu durable, dans
+ * l'ordre des messages, et ferme les connexions qui attendent un journal
+ * désactivé. Appelée après le traitement des événements du tour : une
+ * connexion fermée ici n'a plus d'événement en attente.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+void journal_release(struct server *server) {
+  struct connection *connection;
+  uint64_t committed, value;
+
+  if ( read(server->journalDescriptor, &value, sizeof(value)) == -1
+       && errno != EAGAIN )
+    perror("Error with read");
+  committed = journal_committed(server->journalLog);
+  while ( (connection = server->journalFirst) != NULL
+          && connection->cold->journalSeq <= committed ) {
+    journal_unpark(server, connection);
+    connection_handle(server, connection);
+  }
+  /* Journal désactivé : les réponses retenues ne partiront jamais */
+  if ( journal_disabled(server->journal) ) {
+    while ( server->journalFirst != NULL )
+      connection_close(server, server->journalFirst);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui affiche les statistiques du serveur.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+void stats_print(struct server *server) {
+  struct server_stats *stats = &server->stats;
+
+  printf("\nConnections open : %lu, accepted : %lu, closed : %lu, messages : %lu, "
+         "bytes : %llu\n", server->connections, stats->accepted, stats->closed,
+         stats->messages, stats->bytes);
+  printf("Timeouts read : %lu, idle : %lu, write : %lu\n",
+         stats->readTimeouts, stats->idleTimeouts, stats->writeTimeouts);
+  printf("Shed capacity : %lu, fd limit : %lu, queue delay : %lu, "
+         "accept errors : %lu\n", stats->accept.shedCapacity,
+         stats->accept.shedFdLimit, stats->shedQueueDelay,
+         stats->accept.errors);
+  if ( server->mux )
+    printf("Multiplexed deferred : %lu, protocol errors : %lu\n",
+           stats->deferred, stats->protocolErrors);
+  if ( server->upstreams != NULL )
+    printf("Relayed : %lu, relay errors : %lu\n", stats->relayed,
+           stats->relayErrors);
+  if ( server->relay != NULL )
+    balance_print(&server->relay->balance, now_ns());
+  /* État d'une connexion inactive et tampons prêtés, pour une seule boucle */
+  if ( server->arena.objectSize != 0 )
+    printf("Memory per connection : %zu bytes, buffers lent : %lu of %lu "
+           "(%zu bytes each)\n", server->arena.objectSize
+           + (server_cold(server) ? server->colds.objectSize : 0),
+           server->buffers.used, server->buffers.capacity,
+           server->buffers.objectSize);
+  if ( server->secure != NULL )
+    secure_print(server->secure);
+  if ( server->tstamp != NULL )
+    tstamp_print(server->tstamp);
+  if ( server->journal != NULL )
+    journal_print(server->journal);
+  fflush(stdout);
+}
+
+/******************************************************************************
+ * Fonction qui ajoute les statistiques d'un worker au total.
+ * Prend en paramètre :
+ *     - total    Pointeur vers le total.
+ *     - stats    Pointeur vers les statistiques du worker.
+ *****************************************************************************/
+void stats_add(struct server_stats *total, struct server_stats *stats) {
+  total->accepted += stats->accepted;
+  total->closed += stats->closed;
+  total->messages += stats->messages;
+  total->bytes += stats->bytes;
+  total->readTimeouts += stats->readTimeouts;
+  total->idleTimeouts += stats->idleTimeouts;
+  total->writeTimeouts += stats->writeTimeouts;
+  total->accept.shedCapacity += stats->accept.shedCapacity;
+  total->accept.shedFdLimit += stats->accept.shedFdLimit;
+  total->accept.errors += stats->accept.errors;
+  total->shedQueueDelay += stats->shedQueueDelay;
+  total->local += stats->local;
+  total->remote += stats->remote;
+  total->deferred += stats->deferred;
+  total->protocolErrors += stats->protocolErrors;
+  total->relayed += stats->relayed;
+  total->relayErrors += stats->relayErrors;
+}
+
+/******************************************************************************
+ * Fonction qui affiche les statistiques de tous les workers : le total puis,
+ * pour chacun, sa place et la part des connexions reçues par son CPU.
+ * Prend en paramètre :
+ *     - workers    Tableau des workers.
+ *     - count      Nombre de workers.
+ *****************************************************************************/
+void workers_print(struct worker *workers, int count) {
+  struct server total;
+  struct secure secure;
+  struct process_stats *snapshots, *snapshot;
+  int i;
+
+  snapshots = malloc(count * sizeof(struct process_stats));
+  if ( snapshots == NULL ) {
+    perror("Error with malloc");
+    return;
+  }
+  /* Copie des statistiques publiées, jamais de celles qu'un worker écrit */
+  for ( i = 0; i < count; i++ ) {
+    pthread_mutex_lock(&workers[i].lock);
+    snapshots[i] = workers[i].snapshot;
+    pthread_mutex_unlock(&workers[i].lock);
+  }
+
+  memset(&total, 0, sizeof(total));
+  memset(&secure, 0, sizeof(secure));
+  total.mux = workers[0].server.mux;
+  total.upstreams = workers[0].server.upstreams;
+  total.journal = workers[0].server.journal;
+  if ( workers[0].server.secure != NULL )
+    total.secure = &secure;
+  for ( i = 0; i < count; i++ ) {
+    snapshot = &snapshots[i];
+    total.connections += snapshot->connections;
+    stats_add(&total.stats, &snapshot->stats);
+    secure.handshakes += snapshot->handshakes;
+    secure.resumed += snapshot->resumed;
+    secure.offloaded += snapshot->offloaded;
+    secure.failures += snapshot->failures;
+  }
+  stats_print(&total);
+
+  for ( i = 0; i < count; i++ ) {
+    snapshot = &snapshots[i];
+    printf("Worker %d : cpu %d, node %d, open %lu, accepted %lu, messages %lu, "
+           "local %lu, remote %lu\n", i, snapshot->cpu, snapshot->node,
+           snapshot->connections, snapshot->stats.accepted,
+           snapshot->stats.messages, snapshot->stats.local,
+           snapshot->stats.remote);
+  }
+  fflush(stdout);
+  free(snapshots);
+}
+
+/******************************************************************************
+ * Fonction qui publie les statistiques d'un worker : sous verrou pour le
+ * thread principal, ou pour le superviseur d'un processus worker entre deux
+ * incréments de la séquence (seqlock) ; un verrou pourrait rester pris par
+ * un worker mort.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur du worker.
+ *****************************************************************************/
+void process_publish(struct server *server) {
+  struct process_stats *shared = server->shared;
+
+  if ( server->lock != NULL ) {
+    pthread_mutex_lock(server->lock);
+  } else {
+    __atomic_store_n(&shared->sequence, shared->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+  shared->connections = server->connections;
+  shared->stats = server->stats;
+  if ( server->secure != NULL ) {
+    shared->handshakes = server->secure->handshakes;
+    shared->resumed = server->secure->resumed;
+    shared->offloaded = server->secure->offloaded;
+    shared->failures = server->secure->failures;
+  }
+  shared->cpu = server->cpu;
+  shared->node = server->node;
+  if ( server->lock != NULL )
+    pthread_mutex_unlock(server->lock);
+  else
+    __atomic_store_n(&shared->sequence, shared->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * Fonction qui copie les statistiques publiées par un processus worker,
+ * relues tant qu'une publication est en cours ou a eu lieu pendant la
+ * copie. Au-delà de PUBLISH_RETRIES essais (worker mort pendant une copie,
+ * pas encore remplacé), la dernière copie est gardée.
+ * Prend en paramètre :
+ *     - shared    Pointeur vers les statistiques publiées.
+ *     - copy      Pointeur vers la copie à remplir.
+ *****************************************************************************/
+void process_read(struct process_stats *shared, struct process_stats *copy) {
+  unsigned long before, after;
+  int tries;
+
+  for ( tries = 0; tries < PUBLISH_RETRIES; tries++ ) {
+    before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+    memcpy(copy, shared, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED);
+    if ( before == after && (before & 1) == 0 )
+      return;
+    sched_yield();
+  }
+}
+
+/******************************************************************************
+ * Fonction qui affiche les statistiques de tous les processus workers : le
+ * total puis, pour chacun, son pid et ses redémarrages. Les statistiques d'un
+ * worker mort sont reprises par son remplaçant.
+ * Prend en paramètre :
+ *     - prefork    Pointeur vers le superviseur.
+ *     - arg        Pointeur vers la configuration commune du serveur.
+ *****************************************************************************/
+void processes_print(struct prefork *prefork, void *arg) {
+  struct server *model = arg;
+  struct prefork_slot *slot;
+  struct process_stats *snapshots, *shared;
+  struct server total;
+  struct secure secure;
+  int i;
+
+  snapshots = malloc(prefork->count * sizeof(struct process_stats));
+  if ( snapshots == NULL ) {
+    perror("Error with malloc");
+    return;
+  }
+  for ( i = 0; i < prefork->count; i++ )
+    process_read((struct process_stats *) prefork_slot(prefork, i)->data,
+                 &snapshots[i]);
+
+  memset(&total, 0, sizeof(total));
+  memset(&secure, 0, sizeof(secure));
+  total.mux = model->mux;
+  total.upstreams = model->upstreams;
+  if ( model->secure != NULL )
+    total.secure = &secure;
+  for ( i = 0; i < prefork->count; i++ ) {
+    shared = &snapshots[i];
+    total.connections += shared->connections;
+    stats_add(&total.stats, &shared->stats);
+    secure.handshakes += shared->handshakes;
+    secure.resumed += shared->resumed;
+    secure.offloaded += shared->offloaded;
+    secure.failures += shared->failures;
+  }
+  stats_print(&total);
+
+  for ( i = 0; i < prefork->count; i++ ) {
+    slot = prefork_slot(prefork, i);
+    shared = &snapshots[i];
+    printf("Process %d : pid %d, restarts %lu, open %lu, accepted %lu, "
+           "messages %lu\n", i, (int) slot->pid, slot->restarts,
+           shared->connections, shared->stats.accepted,
+           shared->stats.messages);
+  }
+  fflush(stdout);
+  free(snapshots);
+}
+
+/******************************************************************************
+ * Fonction qui exécute la boucle d'événements jusqu'à l'arrêt du serveur.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+void server_run(struct server *server) {
+  struct epoll_event events[MAX_EVENTS];
+  struct epoll_event event;
+  uint64_t batchStart, queueStart, now;
+  int count, i, committed;
+
+  server->epollDescriptor = epoll_create1(0);
+  if ( server->epollDescriptor == -1 ) {
+    perror("Error with epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if ( epoll_ctl(server->epollDescriptor, EPOLL_CTL_ADD,
+                 server->socketDescriptor, &event) == -1 ) {
+    perror("Error with epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+  if ( server->wakeDescriptor != -1 ) {
+    event.data.ptr = &server->wakeDescriptor;
+    epoll_ctl(server->epollDescriptor, EPOLL_CTL_ADD, server->wakeDescriptor,
+              &event);
+  }
+  /* Tampon d'ajout au journal propre à la boucle, et notification des
+     validations si les réponses les attendent */
+  server->journalDescriptor = -1;
+  if ( server->journal != NULL ) {
+    if ( server->journalSync ) {
+      server->journalDescriptor = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      event.data.ptr = &server->journalDescriptor;
+      epoll_ctl(server->epollDescriptor, EPOLL_CTL_ADD,
+                server->journalDescriptor, &event);
+    }
+    server->journalLog = journal_log_open(server->journal,
+                                          server->journalDescriptor);
+    if ( server->journalLog == NULL ) {
+      perror("Error with journal_log_open");
+      exit(EXIT_FAILURE);
+    }
+  }
+  wheel_init(&server->wheel);
+  if ( server->probeFile != NULL
+       && (server->probes = probe_ring_create()) == NULL ) {
+    perror("Error with probe_ring_create");
+    exit(EXIT_FAILURE);
+  }
+  if ( server->upstreams != NULL && relay_init(server) == -1 ) {
+    perror("Error with relay_init");
+    exit(EXIT_FAILURE);
+  }
+
+  if ( server->shared != NULL )
+    process_publish(server);
+
+  batchStart = now_ns();
+  while ( running ) {
+    /* Délai d'attente des événements (CoDel) : ceux déjà prêts au retour
+       dans epoll_wait ont attendu pendant le tour précédent, depuis son
+       début au plus tôt ; sinon la boucle dormait et ils viennent
+       d'arriver. L'état de CoDel est gardé d'un tour à l'autre. */
+    queueStart = 0;
+    count = 0;
+    if ( server->codel.target != 0 ) {
+      count = epoll_wait(server->epollDescriptor, events, MAX_EVENTS, 0);
+      if ( count > 0 )
+        queueStart = batchStart;
+    }
+    if ( count <= 0 )
+      count = epoll_wait(server->epollDescriptor, events, MAX_EVENTS,
+                         wheel_timeout(&server->wheel));
+    if ( count == -1 && errno != EINTR ) {
+      perror("Error with epoll_wait");
+      break;
+    }
+
+    batchStart = now_ns();
+    if ( queueStart == 0 )
+      queueStart = batchStart;
+    committed = 0;
+    for ( i = 0; i < count; i++ ) {
+      /* Réveil demandé par le thread principal pour l'arrêt */
+      if ( events[i].data.ptr == &server->wakeDescriptor )
+        continue;
+      /* Validation du journal, les réponses partent en fin de tour */
+      if ( events[i].data.ptr == &server->journalDescriptor ) {
+        committed = 1;
+        continue;
+      }
+      /* Connexions amont du relais, jamais délestées */
+      if ( events[i].data.ptr != NULL
+           && ((struct timer *) events[i].data.ptr)->kind == TIMER_UPSTREAM ) {
+        upstream_handle(server, events[i].data.ptr, events[i].events);
+        continue;
+      }
+
+      now = server->codel.target != 0 ? now_ns() : batchStart;
+      if ( codel_should_drop(&server->codel, now - queueStart, now) ) {
+        server->stats.shedQueueDelay++;
+        if ( events[i].data.ptr == NULL )
+          acceptor_reject(server->socketDescriptor);
+        else
+          connection_close(server, events[i].data.ptr);
+        continue;
+      }
+
+      if ( events[i].data.ptr == NULL )
+        server_accept(server);
+      else
+        connection_handle(server, events[i].data.ptr);
+    }
+
+    if ( server->relay != NULL )
+      relay_flush(server);
+    if ( committed )
+      journal_release(server);
+    wheel_advance(&server->wheel, timer_expire, server);
+    if ( server->shared != NULL )
+      process_publish(server);
+
+    /* Les workers laissent l'affichage au thread principal */
+    if ( dumpStats && server->wakeDescriptor == -1 ) {
+      dumpStats = 0;
+      stats_print(server);
+    }
+    if ( dumpProbes && server->wakeDescriptor == -1
+         && server->probeFile != NULL ) {
+      dumpProbes = 0;
+      if ( probe_dump(server->probeFile) == -1 )
+        perror("Error with probe_dump");
+    }
+  }
+
+  close(server->epollDescriptor);
+}
+
+/******************************************************************************
+ * Fonction qui prépare les arènes d'un serveur : états des connexions, champs
+ * froids et tampons prêtés.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *     - node      Nœud NUMA des allocations, -1 pour la politique par défaut.
+ *****************************************************************************/
+void server_arenas_init(struct server *server, int node) {
+  arena_init(&server->arena, sizeof(struct connection), node);
+  arena_init(&server->colds, sizeof(struct connection_cold), node);
+  arena_init(&server->buffers, server->bufferSize, node);
+}
+
+/******************************************************************************
+ * Fonction qui libère les arènes d'un serveur.
+ * Prend en paramètre :
+ *     - server    Pointeur vers le serveur.
+ *****************************************************************************/
+void server_arenas_destroy(struct server *server) {
+  arena_destroy(&server->arena);
+  arena_destroy(&server->colds);
+  arena_destroy(&server->buffers);
+}
+
+/******************************************************************************
+ * Thread d'un worker : épinglage sur son CPU, allocations sur le nœud NUMA de
+ * ce CPU, puis boucle d'événements.
+ * Prend en paramètre :
+ *     - arg    Pointeur vers le worker.
+ *****************************************************************************/
+void *worker_run(void *arg) {
+  struct worker *worker = arg;
+  struct server *server = &worker->server;
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(server->cpu, &cpus);
+  if ( pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0 )
+    server->cpu = -1;
+
+  if ( server->cpu >= 0 && numa_available() != -1 ) {
+    server->node = numa_node_of_cpu(server->cpu);
+    numa_set_localalloc();
+  }
+  server_arenas_init(server, server->node);
+
+  server_run(server);
+  return NULL;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le nœud NUMA d'un CPU, 0 si NUMA n'est pas disponible.
+ *****************************************************************************/
+int cpu_node(int cpu) {
+  int node;
+
+  if ( numa_available() == -1 || (node = numa_node_of_cpu(cpu)) < 0 )
+    return 0;
+  return node;
+}
+
+/******************************************************************************
+ * Fonction qui aiguille chaque nouvelle connexion vers le socket d'un worker
+ * proche du CPU qui a reçu le paquet : un programme CBPF attaché au groupe
+ * SO_REUSEPORT renvoie l'index du socket lu dans une table par CPU. Un CPU
+ * va au worker épinglé sur lui ; sans worker, à un worker de son nœud NUMA,
+ * à tour de rôle entre les CPU du nœud ; sans worker sur le nœud, au worker
+ * CPU modulo nombre de workers, comme le font les CPU au-delà de la table.
+ * Prend en paramètre :
+ *     - socketDescriptor    Un socket du groupe.
+ *     - workers             Tableau des workers, index des sockets du groupe.
+ *     - count               Nombre de workers.
+ *     - cpus                Nombre de CPU.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+int steering_attach(int socketDescriptor, struct worker *workers, int count,
+                    long cpus) {
+  struct sock_filter *code;
+  struct sock_fprog program;
+  int *nodes, *spread;
+  int cpu, node, i, target, seen, length = 0, status;
+
+  /* Deux instructions par CPU : comparaison puis index du socket */
+  if ( cpus > (BPF_MAXINSNS - 3) / 2 )
+    cpus = (BPF_MAXINSNS - 3) / 2;
+  code = malloc((2 * cpus + 3) * sizeof(struct sock_filter));
+  nodes = malloc(count * sizeof(int));
+  spread = calloc(numa_available() == -1 ? 1 : numa_max_node() + 1,
+                  sizeof(int));
+  if ( code == NULL || nodes == NULL || spread == NULL ) {
+    free(code);
+    free(nodes);
+    free(spread);
+    return -1;
+  }
+  for ( i = 0; i < count; i++ )
+    nodes[i] = cpu_node(workers[i].server.cpu);
+
+  code[length++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                                 SKF_AD_OFF + SKF_AD_CPU);
+  for ( cpu = 0; cpu < cpus; cpu++ ) {
+    target = -1;
+    for ( i = 0; i < count && target == -1; i++ ) {
+      if ( workers[i].server.cpu == cpu )
+        target = i;
+    }
+    if ( target == -1 ) {
+      /* Workers du nœud, choisis à tour de rôle par les CPU sans worker */
+      node = cpu_node(cpu);
+      seen = 0;
+      for ( i = 0; i < count; i++ ) {
+        if ( nodes[i] == node )
+          seen++;
+      }
+      if ( seen > 0 ) {
+        seen = spread[node]++ % seen;
+        for ( i = 0; i < count && target == -1; i++ ) {
+          if ( nodes[i] == node && seen-- == 0 )
+            target = i;
+        }
+      } else {
+        target = cpu % count;
+      }
+    }
+    code[length++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                   cpu, 0, 1);
+    code[length++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, target);
+  }
+  code[length++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+                                                 count);
+  code[length++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+  program.len = length;
+  program.filter = code;
+  status = setsockopt(socketDescriptor, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                      &program, sizeof(program));
+  free(code);
+  free(nodes);
+  free(spread);
+  return status;
+}
+
+/******************************************************************************
+ * Fonction qui lance les workers, attend l'arrêt du serveur puis les arrête.
+ * Chaque worker a son socket d'écoute ; le worker i est épinglé sur le CPU
+ * i modulo le nombre de CPU, et reçoit une part de la limite de connexions.
+ * Prend en paramètre :
+ *     - model       Pointeur vers la configuration commune.
+ *     - workers     Tableau des workers à lancer.
+ *     - count       Nombre de workers.
+ *     - port        Port d'écoute, ouvert par chaque worker.
+ *****************************************************************************/
+void workers_run(struct server *model, struct worker *workers, int count,
+                 char *port) {
+  struct server *server;
+  sigset_t blocked, previous;
+  uint64_t wake = 1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int i;
+
+  for ( i = 0; i < count; i++ ) {
+    workers[i].server = *model;
+    server = &workers[i].server;
+    if ( model->secure != NULL ) {
+      workers[i].secure = *model->secure;
+      server->secure = &workers[i].secure;
+    }
+    server->cpu = i % (cpus > 0 ? cpus : 1);
+    server->node = -1;
+    /* Statistiques lues par le thread principal, publiées à chaque tour */
+    pthread_mutex_init(&workers[i].lock, NULL);
+    memset(&workers[i].snapshot, 0, sizeof(workers[i].snapshot));
+    workers[i].snapshot.cpu = server->cpu;
+    workers[i].snapshot.node = -1;
+    server->shared = &workers[i].snapshot;
+    server->lock = &workers[i].lock;
+    server->maxConnections = (model->maxConnections + count - 1) / count;
+    server->reserveDescriptor = acceptor_reserve();
+    server->wakeDescriptor = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    server->socketDescriptor = acceptor_open(port, SOCK_STREAM,
+                                             SIZE_WATING_LIST, 1);
+    /* Indication d'aiguillage si le programme CBPF n'est pas accepté */
+    setsockopt(server->socketDescriptor, SOL_SOCKET, SO_INCOMING_CPU,
+               &server->cpu, sizeof(server->cpu));
+  }
+  if ( steering_attach(workers[0].server.socketDescriptor, workers, count,
+                       cpus > 0 ? cpus : 1) == -1 )
+    perror("Error with SO_ATTACH_REUSEPORT_CBPF");
+
+  /* Les signaux sont reçus par le thread principal seulement */
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  sigaddset(&blocked, SIGUSR1);
+  sigaddset(&blocked, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+  for ( i = 0; i < count; i++ ) {
+    if ( pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0 ) {
+      perror("Error with pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+  printf("%d workers started\n", count);
+  fflush(stdout);
+
+  while ( running ) {
+    sigsuspend(&previous);
+    if ( dumpStats ) {
+      dumpStats = 0;
+      workers_print(workers, count);
+    }
+    if ( dumpProbes && model->probeFile != NULL ) {
+      dumpProbes = 0;
+      if ( probe_dump(model->probeFile) == -1 )
+        perror("Error with probe_dump");
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  for ( i = 0; i < count; i++ ) {
+    server = &workers[i].server;
+    if ( write(server->wakeDescriptor, &wake, sizeof(wake)) == -1 )
+      perror("Error with write");
+    pthread_join(workers[i].thread, NULL);
+  }
+  if ( model->journal != NULL )
+    journal_close(model->journal);
+  workers_print(workers, count);
+
+  for ( i = 0; i < count; i++ ) {
+    server = &workers[i].server;
+    socket_close(server->socketDescriptor);
+    close(server->wakeDescriptor);
+    if ( server->reserveDescriptor != -1 )
+      close(server->reserveDescriptor);
+    server_arenas_destroy(server);
+    relay_free(server);
+    pthread_mutex_destroy(&workers[i].lock);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui relève la limite de descripteurs ouverts jusqu'au maximum
+ * autorisé, pour tenir un grand nombre de connexions inactives.
+ * Renvoie la nouvelle limite.
+ *****************************************************************************/
+rlim_t fd_limit_raise(void) {
+  struct rlimit limit;
+
+  if ( getrlimit(RLIMIT_NOFILE, &limit) == -1 )
+    return 0;
+  if ( limit.rlim_cur < limit.rlim_max ) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  return limit.rlim_cur;
+}
+
+/******************************************************************************
+ * Serveur CLI TCP, reçoit une chaine de caractère d'un client et lui renvoie.
+ *   Les clients sont servis en parallèle par une boucle d'événements.
+ *   Le programme prend en paramètre :
+ *     - port : Port d'écoute du serveur
+ *   Options (durées en secondes, 0 pour désactiver) :
+ *     - -t read  : Délai pour recevoir le premier message (10 par défaut)
+ *     - -i idle  : Délai d'inactivité entre deux messages (60 par défaut)
+ *     - -w write : Délai pour envoyer une réponse (10 par défaut)
+ *   Options de contrôle d'admission :
+ *     - -c max   : Nombre maximal de connexions, les clients en excès sont
+ *                    refusés aussitôt (pas de limite par défaut)
+ *     - -q delay : Délai d'attente cible en millisecondes au-delà duquel des
+ *                    événements sont délestés (5 par défaut, 0 : désactivé)
+ *   Options de capture :
+ *     - -C file  : Capture des messages reçus dans une trace
+ *     - -M mode  : Contenu capturé, 'payload' (défaut) ou 'hash'
+ *   Options du journal :
+ *     - -J dir   : Journal durable des messages reçus, écrit par groupes
+ *                    dans des segments du répertoire 'dir'
+ *     - -Y mode  : 'async' (défaut) répond sans attendre l'écriture, 'sync'
+ *                    répond une fois le message durable
+ *   Option du mode flux :
+ *     - -s size  : Renvoie les octets reçus tels quels, lus par blocs de
+ *                    'size' octets au plus, sans découpage en messages (pour
+ *                    le mode '-F'/'-Z' du client)
+ *   Option du protocole multiplexé :
+ *     - -m       : Protocole binaire : chaque trame porte un identifiant de
+ *                    requête, les réponses partent dès qu'elles sont prêtes,
+ *                    dans le désordre (pour le mode '-m' du client)
+ *   Options du relais :
+ *     - -u list  : Relaie les messages des clients vers les serveurs amont
+ *                    'hôte:port,...' (lancés avec '-m') sur des connexions
+ *                    persistantes et multiplexées
+ *     - -b mode  : Répartition, 'least' (moins de requêtes en cours, défaut)
+ *                    ou 'hash' (hachage cohérent sur l'adresse du client)
+ *     - -P pool  : Connexions par serveur amont (2 par défaut)
+ *   Options TLS :
+ *     - -T file  : Chiffre les connexions avec le certificat et la clé du
+ *                    fichier PEM, tickets de session activés
+ *     - -K       : Chiffrement dans le processus, sans kTLS
+ *   Option d'horodatage :
+ *     - -X       : Découpe le traitement de chaque message grâce aux
+ *                    horodatages du noyau (SO_TIMESTAMPING) : réveil à la
+ *                    réception, application, pile d'envoi
+ *   Option des sondes (make PROBES=1) :
+ *     - -R file  : Mesure en cycles chaque étape du chemin d'un message
+ *                    (accept, recv, decode, handler, encode, send, flush)
+ *                    et écrit la trace au format Chrome/Perfetto dans
+ *                    'file' sur SIGUSR2 et à l'arrêt
+ *   Option des workers :
+ *     - -j count : Nombre de workers, chacun épinglé sur un CPU avec son
+ *                    socket d'écoute ; les connexions sont aiguillées vers
+ *                    le worker du CPU qui les reçoit (1 par défaut)
+ *   Option des processus :
+ *     - -p count, --processes count : Nombre de processus workers, lancés par
+ *                    un superviseur qui ouvre le socket d'écoute, relance
+ *                    les workers morts et agrège leurs statistiques
+ *****************************************************************************/
+
+int main(int argc, char *argv[]) {
+  struct server server;
+  struct sigaction action;
+  struct trace_writer trace;
+  struct secure secure;
+  char *capture = NULL;
+  struct journal journal;
+  char *journalDir = NULL;
+  int journalSync = 0;
+  char *certFile = NULL;
+  int ktls = 1;
+  long streamBuffer = 0;
+  int mux = 0;
+  char *upstreams = NULL;
+  struct balance check;
+  enum balance_policy policy = BALANCE_LEAST;
+  long pool = RELAY_POOL_DEFAULT;
+  struct tstamp_stats tstats;
+  int timestamps = 0;
+  long workerCount = 1;
+  long processCount = 0;
+  char *probeFile = NULL;
+  struct prefork prefork;
+  struct process_stats *shared;
+  static const struct option longOptions[] = {
+    { "processes", required_argument, NULL, 'p' },
+    { NULL, 0, NULL, 0 }
+  };
+  struct worker *workers;
+  int hashOnly = 0;
+  double readTimeout = 10, idleTimeout = 60, writeTimeout = 10;
+  double queueTarget = 5;
+  long maxConnections = 0;
+  int opt, valid = 1;
+
+
+  printf("\n ****      Welcome to the TCP Server.      ****\n\n");
+
+  /* Vérification des paramètres du programme */
+  while ( (opt = getopt_long(argc, argv, "t:i:w:c:q:C:M:J:Y:T:Ks:mXR:j:p:u:b:P:",
+                             longOptions, NULL)) != -1 ) {
+    switch ( opt ) {
+    case 't':
+      readTimeout = atof(optarg);
+      break;
+    case 'i':
+      idleTimeout = atof(optarg);
+      break;
+    case 'w':
+      writeTimeout = atof(optarg);
+      break;
+    case 'c':
+      maxConnections = atol(optarg);
+      break;
+    case 'q':
+      queueTarget = atof(optarg);
+      break;
+    case 'C':
+      capture = optarg;
+      break;
+    case 'M':
+      hashOnly = strcmp(optarg, "hash") == 0;
+      if ( !hashOnly && strcmp(optarg, "payload") != 0 )
+        valid = 0;
+      break;
+    case 'J':
+      journalDir = optarg;
+      break;
+    case 'Y':
+      journalSync = strcmp(optarg, "sync") == 0;
+      if ( !journalSync && strcmp(optarg, "async") != 0 )
+        valid = 0;
+      break;
+    case 'T':
+      certFile = optarg;
+      break;
+    case 'K':
+      ktls = 0;
+      break;
+    case 's':
+      streamBuffer = atol(optarg);
+      if ( streamBuffer < 1 || streamBuffer > STREAM_MAX_BUFFER )
+        valid = 0;
+      break;
+    case 'm':
+      mux = 1;
+      break;
+    case 'X':
+      timestamps = 1;
+      break;
+    case 'R':
+      probeFile = optarg;
+      break;
+    case 'u':
+      upstreams = optarg;
+      break;
+    case 'b':
+      if ( strcmp(optarg, "hash") == 0 )
+        policy = BALANCE_HASH;
+      else if ( strcmp(optarg, "least") != 0 )
+        valid = 0;
+      break;
+    case 'P':
+      pool = atol(optarg);
+      if ( pool < 1 || pool > RELAY_POOL_MAX )
+        valid = 0;
+      break;
+    case 'j':
+      workerCount = atol(optarg);
+      if ( workerCount < 1 || workerCount > MAX_WORKERS )
+        valid = 0;
+      break;
+    case 'p':
+      processCount = atol(optarg);
+      if ( processCount < 1 || processCount > PREFORK_MAX )
+        valid = 0;
+      break;
+    default:
+      valid = 0;
+    }
+  }
+  if ( argc - optind != 1 || !valid || maxConnections < 0 || queueTarget < 0
+       || (mux && streamBuffer != 0) ) {
+    fprintf(stderr, "Usage: %s [-t read] [-i idle] [-w write] [-c max] "
+            "[-q delay] [-C file] [-M hash|payload] [-J dir [-Y sync|async]] "
+            "[-T cert [-K]] "
+            "[-s size|-m|-u upstreams [-b least|hash] [-P pool]] [-X] "
+            "[-R file] "
+            "[-j workers|-p processes] port\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  /* La trace n'est écrite que par un seul thread */
+  if ( capture != NULL && workerCount > 1 ) {
+    fprintf(stderr, "Capture requires a single worker.\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( processCount > 0 && (workerCount > 1 || capture != NULL || timestamps) ) {
+    fprintf(stderr, "Processes exclude workers, capture and timestamps.\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( timestamps && (workerCount > 1 || certFile != NULL || streamBuffer != 0
+                      || mux || upstreams != NULL) ) {
+    fprintf(stderr, "Timestamps require a single worker and plain messages.\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( probeFile != NULL && !probe_compiled() ) {
+    fprintf(stderr, "Probes are not compiled in, rebuild with "
+            "'make PROBES=1'.\n");
+    exit(EXIT_FAILURE);
+  }
+  /* Les anneaux des sondes sont relus par le processus qui écrit la trace */
+  if ( probeFile != NULL && processCount > 0 ) {
+    fprintf(stderr, "Probes require workers, not processes.\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( upstreams != NULL && (streamBuffer != 0 || mux) ) {
+    fprintf(stderr, "The relay serves plain messages only.\n");
+    exit(EXIT_FAILURE);
+  }
+  /* Un seul rédacteur par journal, dans le processus qui l'ouvre */
+  if ( journalDir != NULL && processCount > 0 ) {
+    fprintf(stderr, "The journal requires workers, not processes.\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( journalSync && (journalDir == NULL || mux || upstreams != NULL
+                       || timestamps) ) {
+    fprintf(stderr, "Synchronous journal replies require a journal and "
+            "plain or stream echo.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&server, 0, sizeof(server));
+  server.timeouts[CONN_READ] = seconds_to_ticks(readTimeout);
+  server.timeouts[CONN_IDLE] = seconds_to_ticks(idleTimeout);
+  server.timeouts[CONN_WRITE] = seconds_to_ticks(writeTimeout);
+  server.maxConnections = maxConnections;
+  server.codel.target = (uint64_t) (queueTarget * 1000000);
+  server.stream = streamBuffer != 0;
+  server.bufferSize = server.stream ? streamBuffer : MSG_SIZE;
+  if ( server.stream )
+    printf("Stream echo, %d bytes per read\n", server.bufferSize);
+  server.mux = mux;
+  if ( server.mux ) {
+    server.bufferSize = 2 * MUX_BUFFER;
+    printf("Multiplexed binary protocol, version %d\n", MUX_VERSION);
+  }
+  if ( upstreams != NULL ) {
+    /* Chaque boucle a son relais, la liste est vérifiée une fois ici */
+    if ( balance_init(&check, upstreams, policy) == -1 )
+      exit(EXIT_FAILURE);
+    printf("Relay to %d upstreams (%s), %ld connections each\n", check.count,
+           policy == BALANCE_HASH ? "consistent hash" : "least outstanding",
+           pool);
+    balance_free(&check);
+    server.upstreams = upstreams;
+    server.policy = policy;
+    server.pool = pool;
+  }
+
+  if ( capture != NULL ) {
+    if ( trace_open(&trace, capture, hashOnly) == -1 ) {
+      perror("Error with trace_open");
+      exit(EXIT_FAILURE);
+    }
+    server.trace = &trace;
+    printf("Capture to %s (%s)\n", capture, hashOnly ? "hash" : "payload");
+  }
+
+  if ( journalDir != NULL ) {
+    if ( journal_open(&journal, journalDir) == -1 ) {
+      perror("Error with journal_open");
+      exit(EXIT_FAILURE);
+    }
+    server.journal = &journal;
+    server.journalSync = journalSync;
+    printf("Journal to %s, segment %u (%s, %s replies)\n", journalDir,
+           journal.segment, journal.direct ? "O_DIRECT" : "buffered",
+           journalSync ? "synchronous" : "asynchronous");
+  }
+
+  if ( probeFile != NULL ) {
+    probe_calibrate();
+    server.probeFile = probeFile;
+    printf("Probes to %s, written on SIGUSR2 and at exit\n", probeFile);
+  }
+
+  if ( timestamps ) {
+    tstamp_server_init(&tstats);
+    server.tstamp = &tstats;
+    printf("Kernel timestamps enabled\n");
+  }
+
+  if ( certFile != NULL ) {
+    if ( secure_server_init(&secure, certFile, ktls) == -1 ) {
+      fprintf(stderr, "Unable to load %s\n", certFile);
+      exit(EXIT_FAILURE);
+    }
+    server.secure = &secure;
+    printf("TLS enabled (%s)\n", ktls ? "kTLS when available" : "user space");
+  }
+
+  /* Arrêt propre sur SIGINT et SIGTERM pour afficher les statistiques */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_handler;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = stats_handler;
+  sigaction(SIGUSR1, &action, NULL);
+  /* Sans -R, SIGUSR2 garde son action par défaut */
+  if ( probeFile != NULL ) {
+    action.sa_handler = probes_handler;
+    sigaction(SIGUSR2, &action, NULL);
+  }
+  /* OpenSSL écrit sur le socket sans MSG_NOSIGNAL */
+  action.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &action, NULL);
+
+  printf("Listen on %s, up to %lu descriptors\n", argv[optind],
+         (unsigned long) fd_limit_raise());
+
+  if ( workerCount > 1 ) {
+    workers = calloc(workerCount, sizeof(*workers));
+    if ( workers == NULL ) {
+      perror("Error with calloc");
+      exit(EXIT_FAILURE);
+    }
+    workers_run(&server, workers, workerCount, argv[optind]);
+    free(workers);
+  } else if ( processCount > 0 ) {
+    /* Socket ouvert une fois par le superviseur, hérité par les workers */
+    server.socketDescriptor = acceptor_open(argv[optind], SOCK_STREAM,
+                                            SIZE_WATING_LIST, 0);
+    if ( prefork_init(&prefork, processCount, sizeof(*shared)) == -1 ) {
+      perror("Error with prefork_init");
+      exit(EXIT_FAILURE);
+    }
+    shared = prefork_run(&prefork, &running, &dumpStats, processes_print,
+                         &server);
+
+    if ( shared != NULL ) {
+      /* Worker : reprend les statistiques du worker qu'il remplace, et sa
+         séquence paire s'il est mort pendant une publication */
+      if ( shared->sequence & 1 )
+        shared->sequence++;
+      server.cpu = -1;
+      server.node = -1;
+      server.wakeDescriptor = -1;
+      server.shared = shared;
+      server.stats = shared->stats;
+      server.maxConnections = (maxConnections + processCount - 1) / processCount;
+      if ( server.secure != NULL ) {
+        secure.handshakes = shared->handshakes;
+        secure.resumed = shared->resumed;
+        secure.offloaded = shared->offloaded;
+        secure.failures = shared->failures;
+      }
+      server_arenas_init(&server, -1);
+      server.reserveDescriptor = acceptor_reserve();
+      server_run(&server);
+      socket_close(server.socketDescriptor);
+      server_arenas_destroy(&server);
+      relay_free(&server);
+      if ( server.secure != NULL )
+        secure_free(&secure);
+      exit(EXIT_SUCCESS);
+    }
+
+    socket_close(server.socketDescriptor);
+    prefork_free(&prefork);
+  } else {
+    server.cpu = -1;
+    server.node = -1;
+    server.wakeDescriptor = -1;
+    server_arenas_init(&server, -1);
+
+    /* Descripteur de réserve pour pouvoir refuser un client sur EMFILE */
+    server.reserveDescriptor = acceptor_reserve();
+
+    /* Ouverture du socket */
+    server.socketDescriptor = acceptor_open(argv[optind], SOCK_STREAM,
+                                            SIZE_WATING_LIST, 0);
+
+    /* Traitement de tous message reçu, renvoie au client le message reçu */
+    server_run(&server);
+
+    if ( server.journal != NULL )
+      journal_close(&journal);
+    stats_print(&server);
+    socket_close(server.socketDescriptor);
+    server_arenas_destroy(&server);
+    relay_free(&server);
+  }
+
+  if ( server.probeFile != NULL ) {
+    if ( probe_dump(server.probeFile) == -1 )
+      perror("Error with probe_dump");
+    probe_free();
+  }
+  if ( server.trace != NULL ) {
+    printf("Captured %llu messages to %s\n",
+           (unsigned long long) trace.records, capture);
+    trace_close(&trace);
+  }
+  if ( server.secure != NULL )
+    secure_free(&secure);
+  if ( server.tstamp != NULL )
+    tstamp_stats_free(&tstats);
 
   exit(EXIT_SUCCESS);
 }  
@@ -0,0 +1,477 @@
+/******************************************************************************
+ *
+ * Name File : trace.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MSG_SIZE 80
+#define TRACE_DRAIN_MS 1000	/* Attente des dernières réponses au rejeu */
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes.
+ *****************************************************************************/
+static uint64_t trace_now(clockid_t clock) {
+  struct timespec now;
+
+  clock_gettime(clock, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'adresse d'un bloc du fichier projeté.
+ *****************************************************************************/
+static struct trace_block *trace_block_at(char *map, uint64_t index) {
+  return (struct trace_block *) (map + TRACE_HEADER_SIZE
+                                 + index * TRACE_BLOCK_SIZE);
+}
+
+/******************************************************************************
+ * Fonction qui renvoie la taille d'un enregistrement, complétée à 8 octets.
+ *****************************************************************************/
+static uint32_t trace_record_size(uint16_t size, int hashOnly) {
+  uint32_t len = sizeof(struct trace_record) + (hashOnly ? 8 : size);
+
+  return (len + 7) & ~7u;
+}
+
+/******************************************************************************
+ * Fonction qui ouvre une trace en écriture.
+ * Prend en paramètre :
+ *     - writer      Pointeur vers la trace à initialiser.
+ *     - path        Chemin du fichier, écrasé s'il existe.
+ *     - hashOnly    1 pour n'enregistrer que l'empreinte des messages.
+ * Renvoie 0 en cas de succès, -1 sinon (errno).
+ *****************************************************************************/
+int trace_open(struct trace_writer *writer, char *path, int hashOnly) {
+  struct trace_header *header;
+
+  memset(writer, 0, sizeof(*writer));
+  writer->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if ( writer->fd == -1 )
+    return -1;
+
+  writer->mapSize = TRACE_HEADER_SIZE
+                    + (size_t) TRACE_GROW_BLOCKS * TRACE_BLOCK_SIZE;
+  if ( ftruncate(writer->fd, writer->mapSize) == -1 ) {
+    close(writer->fd);
+    return -1;
+  }
+  writer->map = mmap(NULL, writer->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     writer->fd, 0);
+  if ( writer->map == MAP_FAILED ) {
+    close(writer->fd);
+    return -1;
+  }
+
+  header = (struct trace_header *) writer->map;
+  memcpy(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  header->version = TRACE_VERSION;
+  header->blockSize = TRACE_BLOCK_SIZE;
+  header->startTime = trace_now(CLOCK_REALTIME);
+  header->blocks = 1;
+  header->flags = hashOnly ? TRACE_FLAG_HASH : 0;
+
+  writer->block = trace_block_at(writer->map, 0);
+  writer->block->used = sizeof(struct trace_block);
+  writer->start = trace_now(CLOCK_MONOTONIC);
+  writer->hashOnly = hashOnly;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui passe au bloc suivant, en agrandissant le fichier au besoin.
+ * Renvoie 0 en cas de succès, -1 si le fichier n'a pas pu être agrandi.
+ *****************************************************************************/
+static int trace_next_block(struct trace_writer *writer) {
+  struct trace_header *header = (struct trace_header *) writer->map;
+  size_t size;
+  char *map;
+
+  size = TRACE_HEADER_SIZE + (header->blocks + 1) * TRACE_BLOCK_SIZE;
+  if ( size > writer->mapSize ) {
+    size = writer->mapSize + (size_t) TRACE_GROW_BLOCKS * TRACE_BLOCK_SIZE;
+    if ( ftruncate(writer->fd, size) == -1 )
+      return -1;
+    map = mremap(writer->map, writer->mapSize, size, MREMAP_MAYMOVE);
+    if ( map == MAP_FAILED )
+      return -1;
+    writer->map = map;
+    writer->mapSize = size;
+    header = (struct trace_header *) map;
+  }
+
+  writer->block = trace_block_at(writer->map, header->blocks);
+  writer->block->used = sizeof(struct trace_block);
+  header->blocks++;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui ajoute un message à la trace. Le coût se limite à une lecture
+ * de l'horloge et une copie dans le fichier projeté ; l'écriture sur disque
+ * est laissée au noyau.
+ * Prend en paramètre :
+ *     - writer    Pointeur vers la trace.
+ *     - peer      Identifiant du client.
+ *     - data      Contenu du message.
+ *     - size      Taille du message.
+ *****************************************************************************/
+void trace_append(struct trace_writer *writer, uint32_t peer, char *data,
+                  uint16_t size) {
+  struct trace_record *record;
+  uint64_t hash = 14695981039346656037ull;
+  uint32_t len;
+  uint16_t i;
+
+  if ( size > TRACE_BLOCK_SIZE / 2 )
+    size = TRACE_BLOCK_SIZE / 2;
+  len = trace_record_size(size, writer->hashOnly);
+  if ( writer->block->used + len > TRACE_BLOCK_SIZE
+       && trace_next_block(writer) == -1 )
+    return;
+
+  record = (struct trace_record *) ((char *) writer->block + writer->block->used);
+  record->time = trace_now(CLOCK_MONOTONIC) - writer->start;
+  record->peer = peer;
+  record->size = size;
+  if ( writer->hashOnly ) {
+    for ( i = 0; i < size; i++ ) {
+      hash ^= (unsigned char) data[i];
+      hash *= 1099511628211ull;
+    }
+    record->flags = TRACE_FLAG_HASH;
+    memcpy(record + 1, &hash, sizeof(hash));
+  } else {
+    record->flags = 0;
+    memcpy(record + 1, data, size);
+  }
+
+  if ( writer->block->count == 0 )
+    writer->block->firstTime = record->time;
+  writer->block->lastTime = record->time;
+  writer->block->count++;
+  writer->block->used += len;
+  writer->records++;
+}
+
+/******************************************************************************
+ * Fonction qui ferme une trace : le fichier est ramené aux blocs utilisés.
+ *****************************************************************************/
+void trace_close(struct trace_writer *writer) {
+  struct trace_header *header = (struct trace_header *) writer->map;
+  size_t size = TRACE_HEADER_SIZE + header->blocks * TRACE_BLOCK_SIZE;
+
+  munmap(writer->map, writer->mapSize);
+  if ( ftruncate(writer->fd, size) == -1 )
+    perror("Error with ftruncate");
+  close(writer->fd);
+}
+
+/******************************************************************************
+ * Fonction qui ouvre une trace en lecture.
+ * Prend en paramètre :
+ *     - reader    Pointeur vers la lecture à initialiser.
+ *     - path      Chemin du fichier.
+ * Renvoie 0 en cas de succès, -1 sinon.
+ *****************************************************************************/
+int trace_reader_open(struct trace_reader *reader, char *path) {
+  struct stat st;
+
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if ( reader->fd == -1 )
+    return -1;
+  if ( fstat(reader->fd, &st) == -1 || st.st_size < TRACE_HEADER_SIZE ) {
+    close(reader->fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  reader->mapSize = st.st_size;
+  reader->map = mmap(NULL, reader->mapSize, PROT_READ, MAP_SHARED,
+                     reader->fd, 0);
+  if ( reader->map == MAP_FAILED ) {
+    close(reader->fd);
+    return -1;
+  }
+
+  reader->header = (struct trace_header *) reader->map;
+  if ( memcmp(reader->header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+       || reader->header->version != TRACE_VERSION
+       || reader->header->blockSize != TRACE_BLOCK_SIZE ) {
+    trace_reader_close(reader);
+    errno = EINVAL;
+    return -1;
+  }
+  reader->offset = sizeof(struct trace_block);
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le nombre de blocs lisibles de la trace : ceux de
+ * l'en-tête, dans la limite du fichier si la trace n'a pas été fermée.
+ *****************************************************************************/
+static uint64_t trace_blocks(struct trace_reader *reader) {
+  uint64_t blocks = (reader->mapSize - TRACE_HEADER_SIZE) / TRACE_BLOCK_SIZE;
+
+  return reader->header->blocks < blocks ? reader->header->blocks : blocks;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'enregistrement d'un bloc à une position, s'il y
+ * tient entièrement : une trace corrompue ou tronquée ne doit pas faire lire
+ * hors du bloc ni hors du fichier.
+ * Prend en paramètre :
+ *     - block     Pointeur vers le bloc.
+ *     - offset    Position de l'enregistrement dans le bloc.
+ * Renvoie un pointeur vers l'enregistrement, NULL à la fin du bloc ou si le
+ * bloc ou l'enregistrement est invalide.
+ *****************************************************************************/
+static struct trace_record *trace_record_at(struct trace_block *block,
+                                            uint64_t offset) {
+  struct trace_record *record;
+
+  if ( block->used > TRACE_BLOCK_SIZE
+       || offset + sizeof(*record) > block->used )
+    return NULL;
+  record = (struct trace_record *) ((char *) block + offset);
+  if ( offset + trace_record_size(record->size, record->flags & TRACE_FLAG_HASH)
+       > block->used )
+    return NULL;
+  return record;
+}
+
+/******************************************************************************
+ * Fonction qui place la lecture sur le premier enregistrement postérieur à un
+ * instant donné, par recherche dichotomique sur les blocs.
+ * Prend en paramètre :
+ *     - reader    Pointeur vers la lecture.
+ *     - time      Instant en ns depuis le début de la trace.
+ *****************************************************************************/
+void trace_seek(struct trace_reader *reader, uint64_t time) {
+  struct trace_block *block;
+  struct trace_record *record;
+  uint64_t low = 0, high = trace_blocks(reader), middle;
+
+  if ( high == 0 )
+    return;
+  /* Dernier bloc dont le premier enregistrement précède l'instant */
+  while ( high - low > 1 ) {
+    middle = (low + high) / 2;
+    block = trace_block_at(reader->map, middle);
+    if ( block->count != 0 && block->firstTime <= time )
+      low = middle;
+    else
+      high = middle;
+  }
+  reader->block = low;
+  reader->offset = sizeof(struct trace_block);
+
+  /* Puis parcours du bloc jusqu'à l'instant */
+  block = trace_block_at(reader->map, low);
+  while ( (record = trace_record_at(block, reader->offset)) != NULL ) {
+    if ( record->time >= time )
+      return;
+    reader->offset += trace_record_size(record->size,
+                                        record->flags & TRACE_FLAG_HASH);
+  }
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'enregistrement suivant de la trace.
+ * Renvoie un pointeur vers l'enregistrement, NULL à la fin de la trace.
+ *****************************************************************************/
+struct trace_record *trace_next(struct trace_reader *reader) {
+  struct trace_block *block;
+  struct trace_record *record;
+  uint64_t blocks = trace_blocks(reader);
+
+  while ( reader->block < blocks ) {
+    block = trace_block_at(reader->map, reader->block);
+    /* Fin du bloc, ou bloc invalide : le reste du bloc est ignoré */
+    record = trace_record_at(block, reader->offset);
+    if ( record != NULL ) {
+      reader->offset += trace_record_size(record->size,
+                                          record->flags & TRACE_FLAG_HASH);
+      return record;
+    }
+    reader->block++;
+    reader->offset = sizeof(struct trace_block);
+  }
+  return NULL;
+}
+
+/******************************************************************************
+ * Fonction qui ferme une trace ouverte en lecture.
+ *****************************************************************************/
+void trace_reader_close(struct trace_reader *reader) {
+  munmap(reader->map, reader->mapSize);
+  close(reader->fd);
+}
+
+/* Compteurs du rejeu d'une trace */
+struct replay_stats {
+  uint64_t sent;
+  uint64_t bytes;
+  uint64_t replies;		/* messages en UDP, octets en TCP */
+  uint64_t errors;
+  uint64_t lagTotal;
+  uint64_t lagMax;
+};
+
+/******************************************************************************
+ * Fonction qui lit toutes les réponses disponibles, sans bloquer.
+ *****************************************************************************/
+static void replay_drain(int socketDescriptor, int stream,
+                         struct replay_stats *stats) {
+  char buffer[MSG_SIZE * 64];
+  int status;
+
+  while ( (status = recv(socketDescriptor, buffer, sizeof(buffer), 0)) > 0 )
+    stats->replies += stream ? (uint64_t) status : 1;
+}
+
+/******************************************************************************
+ * Fonction qui attend un événement sur le socket, au plus 'timeout' ns, puis
+ * lit les réponses disponibles.
+ *****************************************************************************/
+static void replay_wait(int socketDescriptor, int stream, short events,
+                        uint64_t timeout, struct replay_stats *stats) {
+  struct pollfd fds;
+  struct timespec delay;
+
+  fds.fd = socketDescriptor;
+  fds.events = POLLIN | events;
+  delay.tv_sec = timeout / 1000000000;
+  delay.tv_nsec = timeout % 1000000000;
+  ppoll(&fds, 1, &delay, NULL);
+  replay_drain(socketDescriptor, stream, stats);
+}
+
+/******************************************************************************
+ * Fonction qui rejoue une trace vers un serveur : chaque message est envoyé
+ * à l'instant où il a été capturé, divisé par la vitesse, ou au plus vite.
+ * Un message capturé par son empreinte est remplacé par un message de même
+ * taille.
+ * Prend en paramètre :
+ *     - socketDescriptor    Socket connecté au serveur.
+ *     - socktype            SOCK_STREAM ou SOCK_DGRAM.
+ *     - path                Chemin de la trace.
+ *     - speed               Facteur de vitesse (1 : temps réel, 0 : au plus
+ *                             vite).
+ *     - from                Début de la fenêtre rejouée, en secondes.
+ *     - to                  Fin de la fenêtre rejouée, 0 : jusqu'à la fin.
+ * Renvoie 0 en cas de succès, -1 si la trace n'a pas pu être lue.
+ *****************************************************************************/
+int trace_replay(int socketDescriptor, int socktype, char *path, double speed,
+                 double from, double to) {
+  struct trace_reader reader;
+  struct trace_record *record;
+  struct replay_stats stats;
+  char synthetic[TRACE_BLOCK_SIZE / 2];
+  char frame[MSG_SIZE];
+  char *payload;
+  size_t len, offset;
+  ssize_t status;
+  uint64_t base = 0, start, due, now, end, expected;
+  uint64_t limit = to > 0 ? (uint64_t) (to * 1e9) : UINT64_MAX;
+  int stream = socktype == SOCK_STREAM;
+  int noDelay = 1;
+
+  if ( trace_reader_open(&reader, path) == -1 )
+    return -1;
+  memset(&stats, 0, sizeof(stats));
+  memset(synthetic, 'x', sizeof(synthetic));
+  fcntl(socketDescriptor, F_SETFL, fcntl(socketDescriptor, F_GETFL) | O_NONBLOCK);
+  if ( stream )
+    setsockopt(socketDescriptor, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+               sizeof(noDelay));
+
+  trace_seek(&reader, (uint64_t) (from * 1e9));
+  start = trace_now(CLOCK_MONOTONIC);
+  while ( (record = trace_next(&reader)) != NULL && record->time <= limit ) {
+    if ( stats.sent == 0 )
+      base = record->time;
+
+    /* Attente de l'instant du message, en lisant les réponses */
+    if ( speed > 0 ) {
+      due = start + (uint64_t) ((record->time - base) / speed);
+      while ( (now = trace_now(CLOCK_MONOTONIC)) < due )
+        replay_wait(socketDescriptor, stream, 0, due - now, &stats);
+      stats.lagTotal += now - due;
+      if ( now - due > stats.lagMax )
+        stats.lagMax = now - due;
+    }
+
+    payload = record->flags & TRACE_FLAG_HASH ? synthetic : (char *) (record + 1);
+    len = record->size;
+
+    /* En TCP, le serveur lit des messages de MSG_SIZE octets */
+    if ( stream ) {
+      memset(frame, 0, sizeof(frame));
+      memcpy(frame, payload, len < MSG_SIZE ? len : MSG_SIZE);
+      payload = frame;
+      len = MSG_SIZE;
+    }
+
+    for ( offset = 0; offset < len; ) {
+      status = send(socketDescriptor, payload + offset, len - offset, MSG_NOSIGNAL);
+      if ( status >= 0 ) {
+        offset += status;
+        continue;
+      }
+      if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+        stats.errors++;
+        break;
+      }
+      replay_wait(socketDescriptor, stream, POLLOUT, 1000000, &stats);
+    }
+    stats.sent++;
+    stats.bytes += record->size;
+    replay_drain(socketDescriptor, stream, &stats);
+  }
+  end = trace_now(CLOCK_MONOTONIC);
+
+  /* Le serveur TCP répond MSG_SIZE octets par message */
+  expected = stream ? stats.sent * MSG_SIZE : stats.sent;
+  due = end + (uint64_t) TRACE_DRAIN_MS * 1000000;
+  while ( stats.replies < expected && (now = trace_now(CLOCK_MONOTONIC)) < due )
+    replay_wait(socketDescriptor, stream, 0, due - now, &stats);
+
+  printf("Replayed %llu messages (%llu bytes) in %.3f s (%.0f msg/s)\n",
+         (unsigned long long) stats.sent, (unsigned long long) stats.bytes,
+         (end - start) / 1e9, stats.sent / ((end - start) / 1e9 + 1e-9));
+  printf("Replies : %llu, errors : %llu, lag avg %.1f us, max %.1f us\n",
+         (unsigned long long) (stream ? stats.replies / MSG_SIZE : stats.replies),
+         (unsigned long long) stats.errors,
+         stats.sent != 0 ? stats.lagTotal / 1e3 / stats.sent : 0.0,
+         stats.lagMax / 1e3);
+
+  trace_reader_close(&reader);
+  return 0;
+}
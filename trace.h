@@ -0,0 +1,93 @@
+/******************************************************************************
+ *
+ * Name File : trace.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Fichier de trace : un en-tête puis des blocs de taille fixe, chacun
+   commençant par l'instant de son premier enregistrement. Les blocs sont
+   ordonnés dans le temps, une recherche dichotomique suffit pour se placer
+   sur une fenêtre de temps. */
+#define TRACE_MAGIC "ECHOTRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 4096
+#define TRACE_BLOCK_SIZE 65536
+#define TRACE_GROW_BLOCKS 256		/* Agrandissement du fichier : 16 Mo */
+#define TRACE_FLAG_HASH 1		/* Empreinte à la place du contenu */
+
+/* En-tête du fichier */
+struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t blockSize;
+  uint64_t startTime;		/* CLOCK_REALTIME du début, en ns */
+  uint64_t blocks;		/* blocs utilisés */
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+/* En-tête d'un bloc */
+struct trace_block {
+  uint64_t firstTime;		/* ns depuis le début de la trace */
+  uint64_t lastTime;
+  uint32_t used;		/* octets utilisés, en-tête compris */
+  uint32_t count;
+};
+
+/* Enregistrement, suivi du contenu (size octets) ou de son empreinte
+   (8 octets), complété à un multiple de 8 octets */
+struct trace_record {
+  uint64_t time;		/* ns depuis le début de la trace */
+  uint32_t peer;		/* identifiant du client */
+  uint16_t size;		/* taille du message */
+  uint16_t flags;
+};
+
+/* Écriture d'une trace, par ajout en fin de fichier projeté en mémoire */
+struct trace_writer {
+  int fd;
+  char *map;
+  size_t mapSize;
+  struct trace_block *block;	/* bloc courant */
+  uint64_t start;		/* CLOCK_MONOTONIC du début, en ns */
+  int hashOnly;
+  uint64_t records;
+};
+
+/* Lecture d'une trace */
+struct trace_reader {
+  int fd;
+  char *map;
+  size_t mapSize;
+  struct trace_header *header;
+  uint64_t block;		/* bloc courant */
+  uint32_t offset;		/* position dans le bloc courant */
+};
+
+int trace_open(struct trace_writer *writer, char *path, int hashOnly);
+void trace_append(struct trace_writer *writer, uint32_t peer, char *data,
+                  uint16_t size);
+void trace_close(struct trace_writer *writer);
+
+int trace_reader_open(struct trace_reader *reader, char *path);
+void trace_seek(struct trace_reader *reader, uint64_t time);
+struct trace_record *trace_next(struct trace_reader *reader);
+void trace_reader_close(struct trace_reader *reader);
+
+int trace_replay(int socketDescriptor, int socktype, char *path, double speed,
+                 double from, double to);
+
+#endif
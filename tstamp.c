@@ -0,0 +1,365 @@
+/******************************************************************************
+ *
+ * Name File : tstamp.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "tstamp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#define TSTAMP_CONTROL 512	/* Données de contrôle d'un message */
+
+/******************************************************************************
+ * Fonction qui active l'horodatage des paquets par le noyau, et par la carte
+ * réseau si elle a été configurée pour (SIOCSHWTSTAMP, hors programme).
+ * Prend en paramètre :
+ *     - fd    Descripteur du socket.
+ *     - tx    1 pour horodater aussi les envois : entrée dans la file de la
+ *               carte et remise au pilote, lus sur la file d'erreurs avec
+ *               le numéro de l'envoi (datagramme, ou dernier octet en TCP).
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur (errno).
+ *****************************************************************************/
+int tstamp_enable(int fd, int tx) {
+  int flags;
+
+  flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE
+          | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+  if ( tx )
+    flags |= SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE
+             | SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_OPT_ID
+             | SOF_TIMESTAMPING_OPT_TSONLY;
+  return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/******************************************************************************
+ * Fonction qui lit l'horloge des horodatages logiciels du noyau.
+ * Prend en paramètre :
+ *     - now    Pointeur vers l'instant à remplir (CLOCK_REALTIME).
+ *****************************************************************************/
+void tstamp_now(struct timespec *now) {
+  clock_gettime(CLOCK_REALTIME, now);
+}
+
+/******************************************************************************
+ * Fonction qui calcule la durée entre deux horodatages.
+ * Prend en paramètre :
+ *     - from    Instant de départ.
+ *     - to      Instant d'arrivée.
+ * Renvoie la durée en ns, UINT64_MAX si un instant manque (nul) ou si les
+ * instants sont dans le désordre.
+ *****************************************************************************/
+uint64_t tstamp_diff(struct timespec *from, struct timespec *to) {
+  int64_t ns;
+
+  if ( (from->tv_sec == 0 && from->tv_nsec == 0)
+       || (to->tv_sec == 0 && to->tv_nsec == 0) )
+    return UINT64_MAX;
+  ns = (int64_t) (to->tv_sec - from->tv_sec) * 1000000000
+       + (to->tv_nsec - from->tv_nsec);
+  return ns < 0 ? UINT64_MAX : (uint64_t) ns;
+}
+
+/******************************************************************************
+ * Fonction qui reçoit des données comme recvfrom, avec l'instant d'arrivée du
+ * paquet dans la pile réseau et, si disponible, sur la carte.
+ * Prend en paramètre :
+ *     - fd         Descripteur du socket.
+ *     - buffer     Pointeur vers la zone à remplir.
+ *     - len        Taille de la zone.
+ *     - flags      Options de recvmsg.
+ *     - addr       Adresse de l'expéditeur à remplir, ou NULL.
+ *     - addrlen    Taille de l'adresse, ou NULL.
+ *     - stamp      Horodatages à remplir (nuls si absents).
+ * Renvoie le code de la fonction recvmsg.
+ *****************************************************************************/
+ssize_t tstamp_recv(int fd, void *buffer, size_t len, int flags,
+                    struct sockaddr *addr, socklen_t *addrlen,
+                    struct tstamp *stamp) {
+  char control[TSTAMP_CONTROL];
+  struct scm_timestamping timestamps;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t status;
+
+  iov.iov_base = buffer;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = addr;
+  msg.msg_namelen = addrlen != NULL ? *addrlen : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  memset(stamp, 0, sizeof(*stamp));
+
+  status = recvmsg(fd, &msg, flags);
+  if ( status == -1 )
+    return -1;
+  if ( addrlen != NULL )
+    *addrlen = msg.msg_namelen;
+
+  for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+    if ( cmsg->cmsg_level == SOL_SOCKET
+         && cmsg->cmsg_type == SCM_TIMESTAMPING ) {
+      memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+      stamp->software = timestamps.ts[0];
+      stamp->hardware = timestamps.ts[2];
+    }
+  }
+  return status;
+}
+
+/******************************************************************************
+ * Fonction qui lit les horodatages d'émission en attente sur la file d'erreurs
+ * du socket, sans bloquer. Seuls ceux de l'envoi demandé sont retenus.
+ * Prend en paramètre :
+ *     - fd     Descripteur du socket.
+ *     - key    Numéro de l'envoi (datagramme depuis l'activation, ou dernier
+ *                octet en TCP), TSTAMP_ANY_KEY pour le plus récent.
+ *     - tx     Horodatages à compléter, à mettre à zéro avant l'envoi.
+ * Renvoie le nombre d'horodatages retenus.
+ *****************************************************************************/
+int tstamp_tx_read(int fd, uint32_t key, struct tstamp_tx *tx) {
+  char control[TSTAMP_CONTROL];
+  struct scm_timestamping timestamps;
+  struct sock_extended_err err;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  int found = 0, haveStamp, haveErr;
+
+  while ( 1 ) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ( recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1 )
+      return found;
+
+    haveStamp = haveErr = 0;
+    for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+          cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+      if ( cmsg->cmsg_level == SOL_SOCKET
+           && cmsg->cmsg_type == SCM_TIMESTAMPING ) {
+        memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+        haveStamp = 1;
+      } else if ( (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                  || (cmsg->cmsg_level == SOL_IPV6
+                      && cmsg->cmsg_type == IPV6_RECVERR) ) {
+        memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+        haveErr = err.ee_errno == ENOMSG
+                  && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING;
+      }
+    }
+    if ( !haveStamp || !haveErr
+         || (key != TSTAMP_ANY_KEY && err.ee_data != key) )
+      continue;
+
+    if ( err.ee_info == SCM_TSTAMP_SCHED ) {
+      tx->sched = timestamps.ts[0];
+    } else if ( err.ee_info == SCM_TSTAMP_SND ) {
+      if ( timestamps.ts[0].tv_sec != 0 || timestamps.ts[0].tv_nsec != 0 )
+        tx->sent = timestamps.ts[0];
+      if ( timestamps.ts[2].tv_sec != 0 || timestamps.ts[2].tv_nsec != 0 )
+        tx->hardware = timestamps.ts[2];
+    }
+    found++;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui prépare les statistiques d'un découpage en étapes.
+ * Prend en paramètre :
+ *     - stats     Pointeur vers les statistiques.
+ *     - stages    Nombre d'étapes (TSTAMP_MAX_STAGES au plus).
+ *     - names     Nom de chaque étape.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur.
+ *****************************************************************************/
+int tstamp_stats_init(struct tstamp_stats *stats, int stages,
+                      const char *const *names) {
+  memset(stats, 0, sizeof(*stats));
+  if ( stages > TSTAMP_MAX_STAGES )
+    return -1;
+  stats->stages = stages;
+  stats->names = names;
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui ajoute la durée d'une étape, ignorée si elle n'a pas pu être
+ * mesurée. Au-delà de TSTAMP_MAX_SAMPLES, les durées ne sont plus gardées.
+ * Prend en paramètre :
+ *     - stats    Pointeur vers les statistiques.
+ *     - stage    Indice de l'étape.
+ *     - value    Durée en ns, UINT64_MAX si inconnue.
+ *****************************************************************************/
+void tstamp_add(struct tstamp_stats *stats, int stage, uint64_t value) {
+  size_t count = stats->counts[stage];
+  uint64_t *samples;
+
+  if ( value == UINT64_MAX || count >= TSTAMP_MAX_SAMPLES )
+    return;
+  /* Tableau de 1024 durées, doublé chaque fois qu'il est plein */
+  if ( count == 0 || (count >= 1024 && (count & (count - 1)) == 0) ) {
+    samples = realloc(stats->samples[stage],
+                      (count == 0 ? 1024 : count * 2) * sizeof(*samples));
+    if ( samples == NULL )
+      return;
+    stats->samples[stage] = samples;
+  }
+  stats->samples[stage][count] = value;
+  stats->counts[stage] = count + 1;
+}
+
+/******************************************************************************
+ * Fonction qui prépare le découpage d'un aller-retour vu du client.
+ * Prend en paramètre :
+ *     - stats    Pointeur vers les statistiques.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur.
+ *****************************************************************************/
+int tstamp_client_init(struct tstamp_stats *stats) {
+  static const char *const names[] = {
+    "round trip",		/* appel de send -> retour de recv */
+    "send stack",		/* appel de send -> file de la carte */
+    "device queue",		/* file de la carte -> pilote */
+    "network+server",		/* pilote -> arrivée de la réponse */
+    "receive wakeup",		/* arrivée de la réponse -> retour de recv */
+    "wire+server (hw)"		/* départ -> arrivée, horloge de la carte */
+  };
+
+  return tstamp_stats_init(stats, sizeof(names) / sizeof(names[0]), names);
+}
+
+/******************************************************************************
+ * Fonction qui ajoute le découpage d'un aller-retour vu du client.
+ * Prend en paramètre :
+ *     - stats     Pointeur vers les statistiques.
+ *     - before    Instant de l'appel de send (tstamp_now).
+ *     - tx        Horodatages d'émission de la requête.
+ *     - rx        Horodatages de réception de la réponse.
+ *     - after     Instant du retour de recv (tstamp_now).
+ *****************************************************************************/
+void tstamp_client_add(struct tstamp_stats *stats, struct timespec *before,
+                       struct tstamp_tx *tx, struct tstamp *rx,
+                       struct timespec *after) {
+  tstamp_add(stats, 0, tstamp_diff(before, after));
+  if ( tstamp_diff(&tx->sent, &rx->software) == UINT64_MAX ) {
+    stats->missing++;
+    return;
+  }
+  tstamp_add(stats, 1, tstamp_diff(before, &tx->sched));
+  tstamp_add(stats, 2, tstamp_diff(&tx->sched, &tx->sent));
+  tstamp_add(stats, 3, tstamp_diff(&tx->sent, &rx->software));
+  tstamp_add(stats, 4, tstamp_diff(&rx->software, after));
+  tstamp_add(stats, 5, tstamp_diff(&tx->hardware, &rx->hardware));
+}
+
+/******************************************************************************
+ * Fonction qui prépare le découpage du traitement d'un message par le
+ * serveur.
+ * Prend en paramètre :
+ *     - stats    Pointeur vers les statistiques.
+ * Renvoie 0 en cas de succès, -1 en cas d'erreur.
+ *****************************************************************************/
+int tstamp_server_init(struct tstamp_stats *stats) {
+  static const char *const names[] = {
+    "receive wakeup",		/* arrivée du message -> retour de recv */
+    "application",		/* retour de recv -> appel de send */
+    "send stack",		/* appel de send -> pilote */
+    "in server (hw)"		/* arrivée -> départ, horloge de la carte */
+  };
+
+  return tstamp_stats_init(stats, sizeof(names) / sizeof(names[0]), names);
+}
+
+/******************************************************************************
+ * Fonction qui ajoute le découpage du traitement d'un message par le serveur.
+ * Prend en paramètre :
+ *     - stats       Pointeur vers les statistiques.
+ *     - rx          Horodatages de réception du message.
+ *     - received    Instant du retour de recv (tstamp_now).
+ *     - before      Instant de l'appel de send (tstamp_now).
+ *     - tx          Horodatages d'émission de la réponse.
+ *****************************************************************************/
+void tstamp_server_add(struct tstamp_stats *stats, struct tstamp *rx,
+                       struct timespec *received, struct timespec *before,
+                       struct tstamp_tx *tx) {
+  tstamp_add(stats, 1, tstamp_diff(received, before));
+  if ( tstamp_diff(&rx->software, &tx->sent) == UINT64_MAX ) {
+    stats->missing++;
+    return;
+  }
+  tstamp_add(stats, 0, tstamp_diff(&rx->software, received));
+  tstamp_add(stats, 2, tstamp_diff(before, &tx->sent));
+  tstamp_add(stats, 3, tstamp_diff(&rx->hardware, &tx->hardware));
+}
+
+/******************************************************************************
+ * Fonction de comparaison de deux durées, pour qsort.
+ *****************************************************************************/
+static int tstamp_compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/******************************************************************************
+ * Fonction qui affiche, pour chaque étape, la moyenne et les centiles de sa
+ * durée en microsecondes.
+ * Prend en paramètre :
+ *     - stats    Pointeur vers les statistiques.
+ *****************************************************************************/
+void tstamp_print(struct tstamp_stats *stats) {
+  uint64_t *samples;
+  double sum;
+  size_t count, i;
+  int stage;
+
+  printf("Timestamps (us)          count      avg      p50      p99      max\n");
+  for ( stage = 0; stage < stats->stages; stage++ ) {
+    count = stats->counts[stage];
+    samples = stats->samples[stage];
+    if ( count == 0 ) {
+      printf("  %-20s %9d\n", stats->names[stage], 0);
+      continue;
+    }
+    qsort(samples, count, sizeof(*samples), tstamp_compare);
+    for ( sum = 0, i = 0; i < count; i++ )
+      sum += samples[i];
+    printf("  %-20s %9zu %8.1f %8.1f %8.1f %8.1f\n", stats->names[stage],
+           count, sum / count / 1e3, samples[count / 2] / 1e3,
+           samples[(size_t) (count * 0.99)] / 1e3, samples[count - 1] / 1e3);
+  }
+  if ( stats->missing > 0 )
+    printf("  Without kernel timestamp : %lu\n", stats->missing);
+}
+
+/******************************************************************************
+ * Fonction qui libère les durées enregistrées.
+ * Prend en paramètre :
+ *     - stats    Pointeur vers les statistiques.
+ *****************************************************************************/
+void tstamp_stats_free(struct tstamp_stats *stats) {
+  int stage;
+
+  for ( stage = 0; stage < stats->stages; stage++ ) {
+    free(stats->samples[stage]);
+    stats->samples[stage] = NULL;
+    stats->counts[stage] = 0;
+  }
+}
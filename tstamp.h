@@ -0,0 +1,70 @@
+/******************************************************************************
+ *
+ * Name File : tstamp.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef TSTAMP_H
+#define TSTAMP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define TSTAMP_MAX_STAGES 8
+#define TSTAMP_MAX_SAMPLES 1048576	/* Échantillons conservés par étape */
+#define TSTAMP_ANY_KEY UINT32_MAX	/* Dernier horodatage d'émission */
+
+/* Horodatages du noyau (logiciels, horloge CLOCK_REALTIME) et de la carte
+   réseau (horloge de la carte, comparables entre eux seulement) */
+struct tstamp {
+  struct timespec software;
+  struct timespec hardware;
+};
+
+/* Horodatages d'émission d'un envoi, lus sur la file d'erreurs */
+struct tstamp_tx {
+  struct timespec sched;	/* entrée dans la file de la carte (qdisc) */
+  struct timespec sent;		/* remise au pilote */
+  struct timespec hardware;	/* départ de la carte */
+};
+
+/* Durées de chaque étape, en ns */
+struct tstamp_stats {
+  int stages;
+  const char *const *names;
+  uint64_t *samples[TSTAMP_MAX_STAGES];
+  size_t counts[TSTAMP_MAX_STAGES];
+  unsigned long missing;	/* mesures sans horodatage du noyau */
+};
+
+int tstamp_enable(int fd, int tx);
+void tstamp_now(struct timespec *now);
+uint64_t tstamp_diff(struct timespec *from, struct timespec *to);
+ssize_t tstamp_recv(int fd, void *buffer, size_t len, int flags,
+                    struct sockaddr *addr, socklen_t *addrlen,
+                    struct tstamp *stamp);
+int tstamp_tx_read(int fd, uint32_t key, struct tstamp_tx *tx);
+int tstamp_stats_init(struct tstamp_stats *stats, int stages,
+                      const char *const *names);
+void tstamp_add(struct tstamp_stats *stats, int stage, uint64_t value);
+int tstamp_client_init(struct tstamp_stats *stats);
+void tstamp_client_add(struct tstamp_stats *stats, struct timespec *before,
+                       struct tstamp_tx *tx, struct tstamp *rx,
+                       struct timespec *after);
+int tstamp_server_init(struct tstamp_stats *stats);
+void tstamp_server_add(struct tstamp_stats *stats, struct tstamp *rx,
+                       struct timespec *received, struct timespec *before,
+                       struct tstamp_tx *tx);
+void tstamp_print(struct tstamp_stats *stats);
+void tstamp_stats_free(struct tstamp_stats *stats);
+
+#endif
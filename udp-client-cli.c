@@ -11,39 +11,45 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "resolver.h"
+#include "open-loop.h"
+#include "trace.h"
+#include "tstamp.h"
+#include "reliable.h"
+#include "hedge.h"
 
 #define MSG_SIZE 80
 
 /******************************************************************************
  * Fonction qui récupère les informations du serveur en mode datagramme.
  * Prend en paramètre :
+ *     - resolver      Pointeur vers le résolveur et son cache.
  *     - serverName    Pointeur vers une chaine de caractère pour le nom ou
  *                       l'adresse IP du serveur.
  *     - serverPort    Pointeur vers une chaine de caractère pour le numéro de
  *                       port du serveur.
  * Renvoie la structure d'information addrinfo.
  *****************************************************************************/
-struct addrinfo get_info(char *serverName, char *serverPort) {
+struct addrinfo get_info(struct resolver *resolver, char *serverName,
+                         char *serverPort) {
   int status;
-  struct addrinfo hints;
   struct addrinfo *servInfo;
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_flags = AI_PASSIVE;
-  hints.ai_canonname = NULL;
-  hints.ai_addr = NULL;
-  hints.ai_next = NULL;
-
-  /* Ouverture et récupération des informations de connexion au serveur */
-  status = getaddrinfo(serverName, serverPort, &hints, &servInfo);
+  /* Résolution servie par le cache si possible, sans bloquer */
+  status = resolver_lookup(resolver, serverName, serverPort, AF_INET,
+                           SOCK_DGRAM, &servInfo);
   if ( status != 0 ) {
     fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
     exit(EXIT_FAILURE);
@@ -102,16 +108,61 @@ void message_send(int socketDescriptor, struct addrinfo *servInfo, char *msg) {
  * Il prend en paramètre :
  *     - socketDescriptor    Numéro du descripteur de socket.
  *     - msg                 Pointeur vers la chaine de caractère à récupérer.
+ *     - stamp               Horodatages de réception à remplir, ou NULL.
+ *     - timeout             Attente maximale en ms.
+ * Renvoie 0 si un message a été reçu, -1 si le délai a expiré.
  *****************************************************************************/
-void message_receive(int socketDescriptor, char *msg) {
+int message_receive(int socketDescriptor, char *msg, struct tstamp *stamp,
+                    int timeout) {
+  struct timeval delay;
   int status;
 
-  status = recv(socketDescriptor, msg, MSG_SIZE, 0);
+  /* Délai d'attente de recv, les horodatages d'émission n'y comptent pas */
+  delay.tv_sec = timeout / 1000;
+  delay.tv_usec = (timeout % 1000) * 1000;
+  setsockopt(socketDescriptor, SOL_SOCKET, SO_RCVTIMEO, &delay, sizeof(delay));
+
+  if ( stamp != NULL )
+    status = tstamp_recv(socketDescriptor, msg, MSG_SIZE, 0, NULL, NULL, stamp);
+  else
+    status = recv(socketDescriptor, msg, MSG_SIZE, 0);
+  if ( status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    return -1;
   if ( status == -1 ) {
     perror("Error with recv");
     close(socketDescriptor);
     exit(EXIT_FAILURE);
   }
+  return 0;
+}
+
+/******************************************************************************
+ * Fonction qui écarte les réponses en retard aux envois précédents, sans
+ * attendre, pour qu'elles ne passent pas pour la réponse du message suivant.
+ * Prend en paramètre :
+ *     - socketDescriptor    Numéro du descripteur de socket.
+ *     - stale               Nombre de réponses en trop encore attendues.
+ * Renvoie le nombre de réponses en trop qui restent attendues.
+ *****************************************************************************/
+long message_drain(int socketDescriptor, long stale) {
+  char msg[MSG_SIZE];
+
+  while ( stale > 0 && recv(socketDescriptor, msg, sizeof(msg), MSG_DONTWAIT) >= 0 )
+    stale--;
+  return stale;
+}
+
+/******************************************************************************
+ * Fonction qui renvoie le temps écoulé depuis un instant donné.
+ * Prend en paramètre :
+ *     - start    Pointeur vers l'instant de départ (CLOCK_MONOTONIC).
+ * Renvoie le temps écoulé en secondes.
+ *****************************************************************************/
+double elapsed_since(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
 /******************************************************************************
@@ -121,35 +172,267 @@ void message_receive(int socketDescriptor, char *msg) {
  *     - host : Adresse de destination (adresse IP ou nom de domaine)
  *     - port : Port du serveur de destination
  *     - msg : Message à envoyer au serveur
+ * Options :
+ *     - -n count : Nombre d'aller-retours à effectuer (1 par défaut), un
+ *                    résumé du débit et de la latence est affiché si > 1
+ *     - -R sched : Mode boucle ouverte : les messages partent au débit fixé
+ *                    par le calendrier, sans attendre les réponses. 'sched'
+ *                    vaut "rate", "from:to:step" (paliers) ou "from-to"
+ *                    (rampe), en messages par seconde
+ *     - -d sec   : Durée du mode boucle ouverte, par palier (10 par défaut)
+ *     - -P file  : Rejoue vers le serveur une trace capturée par un serveur
+ *                    (option -C), 'msg' est alors facultatif
+ *     - -S speed : Vitesse du rejeu (1 : temps réel par défaut, 0 : au plus
+ *                    vite)
+ *     - -W from:to : Fenêtre rejouée, en secondes depuis le début de la trace
+ *     - -X       : Découpe chaque aller-retour grâce aux horodatages du
+ *                    noyau (SO_TIMESTAMPING) : pile d'envoi, file de la
+ *                    carte, réseau et serveur, réveil à la réception
+ *     - -L depth : Mode fiable : requêtes numérotées, retransmises sur délai
+ *                    adaptatif ou sur acquittement sélectif, 'depth' en vol
+ *                    au plus dans la limite de la fenêtre de congestion
+ *     - -E list  : Requêtes doublées : une requête sans réponse après le
+ *                    délai part aussi vers le serveur suivant de la liste
+ *                    'hôte:port,...', la première réponse est retenue ; les
+ *                    requêtes sont numérotées pour reconnaître les réponses
+ *     - -H delay : Délai avant l'envoi en double, "pNN" pour le centile NN
+ *                    des latences observées (p95 par défaut) ou en ms
+ *     - -B pct   : Part maximale des requêtes envoyées en double (10 %
+ *                    par défaut)
+ * Sans -L ni -E, un message sans réponse est renvoyé après un délai qui
+ * double à chaque tentative, RELIABLE_RETRIES fois au plus.
  *****************************************************************************/
 int main(int argc, char *argv[]) {
   struct addrinfo servInfo;
+  struct resolver resolver;
   int socketDescriptor;
   char msg[MSG_SIZE];
+  struct timespec start;
+  double elapsed;
+  long count = 1;
+  long i;
+  struct ol_schedule schedule;
+  char *scheduleSpec = NULL;
+  double duration = 10;
+  char *replay = NULL;
+  double speed = 1, from = 0, to = 0;
+  struct tstamp_stats tstats;
+  struct timespec before, after;
+  struct tstamp_tx tx;
+  struct tstamp rx;
+  int timestamps = 0;
+  int depth = 0;
+  char *endpoints = NULL, *hedgeDelay = NULL;
+  double hedgeBudget = HEDGE_BUDGET;
+  struct hedge hedge;
+  char primary[NI_MAXHOST + NI_MAXSERV + 1];
+  char *copy, *name, *host, *port, *saveptr;
+  struct addrinfo endpointInfo;
+  int fd, e;
+  int opt;
+  int attempt, timeout;
+  long sent = 0, stale = 0, retransmits = 0;
 
 
   /* Vérification des paramètres du programme */
-  if ( argc < 4 ) {
-    fprintf(stderr, "Usage %s host port msg\n", argv[0]);
+  while ( (opt = getopt(argc, argv, "n:R:d:P:S:W:XL:E:H:B:")) != -1 ) {
+    switch ( opt ) {
+    case 'n':
+      count = atol(optarg);
+      break;
+    case 'R':
+      scheduleSpec = optarg;
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'P':
+      replay = optarg;
+      break;
+    case 'S':
+      speed = atof(optarg);
+      break;
+    case 'W':
+      if ( sscanf(optarg, "%lf:%lf", &from, &to) != 2 || to < from )
+        count = 0;
+      break;
+    case 'X':
+      timestamps = 1;
+      break;
+    case 'L':
+      depth = atoi(optarg);
+      if ( depth < 1 || depth > RELIABLE_WINDOW )
+        count = 0;
+      break;
+    case 'E':
+      endpoints = optarg;
+      break;
+    case 'H':
+      hedgeDelay = optarg;
+      break;
+    case 'B':
+      hedgeBudget = atof(optarg);
+      break;
+    default:
+      count = 0;
+    }
+  }
+  if ( scheduleSpec != NULL
+       && ol_schedule_parse(&schedule, scheduleSpec, duration) == -1 )
+    count = 0;
+  if ( endpoints != NULL
+       && hedge_init(&hedge, SOCK_DGRAM, hedgeDelay, hedgeBudget) == -1 )
+    count = 0;
+  if ( argc - optind < (replay != NULL ? 2 : 3) || count < 1 || speed < 0
+       || ((depth != 0 || endpoints != NULL)
+           && (scheduleSpec != NULL || replay != NULL || timestamps))
+       || (depth != 0 && endpoints != NULL) ) {
+    fprintf(stderr, "Usage %s [-n count] [-R rate|from:to:step|from-to] "
+            "[-d sec] [-P file] [-S speed] [-W from:to] "
+            "[-X|-L depth|-E host:port,... [-H pNN|ms] [-B pct]] "
+            "host port [msg]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
   printf("\n ****      Welcome to the UDP Client.      ****\n\n");
 
   /* Récupération des informations du serveur */
-  servInfo = get_info(argv[1], argv[2]);
+  resolver_init(&resolver);
+  servInfo = get_info(&resolver, argv[optind], argv[optind+1]);
   /* Ouverture du socket */
   socketDescriptor = socket_open(&servInfo);
 
-  /* Envoie du message */
-  message_send(socketDescriptor, &servInfo, argv[3]);
-  printf("Message sent : %s\n", argv[3]);
+  /* Mode fiable : les pertes sont retransmises au lieu de bloquer */
+  if ( depth != 0 ) {
+    if ( connect(socketDescriptor, servInfo.ai_addr, servInfo.ai_addrlen) == -1 ) {
+      perror("Error with connect");
+      exit(EXIT_FAILURE);
+    }
+    i = reliable_bench(socketDescriptor, count, depth, argv[optind+2]);
+    socket_close(socketDescriptor);
+    resolver_free(&resolver);
+    exit(i == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  /* Requêtes doublées : un socket associé à chaque serveur de la liste */
+  if ( endpoints != NULL ) {
+    if ( connect(socketDescriptor, servInfo.ai_addr, servInfo.ai_addrlen) == -1 ) {
+      perror("Error with connect");
+      exit(EXIT_FAILURE);
+    }
+    snprintf(primary, sizeof(primary), "%s:%s", argv[optind], argv[optind+1]);
+    hedge_add(&hedge, socketDescriptor, primary);
+    for ( name = strtok_r(endpoints, ",", &saveptr); name != NULL;
+          name = strtok_r(NULL, ",", &saveptr) ) {
+      copy = strdup(name);
+      if ( copy == NULL || hedge_split(copy, &host, &port) == -1 ) {
+        fprintf(stderr, "Invalid endpoint %s\n", name);
+        exit(EXIT_FAILURE);
+      }
+      endpointInfo = get_info(&resolver, host, port);
+      fd = socket_open(&endpointInfo);
+      if ( connect(fd, endpointInfo.ai_addr, endpointInfo.ai_addrlen) == -1 ) {
+        perror("Error with connect");
+        exit(EXIT_FAILURE);
+      }
+      if ( hedge_add(&hedge, fd, name) == -1 ) {
+        fprintf(stderr, "At most %d endpoints\n", HEDGE_MAX_ENDPOINTS);
+        exit(EXIT_FAILURE);
+      }
+      free(copy);
+    }
+    i = hedge_bench(&hedge, count, argv[optind+2]);
+    for ( e = 0; e < hedge.count; e++ )
+      socket_close(hedge.endpoints[e].fd);
+    resolver_free(&resolver);
+    exit(i == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  /* Mode boucle ouverte ou rejeu : le socket est associé au serveur */
+  if ( scheduleSpec != NULL || replay != NULL ) {
+    if ( connect(socketDescriptor, servInfo.ai_addr, servInfo.ai_addrlen) == -1 ) {
+      perror("Error with connect");
+      exit(EXIT_FAILURE);
+    }
+    if ( replay != NULL ) {
+      if ( trace_replay(socketDescriptor, SOCK_DGRAM, replay, speed, from, to) == -1 ) {
+        perror("Error with trace_replay");
+        exit(EXIT_FAILURE);
+      }
+    } else if ( ol_run(socketDescriptor, SOCK_DGRAM, &schedule,
+                       argv[optind+2]) == -1 ) {
+      fprintf(stderr, "Open-loop run failed\n");
+      exit(EXIT_FAILURE);
+    }
+    socket_close(socketDescriptor);
+    resolver_free(&resolver);
+    exit(EXIT_SUCCESS);
+  }
+
+  if ( timestamps ) {
+    tstamp_client_init(&tstats);
+    if ( tstamp_enable(socketDescriptor, 1) == -1 ) {
+      perror("Error with SO_TIMESTAMPING");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for ( i = 0; i < count; i++ ) {
+    if ( timestamps )
+      memset(&tx, 0, sizeof(tx));
+
+    /* Envoie du message, renvoyé tant que la réponse du serveur echo manque */
+    stale = message_drain(socketDescriptor, stale);
+    timeout = RELIABLE_RTO_INITIAL_US / 1000;
+    for ( attempt = 0; ; attempt++ ) {
+      if ( timestamps )
+        tstamp_now(&before);
+      message_send(socketDescriptor, &servInfo, argv[optind+2]);
+      sent++;
+
+      memset(msg, 0, sizeof(msg));
+      if ( message_receive(socketDescriptor, msg, timestamps ? &rx : NULL,
+                           timeout) == 0 )
+        break;
+      if ( attempt == RELIABLE_RETRIES ) {
+        fprintf(stderr, "No reply after %d attempts\n", attempt + 1);
+        socket_close(socketDescriptor);
+        exit(EXIT_FAILURE);
+      }
+      retransmits++;
+      timeout *= 2;
+      if ( timeout > RELIABLE_RTO_MAX_US / 1000 )
+        timeout = RELIABLE_RTO_MAX_US / 1000;
+    }
+    /* Les envois restés sans réponse peuvent encore en recevoir une */
+    stale += attempt;
 
-  /* Reception du message envoyé par le serveur echo */
-  message_receive(socketDescriptor, msg);
-  printf("Message received : %s\n", msg);
+    /* Horodatages d'émission du dernier envoi du datagramme numéro i */
+    if ( timestamps ) {
+      tstamp_now(&after);
+      tstamp_tx_read(socketDescriptor, (uint32_t) (sent - 1), &tx);
+      tstamp_client_add(&tstats, &before, &tx, &rx, &after);
+    }
+  }
+  elapsed = elapsed_since(&start);
+
+  if ( count == 1 ) {
+    printf("Message sent : %s\n", argv[optind+2]);
+    printf("Message received : %s\n", msg);
+  } else {
+    printf("Round trips : %ld in %.6f s (%.0f msg/s, %.1f us avg)\n",
+           count, elapsed, count / elapsed, elapsed * 1e6 / count);
+  }
+  if ( retransmits != 0 )
+    printf("Retransmits : %ld\n", retransmits);
+  if ( timestamps ) {
+    tstamp_print(&tstats);
+    tstamp_stats_free(&tstats);
+  }
 
   socket_close(socketDescriptor);
+  resolver_free(&resolver);
 
 
   exit(EXIT_SUCCESS);
@@ -12,15 +12,19 @@
  *****************************************************************************/
 
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/time.h>
 
 #define MSG_SIZE 80
 #define NAME_ARRAY_SIZE 80
 #define PORT_ARRAY_SIZE 8
+#define RECV_TIMEOUT_MS 1000	/* Attente d'une réponse avant de renvoyer */
+#define RECV_RETRIES 3		/* Renvois d'un message sans réponse */
 
 /******************************************************************************
  * Fonction qui demande à l'utilisateur de saisir une chaine de caractère.
@@ -119,16 +123,26 @@ void message_send(int socketDescriptor, struct addrinfo *servInfo, char *msg) {
  * Il prend en paramètre :
  *     - socketDescriptor    Numéro du descripteur de socket.
  *     - msg                 Pointeur vers la chaine de caractère à récupérer.
+ *     - timeout             Attente maximale en ms.
+ * Renvoie 0 si un message a été reçu, -1 si le délai a expiré.
  *****************************************************************************/
-void message_receive(int socketDescriptor, char *msg) {
+int message_receive(int socketDescriptor, char *msg, int timeout) {
+  struct timeval delay;
   int status;
 
+  delay.tv_sec = timeout / 1000;
+  delay.tv_usec = (timeout % 1000) * 1000;
+  setsockopt(socketDescriptor, SOL_SOCKET, SO_RCVTIMEO, &delay, sizeof(delay));
+
   status = recv(socketDescriptor, msg, MSG_SIZE, 0);
+  if ( status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    return -1;
   if ( status == -1 ) {
     perror("Error with recv");
     close(socketDescriptor);
     exit(EXIT_FAILURE);
   }
+  return 0;
 }
 
 /******************************************************************************
@@ -141,6 +155,8 @@ void message_receive(int socketDescriptor, char *msg) {
  *****************************************************************************/
 int main() {
   int socketDescriptor;
+  int attempt, timeout;
+  char reply[MSG_SIZE];
   struct addrinfo servInfo;
   char msg[MSG_SIZE];
   char serverName[NAME_ARRAY_SIZE];
@@ -168,13 +184,23 @@ int main() {
   input(msg, MSG_SIZE);
 
   while ( strcmp(msg, ".") ) {
-    /* Envoie du message */
-    message_send(socketDescriptor, &servInfo, msg);
-    printf("Message sent : %s\n", msg);
+    /* Envoie du message, renvoyé si la réponse du serveur echo se perd */
+    timeout = RECV_TIMEOUT_MS;
+    for ( attempt = 0; attempt <= RECV_RETRIES; attempt++ ) {
+      message_send(socketDescriptor, &servInfo, msg);
+      printf("Message sent : %s\n", msg);
+
+      memset(reply, 0, sizeof(reply));
+      if ( message_receive(socketDescriptor, reply, timeout) == 0 )
+        break;
+      timeout *= 2;
+    }
 
     /* Reception du message envoyé par le serveur echo */
-    message_receive(socketDescriptor, msg);
-    printf("Message received : %s\n\n", msg);
+    if ( attempt <= RECV_RETRIES )
+      printf("Message received : %s\n\n", reply);
+    else
+      printf("No reply after %d attempts\n\n", attempt);
 
     /* Demande du message à envoyer au serveur */
     printf("Write your message : ");
@@ -11,121 +11,698 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include "trace.h"
+#include "tstamp.h"
+#include "prefork.h"
+#include "reliable.h"
+#include "acceptor.h"
 
 #define MSG_SIZE 80
+#define LIMITER_SIZE 65536	/* Nombre d'entrées, puissance de 2 */
+#define LIMITER_PROBES 8	/* Fenêtre de sondage linéaire */
+#define EGRESS_DEFAULT 1024	/* Réponses en attente au plus, par défaut */
+#define EGRESS_MAX 65536	/* Taille maximale de la file d'envoi */
+#define EGRESS_BATCH 64		/* Réponses envoyées par appel à sendmmsg */
+#define RECEIVE_BATCH 64	/* Messages lus par réveil avant d'envoyer */
+
+/* Clé compacte d'un client extraite de sa sockaddr_storage */
+struct peer_key {
+  unsigned char addr[16];
+  uint16_t port;
+  uint16_t family;
+};
+
+/* Seau à jetons d'un client, lastSeen à 0 indique une entrée libre */
+struct peer_bucket {
+  struct peer_key key;
+  float tokens;
+  uint64_t lastSeen;
+};
+
+/* Requêtes fiables reçues d'un client, lastSeen à 0 indique une entrée
+   libre */
+struct reliable_peer {
+  struct peer_key key;
+  uint64_t lastSeen;
+  struct reliable_receiver receiver;
+};
+
+/* Limiteur de débit par client : table à adressage ouvert allouée une fois */
+struct limiter {
+  struct peer_bucket *table;
+  struct peer_bucket shared;	/* seau commun des clients qui ne trouvent
+				   pas de place dans leur fenêtre */
+  double rate;			/* jetons par seconde */
+  double burst;			/* capacité du seau */
+  uint64_t idleNs;		/* durée au bout de laquelle un seau est plein */
+};
+
+/* Politique appliquée quand la file d'envoi est pleine */
+enum drop_policy {
+  DROP_NEWEST,			/* la nouvelle réponse est abandonnée */
+  DROP_OLDEST,			/* la plus ancienne réponse est abandonnée */
+  DROP_PEER			/* quota de réponses en attente par client,
+				   puis la nouvelle réponse est abandonnée */
+};
+
+/* Réponse en attente d'envoi */
+struct egress_entry {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint32_t hash;		/* hachage du client, pour son quota */
+  int len;
+  char msg[RELIABLE_FRAME_MAX];		/* texte, ou en-tête fiable et texte */
+};
+
+/* Réponses en attente d'un client, count à 0 indique une entrée libre */
+struct peer_count {
+  struct peer_key key;
+  uint32_t hash;
+  unsigned int count;
+};
+
+/* File d'envoi bornée : anneau de réponses que le noyau n'a pas pu prendre
+   (EAGAIN), envoyées dans l'ordre dès que le socket redevient inscriptible */
+struct egress {
+  struct egress_entry *entries;
+  unsigned int capacity;
+  unsigned int head;		/* plus ancienne réponse */
+  unsigned int count;
+  enum drop_policy policy;
+  unsigned int quota;		/* DROP_PEER : réponses par client */
+  struct peer_count *peers;	/* DROP_PEER : table à adressage ouvert */
+  unsigned int peerMask;
+};
+
+/* Statistiques du serveur, affichées à l'arrêt ; en mode --processes,
+   chaque worker tient les siennes en mémoire partagée */
+struct server_stats {
+  unsigned long received;
+  unsigned long sent;
+  unsigned long rateLimited;
+  unsigned long windowFull;	/* refusés par le seau commun, fenêtre pleine */
+  unsigned long queued;		/* réponses passées par la file d'envoi */
+  unsigned long dropped;	/* réponses abandonnées, file pleine */
+  unsigned long sendErrors;
+  unsigned long queueDepth;	/* réponses en attente */
+  unsigned long queueMax;	/* plus grande profondeur atteinte */
+  unsigned long reliable;	/* requêtes en mode fiable */
+  unsigned long duplicates;	/* retransmissions de requêtes déjà reçues */
+};
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dumpStats = 0;
+
+/******************************************************************************
+ * Fonction qui ferme le socket.
+ * Prend en paramètre le descripteur du socket.
+ *****************************************************************************/
+void socket_close(int socketDescriptor) {
+  close(socketDescriptor);
+}
 
 /******************************************************************************
- * Fonction qui récupère les informations du serveur en mode datagramme.
+ * Fonction appelée à la réception de SIGINT ou SIGTERM, demande l'arrêt du
+ * serveur à la fin du traitement en cours.
+ *****************************************************************************/
+void stop_handler(int signum) {
+  (void) signum;
+  running = 0;
+}
+
+/******************************************************************************
+ * Fonction appelée à la réception de SIGUSR1, demande l'affichage des
+ * statistiques.
+ *****************************************************************************/
+void stats_handler(int signum) {
+  (void) signum;
+  dumpStats = 1;
+}
+
+/******************************************************************************
+ * Fonction qui affiche les statistiques du serveur.
  * Prend en paramètre :
- *     - serverName    Pointeur vers une chaine de caractère pour le nom ou
- *                       l'adresse IP du serveur.
- *     - serverPort    Pointeur vers une chaine de caractère pour le numéro de
- *                       port du serveur.
- * Renvoie la structure d'information addrinfo.
+ *     - stats    Pointeur vers les statistiques à afficher.
  *****************************************************************************/
-struct addrinfo get_info(char *serverPort) {
-  int status;
-  struct addrinfo hints;
-  struct addrinfo *servInfo;
-
-  /* Configuration des paramètre du socket pour le serveur */
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;		/* IPv4 et IPv6 ou autre protocole */
-  hints.ai_socktype = SOCK_DGRAM;	/* socket UDP */
-  hints.ai_flags = AI_PASSIVE;		/* écoute sur toute les interfaces */
-  hints.ai_protocol = 0;
-  hints.ai_canonname = NULL;
-  hints.ai_addr = NULL;
-  hints.ai_next = NULL;
-
-  /* Ouverture et récupération des informations de connexion au serveur */
-  status = getaddrinfo(NULL, serverPort, &hints, &servInfo);
-  if ( status != 0 ) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+void stats_print(struct server_stats *stats) {
+  printf("\nMessages received : %lu, sent : %lu, rate limited : %lu "
+         "(window full : %lu)\n", stats->received, stats->sent,
+         stats->rateLimited, stats->windowFull);
+  printf("Send queue depth : %lu (max %lu), queued : %lu, dropped : %lu, "
+         "errors : %lu\n", stats->queueDepth, stats->queueMax, stats->queued,
+         stats->dropped, stats->sendErrors);
+  if ( stats->reliable > 0 )
+    printf("Reliable requests : %lu, duplicates : %lu\n", stats->reliable,
+           stats->duplicates);
+  fflush(stdout);
+}
+
+/******************************************************************************
+ * Fonction qui affiche les statistiques cumulées des workers, puis celles de
+ * chacun d'eux.
+ * Prend en paramètre :
+ *     - prefork    Pointeur vers le superviseur.
+ *     - arg        Inutilisé.
+ *****************************************************************************/
+void processes_print(struct prefork *prefork, void *arg) {
+  struct server_stats total, *stats;
+  struct prefork_slot *slot;
+  int i;
+
+  (void) arg;
+  memset(&total, 0, sizeof(total));
+  for ( i = 0; i < prefork->count; i++ ) {
+    stats = (struct server_stats *) prefork_slot(prefork, i)->data;
+    total.received += stats->received;
+    total.sent += stats->sent;
+    total.rateLimited += stats->rateLimited;
+    total.windowFull += stats->windowFull;
+    total.queued += stats->queued;
+    total.dropped += stats->dropped;
+    total.sendErrors += stats->sendErrors;
+    total.queueDepth += stats->queueDepth;
+    total.reliable += stats->reliable;
+    total.duplicates += stats->duplicates;
+    if ( stats->queueMax > total.queueMax )
+      total.queueMax = stats->queueMax;
+  }
+  stats_print(&total);
+
+  for ( i = 0; i < prefork->count; i++ ) {
+    slot = prefork_slot(prefork, i);
+    stats = (struct server_stats *) slot->data;
+    printf("Process %d : pid %d, restarts %lu, received %lu, sent %lu, "
+           "rate limited %lu (window full %lu), queue %lu, dropped %lu\n", i,
+           (int) slot->pid, slot->restarts, stats->received, stats->sent,
+           stats->rateLimited, stats->windowFull, stats->queueDepth,
+           stats->dropped);
+  }
+  fflush(stdout);
+}
+
+/******************************************************************************
+ * Fonction qui renvoie l'instant courant en nanosecondes (CLOCK_MONOTONIC).
+ *****************************************************************************/
+uint64_t now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Fonction qui initialise le limiteur de débit par client.
+ * Prend en paramètre :
+ *     - limiter    Pointeur vers le limiteur à initialiser.
+ *     - rate       Nombre de messages autorisés par seconde et par client.
+ *     - burst      Nombre de messages autorisés en rafale.
+ *****************************************************************************/
+void limiter_init(struct limiter *limiter, double rate, double burst) {
+  limiter->rate = rate;
+  limiter->burst = burst;
+  limiter->idleNs = (uint64_t) (burst / rate * 1e9) + 1;
+  memset(&limiter->shared, 0, sizeof(limiter->shared));
+  limiter->table = calloc(LIMITER_SIZE, sizeof(struct peer_bucket));
+  if ( limiter->table == NULL ) {
+    perror("Error with calloc");
     exit(EXIT_FAILURE);
   }
+}
+
+/******************************************************************************
+ * Fonction qui extrait la clé compacte d'un client depuis son adresse.
+ * Prend en paramètre :
+ *     - addr    Pointeur vers l'adresse du client.
+ *     - key     Pointeur vers la clé à remplir.
+ * Renvoie le hachage (FNV-1a) de la clé.
+ *****************************************************************************/
+uint32_t peer_key_make(struct sockaddr *addr, struct peer_key *key) {
+  unsigned char *bytes = (unsigned char *) key;
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  memset(key, 0, sizeof(*key));
+  key->family = addr->sa_family;
+  if ( addr->sa_family == AF_INET6 ) {
+    memcpy(key->addr, &((struct sockaddr_in6 *) addr)->sin6_addr, 16);
+    key->port = ((struct sockaddr_in6 *) addr)->sin6_port;
+  } else if ( addr->sa_family == AF_INET ) {
+    memcpy(key->addr, &((struct sockaddr_in *) addr)->sin_addr, 4);
+    key->port = ((struct sockaddr_in *) addr)->sin_port;
+  }
 
-  return *servInfo;
+  for ( i = 0; i < sizeof(*key); i++ ) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
 }
 
 /******************************************************************************
- * Fonction qui permet d'ouvrir le socket.
- * Prend en paramètre la structure récupérée par la fonction 'get_info'.
- * Renvoie le descripteur du socket.
+ * Fonction qui remplit un seau selon le temps écoulé puis y consomme un jeton.
+ * Prend en paramètre :
+ *     - bucket    Pointeur vers le seau.
+ *     - rate      Jetons par seconde.
+ *     - burst     Capacité du seau.
+ *     - idleNs    Durée au bout de laquelle le seau est plein.
+ *     - now       Instant courant en nanosecondes.
+ * Renvoie 1 si un jeton a été consommé, 0 si le seau est vide.
  *****************************************************************************/
-int socket_open(struct addrinfo *servInfo) {
-  int socketDescriptor;
-  struct addrinfo *rp;
+int bucket_take(struct peer_bucket *bucket, double rate, double burst,
+                uint64_t idleNs, uint64_t now) {
+  double tokens;
 
-  /* Ouverture du socket sur le port d'écoute passé en paramètre */
-  for ( rp = servInfo; rp != NULL; rp = rp->ai_next ) {
-    socketDescriptor = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if ( socketDescriptor == -1 )
-      continue;
-    if ( bind(socketDescriptor, rp->ai_addr, rp->ai_addrlen) == 0 )
+  if ( bucket->lastSeen == 0 || now - bucket->lastSeen >= idleNs ) {
+    tokens = burst;
+  } else {
+    tokens = bucket->tokens + (now - bucket->lastSeen) * rate / 1e9;
+    if ( tokens > burst )
+      tokens = burst;
+  }
+  bucket->lastSeen = now;
+
+  if ( tokens < 1 ) {
+    bucket->tokens = tokens;
+    return 0;
+  }
+  bucket->tokens = tokens - 1;
+  return 1;
+}
+
+/******************************************************************************
+ * Fonction qui consomme un jeton dans le seau du client.
+ * Le client est cherché dans une fenêtre fixe de LIMITER_PROBES entrées, sans
+ * allocation. Une entrée inactive depuis plus de 'idleNs' a un seau plein :
+ * elle est considérée comme libre et peut être réutilisée (expiration
+ * paresseuse). Seule une entrée libre est reprise, la plus ancienne de la
+ * fenêtre : le seau d'un client actif n'est jamais remis à plein (une source
+ * qui change d'adresse remettrait sinon toutes les limites à zéro). Si toute
+ * la fenêtre est active, le nouveau client puise dans un seau commun, de la
+ * taille d'une fenêtre : des sources usurpées qui occupent les fenêtres le
+ * partagent avec les vrais clients au lieu de les exclure.
+ * Prend en paramètre :
+ *     - limiter    Pointeur vers le limiteur.
+ *     - addr       Pointeur vers l'adresse du client.
+ *     - now        Instant courant en nanosecondes.
+ * Renvoie 1 si le message peut être traité, 0 s'il doit être ignoré, -1 s'il
+ * est ignoré faute de jeton dans le seau commun.
+ *****************************************************************************/
+int limiter_allow(struct limiter *limiter, struct sockaddr *addr, uint64_t now) {
+  struct peer_key key;
+  struct peer_bucket *bucket;
+  struct peer_bucket *victim = NULL;
+  uint32_t slot;
+  int i;
+
+  slot = peer_key_make(addr, &key);
+  for ( i = 0; i < LIMITER_PROBES; i++ ) {
+    bucket = &limiter->table[(slot + i) & (LIMITER_SIZE - 1)];
+    if ( bucket->lastSeen != 0 && memcmp(&bucket->key, &key, sizeof(key)) == 0 )
+      break;
+    if ( victim == NULL || bucket->lastSeen < victim->lastSeen )
+      victim = bucket;
+  }
+
+  if ( i == LIMITER_PROBES ) {
+    /* Fenêtre occupée par des clients actifs : seau commun */
+    if ( victim->lastSeen != 0 && now - victim->lastSeen < limiter->idleNs )
+      return bucket_take(&limiter->shared, limiter->rate * LIMITER_PROBES,
+                         limiter->burst * LIMITER_PROBES, limiter->idleNs,
+                         now) ? 1 : -1;
+    /* Nouveau client ou client expiré : seau plein */
+    bucket = victim;
+    bucket->key = key;
+    bucket->lastSeen = 0;
+  }
+  return bucket_take(bucket, limiter->rate, limiter->burst, limiter->idleNs,
+                     now);
+}
+
+/******************************************************************************
+ * Fonction qui cherche l'état des requêtes fiables d'un client, sur le modèle
+ * du limiteur : fenêtre fixe de LIMITER_PROBES entrées, l'entrée la plus
+ * ancienne est reprise si la fenêtre est pleine. Un client nouveau ou repris
+ * commence à la requête reçue.
+ * Prend en paramètre :
+ *     - table       Table des clients, LIMITER_SIZE entrées.
+ *     - addr        Pointeur vers l'adresse du client.
+ *     - sequence    Numéro de la requête reçue.
+ *     - now         Instant courant en nanosecondes.
+ * Renvoie l'état du client.
+ *****************************************************************************/
+struct reliable_receiver *reliable_peer_find(struct reliable_peer *table,
+                                             struct sockaddr *addr,
+                                             uint32_t sequence, uint64_t now) {
+  struct peer_key key;
+  struct reliable_peer *peer;
+  struct reliable_peer *victim = NULL;
+  uint32_t slot;
+  int i;
+
+  slot = peer_key_make(addr, &key);
+  for ( i = 0; i < LIMITER_PROBES; i++ ) {
+    peer = &table[(slot + i) & (LIMITER_SIZE - 1)];
+    if ( peer->lastSeen != 0 && memcmp(&peer->key, &key, sizeof(key)) == 0 )
       break;
-    close(socketDescriptor);
+    if ( victim == NULL || peer->lastSeen < victim->lastSeen )
+      victim = peer;
   }
 
-  if ( rp == NULL ) {
-    fprintf(stderr, "Could not bind\n");
-    fprintf(stderr, "Port number is already used.\n");
+  if ( i == LIMITER_PROBES ) {
+    peer = victim;
+    peer->key = key;
+    peer->receiver.cumulative = sequence;
+    peer->receiver.window = 0;
+  }
+  peer->lastSeen = now;
+  return &peer->receiver;
+}
+
+/******************************************************************************
+ * Fonction qui initialise la file d'envoi.
+ * Prend en paramètre :
+ *     - egress      Pointeur vers la file à initialiser.
+ *     - capacity    Nombre de réponses en attente au plus.
+ *     - policy      Politique appliquée quand la file est pleine.
+ *     - quota       DROP_PEER : réponses en attente au plus par client.
+ *****************************************************************************/
+void egress_init(struct egress *egress, unsigned int capacity,
+                 enum drop_policy policy, unsigned int quota) {
+  unsigned int size = 1;
+
+  memset(egress, 0, sizeof(*egress));
+  egress->capacity = capacity;
+  egress->policy = policy;
+  egress->quota = quota;
+  egress->entries = calloc(capacity, sizeof(struct egress_entry));
+  if ( egress->entries == NULL ) {
+    perror("Error with calloc");
     exit(EXIT_FAILURE);
   }
 
-  return socketDescriptor;
+  /* Au plus 'capacity' clients en attente : table remplie à moitié */
+  if ( policy == DROP_PEER ) {
+    while ( size < 2 * capacity )
+      size <<= 1;
+    egress->peerMask = size - 1;
+    egress->peers = calloc(size, sizeof(struct peer_count));
+    if ( egress->peers == NULL ) {
+      perror("Error with calloc");
+      exit(EXIT_FAILURE);
+    }
+  }
 }
 
 /******************************************************************************
- * Fonction qui ferme le socket.
- * Prend en paramètre le descripteur du socket.
+ * Fonction qui cherche le compteur de réponses en attente d'un client.
+ * Prend en paramètre :
+ *     - egress    Pointeur vers la file.
+ *     - key       Clé du client.
+ *     - hash      Hachage de la clé.
+ * Renvoie l'entrée du client, ou l'entrée libre où l'insérer.
  *****************************************************************************/
-void socket_close(int socketDescriptor) {
-  close(socketDescriptor);
+struct peer_count *egress_peer(struct egress *egress, struct peer_key *key,
+                               uint32_t hash) {
+  struct peer_count *peer;
+  uint32_t slot = hash & egress->peerMask;
+
+  while ( 1 ) {
+    peer = &egress->peers[slot];
+    if ( peer->count == 0 || (peer->hash == hash
+                              && memcmp(&peer->key, key, sizeof(*key)) == 0) )
+      return peer;
+    slot = (slot + 1) & egress->peerMask;
+  }
+}
+
+/******************************************************************************
+ * Fonction qui décompte une réponse d'un client qui quitte la file. Une
+ * entrée vidée est comblée en remontant les suivantes (suppression sans
+ * pierre tombale du sondage linéaire).
+ * Prend en paramètre :
+ *     - egress    Pointeur vers la file.
+ *     - entry     Réponse qui quitte la file.
+ *****************************************************************************/
+void egress_peer_release(struct egress *egress, struct egress_entry *entry) {
+  struct peer_key key;
+  struct peer_count *peer;
+  uint32_t hole, next, home;
+
+  if ( egress->policy != DROP_PEER )
+    return;
+  peer_key_make((struct sockaddr *) &entry->addr, &key);
+  peer = egress_peer(egress, &key, entry->hash);
+  if ( peer->count == 0 || --peer->count > 0 )
+    return;
+
+  hole = peer - egress->peers;
+  next = hole;
+  while ( 1 ) {
+    next = (next + 1) & egress->peerMask;
+    if ( egress->peers[next].count == 0 )
+      break;
+    /* Une entrée peut remonter si sa place naturelle n'est pas entre le
+       trou et elle */
+    home = egress->peers[next].hash & egress->peerMask;
+    if ( ((next - home) & egress->peerMask) >= ((next - hole) & egress->peerMask) ) {
+      egress->peers[hole] = egress->peers[next];
+      hole = next;
+    }
+  }
+  egress->peers[hole].count = 0;
+}
+
+/******************************************************************************
+ * Fonction qui ajoute une réponse à la file d'envoi, ou l'abandonne selon la
+ * politique si la file est pleine.
+ * Prend en paramètre :
+ *     - egress     Pointeur vers la file.
+ *     - addr       Pointeur vers l'adresse du client.
+ *     - addrlen    Taille de l'adresse.
+ *     - msg        Réponse à envoyer.
+ *     - len        Taille de la réponse.
+ *     - stats      Statistiques du serveur.
+ * Renvoie 1 si la réponse est en file, 0 si elle est abandonnée.
+ *****************************************************************************/
+int egress_push(struct egress *egress, struct sockaddr_storage *addr,
+                socklen_t addrlen, char *msg, int len,
+                struct server_stats *stats) {
+  struct egress_entry *entry;
+  struct peer_count *peer = NULL;
+  struct peer_key key;
+  uint32_t hash;
+
+  hash = peer_key_make((struct sockaddr *) addr, &key);
+  if ( egress->policy == DROP_PEER ) {
+    peer = egress_peer(egress, &key, hash);
+    if ( peer->count >= egress->quota ) {
+      stats->dropped++;
+      return 0;
+    }
+  }
+
+  if ( egress->count == egress->capacity ) {
+    if ( egress->policy != DROP_OLDEST ) {
+      stats->dropped++;
+      return 0;
+    }
+    /* La plus ancienne réponse laisse sa place */
+    egress_peer_release(egress, &egress->entries[egress->head]);
+    egress->head = (egress->head + 1) % egress->capacity;
+    egress->count--;
+    stats->dropped++;
+  }
+
+  entry = &egress->entries[(egress->head + egress->count) % egress->capacity];
+  memcpy(&entry->addr, addr, addrlen);
+  entry->addrlen = addrlen;
+  entry->hash = hash;
+  entry->len = len;
+  memcpy(entry->msg, msg, len);
+  egress->count++;
+  if ( peer != NULL ) {
+    if ( peer->count == 0 ) {
+      peer->key = key;
+      peer->hash = hash;
+    }
+    peer->count++;
+  }
+
+  stats->queued++;
+  stats->queueDepth = egress->count;
+  if ( egress->count > stats->queueMax )
+    stats->queueMax = egress->count;
+  return 1;
+}
+
+/******************************************************************************
+ * Fonction qui envoie les réponses en attente, par lots de EGRESS_BATCH
+ * (sendmmsg), jusqu'à ce que le tampon d'envoi du socket soit plein.
+ * Prend en paramètre :
+ *     - egress              Pointeur vers la file.
+ *     - socketDescriptor    Numéro du descripteur de socket.
+ *     - stats               Statistiques du serveur.
+ *****************************************************************************/
+void egress_flush(struct egress *egress, int socketDescriptor,
+                  struct server_stats *stats) {
+  struct mmsghdr msgs[EGRESS_BATCH];
+  struct iovec iovs[EGRESS_BATCH];
+  struct egress_entry *entry;
+  unsigned int count, index;
+  int sent, i;
+
+  while ( egress->count > 0 ) {
+    /* Lot contigu dans l'anneau */
+    count = egress->count;
+    if ( count > EGRESS_BATCH )
+      count = EGRESS_BATCH;
+    if ( count > egress->capacity - egress->head )
+      count = egress->capacity - egress->head;
+
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for ( i = 0; i < (int) count; i++ ) {
+      entry = &egress->entries[egress->head + i];
+      iovs[i].iov_base = entry->msg;
+      iovs[i].iov_len = entry->len;
+      msgs[i].msg_hdr.msg_name = &entry->addr;
+      msgs[i].msg_hdr.msg_namelen = entry->addrlen;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    sent = sendmmsg(socketDescriptor, msgs, count, 0);
+    if ( sent == -1 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+        break;
+      /* Erreur propre à la première réponse : elle est abandonnée */
+      perror("Error with sendmmsg");
+      stats->sendErrors++;
+      sent = 0;
+      index = 1;
+    } else {
+      stats->sent += sent;
+      index = sent;
+    }
+
+    for ( i = 0; i < (int) index; i++ )
+      egress_peer_release(egress, &egress->entries[egress->head + i]);
+    egress->head = (egress->head + index) % egress->capacity;
+    egress->count -= index;
+    if ( sent > 0 && sent < (int) count )
+      break;
+  }
+  stats->queueDepth = egress->count;
+}
+
+/******************************************************************************
+ * Fonction qui change les événements attendus sur le socket. L'inscription
+ * est exclusive (EPOLLEXCLUSIVE) pour que les processus workers qui
+ * partagent le socket ne soient pas tous réveillés par chaque message ; elle
+ * ne peut pas être modifiée et est donc refaite.
+ * Prend en paramètre :
+ *     - epollDescriptor     Descripteur epoll.
+ *     - socketDescriptor    Numéro du descripteur de socket.
+ *     - current             Événements attendus, mis à jour.
+ *     - events              EPOLLIN, avec EPOLLOUT si des réponses attendent.
+ *****************************************************************************/
+void socket_watch(int epollDescriptor, int socketDescriptor, uint32_t *current,
+                  uint32_t events) {
+  struct epoll_event event;
+
+  if ( *current == events )
+    return;
+  if ( *current != 0 )
+    epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, socketDescriptor, NULL);
+  memset(&event, 0, sizeof(event));
+  event.events = events | EPOLLEXCLUSIVE;
+  if ( epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, socketDescriptor, &event) == -1 ) {
+    perror("Error with epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+  *current = events;
+}
+
+/******************************************************************************
+ * Fonction qui libère la file d'envoi.
+ * Prend en paramètre :
+ *     - egress    Pointeur vers la file.
+ *****************************************************************************/
+void egress_free(struct egress *egress) {
+  free(egress->entries);
+  free(egress->peers);
 }
 
 /******************************************************************************
  * Fonction qui reçoit un message du descripteur de socket.
  * Il prend en paramètre :
  *     - socketDescriptor    Numéro du descripteur de socket.
- *     - servInfo            Pointeur vers les informations récupérées par la
- *                             fonction 'get_info'.
+ *     - addr                Pointeur vers l'adresse du client à remplir.
+ *     - addrlen             Pointeur vers la taille de l'adresse à remplir.
  *     - msg                 Pointeur vers la chaine de caractère à récupérer.
+ *     - size                Taille du tampon 'msg'.
+ *     - stamp               Horodatages de réception à remplir, ou NULL.
+ * Renvoie le code de la fonction recvfrom, -1 avec EAGAIN si aucun message
+ * n'attend.
  *****************************************************************************/
-void message_receive(int socketDescriptor, struct addrinfo *servInfo, char *msg) {
+int message_receive(int socketDescriptor, struct sockaddr_storage *addr,
+                    socklen_t *addrlen, char *msg, size_t size,
+                    struct tstamp *stamp) {
   int status;
 
-  servInfo->ai_addrlen = sizeof(struct sockaddr_storage);
-  status = recvfrom(socketDescriptor, msg, MSG_SIZE, 0,
-                   (struct sockaddr *) &servInfo->ai_addr, &servInfo->ai_addrlen);
-  if ( status == -1 ) {
+  *addrlen = sizeof(*addr);
+  if ( stamp != NULL )
+    status = tstamp_recv(socketDescriptor, msg, size, 0,
+                         (struct sockaddr *) addr, addrlen, stamp);
+  else
+    status = recvfrom(socketDescriptor, msg, size, 0,
+                      (struct sockaddr *) addr, addrlen);
+  if ( status == -1 && errno != EINTR && errno != EAGAIN
+       && errno != EWOULDBLOCK ) {
     perror("Error with recvfrom");
     fprintf(stderr, "Ignoring the message.\n");
   }
+
+  return status;
 }
 
 /******************************************************************************
  * Fonction qui envoie un message sur le socket passé en paramètre.
  * Prend en paramètre :
  *     - socketDescriptor    Numéro du descripteur de socket.
- *     - servInfo            Pointeur vers les informations récupérées par la
- *                             fonction 'get_info'.
+ *     - addr                Pointeur vers l'adresse du client.
+ *     - addrlen             Taille de l'adresse.
  *     - msg                 Pointeur vers la chaine de caractère à envoyer.
- * Renvoie 1 si le message à bien été envoyé, 0 sinon.
+ *     - len                 Taille du message.
+ * Renvoie 1 si le message à bien été envoyé, 0 en cas d'erreur, -1 si le
+ * tampon d'envoi du socket est plein (EAGAIN).
  *****************************************************************************/
-int message_send(int socketDescriptor, struct addrinfo *servInfo, char *msg) {
+int message_send(int socketDescriptor, struct sockaddr_storage *addr,
+                 socklen_t addrlen, char *msg, int len) {
   int status;
 
-  status = sendto(socketDescriptor, msg, strlen(msg), 0,
-                  (struct sockaddr *) &servInfo->ai_addr, servInfo->ai_addrlen);
+  status = sendto(socketDescriptor, msg, len, 0, (struct sockaddr *) addr,
+                  addrlen);
   if ( status == -1 ) {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK )
+      return -1;
     perror("Error with sendto");
     return 0;
   }
@@ -135,17 +712,17 @@ int message_send(int socketDescriptor, struct addrinfo *servInfo, char *msg) {
 /******************************************************************************
  * Fonction qui affiche les informations du client connecter au serveur.
  * Prend en paramètre :
- *     - servInfo    Pointeur vers les informations récupérées par la
- *                     fonction 'get_info'.
- *     - msg         Pointeur vers la chaine de caractère pour afficher
-                       le nombre d'octets reçu par le serveur.
+ *     - addr       Pointeur vers l'adresse du client.
+ *     - addrlen    Taille de l'adresse.
+ *     - msg        Pointeur vers la chaine de caractère pour afficher
+                      le nombre d'octets reçu par le serveur.
  *****************************************************************************/
-void printClient(struct addrinfo *servInfo, char *msg) {
+void printClient(struct sockaddr_storage *addr, socklen_t addrlen, char *msg) {
   int status;
   char host[NI_MAXHOST], service[NI_MAXHOST];
 
-  status = getnameinfo((struct sockaddr *) &servInfo->ai_addr,
-                         servInfo->ai_addrlen, host, NI_MAXHOST, 
+  status = getnameinfo((struct sockaddr *) addr,
+                         addrlen, host, NI_MAXHOST, 
                          service, NI_MAXSERV, NI_NUMERICSERV);
   if ( status == 0 ) {
     printf("Received %zd bytes from %s:%s\n", strlen(msg)*4, host, service);
@@ -158,42 +735,339 @@ void printClient(struct addrinfo *servInfo, char *msg) {
  * Serveur simple UDP, reçoit une chaine de caractère d'un client et lui renvoie.
  * Le programme prend en paramètre :
  *     - port : Port d'écoute du serveur.
+ * Options :
+ *     - -r rate  : Nombre de messages par seconde autorisés pour chaque client,
+ *                    les messages en excès sont ignorés (pas de limite par
+ *                    défaut)
+ *     - -b burst : Nombre de messages autorisés en rafale (rate par défaut)
+ *     - -C file  : Capture des messages reçus dans une trace
+ *     - -M mode  : Contenu capturé, 'payload' (défaut) ou 'hash'
+ *     - -X       : Découpe le traitement de chaque message grâce aux
+ *                    horodatages du noyau (SO_TIMESTAMPING), affiché à l'arrêt
+ *     - -p count, --processes count : Nombre de processus workers, lancés par
+ *                    un superviseur qui ouvre le socket, relance les workers
+ *                    morts et agrège leurs statistiques ; la limite de débit
+ *                    s'applique alors dans chaque worker
+ *     - -Q depth : Réponses en attente au plus quand le tampon d'envoi du
+ *                    socket est plein (1024 par défaut, par worker)
+ *     - -D policy : Réponse abandonnée quand la file est pleine : 'newest'
+ *                    (défaut), 'oldest', ou 'peer[:quota]' qui limite aussi
+ *                    les réponses en attente de chaque client (depth/8 par
+ *                    défaut)
+ * Les datagrammes du mode fiable (option -L du client) sont reconnus à leur
+ * en-tête : la réponse reprend le numéro et l'horodatage de la requête et
+ * acquitte les requêtes reçues du client (cumul et plages sélectives) ; une
+ * retransmission déjà reçue est renvoyée, sa réponse a pu être perdue.
  *****************************************************************************/
 
 int main(int argc, char *argv[]) {
-  struct addrinfo servInfo;
+  struct sockaddr_storage peerAddr;
+  socklen_t peerLength;
   int socketDescriptor;
-  char msg[MSG_SIZE];
+  char datagram[RELIABLE_FRAME_MAX + 1];
+  char reply[RELIABLE_FRAME_MAX];
+  char *msg, *out;
+  int length, outLength, headerSize;
+  struct reliable_header header;
+  struct reliable_peer *peers = NULL;
+  struct reliable_receiver *receiver;
+  struct limiter limiter;
+  struct server_stats stats, *counters = &stats;
+  struct sigaction action;
+  struct prefork prefork;
+  struct trace_writer trace;
+  struct peer_key key;
+  char *capture = NULL;
+  double rate = 0;
+  double burst = 0;
+  int hashOnly = 0;
+  struct tstamp_stats tstats;
+  struct timespec receivedAt, before;
+  struct tstamp_tx tx;
+  struct tstamp rx;
+  int timestamps = 0;
+  int processCount = 0;
+  struct egress egress;
+  long queueDepth = EGRESS_DEFAULT;
+  enum drop_policy policy = DROP_NEWEST;
+  long quota = 0;
+  struct epoll_event event;
+  uint32_t watched = 0;
+  int epollDescriptor;
+  int received, batch, status, allowed;
+  int opt;
+  static const struct option longOptions[] = {
+    { "processes", required_argument, NULL, 'p' },
+    { NULL, 0, NULL, 0 }
+  };
 
 
   /* Vérification des paramètres du programme */
-  if ( argc != 2 ) {
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  while ( (opt = getopt_long(argc, argv, "r:b:C:M:Xp:Q:D:",
+                             longOptions, NULL)) != -1 ) {
+    switch ( opt ) {
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'b':
+      burst = atof(optarg);
+      break;
+    case 'C':
+      capture = optarg;
+      break;
+    case 'M':
+      hashOnly = strcmp(optarg, "hash") == 0;
+      if ( !hashOnly && strcmp(optarg, "payload") != 0 )
+        rate = -1;
+      break;
+    case 'X':
+      timestamps = 1;
+      break;
+    case 'p':
+      processCount = atoi(optarg);
+      if ( processCount < 1 || processCount > PREFORK_MAX )
+        rate = -1;
+      break;
+    case 'Q':
+      queueDepth = atol(optarg);
+      if ( queueDepth < 1 || queueDepth > EGRESS_MAX )
+        rate = -1;
+      break;
+    case 'D':
+      if ( strcmp(optarg, "newest") == 0 )
+        policy = DROP_NEWEST;
+      else if ( strcmp(optarg, "oldest") == 0 )
+        policy = DROP_OLDEST;
+      else if ( strncmp(optarg, "peer", 4) == 0
+                && (optarg[4] == '\0' || optarg[4] == ':') ) {
+        policy = DROP_PEER;
+        if ( optarg[4] == ':' && (quota = atol(optarg + 5)) < 1 )
+          rate = -1;
+      } else
+        rate = -1;
+      break;
+    default:
+      rate = -1;
+    }
+  }
+  if ( argc - optind != 1 || rate < 0 || burst < 0 ) {
+    fprintf(stderr, "Usage: %s [-r rate] [-b burst] [-C file] [-M hash|payload] [-X] [-p processes] [-Q depth] [-D newest|oldest|peer[:quota]] port\n", argv[0]);
     exit(EXIT_FAILURE);
   }
+  if ( quota == 0 )
+    quota = queueDepth / 8 > 0 ? queueDepth / 8 : 1;
+  /* La capture et les horodatages n'ont qu'un fichier et qu'une file
+     d'erreurs : ils restent réservés au mode à un seul processus */
+  if ( processCount > 0 && (capture != NULL || timestamps) ) {
+    fprintf(stderr, "Processes are not supported with -C or -X\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( burst < 1 )
+    burst = rate < 1 ? 1 : rate;
 
   printf("\n ****      Welcome to the UDP Server.      ****\n\n");
 
-  /* Récupération des informations du serveur */
-  servInfo = get_info(argv[1]);
+  /* Arrêt propre sur SIGINT et SIGTERM pour afficher les statistiques */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_handler;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = stats_handler;
+  sigaction(SIGUSR1, &action, NULL);
+
+  memset(&stats, 0, sizeof(stats));
+  if ( rate > 0 ) {
+    limiter_init(&limiter, rate, burst);
+    printf("Rate limit : %.0f msg/s per peer, burst %.0f\n", rate, burst);
+  }
+
+  if ( capture != NULL ) {
+    if ( trace_open(&trace, capture, hashOnly) == -1 ) {
+      perror("Error with trace_open");
+      exit(EXIT_FAILURE);
+    }
+    printf("Capture to %s (%s)\n", capture, hashOnly ? "hash" : "payload");
+  }
+
+  /* Ouverture du socket, peerAddr reçoit ensuite l'adresse de chaque client */
+  socketDescriptor = acceptor_open(argv[optind], SOCK_DGRAM, 0, 0);
+  if ( timestamps ) {
+    tstamp_server_init(&tstats);
+    if ( tstamp_enable(socketDescriptor, 1) == -1 ) {
+      perror("Error with SO_TIMESTAMPING");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  /* Ouverture du socket */
-  socketDescriptor = socket_open(&servInfo);
+  printf("Listen on %s\n", argv[optind]);
 
-  printf("Listen on %s\n", argv[1]);
+  /* Mode --processes : chaque worker reçoit sur le socket hérité, le
+     superviseur relance les morts et affiche les statistiques agrégées */
+  if ( processCount > 0 ) {
+    if ( prefork_init(&prefork, processCount, sizeof(struct server_stats)) == -1 ) {
+      perror("Error with prefork_init");
+      exit(EXIT_FAILURE);
+    }
+    counters = prefork_run(&prefork, &running, &dumpStats, processes_print, NULL);
+    if ( counters == NULL ) {
+      prefork_free(&prefork);
+      if ( rate > 0 )
+        free(limiter.table);
+      socket_close(socketDescriptor);
+      exit(EXIT_SUCCESS);
+    }
+  }
+
+  /* Boucle d'événements propre à chaque worker : les réponses que le noyau
+     refuse attendent dans la file pendant que la réception continue */
+  egress_init(&egress, queueDepth, policy, quota);
+  counters->queueDepth = 0;
+  epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+  if ( epollDescriptor == -1 ) {
+    perror("Error with epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  socket_watch(epollDescriptor, socketDescriptor, &watched, EPOLLIN);
 
   /* Traitement de tous message reçu, renvoie au client le message reçu */
-  while ( 1 ) {
-    memset(msg, 0, sizeof(msg));
-    message_receive(socketDescriptor, &servInfo, msg);
-    printClient(&servInfo, msg);
-    printf(">> %s\n", msg);
+  while ( running ) {
+    if ( dumpStats ) {
+      dumpStats = 0;
+      stats_print(counters);
+    }
+    if ( epoll_wait(epollDescriptor, &event, 1, -1) == -1 )
+      continue;
+    if ( event.events & EPOLLOUT )
+      egress_flush(&egress, socketDescriptor, counters);
+
+    for ( batch = 0; batch < RECEIVE_BATCH && running; batch++ ) {
+      memset(datagram, 0, sizeof(datagram));
+      if ( (received = message_receive(socketDescriptor, &peerAddr, &peerLength,
+                                       datagram, RELIABLE_FRAME_MAX,
+                                       timestamps ? &rx : NULL)) == -1 )
+        break;
+      if ( timestamps )
+        tstamp_now(&receivedAt);
+      counters->received++;
+
+      /* Requête fiable : le texte suit l'en-tête ; sinon, texte seul tronqué
+         comme avant à MSG_SIZE */
+      headerSize = reliable_decode((unsigned char *) datagram, received, &header);
+      if ( headerSize > 0 && header.type == RELIABLE_REQUEST ) {
+        msg = datagram + headerSize;
+        received = header.length;
+        msg[received] = '\0';
+      } else {
+        headerSize = 0;
+        msg = datagram;
+        if ( received > MSG_SIZE )
+          received = MSG_SIZE;
+        memset(datagram + MSG_SIZE, 0, sizeof(datagram) - MSG_SIZE);
+      }
+
+      /* Capture de tout message reçu, y compris ceux qui seront limités */
+      if ( capture != NULL )
+        trace_append(&trace, peer_key_make((struct sockaddr *) &peerAddr,
+                                           &key), msg, received);
 
-    if ( message_send(socketDescriptor, &servInfo, msg) )
-      printf(">> # Same message sent.\n");
+      /* Message en excès : ignoré avant tout autre traitement */
+      if ( rate > 0 && (allowed = limiter_allow(&limiter,
+                                                (struct sockaddr *) &peerAddr,
+                                                now_ns())) != 1 ) {
+        counters->rateLimited++;
+        if ( allowed == -1 )
+          counters->windowFull++;
+        continue;
+      }
+
+      printClient(&peerAddr, peerLength, msg);
+      printf(">> %s\n", msg);
+
+      /* La réponse acquitte la requête et celles déjà reçues du client */
+      out = msg;
+      outLength = length = strnlen(msg, MSG_SIZE);
+      if ( headerSize > 0 ) {
+        if ( peers == NULL
+             && (peers = calloc(LIMITER_SIZE, sizeof(struct reliable_peer))) == NULL ) {
+          perror("Error with calloc");
+          exit(EXIT_FAILURE);
+        }
+        receiver = reliable_peer_find(peers, (struct sockaddr *) &peerAddr,
+                                      header.sequence, now_ns());
+        counters->reliable++;
+        if ( !reliable_receive(receiver, header.sequence) )
+          counters->duplicates++;
+        reliable_ack(receiver, &header);
+        header.type = RELIABLE_REPLY;
+        header.length = length;
+        out = reply;
+        outLength = reliable_encode(&header, (unsigned char *) reply);
+        memcpy(reply + outLength, msg, length);
+        outLength += length;
+      }
+
+      /* Des réponses attendent déjà : celle-ci passe derrière elles */
+      if ( egress.count > 0 ) {
+        if ( egress_push(&egress, &peerAddr, peerLength, out, outLength,
+                         counters) )
+          printf(">> # Same message queued.\n");
+        continue;
+      }
+
+      if ( timestamps ) {
+        memset(&tx, 0, sizeof(tx));
+        tstamp_now(&before);
+      }
+      status = message_send(socketDescriptor, &peerAddr, peerLength, out,
+                            outLength);
+      if ( status == 1 ) {
+        /* Horodatages d'émission de la réponse, numérotée par les envois */
+        if ( timestamps ) {
+          tstamp_tx_read(socketDescriptor, (uint32_t) counters->sent, &tx);
+          tstamp_server_add(&tstats, &rx, &receivedAt, &before, &tx);
+        }
+        printf(">> # Same message sent.\n");
+        counters->sent++;
+      } else if ( status == -1 ) {
+        if ( egress_push(&egress, &peerAddr, peerLength, out, outLength,
+                         counters) )
+          printf(">> # Same message queued.\n");
+      } else {
+        counters->sendErrors++;
+      }
+    }
+
+    if ( egress.count > 0 )
+      egress_flush(&egress, socketDescriptor, counters);
+    socket_watch(epollDescriptor, socketDescriptor, &watched,
+                 egress.count > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
   }
+  close(epollDescriptor);
+  egress_free(&egress);
+  free(peers);
 
+  /* Un worker s'arrête sans rien afficher : le superviseur s'en charge */
+  if ( processCount > 0 ) {
+    if ( rate > 0 )
+      free(limiter.table);
+    socket_close(socketDescriptor);
+    exit(EXIT_SUCCESS);
+  }
+
+  stats_print(&stats);
+  if ( timestamps ) {
+    tstamp_print(&tstats);
+    tstamp_stats_free(&tstats);
+  }
+
+  if ( capture != NULL ) {
+    printf("Captured %llu messages to %s\n",
+           (unsigned long long) trace.records, capture);
+    trace_close(&trace);
+  }
+  if ( rate > 0 )
+    free(limiter.table);
   socket_close(socketDescriptor);
 
   exit(EXIT_SUCCESS);
-}  
+}
@@ -0,0 +1,186 @@
+/******************************************************************************
+ *
+ * Name File : wheel.c
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "wheel.h"
+
+#include <time.h>
+
+/******************************************************************************
+ * Fonction qui renvoie le tick courant de la roue temporelle.
+ *****************************************************************************/
+uint64_t now_tick(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000) / WHEEL_TICK_MS;
+}
+
+/******************************************************************************
+ * Fonction qui convertit une durée en secondes en nombre de ticks.
+ * Prend en paramètre :
+ *     - seconds    Durée en secondes, 0 pour aucune échéance.
+ * Renvoie le nombre de ticks (au moins 1 si la durée n'est pas nulle).
+ *****************************************************************************/
+unsigned int seconds_to_ticks(double seconds) {
+  unsigned int ticks;
+
+  if ( seconds <= 0 )
+    return 0;
+  ticks = (unsigned int) (seconds * 1000 / WHEEL_TICK_MS);
+  return ticks == 0 ? 1 : ticks;
+}
+
+/******************************************************************************
+ * Fonction qui initialise la roue temporelle.
+ * Prend en paramètre :
+ *     - wheel    Pointeur vers la roue à initialiser.
+ *****************************************************************************/
+void wheel_init(struct timer_wheel *wheel) {
+  int i;
+
+  for ( i = 0; i < WHEEL_SLOTS; i++ ) {
+    wheel->slots[i].next = &wheel->slots[i];
+    wheel->slots[i].prev = &wheel->slots[i];
+  }
+  wheel->current = now_tick();
+  wheel->count = 0;
+}
+
+/******************************************************************************
+ * Fonction qui chaîne une échéance en fin de liste.
+ * Prend en paramètre :
+ *     - head     Pointeur vers la tête de la liste.
+ *     - timer    Pointeur vers l'échéance.
+ *****************************************************************************/
+static void timer_link(struct timer *head, struct timer *timer) {
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+/******************************************************************************
+ * Fonction qui désarme une échéance, sans effet si elle ne l'est pas.
+ * Prend en paramètre :
+ *     - wheel    Pointeur vers la roue.
+ *     - timer    Pointeur vers l'échéance.
+ *****************************************************************************/
+void wheel_cancel(struct timer_wheel *wheel, struct timer *timer) {
+  if ( timer->expires == 0 )
+    return;
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->expires = 0;
+  wheel->count--;
+}
+
+/******************************************************************************
+ * Fonction qui (ré)arme une échéance dans la roue.
+ * Prend en paramètre :
+ *     - wheel    Pointeur vers la roue.
+ *     - timer    Pointeur vers l'échéance.
+ *     - ticks    Délai en ticks, l'échéance est seulement désarmée si 0.
+ *****************************************************************************/
+void wheel_schedule(struct timer_wheel *wheel, struct timer *timer,
+                    unsigned int ticks) {
+  struct timer *slot;
+
+  wheel_cancel(wheel, timer);
+  if ( ticks == 0 )
+    return;
+
+  /* Roue vide : epoll_wait a pu dormir sans limite, le tick courant n'a pas
+     avancé depuis */
+  if ( wheel->count == 0 )
+    wheel->current = now_tick();
+  /* Une échéance plus lointaine qu'un tour attend son tour dans la case */
+  timer->expires = wheel->current + ticks;
+  slot = &wheel->slots[timer->expires & (WHEEL_SLOTS - 1)];
+  timer_link(slot, timer);
+  wheel->count++;
+}
+
+/******************************************************************************
+ * Fonction qui indique le délai avant la première case non vide de la roue :
+ * aucune échéance n'arrive avant, la boucle peut dormir jusque-là au lieu
+ * de se réveiller à chaque tick. Une case qui ne porte que des échéances
+ * des tours suivants donne un réveil en avance, sans effet.
+ * Prend en paramètre :
+ *     - wheel    Pointeur vers la roue.
+ * Renvoie le délai en millisecondes pour epoll_wait, -1 si la roue est vide.
+ *****************************************************************************/
+int wheel_timeout(struct timer_wheel *wheel) {
+  struct timer *slot;
+  uint64_t tick, now;
+
+  if ( wheel->count == 0 )
+    return -1;
+  for ( tick = wheel->current; tick < wheel->current + WHEEL_SLOTS; tick++ ) {
+    slot = &wheel->slots[tick & (WHEEL_SLOTS - 1)];
+    if ( slot->next != slot )
+      break;
+  }
+  now = now_tick();
+  if ( tick <= now )
+    return 0;
+  return (int) (tick - now) * WHEEL_TICK_MS;
+}
+
+/******************************************************************************
+ * Fonction qui fait avancer la roue jusqu'au tick courant et traite les
+ * échéances dépassées, désarmées avant d'être passées à 'expire'. Chaque
+ * case est d'abord détachée dans une liste locale : le traitement peut
+ * libérer ou réarmer d'autres échéances sans invalider le parcours, et les
+ * échéances des tours suivants, remises dans la case, ne sont vues qu'une
+ * fois.
+ * Prend en paramètre :
+ *     - wheel     Pointeur vers la roue.
+ *     - expire    Traitement d'une échéance atteinte.
+ *     - arg       Argument passé à 'expire'.
+ *****************************************************************************/
+void wheel_advance(struct timer_wheel *wheel, wheel_expire expire, void *arg) {
+  struct timer pending, *slot, *timer;
+  uint64_t now = now_tick();
+
+  if ( wheel->count == 0 ) {
+    wheel->current = now + 1;
+    return;
+  }
+
+  for ( ; wheel->current <= now; wheel->current++ ) {
+    slot = &wheel->slots[wheel->current & (WHEEL_SLOTS - 1)];
+    if ( slot->next == slot )
+      continue;
+    pending.next = slot->next;
+    pending.prev = slot->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    slot->next = slot;
+    slot->prev = slot;
+
+    while ( (timer = pending.next) != &pending ) {
+      timer->prev->next = timer->next;
+      timer->next->prev = timer->prev;
+      if ( timer->expires > wheel->current ) {
+        timer_link(slot, timer);
+        continue;
+      }
+      /* Déjà sortie de la liste : désarmée sans autre effet */
+      timer->expires = 0;
+      wheel->count--;
+      expire(timer, arg);
+    }
+  }
+}
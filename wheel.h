@@ -0,0 +1,54 @@
+/******************************************************************************
+ *
+ * Name File : wheel.h
+ * Authors   : OLIVIER Thomas & ROBERT DE ST VINCENT Guillaume
+ * Location  : UPSSITECH - University Paul Sabatier
+ * Date      : October 2018
+ *
+ *                        This work is licensed under a 
+ *              Creative Commons Attribution 4.0 International License.
+ *                                    (CC BY)
+ *
+ *****************************************************************************/
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+/* Roue temporelle hachée des boucles d'événements : les échéances des
+   connexions (lecture, inactivité, écriture) et des autres objets d'une
+   boucle y sont armées, annulées et réarmées en O(1) */
+#define WHEEL_SLOTS 1024	/* Nombre de cases de la roue, puissance de 2 */
+#define WHEEL_TICK_MS 10	/* Résolution de la roue */
+
+/* Échéance chaînée dans une case de la roue, placée en tête de l'objet qui
+   la porte */
+struct timer {
+  struct timer *next;
+  struct timer *prev;
+  uint64_t expires;		/* tick d'expiration, 0 si désarmée */
+  int kind;			/* objet qui la porte, propre au serveur */
+};
+
+/* Roue temporelle hachée : insertion et annulation en O(1) */
+struct timer_wheel {
+  struct timer slots[WHEEL_SLOTS];	/* têtes de listes circulaires */
+  uint64_t current;		/* prochain tick à traiter */
+  unsigned long count;		/* nombre d'échéances armées */
+};
+
+/* Traitement d'une échéance atteinte, déjà désarmée : l'objet peut la
+   réarmer ou être libéré */
+typedef void (*wheel_expire)(struct timer *timer, void *arg);
+
+uint64_t now_tick(void);
+unsigned int seconds_to_ticks(double seconds);
+void wheel_init(struct timer_wheel *wheel);
+void wheel_cancel(struct timer_wheel *wheel, struct timer *timer);
+void wheel_schedule(struct timer_wheel *wheel, struct timer *timer,
+                    unsigned int ticks);
+int wheel_timeout(struct timer_wheel *wheel);
+void wheel_advance(struct timer_wheel *wheel, wheel_expire expire, void *arg);
+
+#endif